@@ -14,6 +14,7 @@
 #endif
 
 #include <limits.h>
+#include <cstdlib>
 
 #include <iostream>
 #include <sstream>
@@ -21,6 +22,7 @@
 #include <string>
 
 #include <iterator>
+#include <list>
 #include <map>
 #include <set>
 #include <vector>
@@ -39,6 +41,7 @@ extern "C" {
 #include "guid.h"
 #include "mail-user.h"
 #include "array.h"
+#include "ioloop.h"
 #include "dict-rados.h"
 }
 
@@ -76,11 +79,17 @@ using librmb::RadosGuidGenerator;
 
 #define DICT_USERNAME_SEPARATOR '/'
 
+class rados_dict_transaction_context;
+
 struct rados_dict {
   struct dict dict;
   RadosCluster *cluster;
   RadosDictionary *d;
   RadosGuidGenerator *guid_generator;
+  /* submitted async commits, oldest first */
+  std::list<rados_dict_transaction_context *> *commits;
+  /* flushes the queued async lookups in the next ioloop run */
+  struct timeout *to_lookups;
 };
 
 class DictGuidGenerator : public librmb::RadosGuidGenerator {
@@ -121,6 +130,10 @@ int rados_dict_init(struct dict *driver, const char *uri, const struct dict_sett
   string clustername = "ceph";
   string rados_username = "client.admin";
   string ceph_cfg = "rbox_cfg";
+  size_t cache_size = 0;
+  unsigned int cache_ttl = 0;
+  std::list<string> cache_bypass;
+  unsigned int shared_shards = 0;
 
   if (uri != nullptr) {
     vector<string> props(explode(uri, ':'));
@@ -136,6 +149,17 @@ int rados_dict_init(struct dict *driver, const char *uri, const struct dict_sett
         rados_username = it->substr(16);
       } else if (it->compare(0, 21, "dict_cfg_object_name=") == 0) {
         ceph_cfg = it->substr(21);
+      } else if (it->compare(0, 11, "cache_size=") == 0) {
+        // the cache is per process, see RadosDictionaryCache
+        cache_size = strtoul(it->substr(11).c_str(), nullptr, 10);
+      } else if (it->compare(0, 10, "cache_ttl=") == 0) {
+        cache_ttl = strtoul(it->substr(10).c_str(), nullptr, 10);
+      } else if (it->compare(0, 13, "cache_bypass=") == 0) {
+        // comma separated key prefixes, e.g. cache_bypass=shared/,priv/sieve/
+        vector<string> prefixes(explode(it->substr(13), ','));
+        cache_bypass.insert(cache_bypass.end(), prefixes.begin(), prefixes.end());
+      } else if (it->compare(0, 14, "shared_shards=") == 0) {
+        shared_shards = strtoul(it->substr(14).c_str(), nullptr, 10);
       } else {
         *error_r = t_strdup_printf("Invalid URI!");
         return -1;
@@ -160,8 +184,11 @@ int rados_dict_init(struct dict *driver, const char *uri, const struct dict_sett
     return -1;
   }
 
+  dict->commits = new std::list<rados_dict_transaction_context *>();
   dict->guid_generator = new DictGuidGenerator();
   dict->d = new librmb::RadosDictionaryImpl(dict->cluster, poolname, username, oid, dict->guid_generator, ceph_cfg);
+  dict->d->get_cache()->configure(cache_size, cache_ttl, cache_bypass);
+  dict->d->set_shared_shards(shared_shards);
   dict->dict = *driver;
   *dict_r = &dict->dict;
 
@@ -179,6 +206,10 @@ void rados_dict_deinit(struct dict *_dict) {
   rados_dict_wait(_dict);
 
   if (dict->d != nullptr) {
+#ifdef DEBUG
+    i_debug("rados_dict_deinit: cache hits=%lu, misses=%lu", dict->d->get_cache()->get_hits(),
+            dict->d->get_cache()->get_misses());
+#endif
     delete dict->d;
     dict->d = nullptr;
   }
@@ -191,11 +222,15 @@ void rados_dict_deinit(struct dict *_dict) {
     delete dict->guid_generator;
     dict->guid_generator = nullptr;
   }
+  if (dict->commits != nullptr) {
+    delete dict->commits;
+    dict->commits = nullptr;
+  }
 
   i_free(_dict);
 }
 
-static void rados_lookup_complete_callback(rados_completion_t comp, void *arg);
+static void rados_dict_finish_commits(struct rados_dict *dict, bool wait);
 
 #if DOVECOT_PREREQ(2, 3)
 void rados_dict_wait(struct dict *_dict)
@@ -204,8 +239,13 @@ int rados_dict_wait(struct dict *_dict)
 #endif
 {
   struct rados_dict *dict = (struct rados_dict *)_dict;
+  rados_dict_flush_lookups(_dict);
   // JRSE: not required with remote update? = > yes due to async lookup
   dict->d->wait_for_completions();
+  // the callbacks may start new commits
+  while (!dict->commits->empty()) {
+    rados_dict_finish_commits(dict, true);
+  }
 
 #if DOVECOT_PREREQ(2, 3)
   return;
@@ -216,27 +256,16 @@ int rados_dict_wait(struct dict *_dict)
 
 class rados_dict_lookup_context {
  public:
-  RadosDictionary *dict;
-  ObjectReadOperation read_op;
-  map<string, bufferlist> result_map;
-  int r_val = -1;
-  bufferlist bl;
-
-  AioCompletion *completion;
-  string key;
-  string value;
   void *context = nullptr;
   dict_lookup_callback_t *callback;
 
-  explicit rados_dict_lookup_context(RadosDictionary *_dict) : callback(nullptr) {
-    dict = _dict;
-    completion = librados::Rados::aio_create_completion(this, rados_lookup_complete_callback, nullptr);
+  rados_dict_lookup_context(dict_lookup_callback_t *_callback, void *_context) {
+    callback = _callback;
+    context = _context;
   }
-
-  ~rados_dict_lookup_context() {}
 };
 
-static void rados_lookup_complete_callback(rados_completion_t comp ATTR_UNUSED, void *arg) {
+static void rados_lookup_complete_callback(int ret, const string &value, void *arg) {
   rados_dict_lookup_context *lc = reinterpret_cast<rados_dict_lookup_context *>(arg);
 
   struct dict_lookup_result result;
@@ -247,63 +276,46 @@ static void rados_lookup_complete_callback(rados_completion_t comp ATTR_UNUSED,
   const char *values[2];
 #endif
 
-  int ret = lc->completion->get_return_value();
-
-  if (lc->callback != nullptr) {
-    if (ret == 0) {
-      auto it = lc->result_map.find(lc->key);
-      if (it != lc->result_map.end()) {
-        lc->value = it->second.to_str();
-        result.value = lc->value.c_str();
+  if (ret == 0) {
+    result.value = value.c_str();
 #ifdef DOVECOT_CEPH_PLUGINS_HAVE_DICT_LOOKUP_RESULT_VALUES
-        values[0] = lc->value.c_str();
-        values[1] = nullptr;
-        result.values = values;
+    values[0] = value.c_str();
+    values[1] = nullptr;
+    result.values = values;
 #endif
-        result.ret = RADOS_COMMIT_RET_OK;
-      } else {
-        result.ret = RADOS_COMMIT_RET_NOTFOUND;
-      }
-    } else {
-      if (ret == -ENOENT) {
-        result.ret = RADOS_COMMIT_RET_NOTFOUND;
-      } else {
-        result.ret = RADOS_COMMIT_RET_FAILED;
-      }
-    }
-    lc->callback(&result, lc->context);
+    result.ret = RADOS_COMMIT_RET_OK;
+  } else if (ret == -ENOENT) {
+    result.ret = RADOS_COMMIT_RET_NOTFOUND;
+  } else {
+    result.ret = RADOS_COMMIT_RET_FAILED;
   }
+  lc->callback(&result, lc->context);
 
   delete lc;
   lc = NULL;
 }
 
+/* submits the queued async lookups, one read operation per dict object */
+void rados_dict_flush_lookups(struct dict *_dict) {
+  struct rados_dict *dict = (struct rados_dict *)_dict;
+  if (dict->to_lookups != nullptr) {
+    timeout_remove(&dict->to_lookups);
+  }
+  dict->d->flush_lookups();
+}
+
+/* the lookups are queued and read with one operation per dict object in the next
+ * ioloop run, by the next dict call (other than lookup_async) or by dict_wait */
 void rados_dict_lookup_async(struct dict *_dict, const char *key, dict_lookup_callback_t *callback, void *context) {
-  RadosDictionary *d = ((struct rados_dict *)_dict)->d;
-  set<string> keys;
-  keys.insert(key);
-  auto lc = new rados_dict_lookup_context(d);
-
-  lc->key = key;
-  lc->context = context;
-  lc->callback = callback;
-  lc->read_op.omap_get_vals_by_keys(keys, &lc->result_map, &lc->r_val);
-
-  int err = d->get_io_ctx(key).aio_operate(d->get_full_oid(key), lc->completion, &lc->read_op,
-                                           LIBRADOS_OPERATION_NOFLAG, &lc->bl);
-
-  if (err < 0) {
-    if (lc->callback != nullptr) {
-      struct dict_lookup_result result;
-      i_zero(&result);
-      result.ret = RADOS_COMMIT_RET_FAILED;
-      lc->callback(&result, context);
-    }
-    lc->completion->release();
-    delete lc;
-    lc = nullptr;
-  } else {
-    d->push_back_completion(lc->completion);
+  struct rados_dict *dict = (struct rados_dict *)_dict;
+  rados_dict_finish_commits(dict, false);
+
+  if (callback == nullptr) {
+    return;
+  }
+  dict->d->lookup_async(key, rados_lookup_complete_callback, new rados_dict_lookup_context(callback, context));
+  if (dict->to_lookups == nullptr) {
+    dict->to_lookups = rados_dict_lookup_timeout_add(_dict);
   }
 }
 
@@ -322,14 +334,30 @@ int rados_dict_lookup(struct dict *_dict, pool_t pool, const char *key, const ch
   map<string, bufferlist> result_map;
   *value_r = nullptr;
   *error_r = nullptr;
+  rados_dict_finish_commits(dict, false);
+  rados_dict_flush_lookups(_dict);
+
+  string cached_value;
+  bool found = false;
+  if (d->get_cache()->lookup(key, &cached_value, &found)) {
+    if (found) {
+      *value_r = p_strdup(pool, cached_value.c_str());
+      return RADOS_COMMIT_RET_OK;
+    }
+    return RADOS_COMMIT_RET_NOTFOUND;
+  }
+  uint64_t generation = d->get_cache()->get_generation();
 
   int err = d->get_io_ctx(key).omap_get_vals_by_keys(d->get_full_oid(key), keys, &result_map);
   if (err == 0) {
     auto value = result_map.find(key);
     if (value != result_map.end()) {
-      *value_r = p_strdup(pool, value->second.to_str().c_str());
+      string str_value = value->second.to_str();
+      d->get_cache()->update(key, &str_value, generation);
+      *value_r = p_strdup(pool, str_value.c_str());
       return RADOS_COMMIT_RET_OK;
     }
+    d->get_cache()->update(key, nullptr, generation);
   } else if (err < 0 && err != -ENOENT) {
     *error_r = NULL;  // t_strdup_printf("omap_get_vals_by_keys(%s) failed: %s", key, strerror(-err));
     return RADOS_COMMIT_RET_FAILED;
@@ -354,21 +382,34 @@ class rados_dict_transaction_context {
   set<string> unset_set;
   map<string, int64_t> atomic_inc_map;
 
+  /* compound write operation of one dict object */
+  struct object_write {
+    ObjectWriteOperation write_op;
+    /* async commit */
+    AioCompletion *completion = nullptr;
+    /* the write operation contains atomic increments */
+    bool atomic_inc = false;
+    int result = -ENORESULT;
+  };
+  object_write write_private;
+  /* by shard oid */
+  map<string, object_write> write_shared;
+  /* atomic increments are guarded by an omap_cmp of their keys. They are written with their
+   * own operation, so that a missing key does not cancel the other changes of the dict object. */
+  object_write inc_private;
+  map<string, object_write> inc_shared;
+
   bool dirty_private;
   bool locked_private;
-  int result_private;
 
   bool dirty_shared;
   bool locked_shared;
-  int result_shared;
 
   explicit rados_dict_transaction_context(struct dict *_dict) {
     dirty_private = false;
     dirty_shared = false;
     locked_private = false;
     locked_shared = false;
-    result_private = -ENORESULT;
-    result_shared = -ENORESULT;
 
     callback = nullptr;
     atomic_inc_not_found = false;
@@ -434,27 +475,70 @@ class rados_dict_transaction_context {
     atomic_inc_map[key] = diff;
   }
 
+  /* the cached values of the changed keys are outdated */
+  void invalidate_cache() {
+    librmb::RadosDictionaryCache *cache = ((struct rados_dict *)ctx.dict)->d->get_cache();
+    for (auto it = set_map.begin(); it != set_map.end(); it++) {
+      cache->invalidate(it->first);
+    }
+    for (auto it = unset_set.begin(); it != unset_set.end(); it++) {
+      cache->invalidate(*it);
+    }
+    for (auto it = atomic_inc_map.begin(); it != atomic_inc_map.end(); it++) {
+      cache->invalidate(it->first);
+    }
+  }
+
+  /* write operation of the private dict object or the shared shard object of the key */
+  object_write &get_object_write(const string &key) {
+    if (is_private(key)) {
+      return write_private;
+    }
+    const string oid = ((struct rados_dict *)ctx.dict)->d->get_full_oid(key);
+    auto it = write_shared.find(oid);
+    if (it == write_shared.end()) {
+      it = write_shared.insert(std::make_pair(oid, object_write())).first;
+#ifdef DOVECOT_CEPH_PLUGINS_HAVE_DICT_SET_TIMESTAMP
+      if (ctx.timestamp.tv_sec != 0 || ctx.timestamp.tv_nsec != 0) {
+        it->second.write_op.mtime2(&ctx.timestamp);
+      }
+#endif
+    }
+    return it->second;
+  }
+
+  /* atomic increment operation of the private dict object or the shared shard object of the key */
+  object_write &get_object_inc(const string &key) {
+    object_write *write;
+    // no is_private: the compound write operation of the dict object is not dirty
+    if (!key.compare(0, strlen(DICT_PATH_PRIVATE), DICT_PATH_PRIVATE)) {
+      write = &inc_private;
+    } else {
+      write = &inc_shared[((struct rados_dict *)ctx.dict)->d->get_full_oid(key)];
+    }
+    if (!write->atomic_inc) {
+      write->atomic_inc = true;
+#ifdef DOVECOT_CEPH_PLUGINS_HAVE_DICT_SET_TIMESTAMP
+      if (ctx.timestamp.tv_sec != 0 || ctx.timestamp.tv_nsec != 0) {
+        write->write_op.mtime2(&ctx.timestamp);
+      }
+#endif
+    }
+    return *write;
+  }
+
   void deploy_set_map() {
     if (set_map.size() > 0) {
-      struct rados_dict *dict = (struct rados_dict *)ctx.dict;
-      RadosDictionary *d = dict->d;
 #ifdef DEBUG
       i_debug("deploy_set_map: set_map size = %lu", set_map.size());
 #endif
+      map<object_write *, map<string, bufferlist>> object_maps;
       for (auto it = set_map.begin(); it != set_map.end(); it++) {
-        map<string, bufferlist> map;
-        bufferlist bl;
-        bl.append(it->second);
         const string key = it->first;
-        map.insert(pair<string, bufferlist>(key, bl));
-
-        std::string oid = is_private(key) ? d->get_private_oid() : d->get_shared_oid();
-#ifdef DEBUG
-        i_debug("deploy_set_map_value: %s , oid=%s", bl.to_str().c_str(), oid.c_str());
-#endif
-        if ((is_private(key) ? d->get_private_io_ctx() : d->get_shared_io_ctx()).omap_set(oid, map) < 0) {
-          i_error("unable to set key(%s), oid(%s), is_private(%d)", key.c_str(), oid.c_str(), is_private(key));
-        }
+        object_maps[&get_object_write(key)][key].append(it->second);
+      }
+      for (auto it = object_maps.begin(); it != object_maps.end(); it++) {
+        it->first->write_op.omap_set(it->second);
       }
       set_map.clear();
     }
@@ -462,19 +546,21 @@ class rados_dict_transaction_context {
 
   void deploy_atomic_inc_map() {
     if (atomic_inc_map.size() > 0) {
-      struct rados_dict *dict = (struct rados_dict *)ctx.dict;
-
-      RadosDictionary *d = dict->d;
-      string old_value = "0";
 #ifdef DEBUG
       i_debug("deploy_atomic_inc_map: atomic_inc_map size = %lu", atomic_inc_map.size());
 #endif
-      for (auto it = atomic_inc_map.begin(); it != atomic_inc_map.end() && !atomic_inc_not_found; it++) {
-        const string key = it->first;
-        std::string oid = is_private(key) ? d->get_private_oid() : d->get_shared_oid();
+      // numops would create missing keys, dovecot expects NOTFOUND (e.g. to recalculate the quota).
+      map<object_write *, map<string, pair<bufferlist, int>>> object_keys;
+      for (auto it = atomic_inc_map.begin(); it != atomic_inc_map.end(); it++) {
+        object_keys[&get_object_inc(it->first)][it->first] =
+            pair<bufferlist, int>(bufferlist(), LIBRADOS_CMPXATTR_OP_GT);
+      }
+      for (auto it = object_keys.begin(); it != object_keys.end(); it++) {
+        it->first->write_op.omap_cmp(it->second, nullptr);
+      }
+      for (auto it = atomic_inc_map.begin(); it != atomic_inc_map.end(); it++) {
         // it->second is a signed long int
-        librmb::RadosUtils::osd_add(&(is_private(key) ? d->get_private_io_ctx() : d->get_shared_io_ctx()), oid, key,
-                                    it->second);
+        librmb::RadosUtils::osd_add(&get_object_inc(it->first).write_op, it->first, it->second);
       }
       atomic_inc_map.clear();
     }
@@ -482,31 +568,138 @@ class rados_dict_transaction_context {
 
   void deploy_unset_set() {
     if (unset_set.size() > 0) {
-      struct rados_dict *dict = (struct rados_dict *)ctx.dict;
-      RadosDictionary *d = dict->d;
 #ifdef DEBUG
       i_debug("deploy_unset_set: unset_set size = %lu", unset_set.size());
 #endif
+      map<object_write *, set<string>> object_keys;
       for (auto it = unset_set.begin(); it != unset_set.end(); it++) {
-        set<string> keys;
-        const string key = *it;
-        keys.insert(key);
-        std::string oid = is_private(key) ? d->get_private_oid() : d->get_shared_oid();
-#ifdef DEBUG
-        i_debug("deploy_unset_map_value key: %s , oid=%s", key.c_str(), oid.c_str());
-#endif
-        if ((is_private(key) ? d->get_private_io_ctx() : d->get_shared_io_ctx()).omap_rm_keys(oid, keys) < 0) {
-          i_error("unable to unset key(%s), oid(%s), is_private(%d)", key.c_str(), oid.c_str(), is_private(key));
-        }
+        object_keys[&get_object_write(*it)].insert(*it);
+      }
+      for (auto it = object_keys.begin(); it != object_keys.end(); it++) {
+        it->first->write_op.omap_rm_keys(it->second);
       }
       unset_set.clear();
     }
   }
+
+  /* executes (async: submits) the compound write operations of the private and shared dict objects,
+   * followed by their atomic increments */
+  void deploy_write_ops(bool async) {
+    struct rados_dict *dict = (struct rados_dict *)ctx.dict;
+    RadosDictionary *d = dict->d;
+    if (dirty_private) {
+      deploy_write_op(&d->get_private_io_ctx(), d->get_private_oid(), &write_private, async);
+    }
+    for (auto it = write_shared.begin(); it != write_shared.end(); it++) {
+      deploy_write_op(&d->get_shared_io_ctx(), it->first, &it->second, async);
+    }
+    if (inc_private.atomic_inc) {
+      deploy_write_op(&d->get_private_io_ctx(), d->get_private_oid(), &inc_private, async);
+    }
+    for (auto it = inc_shared.begin(); it != inc_shared.end(); it++) {
+      deploy_write_op(&d->get_shared_io_ctx(), it->first, &it->second, async);
+    }
+  }
+
+  void deploy_write_op(librados::IoCtx *io_ctx, const string &oid, object_write *write, bool async) {
+    if (!async) {
+      write->result = io_ctx->operate(oid, &write->write_op);
+      return;
+    }
+    write->completion = librados::Rados::aio_create_completion();
+    write->result = io_ctx->aio_operate(oid, write->completion, &write->write_op);
+    if (write->result < 0) {
+      write->completion->release();
+      write->completion = nullptr;
+    }
+  }
+
+  bool is_complete(const object_write &write) {
+    return write.completion == nullptr || write.completion->is_complete();
+  }
+
+  bool is_complete() {
+    if (!is_complete(write_private) || !is_complete(inc_private)) {
+      return false;
+    }
+    for (auto it = write_shared.begin(); it != write_shared.end(); it++) {
+      if (!is_complete(it->second)) {
+        return false;
+      }
+    }
+    for (auto it = inc_shared.begin(); it != inc_shared.end(); it++) {
+      if (!is_complete(it->second)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void wait_write_op(object_write *write) {
+    if (write->completion != nullptr) {
+      write->completion->wait_for_complete();
+      write->result = write->completion->get_return_value();
+      write->completion->release();
+      write->completion = nullptr;
+    }
+  }
+
+  /* ECANCELED: failed omap_cmp, ENOENT: the dict object does not exist yet */
+  bool is_atomic_inc_not_found(const object_write &write) {
+    return write.atomic_inc && (write.result == -ECANCELED || write.result == -ENOENT);
+  }
+
+  /* waits for the write operations and evaluates the commit result */
+  int wait_write_ops() {
+    struct rados_dict *dict = (struct rados_dict *)ctx.dict;
+    RadosDictionary *d = dict->d;
+
+    wait_write_op(&write_private);
+    for (auto it = write_shared.begin(); it != write_shared.end(); it++) {
+      wait_write_op(&it->second);
+    }
+    wait_write_op(&inc_private);
+    for (auto it = inc_shared.begin(); it != inc_shared.end(); it++) {
+      wait_write_op(&it->second);
+    }
+    int ret = RADOS_COMMIT_RET_OK;
+    if (get_result(write_private.result) == RADOS_COMMIT_RET_FAILED) {
+      i_error("unable to update private dict, oid(%s), error(%d)", d->get_private_oid().c_str(),
+              write_private.result);
+      ret = RADOS_COMMIT_RET_FAILED;
+    }
+    for (auto it = write_shared.begin(); it != write_shared.end(); it++) {
+      if (get_result(it->second.result) == RADOS_COMMIT_RET_FAILED) {
+        i_error("unable to update shared dict, oid(%s), error(%d)", it->first.c_str(), it->second.result);
+        ret = RADOS_COMMIT_RET_FAILED;
+      }
+    }
+    // the other changes are written, also if a key of the atomic increments does not exist.
+    atomic_inc_not_found = is_atomic_inc_not_found(inc_private);
+    if (!atomic_inc_not_found && get_result(inc_private.result) == RADOS_COMMIT_RET_FAILED) {
+      i_error("unable to increment private dict, oid(%s), error(%d)", d->get_private_oid().c_str(),
+              inc_private.result);
+      ret = RADOS_COMMIT_RET_FAILED;
+    }
+    for (auto it = inc_shared.begin(); it != inc_shared.end(); it++) {
+      if (is_atomic_inc_not_found(it->second)) {
+        atomic_inc_not_found = true;
+      } else if (get_result(it->second.result) == RADOS_COMMIT_RET_FAILED) {
+        i_error("unable to increment shared dict, oid(%s), error(%d)", it->first.c_str(), it->second.result);
+        ret = RADOS_COMMIT_RET_FAILED;
+      }
+    }
+    if (ret == RADOS_COMMIT_RET_OK && atomic_inc_not_found) {
+      return RADOS_COMMIT_RET_NOTFOUND;
+    }
+    return ret;
+  }
 };
 
 static std::mutex transaction_lock;
 
 struct dict_transaction_context *rados_dict_transaction_init(struct dict *_dict) {
+  rados_dict_flush_lookups(_dict);
   struct rados_dict_transaction_context *ctx = new rados_dict_transaction_context(_dict);
   return &ctx->ctx;
 }
@@ -520,12 +713,46 @@ void rados_dict_set_timestamp(struct dict_transaction_context *_ctx, const struc
   if (ts != NULL) {
     _ctx->timestamp.tv_sec = t.tv_sec;
     _ctx->timestamp.tv_nsec = t.tv_nsec;
-    ctx->write_op_private.mtime2(&t);
-    ctx->write_op_shared.mtime2(&t);
+    ctx->write_private.write_op.mtime2(&t);
+    for (auto it = ctx->write_shared.begin(); it != ctx->write_shared.end(); it++) {
+      it->second.write_op.mtime2(&t);
+    }
+    // the atomic increments get the timestamp, when they are deployed by the commit
   }
 }
 #endif
 
+/* calls the commit callback and frees the transaction */
+static int rados_dict_transaction_finish(rados_dict_transaction_context *ctx) {
+  int ret = ctx->wait_write_ops();
+  if (ctx->callback != nullptr) {
+#if DOVECOT_PREREQ(2, 3)
+    struct dict_commit_result result = {static_cast<dict_commit_ret>(ret), nullptr};  // TODO(p.mauritius): text?
+    ctx->callback(&result, ctx->context);
+#else
+    ctx->callback(ret, ctx->context);
+#endif
+  }
+  delete ctx;
+  return ret;
+}
+
+/* finishes the async commits, which are complete (wait = false) or all async commits (wait = true) */
+static void rados_dict_finish_commits(struct rados_dict *dict, bool wait) {
+  std::list<rados_dict_transaction_context *> finished;
+  for (auto it = dict->commits->begin(); it != dict->commits->end();) {
+    if (wait || (*it)->is_complete()) {
+      finished.push_back(*it);
+      it = dict->commits->erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (auto it = finished.begin(); it != finished.end(); ++it) {
+    rados_dict_transaction_finish(*it);
+  }
+}
+
 void (*transaction_commit)(struct dict_transaction_context *ctx, bool async,
                            dict_transaction_commit_callback_t *callback, void *context);
 
@@ -538,32 +765,28 @@ int rados_dict_transaction_commit(struct dict_transaction_context *_ctx, bool as
 #endif
 {
   rados_dict_transaction_context *ctx = reinterpret_cast<rados_dict_transaction_context *>(_ctx);
-  string old_value = "0";
+  struct rados_dict *dict = (struct rados_dict *)_ctx->dict;
+
+  ctx->context = context;
+  ctx->callback = callback;
 
+  // the queued lookups are read before the changes of the transaction
+  rados_dict_flush_lookups(_ctx->dict);
+  ctx->invalidate_cache();
   ctx->deploy_set_map();
   ctx->deploy_atomic_inc_map();
   ctx->deploy_unset_set();
+  ctx->deploy_write_ops(async);
 
-  bool failed = false;
-  int ret;
-
-  ctx->context = context;
-  ctx->callback = callback;
-
-  ret =
-      ctx->atomic_inc_not_found ? RADOS_COMMIT_RET_NOTFOUND : (failed ? RADOS_COMMIT_RET_FAILED : RADOS_COMMIT_RET_OK);
-  if (callback != nullptr) {
-#if DOVECOT_PREREQ(2, 3)
-    struct dict_commit_result result = {static_cast<dict_commit_ret>(ret), nullptr};  // TODO(p.mauritius): text?
-    callback(&result, ctx->context);
-#else
-    callback(ret, ctx->context);
-#endif
+  int ret = RADOS_COMMIT_RET_OK;
+  if (async) {
+    // the callback is called by rados_dict_wait or the next dict operation after the commit is complete.
+    dict->commits->push_back(ctx);
+    rados_dict_finish_commits(dict, false);
+  } else {
+    ret = rados_dict_transaction_finish(ctx);
   }
 
-  delete ctx;
-  ctx = NULL;
-
 #if DOVECOT_PREREQ(2, 3)
   return;
 #else
@@ -616,6 +839,8 @@ void rados_dict_atomic_inc(struct dict_transaction_context *_ctx, const char *_k
 class kv_map {
  public:
   int rval = -1;
+  /* set by omap_get_vals2, when the read operation completes */
+  bool more = false;
   string key;
   std::map<string, bufferlist> map;
   typename std::map<string, bufferlist>::iterator map_iter;
@@ -645,6 +870,19 @@ class rados_dict_iterate_context {
     guid_to_str = guid_128_to_string(this->guid);
   }
 
+  /* merges the results of the same query (key) from the shards */
+  void merge_results() {
+    for (auto it = results.begin(); it != results.end(); it++) {
+      for (auto first = results.begin(); first != it; first++) {
+        if (first->key == it->key) {
+          first->map.insert(it->map.begin(), it->map.end());
+          it->map.clear();
+          break;
+        }
+      }
+    }
+  }
+
   void dump() {
     auto g = guid_to_str;
     for (const auto &i : results) {
@@ -655,9 +893,45 @@ class rados_dict_iterate_context {
   }
 };
 
+/* read operation of one dict object (private, shared shard) */
+class rados_dict_object_read {
+ public:
+  librados::IoCtx *io_ctx = nullptr;
+  string oid;
+  ObjectReadOperation read_op;
+  AioCompletion *completion = nullptr;
+  bufferlist bl;
+  /* a missing shard object is empty (not all shards have keys) */
+  bool missing_ok = false;
+  /* results of the read operation [first_result, end_result) */
+  size_t first_result = 0;
+  size_t end_result = 0;
+};
+
+/* adds the query of the keys to the read operation, one result per query */
+static void rados_dict_iterate_add_keys(rados_dict_iterate_context *iter, ObjectReadOperation *read_op,
+                                        const set<string> &keys) {
+  if (iter->flags & DICT_ITERATE_FLAG_EXACT_KEY) {
+    iter->results.emplace_back();
+    read_op->omap_get_vals_by_keys(keys, &iter->results.back().map, &iter->results.back().rval);
+    return;
+  }
+  for (auto k : keys) {
+    iter->results.emplace_back();
+    iter->results.back().key = k;
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_OMAP_GET_VALS2
+    read_op->omap_get_vals2("", k, LONG_MAX, &iter->results.back().map, &iter->results.back().more,
+                            &iter->results.back().rval);
+#else
+    read_op->omap_get_vals("", k, LONG_MAX, &iter->results.back().map, &iter->results.back().rval);
+#endif
+  }
+}
+
 struct dict_iterate_context *rados_dict_iterate_init(struct dict *_dict, const char *const *paths,
                                                      const enum dict_iterate_flags flags) {
   RadosDictionary *d = ((struct rados_dict *)_dict)->d;
+  rados_dict_flush_lookups(_dict);
 
   /* these flags are not supported for now */
   i_assert((flags & DICT_ITERATE_FLAG_SORT_BY_VALUE) == 0);
@@ -679,112 +953,98 @@ struct dict_iterate_context *rados_dict_iterate_init(struct dict *_dict, const c
       private_keys.insert(key);
     }
   }
-  bufferlist bl_private;
-  bufferlist bl_shared;
   if (private_keys.size() + shared_keys.size() > 0) {
-    AioCompletion *private_read_completion = nullptr;
-    ObjectReadOperation private_read_op;
-    AioCompletion *shared_read_completion = nullptr;
-    ObjectReadOperation shared_read_op;
+    std::list<rados_dict_object_read> reads;
+    unsigned int shards = d->get_shared_shards();
 
-    if (flags & DICT_ITERATE_FLAG_EXACT_KEY) {
-      iter->results.reserve(2);
-    } else {
-      iter->results.reserve(private_keys.size() + shared_keys.size());
-    }
+    // the read operations reference the results, which must not be reallocated.
+    iter->results.reserve(private_keys.size() + shared_keys.size() * shards);
 
     if (private_keys.size() > 0) {
 #ifdef DEBUG
       i_debug("rados_dict_iterate_init(): private query");
 #endif
-      private_read_completion = librados::Rados::aio_create_completion();
-
-      if (flags & DICT_ITERATE_FLAG_EXACT_KEY) {
-        iter->results.emplace_back();
-        private_read_op.omap_get_vals_by_keys(private_keys, &iter->results.back().map, &iter->results.back().rval);
-      } else {
-        for (auto k : private_keys) {
-          iter->results.emplace_back();
-          iter->results.back().key = k;
-#ifdef DOVECOT_CEPH_PLUGIN_HAVE_OMAP_GET_VALS2
-          bool more;
-          private_read_op.omap_get_vals2("", k, LONG_MAX, &iter->results.back().map, &more, &iter->results.back().rval);
-#else
-          private_read_op.omap_get_vals("", k, LONG_MAX, &iter->results.back().map, &iter->results.back().rval);
-#endif
-        }
-      }
-
-      int err = d->get_private_io_ctx().aio_operate(d->get_private_oid(), private_read_completion, &private_read_op,
-                                                    &bl_private);
-#ifdef DEBUG
-      i_debug("rados_dict_iterate_init(): private err=%d(%s)", err, strerror(-err));
-#endif
-      iter->failed = err < 0;
+      reads.emplace_back();
+      reads.back().io_ctx = &d->get_private_io_ctx();
+      reads.back().oid = d->get_private_oid();
+      reads.back().first_result = iter->results.size();
+      rados_dict_iterate_add_keys(iter, &reads.back().read_op, private_keys);
+      reads.back().end_result = iter->results.size();
     }
 
-    if (!iter->failed && shared_keys.size() > 0) {
+    if (shared_keys.size() > 0) {
 #ifdef DEBUG
-      i_debug("rados_dict_iterate_init(): shared query");
+      i_debug("rados_dict_iterate_init(): shared query, shards=%u", shards);
 #endif
-      shared_read_completion = librados::Rados::aio_create_completion();
-
       if (flags & DICT_ITERATE_FLAG_EXACT_KEY) {
-        iter->results.emplace_back();
-        shared_read_op.omap_get_vals_by_keys(shared_keys, &iter->results.back().map, &iter->results.back().rval);
-      } else {
+        // only the shards of the keys
+        map<string, set<string>> shard_keys;
         for (auto k : shared_keys) {
-          iter->results.emplace_back();
-          iter->results.back().key = k;
-#ifdef DOVECOT_CEPH_PLUGIN_HAVE_OMAP_GET_VALS2
-          bool more;
-          shared_read_op.omap_get_vals2("", k, LONG_MAX, &iter->results.back().map, &more, &iter->results.back().rval);
-#else
-          shared_read_op.omap_get_vals("", k, LONG_MAX, &iter->results.back().map, &iter->results.back().rval);
-#endif
+          shard_keys[d->get_full_oid(k)].insert(k);
+        }
+        for (auto it = shard_keys.begin(); it != shard_keys.end(); it++) {
+          reads.emplace_back();
+          reads.back().io_ctx = &d->get_shared_io_ctx();
+          reads.back().oid = it->first;
+          reads.back().missing_ok = shards > 1;
+          reads.back().first_result = iter->results.size();
+          rados_dict_iterate_add_keys(iter, &reads.back().read_op, it->second);
+          reads.back().end_result = iter->results.size();
+        }
+      } else {
+        for (unsigned int shard = 0; shard < shards; shard++) {
+          reads.emplace_back();
+          reads.back().io_ctx = &d->get_shared_io_ctx();
+          reads.back().oid = d->get_shared_shard_oid(shard);
+          reads.back().missing_ok = shards > 1;
+          reads.back().first_result = iter->results.size();
+          rados_dict_iterate_add_keys(iter, &reads.back().read_op, shared_keys);
+          reads.back().end_result = iter->results.size();
         }
       }
-
-      int err =
-          d->get_shared_io_ctx().aio_operate(d->get_shared_oid(), shared_read_completion, &shared_read_op, &bl_shared);
-#ifdef DEBUG
-      i_debug("rados_dict_iterate_init(): shared err=%d(%s)", err, strerror(-err));
-#endif
-      iter->failed = err < 0;
     }
 
-    if (!iter->failed && private_keys.size() > 0) {
-      if (!private_read_completion->is_complete()) {
-        int err = private_read_completion->wait_for_complete_and_cb();
+    for (auto it = reads.begin(); it != reads.end() && !iter->failed; it++) {
+      it->completion = librados::Rados::aio_create_completion();
+      int err = it->io_ctx->aio_operate(it->oid, it->completion, &it->read_op, &it->bl);
 #ifdef DEBUG
-        i_debug("rados_dict_iterate_init(): priv wait_for_complete_and_cb() err=%d(%s)", err, strerror(-err));
+      i_debug("rados_dict_iterate_init(): oid=%s err=%d(%s)", it->oid.c_str(), err, strerror(-err));
 #endif
-        iter->failed = err < 0;
-      }
-      if (!iter->failed) {
-        int err = private_read_completion->get_return_value();
-#ifdef DEBUG
-        i_debug("rados_dict_iterate_init(): priv get_return_value() err=%d(%s)", err, strerror(-err));
-#endif
-        iter->failed |= err < 0;
+      if (err < 0) {
+        it->completion->release();
+        it->completion = nullptr;
+        iter->failed = true;
       }
     }
 
-    if (!iter->failed && shared_keys.size() > 0) {
-      if (!shared_read_completion->is_complete()) {
-        int err = shared_read_completion->wait_for_complete_and_cb();
+    // wait for all submitted operations, they reference the results.
+    for (auto it = reads.begin(); it != reads.end(); it++) {
+      if (it->completion == nullptr) {
+        continue;
+      }
+      if (!it->completion->is_complete()) {
+        int err = it->completion->wait_for_complete_and_cb();
 #ifdef DEBUG
-        i_debug("rados_dict_iterate_init(): shared wait_for_complete_and_cb() err=%d(%s)", err, strerror(-err));
+        i_debug("rados_dict_iterate_init(): wait_for_complete_and_cb() oid=%s err=%d(%s)", it->oid.c_str(), err,
+                strerror(-err));
 #endif
-        iter->failed = err < 0;
+        iter->failed |= err < 0;
       }
-      if (!iter->failed) {
-        int err = shared_read_completion->get_return_value();
+      int err = it->completion->get_return_value();
 #ifdef DEBUG
-        i_debug("rados_dict_iterate_init(): shared get_return_value() err=%d(%s)", err, strerror(-err));
+      i_debug("rados_dict_iterate_init(): get_return_value() oid=%s err=%d(%s)", it->oid.c_str(), err,
+              strerror(-err));
 #endif
-        iter->failed |= err < 0;
+      if (err == -ENOENT && it->missing_ok) {
+        for (size_t i = it->first_result; i < it->end_result; i++) {
+          iter->results[i].map.clear();
+          iter->results[i].rval = 0;
+        }
+        err = 0;
       }
+      iter->failed |= err < 0;
+      it->completion->release();
+      it->completion = nullptr;
     }
 
     if (!iter->failed) {
@@ -797,19 +1057,11 @@ struct dict_iterate_context *rados_dict_iterate_init(struct dict *_dict, const c
     }
 
     if (!iter->failed) {
+      iter->merge_results();
       iter->dump();
       iter->results_iter = iter->results.begin();
       iter->results_iter->map_iter = iter->results_iter->map.begin();
     }
-
-    if (private_read_completion != nullptr) {
-      private_read_completion->release();
-      private_read_completion = nullptr;
-    }
-    if (shared_read_completion != nullptr) {
-      shared_read_completion->release();
-      shared_read_completion = nullptr;
-    }
   } else {
 #ifdef DEBUG
     i_debug("rados_dict_iterate_init() no keys");
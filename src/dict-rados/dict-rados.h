@@ -27,6 +27,9 @@ extern int rados_dict_lookup(struct dict *_dict, pool_t pool, const char *key, c
 
 extern void rados_dict_lookup_async(struct dict *_dict, const char *key, dict_lookup_callback_t *callback,
                                     void *context);
+extern void rados_dict_flush_lookups(struct dict *_dict);
+/* calls rados_dict_flush_lookups in the next ioloop run (NULL if there is no ioloop) */
+extern struct timeout *rados_dict_lookup_timeout_add(struct dict *_dict);
 extern struct dict_transaction_context *rados_dict_transaction_init(struct dict *_dict);
 #if DOVECOT_PREREQ(2, 3)
 extern void rados_dict_transaction_commit(struct dict_transaction_context *_ctx, bool async,
@@ -14,6 +14,7 @@
 #include "libdict-rados-plugin.h"
 #include "dict-rados.h"
 #include "macros.h"
+#include "ioloop.h"
 
 const char *dict_rados_plugin_version = DOVECOT_ABI_VERSION;
 
@@ -43,6 +44,16 @@ struct dict dict_driver_rados = {.name = "rados",
 
 static int plugin_ref_count = 0;
 
+/* the type checking ioloop macros of Dovecot are not available in C++ (dict-rados.cpp) */
+static void rados_dict_lookup_timeout(struct dict *dict) { rados_dict_flush_lookups(dict); }
+
+struct timeout *rados_dict_lookup_timeout_add(struct dict *dict) {
+  if (current_ioloop == NULL) {
+    return NULL;
+  }
+  return timeout_add(0, rados_dict_lookup_timeout, dict);
+}
+
 void dict_rados_plugin_init(struct module *module ATTR_UNUSED) {
   if (plugin_ref_count++ > 0) {
     return;
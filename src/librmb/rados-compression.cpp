@@ -0,0 +1,137 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#include "dovecot-ceph-plugin-config.h"
+
+#include "rados-compression.h"
+#include <errno.h>
+#include <string>
+#include <sstream>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+namespace librmb {
+
+bool RadosCompression::parse_config(const std::string &config, std::string *codec, int *level) {
+  size_t pos = config.find(':');
+  *codec = config.substr(0, pos);
+  *level = 0;
+  if (pos != std::string::npos) {
+    try {
+      *level = std::stoi(config.substr(pos + 1));
+    } catch (std::exception &e) {
+      return false;
+    }
+  }
+  return is_supported(*codec);
+}
+
+bool RadosCompression::is_supported(const std::string &codec) {
+#ifdef HAVE_ZSTD
+  if (codec.compare(RBOX_COMPRESSION_ZSTD) == 0) {
+    return true;
+  }
+#endif
+#ifdef HAVE_LZ4
+  if (codec.compare(RBOX_COMPRESSION_LZ4) == 0) {
+    return true;
+  }
+#endif
+  return false;
+}
+
+int RadosCompression::compress(const std::string &codec, int level, librados::bufferlist &in,
+                               librados::bufferlist *out) {
+  if (in.length() == 0) {
+    return -EINVAL;
+  }
+#ifdef HAVE_ZSTD
+  if (codec.compare(RBOX_COMPRESSION_ZSTD) == 0) {
+    librados::bufferptr ptr(ZSTD_compressBound(in.length()));
+    size_t ret = ZSTD_compress(ptr.c_str(), ptr.length(), in.c_str(), in.length(),
+                               level > 0 ? level : ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(ret)) {
+      return -EIO;
+    }
+    ptr.set_length(ret);
+    out->push_back(ptr);
+    return 0;
+  }
+#endif
+#ifdef HAVE_LZ4
+  if (codec.compare(RBOX_COMPRESSION_LZ4) == 0) {
+    librados::bufferptr ptr(LZ4_compressBound(in.length()));
+    // level is the acceleration of lz4
+    int ret = LZ4_compress_fast(in.c_str(), ptr.c_str(), in.length(), ptr.length(), level > 0 ? level : 1);
+    if (ret <= 0) {
+      return -EIO;
+    }
+    ptr.set_length(ret);
+    out->push_back(ptr);
+    return 0;
+  }
+#endif
+  return -ENOTSUP;
+}
+
+int RadosCompression::decompress(const std::string &codec, librados::bufferlist &in, size_t size,
+                                 librados::bufferlist *out) {
+#ifdef HAVE_ZSTD
+  if (codec.compare(RBOX_COMPRESSION_ZSTD) == 0) {
+    librados::bufferptr ptr(size);
+    size_t ret = ZSTD_decompress(ptr.c_str(), ptr.length(), in.c_str(), in.length());
+    if (ZSTD_isError(ret) || ret != size) {
+      return -EIO;
+    }
+    out->push_back(ptr);
+    return 0;
+  }
+#endif
+#ifdef HAVE_LZ4
+  if (codec.compare(RBOX_COMPRESSION_LZ4) == 0) {
+    librados::bufferptr ptr(size);
+    int ret = LZ4_decompress_safe(in.c_str(), ptr.c_str(), in.length(), ptr.length());
+    if (ret < 0 || static_cast<size_t>(ret) != size) {
+      return -EIO;
+    }
+    out->push_back(ptr);
+    return 0;
+  }
+#endif
+  return -ENOTSUP;
+}
+
+std::string RadosCompression::to_metadata(const std::string &codec, size_t size) {
+  std::stringstream ss;
+  ss << codec << ":" << size;
+  return ss.str();
+}
+
+bool RadosCompression::from_metadata(const std::string &value, std::string *codec, size_t *size) {
+  size_t pos = value.find(':');
+  if (pos == std::string::npos || pos == 0) {
+    return false;
+  }
+  *codec = value.substr(0, pos);
+  try {
+    *size = std::stoul(value.substr(pos + 1));
+  } catch (std::exception &e) {
+    return false;
+  }
+  return true;
+}
+
+} /* namespace librmb */
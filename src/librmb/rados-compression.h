@@ -0,0 +1,76 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#ifndef SRC_LIBRMB_RADOS_COMPRESSION_H_
+#define SRC_LIBRMB_RADOS_COMPRESSION_H_
+
+#include <string>
+#include <rados/librados.hpp>
+
+#define RBOX_COMPRESSION_ZSTD "zstd"
+#define RBOX_COMPRESSION_LZ4 "lz4"
+
+namespace librmb {
+
+/**
+ * class RadosCompression
+ *
+ * Compression of mail objects (rbox_compression). The codec and the size of the
+ * uncompressed mail are saved in the metadata RBOX_METADATA_COMPRESSION
+ * (format: <codec>:<size>).
+ *
+ */
+class RadosCompression {
+ public:
+  /*!
+   * parse the configuration value
+   * @param[in] config <codec>[:<level>] e.g. zstd:3, lz4
+   * @param[out] codec valid ptr
+   * @param[out] level valid ptr, 0 = default level of the codec
+   * @return false if the codec is unknown or not supported by this build
+   */
+  static bool parse_config(const std::string &config, std::string *codec, int *level);
+  /*!
+   * @return true if the codec is supported by this build
+   */
+  static bool is_supported(const std::string &codec);
+  /*!
+   * compress data
+   * @param[in] codec valid codec
+   * @param[in] level compression level
+   * @param[in] in uncompressed data
+   * @param[out] out valid ptr to the compressed data
+   * @return linux error code or 0 if successful
+   */
+  static int compress(const std::string &codec, int level, librados::bufferlist &in, librados::bufferlist *out);
+  /*!
+   * decompress data
+   * @param[in] codec valid codec
+   * @param[in] in compressed data
+   * @param[in] size size of the uncompressed data
+   * @param[out] out valid ptr to the uncompressed data
+   * @return linux error code or 0 if successful
+   */
+  static int decompress(const std::string &codec, librados::bufferlist &in, size_t size, librados::bufferlist *out);
+  /*!
+   * @return metadata value <codec>:<size>
+   */
+  static std::string to_metadata(const std::string &codec, size_t size);
+  /*!
+   * parse the metadata value
+   * @return false if the value is invalid
+   */
+  static bool from_metadata(const std::string &value, std::string *codec, size_t *size);
+};
+
+} /* namespace librmb */
+
+#endif /* SRC_LIBRMB_RADOS_COMPRESSION_H_ */
@@ -0,0 +1,176 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#include "rados-copy-operations.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <list>
+#include <map>
+#include <string>
+
+#include "rados-util.h"
+
+namespace librmb {
+
+RadosCopyOperations::RadosCopyOperations() : ops_finished(0) {}
+
+RadosCopyOperations::~RadosCopyOperations() {
+  if (!ops.empty()) {
+    wait(false, nullptr);
+  }
+}
+
+int RadosCopyOperations::add(librados::IoCtx &io_ctx, const std::string &src_oid, const char *src_ns,
+                             const std::string &dest_oid, const char *dest_ns, std::list<RadosMetadata> &to_update,
+                             bool delete_source, unsigned int max_inflight) {
+  copy_operation *op = new copy_operation();
+  op->src_oid = src_oid;
+  op->dest_oid = dest_oid;
+  op->src_io_ctx.dup(io_ctx);
+  op->src_io_ctx.set_namespace(src_ns);
+  op->dest_io_ctx.dup(io_ctx);
+  op->dest_io_ctx.set_namespace(dest_ns);
+  op->copied = !delete_source || strcmp(src_ns, dest_ns) != 0;
+  op->move = delete_source && op->copied;
+  op->ret = 0;
+
+  if (op->copied) {
+    RadosUtils::copy_from(&op->write_op, src_oid, op->src_io_ctx);
+  } else {
+    // move within the namespace only updates the metadata
+    op->write_op.assert_exists();
+  }
+  // see RadosStorage::copy
+  time_t save_time = time(NULL);
+  op->write_op.mtime(&save_time);
+  for (std::list<RadosMetadata>::iterator it = to_update.begin(); it != to_update.end(); ++it) {
+    op->write_op.setxattr((*it).key.c_str(), (*it).bl);
+  }
+
+  op->completion = librados::Rados::aio_create_completion();
+  int ret;
+  if (op->copied) {
+    ret = op->dest_io_ctx.aio_operate(dest_oid, op->completion, &op->write_op);
+  } else {
+    // the object is updated in place on commit, there is nothing to restore on rollback.
+    op->read_op.assert_exists();
+    ret = op->dest_io_ctx.aio_operate(dest_oid, op->completion, &op->read_op, nullptr);
+  }
+  if (ret < 0) {
+    op->completion->release();
+    delete op;
+    return ret;
+  }
+  ops.push_back(op);
+  while (max_inflight > 0 && ops.size() - ops_finished > max_inflight) {
+    wait_for_operation(ops[ops_finished++]);
+  }
+  return 0;
+}
+
+void RadosCopyOperations::wait_for_operation(copy_operation *op) {
+  if (op->completion == nullptr) {
+    return;
+  }
+  op->completion->wait_for_complete();
+  op->ret = op->completion->get_return_value();
+  op->completion->release();
+  op->completion = nullptr;
+}
+
+// updates the metadata of the objects moved within the namespace.
+int RadosCopyOperations::update_objects(std::map<std::string, int> *failed) {
+  for (std::deque<copy_operation *>::iterator it = ops.begin(); it != ops.end(); ++it) {
+    copy_operation *op = *it;
+    if (op->copied) {
+      continue;
+    }
+    op->completion = librados::Rados::aio_create_completion();
+    op->ret = op->dest_io_ctx.aio_operate(op->dest_oid, op->completion, &op->write_op);
+    if (op->ret < 0) {
+      op->completion->release();
+      op->completion = nullptr;
+    }
+  }
+  int ret = 0;
+  for (std::deque<copy_operation *>::iterator it = ops.begin(); it != ops.end(); ++it) {
+    copy_operation *op = *it;
+    wait_for_operation(op);
+    if (op->ret < 0) {
+      if (failed != nullptr) {
+        (*failed)[op->src_oid] = op->ret;
+      }
+      ret = ret < 0 ? ret : op->ret;
+    }
+  }
+  return ret;
+}
+
+// removes the sources of the moved objects or the copied objects.
+int RadosCopyOperations::remove_objects(bool sources, std::map<std::string, int> *failed) {
+  int ret = 0;
+  for (std::deque<copy_operation *>::iterator it = ops.begin(); it != ops.end(); ++it) {
+    copy_operation *op = *it;
+    if ((sources ? !op->move : !op->copied) || op->ret < 0) {
+      continue;
+    }
+    op->completion = librados::Rados::aio_create_completion();
+    librados::IoCtx &remove_io_ctx = sources ? op->src_io_ctx : op->dest_io_ctx;
+    if (remove_io_ctx.aio_remove(sources ? op->src_oid : op->dest_oid, op->completion) < 0) {
+      op->completion->release();
+      op->completion = nullptr;
+    }
+  }
+  for (std::deque<copy_operation *>::iterator it = ops.begin(); it != ops.end(); ++it) {
+    copy_operation *op = *it;
+    wait_for_operation(op);
+    // the source has been removed in between, the object is moved anyway.
+    if (sources && op->ret < 0 && op->ret != -ENOENT) {
+      if (failed != nullptr) {
+        (*failed)[op->src_oid] = op->ret;
+      }
+      ret = ret < 0 ? ret : op->ret;
+    }
+  }
+  return ret;
+}
+
+int RadosCopyOperations::wait(bool commit, std::map<std::string, int> *failed) {
+  int ret = 0;
+  for (std::deque<copy_operation *>::iterator it = ops.begin(); it != ops.end(); ++it) {
+    wait_for_operation(*it);
+    if ((*it)->ret < 0) {
+      if (failed != nullptr) {
+        (*failed)[(*it)->src_oid] = (*it)->ret;
+      }
+      ret = ret < 0 ? ret : (*it)->ret;
+    }
+  }
+  if (commit && ret == 0) {
+    ret = update_objects(failed);
+  }
+  // the sources of the moved objects are removed, only if all objects have been copied.
+  if (commit && ret == 0) {
+    ret = remove_objects(true, failed);
+  } else {
+    remove_objects(false, nullptr);
+  }
+  for (std::deque<copy_operation *>::iterator it = ops.begin(); it != ops.end(); ++it) {
+    delete *it;
+  }
+  ops.clear();
+  ops_finished = 0;
+  return ret;
+}
+
+}  // namespace librmb
@@ -0,0 +1,87 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#ifndef SRC_LIBRMB_RADOS_COPY_OPERATIONS_H_
+#define SRC_LIBRMB_RADOS_COPY_OPERATIONS_H_
+
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+
+#include <rados/librados.hpp>
+#include "rados-types.h"
+
+namespace librmb {
+
+/**
+ * class RadosCopyOperations
+ *
+ * Queue of the asynchronous copy and move operations of one transaction
+ * (see RadosStorage::copy_async). The operations are submitted immediately and
+ * completed by wait: on commit the sources of the moved objects are removed,
+ * otherwise the copied objects are removed again. Objects moved within their
+ * namespace are only checked for existence until commit, their metadata is
+ * updated by wait.
+ *
+ */
+class RadosCopyOperations {
+ public:
+  RadosCopyOperations();
+  /* discards the operations, which have not been completed by wait */
+  virtual ~RadosCopyOperations();
+
+  /*!
+   * submit a copy (delete_source = false) or move of an object.
+   * @param[in] io_ctx io context of the storage, the namespaces are set on duplicates.
+   * @param[in] max_inflight max. number of unfinished operations in the queue (0 = unlimited)
+   * @return linux errorcode or 0 if the operation has been submitted
+   */
+  int add(librados::IoCtx &io_ctx, const std::string &src_oid, const char *src_ns, const std::string &dest_oid,
+          const char *dest_ns, std::list<RadosMetadata> &to_update, bool delete_source, unsigned int max_inflight);
+  /*!
+   * wait for all queued operations and empty the queue.
+   * @param[in] commit false to discard the queued operations
+   * @param[out] failed source oid => linux errorcode of each failed operation (may be nullptr)
+   * @return linux errorcode of the first failed operation or 0 if successful
+   */
+  int wait(bool commit, std::map<std::string, int> *failed);
+  bool empty() { return ops.empty(); }
+
+ private:
+  struct copy_operation {
+    std::string src_oid;
+    std::string dest_oid;
+    librados::IoCtx src_io_ctx;
+    librados::IoCtx dest_io_ctx;
+    /* the object has been copied to dest_oid (false for moves within the namespace) */
+    bool copied;
+    /* the source is removed on commit */
+    bool move;
+    librados::ObjectWriteOperation write_op;
+    /* existence check of an object, which is moved within the namespace */
+    librados::ObjectReadOperation read_op;
+    librados::AioCompletion *completion;
+    int ret;
+  };
+  void wait_for_operation(copy_operation *op);
+  int update_objects(std::map<std::string, int> *failed);
+  int remove_objects(bool sources, std::map<std::string, int> *failed);
+
+ private:
+  /* the first ops_finished operations are completed */
+  std::deque<copy_operation *> ops;
+  size_t ops_finished;
+};
+
+}  // namespace librmb
+
+#endif  // SRC_LIBRMB_RADOS_COPY_OPERATIONS_H_
@@ -0,0 +1,136 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#include "rados-dictionary-cache.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+namespace librmb {
+
+RadosDictionaryCache::RadosDictionaryCache() : max_entries(0), ttl(0), generation(0), hits(0), misses(0) {}
+
+void RadosDictionaryCache::configure(size_t max_entries_, unsigned int ttl_,
+                                     const std::list<std::string> &bypass_prefixes_) {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  max_entries = max_entries_;
+  // entries never expire otherwise, even if they have been changed by another process
+  ttl = ttl_ > 0 ? ttl_ : RBOX_DICT_CACHE_DEFAULT_TTL;
+  bypass_prefixes = bypass_prefixes_;
+  lru.clear();
+  index.clear();
+}
+
+bool RadosDictionaryCache::is_cached_key(const std::string &key) {
+  if (max_entries == 0) {
+    return false;
+  }
+  for (std::list<std::string>::iterator it = bypass_prefixes.begin(); it != bypass_prefixes.end(); ++it) {
+    if (key.compare(0, it->size(), *it) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RadosDictionaryCache::lookup(const std::string &key, std::string *value_r, bool *found_r) {
+  if (!is_cached_key(key)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  std::map<std::string, std::list<entry>::iterator>::iterator it = index.find(key);
+  if (it != index.end() && it->second->expires < time(NULL)) {
+    remove(it);
+    it = index.end();
+  }
+  if (it == index.end()) {
+    misses++;
+    return false;
+  }
+  lru.splice(lru.begin(), lru, it->second);
+  *value_r = it->second->value;
+  *found_r = it->second->found;
+  hits++;
+  return true;
+}
+
+uint64_t RadosDictionaryCache::get_generation() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  return generation;
+}
+
+void RadosDictionaryCache::update(const std::string &key, const std::string *value, uint64_t generation_) {
+  if (!is_cached_key(key)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  if (generation_ != generation) {
+    // the value may be outdated
+    return;
+  }
+  std::map<std::string, std::list<entry>::iterator>::iterator it = index.find(key);
+  if (it != index.end()) {
+    remove(it);
+  }
+  entry e;
+  e.key = key;
+  e.found = value != nullptr;
+  e.value = value != nullptr ? *value : "";
+  e.expires = time(NULL) + ttl;
+  lru.push_front(e);
+  index[key] = lru.begin();
+  while (lru.size() > max_entries) {
+    remove(index.find(lru.back().key));
+  }
+}
+
+void RadosDictionaryCache::invalidate(const std::string &key) {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  // every write starts a new generation, whether the key is cached or not
+  generation++;
+  if (!is_cached_key(key)) {
+    return;
+  }
+  std::map<std::string, std::list<entry>::iterator>::iterator it = index.find(key);
+  if (it != index.end()) {
+    remove(it);
+  }
+}
+
+void RadosDictionaryCache::clear() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  generation++;
+  lru.clear();
+  index.clear();
+}
+
+uint64_t RadosDictionaryCache::get_hits() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  return hits;
+}
+
+uint64_t RadosDictionaryCache::get_misses() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  return misses;
+}
+
+size_t RadosDictionaryCache::size() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  return lru.size();
+}
+
+void RadosDictionaryCache::remove(std::map<std::string, std::list<entry>::iterator>::iterator it) {
+  lru.erase(it->second);
+  index.erase(it);
+}
+
+}  // namespace librmb
@@ -0,0 +1,103 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#ifndef SRC_LIBRMB_RADOS_DICTIONARY_CACHE_H_
+#define SRC_LIBRMB_RADOS_DICTIONARY_CACHE_H_
+
+#include <time.h>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>  // NOLINT
+#include <string>
+
+/* time to live of the cache entries in seconds, if no ttl is configured */
+#define RBOX_DICT_CACHE_DEFAULT_TTL 5
+
+namespace librmb {
+
+/**
+ * class RadosDictionaryCache
+ *
+ * LRU cache of dictionary values (and of keys which do not exist). Entries expire
+ * after ttl seconds. Keys starting with one of the bypass prefixes are not cached.
+ *
+ * The cache is local to the process: changes made by other processes or hosts
+ * are only seen after the entry expired, so keep the ttl short.
+ *
+ * Writes invalidate the cached keys. A lookup, which has been started before an
+ * invalidation of any key, does not update the cache (see get_generation).
+ *
+ */
+class RadosDictionaryCache {
+ public:
+  RadosDictionaryCache();
+  virtual ~RadosDictionaryCache() {}
+
+  /*!
+   * @param[in] max_entries max. number of cached keys (0 = disabled)
+   * @param[in] ttl time to live of an entry in seconds (0 = RBOX_DICT_CACHE_DEFAULT_TTL)
+   * @param[in] bypass_prefixes keys with these prefixes are not cached
+   */
+  void configure(size_t max_entries, unsigned int ttl, const std::list<std::string> &bypass_prefixes);
+  /*!
+   * @return true if the cache is enabled and the key is not bypassed
+   */
+  bool is_cached_key(const std::string &key);
+  /*!
+   * @param[out] value_r valid ptr, cached value
+   * @param[out] found_r valid ptr, false if the key does not exist
+   * @return false if the key is not cached (miss)
+   */
+  bool lookup(const std::string &key, std::string *value_r, bool *found_r);
+  /*!
+   * @return generation to pass to update
+   */
+  uint64_t get_generation();
+  /*!
+   * add the result of a lookup, unless the cache has been invalidated since generation
+   * @param[in] value nullptr if the key does not exist
+   */
+  void update(const std::string &key, const std::string *value, uint64_t generation);
+  void invalidate(const std::string &key);
+  void clear();
+
+  unsigned int get_ttl() { return ttl; }
+  uint64_t get_hits();
+  uint64_t get_misses();
+  size_t size();
+
+ private:
+  struct entry {
+    std::string key;
+    std::string value;
+    bool found;
+    time_t expires;
+  };
+  void remove(std::map<std::string, std::list<entry>::iterator>::iterator it);
+
+ private:
+  size_t max_entries;
+  unsigned int ttl;
+  std::list<std::string> bypass_prefixes;
+  /* most recently used first */
+  std::list<entry> lru;
+  std::map<std::string, std::list<entry>::iterator> index;
+  uint64_t generation;
+  uint64_t hits;
+  uint64_t misses;
+  /* async lookups update the cache in the librados callback */
+  std::mutex cache_mutex;
+};
+
+}  // namespace librmb
+
+#endif  // SRC_LIBRMB_RADOS_DICTIONARY_CACHE_H_
@@ -37,6 +37,16 @@ using librmb::RadosDictionaryImpl;
 #define DICT_PATH_PRIVATE "priv/"
 #define DICT_PATH_SHARED "shared/"
 
+/* FNV-1a, the shard of a key has to be the same in all processes */
+static uint32_t shard_hash(const std::string &key) {
+  uint32_t hash = 2166136261U;
+  for (std::string::const_iterator it = key.begin(); it != key.end(); ++it) {
+    hash ^= static_cast<unsigned char>(*it);
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
 RadosDictionaryImpl::RadosDictionaryImpl(RadosCluster *_cluster, const string &_poolname, const string &_username,
                                          const string &_oid, librmb::RadosGuidGenerator *guid_generator_,
                                          const std::string &cfg_object_name_)
@@ -51,10 +61,15 @@ RadosDictionaryImpl::RadosDictionaryImpl(RadosCluster *_cluster, const string &_
   private_io_ctx_created = false;
   guid_generator = guid_generator_;
   shared_oid = oid;
+  shared_shards = 0;
   private_oid = oid;
+  pending_keys = 0;
+  pending_generation = 0;
 }
 
 RadosDictionaryImpl::~RadosDictionaryImpl() {
+  // the callbacks of the queued lookups are called
+  wait_for_completions();
   if (namespace_mgr != nullptr) {
     delete namespace_mgr;
     namespace_mgr = nullptr;
@@ -69,11 +84,18 @@ const string RadosDictionaryImpl::get_shared_oid() { return shared_oid; }
 
 const string RadosDictionaryImpl::get_private_oid() { return private_oid; }
 
+const string RadosDictionaryImpl::get_shared_shard_oid(unsigned int shard) {
+  if (get_shared_shards() == 1) {
+    return get_shared_oid();
+  }
+  return get_shared_oid() + "." + std::to_string(shard);
+}
+
 const string RadosDictionaryImpl::get_full_oid(const std::string &key) {
   if (!key.compare(0, strlen(DICT_PATH_PRIVATE), DICT_PATH_PRIVATE)) {
     return get_private_oid();
   } else if (!key.compare(0, strlen(DICT_PATH_SHARED), DICT_PATH_SHARED)) {
-    return get_shared_oid();
+    return get_shared_shard_oid(shard_hash(key) % get_shared_shards());
   } else {
     // TODO(peter) i_unreached();
   }
@@ -154,6 +176,11 @@ librados::IoCtx &RadosDictionaryImpl::get_io_ctx(const std::string &key) {
 
 int RadosDictionaryImpl::get(const string &key, string *value_r) {
   int r_val = -1;
+  bool found = false;
+  if (cache.lookup(key, value_r, &found)) {
+    return found ? 0 : -ENOENT;
+  }
+  uint64_t generation = cache.get_generation();
 
   set<string> keys;
   keys.insert(key);
@@ -170,8 +197,10 @@ int RadosDictionaryImpl::get(const string &key, string *value_r) {
       auto it = map.find(key);  // map.begin();
       if (it != map.end()) {
         *value_r = it->second.to_str();
+        cache.update(key, value_r, generation);
         return 0;
       }
+      cache.update(key, nullptr, generation);
       return -ENOENT;
     } else {
       err = r_val;
@@ -193,6 +222,7 @@ void RadosDictionaryImpl::push_back_completion(librados::AioCompletion *c) {
 }
 
 void RadosDictionaryImpl::wait_for_completions() {
+  flush_lookups();
   while (!completions.empty()) {
     auto c = completions.front();
     c->wait_for_complete_and_cb();
@@ -200,3 +230,86 @@ void RadosDictionaryImpl::wait_for_completions() {
     c->release();
   }
 }
+
+void RadosDictionaryImpl::lookup_async(const std::string &key, RadosDictionaryLookupCallback callback,
+                                       void *context) {
+  string value;
+  bool found = false;
+  if (cache.lookup(key, &value, &found)) {
+    callback(found ? 0 : -ENOENT, value, context);
+    return;
+  }
+  uint64_t generation = cache.get_generation();
+  if (pending_keys > 0 && (pending_generation != generation || pending_keys >= RBOX_DICT_LOOKUP_BATCH_MAX_KEYS)) {
+    // the queued lookups must not see a later write
+    flush_lookups();
+  }
+  librados::IoCtx *io_ctx = &get_io_ctx(key);
+  std::pair<librados::IoCtx *, std::string> object(io_ctx, get_full_oid(key));
+  lookup_batch *batch = pending_lookups[object];
+  if (batch == nullptr) {
+    batch = new lookup_batch();
+    batch->dict = this;
+    batch->io_ctx = io_ctx;
+    batch->oid = object.second;
+    batch->cache_generation = generation;
+    batch->r_val = 0;
+    batch->completion = nullptr;
+    pending_lookups[object] = batch;
+  }
+  if (batch->keys.insert(key).second) {
+    pending_keys++;
+  }
+  pending_generation = generation;
+  lookup_batch::request request = {key, callback, context};
+  batch->requests.push_back(request);
+}
+
+void RadosDictionaryImpl::flush_lookups() {
+  std::map<std::pair<librados::IoCtx *, std::string>, lookup_batch *> batches;
+  batches.swap(pending_lookups);
+  pending_keys = 0;
+  for (auto it = batches.begin(); it != batches.end(); ++it) {
+    lookup_batch *batch = it->second;
+    batch->read_op.omap_get_vals_by_keys(batch->keys, &batch->values, &batch->r_val);
+    batch->completion = librados::Rados::aio_create_completion(batch, lookup_batch_complete, nullptr);
+    int err = batch->io_ctx->aio_operate(batch->oid, batch->completion, &batch->read_op, LIBRADOS_OPERATION_NOFLAG,
+                                         &batch->bl);
+    if (err < 0) {
+      batch->completion->release();
+      finish_lookup_batch(batch, err);
+    } else {
+      push_back_completion(batch->completion);
+    }
+  }
+}
+
+void RadosDictionaryImpl::lookup_batch_complete(rados_completion_t comp, void *arg) {
+  lookup_batch *batch = reinterpret_cast<lookup_batch *>(arg);
+  int ret = batch->completion->get_return_value();
+  if (ret == 0 && batch->r_val < 0) {
+    ret = batch->r_val;
+  }
+  batch->dict->finish_lookup_batch(batch, ret);
+}
+
+// passes the values to the callbacks of the batch and frees the batch.
+void RadosDictionaryImpl::finish_lookup_batch(lookup_batch *batch, int ret) {
+  string empty;
+  for (auto it = batch->requests.begin(); it != batch->requests.end(); ++it) {
+    if (ret < 0) {
+      it->callback(ret, empty, it->context);
+      continue;
+    }
+    auto value = batch->values.find(it->key);
+    if (value == batch->values.end()) {
+      cache.update(it->key, nullptr, batch->cache_generation);
+      it->callback(-ENOENT, empty, it->context);
+    } else {
+      string str_value = value->second.to_str();
+      cache.update(it->key, &str_value, batch->cache_generation);
+      it->callback(0, str_value, it->context);
+    }
+  }
+  delete batch;
+}
@@ -13,7 +13,10 @@
 #define SRC_LIBRMB_RADOS_DICTIONARY_IMPL_H_
 
 #include <list>
+#include <map>
+#include <set>
 #include <string>
+#include <utility>
 #include <cstdint>
 #include <mutex>  // NOLINT
 
@@ -38,6 +41,10 @@ class RadosDictionaryImpl : public RadosDictionary {
   const std::string get_shared_oid() override;
   const std::string get_private_oid() override;
 
+  void set_shared_shards(unsigned int shards) override { shared_shards = shards; }
+  unsigned int get_shared_shards() override { return shared_shards > 1 ? shared_shards : 1; }
+  const std::string get_shared_shard_oid(unsigned int shard) override;
+
   const std::string& get_oid() override { return oid; }
   const std::string& get_username() override { return username; }
   const std::string& get_poolname() override { return poolname; }
@@ -50,13 +57,40 @@ class RadosDictionaryImpl : public RadosDictionary {
   void push_back_completion(librados::AioCompletion* c) override;
   void wait_for_completions() override;
 
+  void lookup_async(const std::string& key, RadosDictionaryLookupCallback callback, void* context) override;
+  void flush_lookups() override;
+
   int get(const std::string& key, std::string* value_r) override;
+  RadosDictionaryCache* get_cache() override { return &cache; }
 
  private:
   bool load_configuration(librados::IoCtx* io_ctx);
 
   bool lookup_namespace(std::string& username_, librmb::RadosDovecotCephCfg* cfg_, std::string* ns);
 
+  /* queued lookups of one dict object */
+  struct lookup_batch {
+    struct request {
+      std::string key;
+      RadosDictionaryLookupCallback callback;
+      void* context;
+    };
+    RadosDictionaryImpl* dict;
+    librados::IoCtx* io_ctx;
+    std::string oid;
+    std::set<std::string> keys;
+    std::list<request> requests;
+    uint64_t cache_generation;
+
+    librados::ObjectReadOperation read_op;
+    std::map<std::string, librados::bufferlist> values;
+    int r_val;
+    librados::bufferlist bl;
+    librados::AioCompletion* completion;
+  };
+  static void lookup_batch_complete(rados_completion_t comp, void* arg);
+  void finish_lookup_batch(lookup_batch* batch, int ret);
+
  private:
   RadosCluster* cluster;
   std::string poolname;
@@ -64,6 +98,7 @@ class RadosDictionaryImpl : public RadosDictionary {
   std::string oid;
 
   std::string shared_oid;
+  unsigned int shared_shards;
   librados::IoCtx shared_io_ctx;
   bool shared_io_ctx_created;
 
@@ -73,12 +108,19 @@ class RadosDictionaryImpl : public RadosDictionary {
 
   std::list<librados::AioCompletion*> completions;
   std::mutex completions_mutex;
+  /* lookups queued by lookup_async, one batch per dict object (private, shared shards) */
+  std::map<std::pair<librados::IoCtx*, std::string>, lookup_batch*> pending_lookups;
+  size_t pending_keys;
+  /* cache generation of the queued lookups */
+  uint64_t pending_generation;
 
   librmb::RadosDovecotCephCfg* cfg;
   librmb::RadosNamespaceManager* namespace_mgr;
 
   RadosGuidGenerator* guid_generator;
   std::string cfg_object_name;
+
+  RadosDictionaryCache cache;
 };
 
 }  // namespace librmb
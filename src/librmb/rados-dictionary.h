@@ -15,9 +15,16 @@
 #include <string>
 
 #include <rados/librados.hpp>
+#include "rados-dictionary-cache.h"
 
 namespace librmb {
 
+/* max. number of keys queued by lookup_async */
+#define RBOX_DICT_LOOKUP_BATCH_MAX_KEYS 64
+
+/* result of an async lookup: ret is 0 (value is valid), -ENOENT or a linux error code */
+typedef void (*RadosDictionaryLookupCallback)(int ret, const std::string& value, void* context);
+
 /**
  * Rados Dictionary
  *
@@ -31,6 +38,18 @@ class RadosDictionary {
   virtual const std::string get_shared_oid() = 0;
   virtual const std::string get_private_oid() = 0;
 
+  /*!
+   * distribute the shared keys to shards objects (get_shared_shard_oid) by the hash of
+   * the key. The keys are not moved, if the number of shards is changed.
+   * @param[in] shards number of shard objects (0,1 = all shared keys in get_shared_oid)
+   */
+  virtual void set_shared_shards(unsigned int shards) = 0;
+  virtual unsigned int get_shared_shards() = 0;
+  /*!
+   * @return oid of the shared shard object
+   */
+  virtual const std::string get_shared_shard_oid(unsigned int shard) = 0;
+
   virtual const std::string& get_oid() = 0;
   virtual const std::string& get_username() = 0;
   virtual const std::string& get_poolname() = 0;
@@ -41,9 +60,21 @@ class RadosDictionary {
 
   virtual void remove_completion(librados::AioCompletion* c) = 0;
   virtual void push_back_completion(librados::AioCompletion* c) = 0;
+  /* submits the queued lookups and waits for all completions */
   virtual void wait_for_completions() = 0;
 
+  /*!
+   * queue an async lookup. The queued lookups of a dict object are read with one
+   * operation by flush_lookups, at the latest when RBOX_DICT_LOOKUP_BATCH_MAX_KEYS
+   * keys are queued or a key has been written. The callback may be called by a librados thread.
+   */
+  virtual void lookup_async(const std::string& key, RadosDictionaryLookupCallback callback, void* context) = 0;
+  /* submit the queued lookups */
+  virtual void flush_lookups() = 0;
+
   virtual int get(const std::string& key, std::string* value_r) = 0;
+  /* cache of the dictionary values (disabled by default) */
+  virtual RadosDictionaryCache* get_cache() = 0;
 };
 }  // namespace librmb
 
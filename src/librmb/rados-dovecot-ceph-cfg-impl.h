@@ -46,6 +46,17 @@ class RadosDovecotCephCfgImpl : public RadosDovecotCephCfg {
   bool is_ceph_posix_bugfix_enabled() override { return dovecot_cfg.is_ceph_posix_bugfix_enabled(); }
   bool is_ceph_aio_wait_for_safe_and_cb() override { return dovecot_cfg.is_ceph_aio_wait_for_safe_and_cb(); }
   bool is_write_chunks() override { return dovecot_cfg.is_write_chunks(); }
+  int get_metadata_batch_size() override { return dovecot_cfg.get_metadata_batch_size(); }
+  int get_read_chunk_size() override { return dovecot_cfg.get_read_chunk_size(); }
+  bool is_mail_omap_cache() override { return dovecot_cfg.is_mail_omap_cache(); }
+  int get_save_segment_size() override { return dovecot_cfg.get_save_segment_size(); }
+  int get_write_chunk_size() override { return dovecot_cfg.get_write_chunk_size(); }
+  int get_write_chunks_max_inflight() override { return dovecot_cfg.get_write_chunks_max_inflight(); }
+  int get_save_max_inflight() override { return dovecot_cfg.get_save_max_inflight(); }
+  int get_mail_dedup_min_size() override { return dovecot_cfg.get_mail_dedup_min_size(); }
+  const std::string &get_compression() override { return dovecot_cfg.get_compression(); }
+  int get_mail_inline_max_size() override { return dovecot_cfg.get_mail_inline_max_size(); }
+  int get_alt_segment_size() override { return dovecot_cfg.get_alt_segment_size(); }
   // rados config
   bool is_user_mapping() override { return rados_cfg.is_user_mapping(); }
   void set_config_valid(bool is_valid_) override {
@@ -41,6 +41,28 @@ class RadosDovecotCephCfg {
   virtual bool is_ceph_posix_bugfix_enabled() = 0;
   virtual bool is_ceph_aio_wait_for_safe_and_cb() = 0;
   virtual bool is_write_chunks() = 0;
+  /* max. number of mails, which metadata is loaded with one batch (0,1 = disabled) */
+  virtual int get_metadata_batch_size() = 0;
+  /* size of the ranged reads of mail objects in bytes (0 = read complete object) */
+  virtual int get_read_chunk_size() = 0;
+  /* store header block, envelope and bodystructure of a mail in the omap of the mail object */
+  virtual bool is_mail_omap_cache() = 0;
+  /* size of the page aligned buffer segments the mail is saved to (0 = default bufferlist append) */
+  virtual int get_save_segment_size() = 0;
+  /* size of a chunk written in rbox_ceph_write_chunks mode (0 = every stream write) */
+  virtual int get_write_chunk_size() = 0;
+  /* max. number of chunk writes in flight per mail in rbox_ceph_write_chunks mode */
+  virtual int get_write_chunks_max_inflight() = 0;
+  /* max. number of outstanding mail object writes per save transaction (0 = unlimited) */
+  virtual int get_save_max_inflight() = 0;
+  /* min. body size of a mail to store its body as single instance (0 = disabled) */
+  virtual int get_mail_dedup_min_size() = 0;
+  /* compression of the mail objects <codec>[:<level>], e.g. zstd:3 (empty = disabled) */
+  virtual const std::string &get_compression() = 0;
+  /* max. size of a mail, which is stored in an xattr of the mail object instead of the object data (0 = disabled) */
+  virtual int get_mail_inline_max_size() = 0;
+  /* size of the segment objects mails moved to the alt storage are packed into (0 = one object per mail) */
+  virtual int get_alt_segment_size() = 0;
 
   virtual const std::string &get_pool_name_metadata_key() = 0;
   virtual const std::string &get_update_attributes_key() = 0;
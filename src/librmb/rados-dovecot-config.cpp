@@ -11,6 +11,9 @@
 
 #include "rados-dovecot-config.h"
 
+#include <limits.h>
+#include <stdlib.h>
+
 #include <iostream>
 #include <sstream>
 #include "rados-types.h"
@@ -27,7 +30,18 @@ RadosConfig::RadosConfig()
       save_log("rados_save_log"),
       rbox_check_empty_mailboxes("rados_check_empty_mailboxes"),
       rbox_ceph_aio_wait_for_safe_and_cb("rbox_ceph_aio_wait_for_safe_and_cb"),
-      rbox_ceph_write_chunks("rbox_ceph_write_chunks") {
+      rbox_ceph_write_chunks("rbox_ceph_write_chunks"),
+      rbox_metadata_batch_size("rbox_metadata_batch_size"),
+      rbox_read_chunk_size("rbox_read_chunk_size"),
+      rbox_mail_omap_cache("rbox_mail_omap_cache"),
+      rbox_save_segment_size("rbox_save_segment_size"),
+      rbox_write_chunk_size("rbox_write_chunk_size"),
+      rbox_write_chunks_max_inflight("rbox_write_chunks_max_inflight"),
+      rbox_save_max_inflight("rbox_save_max_inflight"),
+      rbox_mail_dedup_min_size("rbox_mail_dedup_min_size"),
+      rbox_compression("rbox_compression"),
+      rbox_mail_inline_max_size("rbox_mail_inline_max_size"),
+      rbox_alt_segment_size("rbox_alt_segment_size") {
   config[pool_name] = "mail_storage";
 
   config[rbox_cfg_object_name] = "rbox_cfg";
@@ -38,6 +52,17 @@ RadosConfig::RadosConfig()
   config[rbox_check_empty_mailboxes] = "false";
   config[rbox_ceph_aio_wait_for_safe_and_cb] = "false";
   config[rbox_ceph_write_chunks] = "false";
+  config[rbox_metadata_batch_size] = "100";
+  config[rbox_read_chunk_size] = "0";
+  config[rbox_mail_omap_cache] = "false";
+  config[rbox_save_segment_size] = "0";
+  config[rbox_write_chunk_size] = "4194304";
+  config[rbox_write_chunks_max_inflight] = "8";
+  config[rbox_save_max_inflight] = "64";
+  config[rbox_mail_dedup_min_size] = "0";
+  config[rbox_compression] = "";
+  config[rbox_mail_inline_max_size] = "0";
+  config[rbox_alt_segment_size] = "0";
   is_valid = false;
 }
 
@@ -46,6 +71,16 @@ bool RadosConfig::string_contains_key(const std::string &str, enum rbox_metadata
   return str.find(value) != std::string::npos;
 }
 
+int RadosConfig::get_int_value(const std::string &key, int default_value) {
+  const char *value = config[key].c_str();
+  char *end = NULL;
+  long ret = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || ret < 0 || ret > INT_MAX) {
+    return default_value;
+  }
+  return static_cast<int>(ret);
+}
+
 void RadosConfig::update_pool_name_metadata(const char *value) {
   if (value == NULL) {
     return;
@@ -74,6 +109,17 @@ std::string RadosConfig::to_string() {
   ss << "  " << rbox_ceph_aio_wait_for_safe_and_cb << "=" << config[rbox_ceph_aio_wait_for_safe_and_cb] << std::endl;
   ss << "  " << rbox_ceph_write_chunks << "=" << config[rbox_ceph_write_chunks]
      << std::endl;
+  ss << "  " << rbox_metadata_batch_size << "=" << config[rbox_metadata_batch_size] << std::endl;
+  ss << "  " << rbox_read_chunk_size << "=" << config[rbox_read_chunk_size] << std::endl;
+  ss << "  " << rbox_mail_omap_cache << "=" << config[rbox_mail_omap_cache] << std::endl;
+  ss << "  " << rbox_save_segment_size << "=" << config[rbox_save_segment_size] << std::endl;
+  ss << "  " << rbox_write_chunk_size << "=" << config[rbox_write_chunk_size] << std::endl;
+  ss << "  " << rbox_write_chunks_max_inflight << "=" << config[rbox_write_chunks_max_inflight] << std::endl;
+  ss << "  " << rbox_save_max_inflight << "=" << config[rbox_save_max_inflight] << std::endl;
+  ss << "  " << rbox_mail_dedup_min_size << "=" << config[rbox_mail_dedup_min_size] << std::endl;
+  ss << "  " << rbox_compression << "=" << config[rbox_compression] << std::endl;
+  ss << "  " << rbox_mail_inline_max_size << "=" << config[rbox_mail_inline_max_size] << std::endl;
+  ss << "  " << rbox_alt_segment_size << "=" << config[rbox_alt_segment_size] << std::endl;
   return ss.str();
 }
 
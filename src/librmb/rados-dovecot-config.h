@@ -60,6 +60,17 @@ class RadosConfig {
   bool is_write_chunks() {
     return config[rbox_ceph_write_chunks].compare("true") == 0 ? true : false;
   }
+  int get_metadata_batch_size() { return get_int_value(rbox_metadata_batch_size, 0); }
+  int get_read_chunk_size() { return get_int_value(rbox_read_chunk_size, 0); }
+  bool is_mail_omap_cache() { return config[rbox_mail_omap_cache].compare("true") == 0 ? true : false; }
+  int get_save_segment_size() { return get_int_value(rbox_save_segment_size, 0); }
+  int get_write_chunk_size() { return get_int_value(rbox_write_chunk_size, 0); }
+  int get_write_chunks_max_inflight() { return get_int_value(rbox_write_chunks_max_inflight, 0); }
+  int get_save_max_inflight() { return get_int_value(rbox_save_max_inflight, 0); }
+  int get_mail_dedup_min_size() { return get_int_value(rbox_mail_dedup_min_size, 0); }
+  const std::string &get_compression() { return config[rbox_compression]; }
+  int get_mail_inline_max_size() { return get_int_value(rbox_mail_inline_max_size, 0); }
+  int get_alt_segment_size() { return get_int_value(rbox_alt_segment_size, 0); }
 
   /*!
    * print configuration
@@ -68,6 +79,7 @@ class RadosConfig {
 
  private:
   bool string_contains_key(const std::string &str, enum rbox_metadata_key key);
+  int get_int_value(const std::string &key, int default_value);
 
  private:
   std::map<std::string, std::string> config;
@@ -82,6 +94,17 @@ class RadosConfig {
   std::string rbox_check_empty_mailboxes;
   std::string rbox_ceph_aio_wait_for_safe_and_cb;
   std::string rbox_ceph_write_chunks;
+  std::string rbox_metadata_batch_size;
+  std::string rbox_read_chunk_size;
+  std::string rbox_mail_omap_cache;
+  std::string rbox_save_segment_size;
+  std::string rbox_write_chunk_size;
+  std::string rbox_write_chunks_max_inflight;
+  std::string rbox_save_max_inflight;
+  std::string rbox_mail_dedup_min_size;
+  std::string rbox_compression;
+  std::string rbox_mail_inline_max_size;
+  std::string rbox_alt_segment_size;
   bool is_valid;
 };
 
@@ -30,7 +30,8 @@ RadosMail::RadosMail()
       mail_buffer(nullptr),
       save_date_rados(-1),
       valid(true),
-      index_ref(false) {}
+      index_ref(false),
+      compressible(true) {}
 
 RadosMail::~RadosMail() {}
 
@@ -60,6 +61,8 @@ std::string RadosMail::to_string(const string& padding) {
   RadosUtils::get_metadata(RBOX_METADATA_PVT_FLAGS, &attrset, &pvt_flags);
   char* from_envelope = NULL;
   RadosUtils::get_metadata(RBOX_METADATA_FROM_ENVELOPE, &attrset, &from_envelope);
+  char* compression = NULL;
+  RadosUtils::get_metadata(RBOX_METADATA_COMPRESSION, &attrset, &compression);
 
   time_t ts = -1;
   if (recv_time_str != NULL) {
@@ -152,5 +155,10 @@ std::string RadosMail::to_string(const string& padding) {
        << "(from envelope): " << from_envelope << endl;
   }
 
+  if (compression != NULL) {
+    ss << padding << "        " << static_cast<char>(RBOX_METADATA_COMPRESSION) << "(compression): " << compression
+       << endl;
+  }
+
   return ss.str();
 }
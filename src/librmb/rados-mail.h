@@ -88,6 +88,9 @@ class RadosMail {
   string to_string(const string& padding);
   void add_metadata(const RadosMetadata& metadata) { attrset[metadata.key] = metadata.bl; }
   bool is_deprecated_uid() {return deprecated_uid;}
+  /* false, if the mail data is already compressed (zlib plugin) */
+  bool is_compressible() { return compressible; }
+  void set_compressible(bool compressible_) { compressible = compressible_; }
   void set_deprecated_uid(bool deprecated_uid_) {deprecated_uid = deprecated_uid_;}
   /*!
    * Some metadata isn't saved as xattribute (default). To access those, get_extended_metadata can
@@ -123,6 +126,7 @@ class RadosMail {
   bool valid;
   bool index_ref;
   bool deprecated_uid;
+  bool compressible;
 };
 
 }  // namespace librmb
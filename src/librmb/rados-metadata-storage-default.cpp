@@ -9,9 +9,12 @@
  * Foundation.  See file COPYING.
  */
 
+#include "dovecot-ceph-plugin-config.h"
 #include "rados-metadata-storage-default.h"
 #include "rados-util.h"
 #include <utility>
+#include <vector>
+#include <limits.h>
 namespace librmb {
 
 std::string RadosMetadataStorageDefault::module_name = "default";
@@ -31,11 +34,74 @@ int RadosMetadataStorageDefault::load_metadata(RadosMail *mail) {
   ret = io_ctx->getxattrs(*mail->get_oid(), *mail->get_metadata());
 
   if (ret >= 0) {
+    // the mail data of inline mails is no metadata (see read_mail)
+    mail->get_metadata()->erase(RBOX_INLINE_XATTR);
     ret = RadosUtils::get_all_keys_and_values(io_ctx, *mail->get_oid(), mail->get_extended_metadata());
   }
 
   return ret;
 }
+int RadosMetadataStorageDefault::load_metadata_batch(std::vector<RadosMail *> &mails) {
+  struct metadata_read {
+    librados::AioCompletion *completion;
+    librados::ObjectReadOperation op;
+    int xattr_err;
+    int omap_err;
+    bool more;
+  };
+  std::vector<metadata_read *> reads;
+  reads.reserve(mails.size());
+
+  for (std::vector<RadosMail *>::iterator it = mails.begin(); it != mails.end(); ++it) {
+    RadosMail *mail = *it;
+    mail->get_metadata()->clear();
+    mail->get_extended_metadata()->clear();
+
+    metadata_read *read = new metadata_read();
+    read->xattr_err = 0;
+    read->omap_err = 0;
+    read->more = false;
+    read->op.getxattrs(mail->get_metadata(), &read->xattr_err);
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_OMAP_GET_VALS2
+    read->op.omap_get_vals2("", "", LONG_MAX, mail->get_extended_metadata(), &read->more, &read->omap_err);
+#else
+    read->op.omap_get_vals("", "", LONG_MAX, mail->get_extended_metadata(), &read->omap_err);
+#endif
+    read->completion = librados::Rados::aio_create_completion();
+    if (io_ctx->aio_operate(*mail->get_oid(), read->completion, &read->op, nullptr) < 0) {
+      read->completion->release();
+      read->completion = nullptr;
+    }
+    reads.push_back(read);
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < reads.size(); i++) {
+    metadata_read *read = reads[i];
+    int ret_read = -1;
+    if (read->completion != nullptr) {
+      read->completion->wait_for_complete();
+      ret_read = read->completion->get_return_value();
+      read->completion->release();
+    }
+    if (ret_read >= 0 && read->more) {
+      // the osd limits the omap values per read
+      ret_read = RadosUtils::get_more_omap_values(io_ctx, *mails[i]->get_oid(), mails[i]->get_extended_metadata());
+    }
+    mails[i]->set_valid(ret_read >= 0);
+    if (ret_read < 0) {
+      mails[i]->get_metadata()->clear();
+      mails[i]->get_extended_metadata()->clear();
+      ret = ret_read;
+    } else {
+      mails[i]->get_metadata()->erase(RBOX_INLINE_XATTR);
+      RadosUtils::remove_mail_cache_keys(mails[i]->get_extended_metadata());
+    }
+    delete read;
+  }
+  return ret;
+}
+
 int RadosMetadataStorageDefault::set_metadata(RadosMail *mail, RadosMetadata &xattr) {
   mail->add_metadata(xattr);
   return io_ctx->setxattr(*mail->get_oid(), xattr.key.c_str(), xattr.bl);
@@ -75,6 +141,14 @@ bool RadosMetadataStorageDefault::update_metadata(const std::string &oid, std::l
   completion->release();
   return ret == 0;
 }
+void RadosMetadataStorageDefault::update_metadata(librados::ObjectWriteOperation *write_op, RadosMail *mail,
+                                                  std::list<RadosMetadata> &to_update) {
+  for (std::list<RadosMetadata>::iterator it = to_update.begin(); it != to_update.end(); ++it) {
+    mail->add_metadata(*it);
+    write_op->setxattr((*it).key.c_str(), (*it).bl);
+  }
+}
+
 int RadosMetadataStorageDefault::update_keyword_metadata(const std::string &oid, RadosMetadata *metadata) {
   int ret = -1;
   if (metadata != nullptr) {
@@ -15,6 +15,7 @@
 #include <map>
 #include <string>
 #include <set>
+#include <vector>
 #include "rados-metadata-storage-module.h"
 
 namespace librmb {
@@ -31,8 +32,11 @@ class RadosMetadataStorageDefault : public RadosStorageMetadataModule {
   void set_io_ctx(librados::IoCtx *io_ctx_) override { this->io_ctx = io_ctx_; }
 
   int load_metadata(RadosMail *mail) override;
+  int load_metadata_batch(std::vector<RadosMail *> &mails) override;
   int set_metadata(RadosMail *mail, RadosMetadata &xattr) override;
   bool update_metadata(const std::string &oid, std::list<RadosMetadata> &to_update) override;
+  void update_metadata(librados::ObjectWriteOperation *write_op, RadosMail *mail,
+                       std::list<RadosMetadata> &to_update) override;
   void save_metadata(librados::ObjectWriteOperation *write_op, RadosMail *mail) override;
   int set_metadata(RadosMail *mail, RadosMetadata &xattr, librados::ObjectWriteOperation *write_op) override;
 
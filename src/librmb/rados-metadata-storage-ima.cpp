@@ -9,10 +9,13 @@
  * Foundation.  See file COPYING.
  */
 
+#include "dovecot-ceph-plugin-config.h"
 #include "rados-metadata-storage-ima.h"
 #include "rados-util.h"
 #include <string.h>
 #include <utility>
+#include <vector>
+#include <limits.h>
 
 std::string librmb::RadosMetadataStorageIma::module_name = "ima";
 std::string librmb::RadosMetadataStorageIma::keyword_key = "K";
@@ -56,20 +59,7 @@ int RadosMetadataStorageIma::parse_attribute(RadosMail *mail, json_t *root) {
   return 0;
 }
 
-int RadosMetadataStorageIma::load_metadata(RadosMail *mail) {
-  if (mail == nullptr) {
-    return -1;
-  }
-  if (mail->get_metadata()->size() > 0) {
-    return 0;
-  }
-
-  std::map<string, ceph::bufferlist> attr;
-  int ret = io_ctx->getxattrs(*mail->get_oid(), attr);
-  if (ret < 0) {
-    return ret;
-  }
-
+void RadosMetadataStorageIma::load_attributes(RadosMail *mail, std::map<std::string, ceph::bufferlist> &attr) {
   if (attr.find(cfg->get_metadata_storage_attribute()) != attr.end()) {
     // json object for immutable attributes.
     json_t *root;
@@ -80,12 +70,28 @@ int RadosMetadataStorageIma::load_metadata(RadosMail *mail) {
     json_decref(root);
   }
 
-  // load other attributes
+  // load other attributes, the mail data of inline mails is no metadata (see read_mail)
   for (std::map<string, ceph::bufferlist>::iterator it = attr.begin(); it != attr.end(); ++it) {
-    if ((*it).first.compare(cfg->get_metadata_storage_attribute()) != 0) {
+    if ((*it).first.compare(cfg->get_metadata_storage_attribute()) != 0 && (*it).first != RBOX_INLINE_XATTR) {
       (*mail->get_metadata())[(*it).first] = (*it).second;
     }
   }
+}
+
+int RadosMetadataStorageIma::load_metadata(RadosMail *mail) {
+  if (mail == nullptr) {
+    return -1;
+  }
+  if (mail->get_metadata()->size() > 0) {
+    return 0;
+  }
+
+  std::map<string, ceph::bufferlist> attr;
+  int ret = io_ctx->getxattrs(*mail->get_oid(), attr);
+  if (ret < 0) {
+    return ret;
+  }
+  load_attributes(mail, attr);
 
   // load other omap values.
   if (cfg->is_updateable_attribute(librmb::RBOX_METADATA_OLDV1_KEYWORDS)) {
@@ -95,6 +101,74 @@ int RadosMetadataStorageIma::load_metadata(RadosMail *mail) {
   return ret;
 }
 
+int RadosMetadataStorageIma::load_metadata_batch(std::vector<RadosMail *> &mails) {
+  struct metadata_read {
+    librados::AioCompletion *completion;
+    librados::ObjectReadOperation op;
+    std::map<std::string, ceph::bufferlist> attr;
+    int xattr_err;
+    int omap_err;
+    bool more;
+  };
+  std::vector<metadata_read *> reads(mails.size(), nullptr);
+  bool load_omap = cfg->is_updateable_attribute(librmb::RBOX_METADATA_OLDV1_KEYWORDS);
+
+  for (size_t i = 0; i < mails.size(); i++) {
+    RadosMail *mail = mails[i];
+    if (mail->get_metadata()->size() > 0) {
+      // already loaded, see load_metadata
+      continue;
+    }
+    metadata_read *read = new metadata_read();
+    read->xattr_err = 0;
+    read->omap_err = 0;
+    read->more = false;
+    read->op.getxattrs(&read->attr, &read->xattr_err);
+    if (load_omap) {
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_OMAP_GET_VALS2
+      read->op.omap_get_vals2("", "", LONG_MAX, mail->get_extended_metadata(), &read->more, &read->omap_err);
+#else
+      read->op.omap_get_vals("", "", LONG_MAX, mail->get_extended_metadata(), &read->omap_err);
+#endif
+    }
+    read->completion = librados::Rados::aio_create_completion();
+    if (io_ctx->aio_operate(*mail->get_oid(), read->completion, &read->op, nullptr) < 0) {
+      read->completion->release();
+      read->completion = nullptr;
+    }
+    reads[i] = read;
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < reads.size(); i++) {
+    metadata_read *read = reads[i];
+    if (read == nullptr) {
+      mails[i]->set_valid(true);
+      continue;
+    }
+    int ret_read = -1;
+    if (read->completion != nullptr) {
+      read->completion->wait_for_complete();
+      ret_read = read->completion->get_return_value();
+      read->completion->release();
+    }
+    if (ret_read >= 0 && read->more) {
+      // the osd limits the omap values per read
+      ret_read = RadosUtils::get_more_omap_values(io_ctx, *mails[i]->get_oid(), mails[i]->get_extended_metadata());
+    }
+    mails[i]->set_valid(ret_read >= 0);
+    if (ret_read < 0) {
+      mails[i]->get_extended_metadata()->clear();
+      ret = ret_read;
+    } else {
+      RadosUtils::remove_mail_cache_keys(mails[i]->get_extended_metadata());
+      load_attributes(mails[i], read->attr);
+    }
+    delete read;
+  }
+  return ret;
+}
+
 // it is required that mail->get_metadata is up to date before update.
 int RadosMetadataStorageIma::set_metadata(RadosMail *mail, RadosMetadata &xattr) {
   enum rbox_metadata_key k = static_cast<enum rbox_metadata_key>(*xattr.key.c_str());
@@ -130,6 +204,10 @@ void RadosMetadataStorageIma::save_metadata(librados::ObjectWriteOperation *writ
   if (mail->get_metadata()->size() > 0) {
     for (std::map<string, ceph::bufferlist>::iterator it = mail->get_metadata()->begin();
          it != mail->get_metadata()->end(); ++it) {
+      if (RadosUtils::is_object_data_xattr((*it).first)) {
+        // set with the object data (e.g. compression), not part of the json attribute
+        continue;
+      }
       enum rbox_metadata_key k = static_cast<enum rbox_metadata_key>(*(*it).first.c_str());
       if (!cfg->is_updateable_attribute(k) || !cfg->is_update_attributes()) {
         json_object_set_new(root, (*it).first.c_str(), json_string((*it).second.to_str().c_str()));
@@ -185,6 +263,17 @@ bool RadosMetadataStorageIma::update_metadata(const std::string &oid, std::list<
   completion->release();
   return ret == 0;
 }
+
+void RadosMetadataStorageIma::update_metadata(librados::ObjectWriteOperation *write_op, RadosMail *mail,
+                                              std::list<RadosMetadata> &to_update) {
+  // same as update_metadata(oid, to_update): the updates are saved with the extended metadata
+  for (std::list<RadosMetadata>::iterator it = to_update.begin(); it != to_update.end(); ++it) {
+    (*mail->get_extended_metadata())[(*it).key] = (*it).bl;
+  }
+  // mail has to be loaded completely, the json attribute is rewritten.
+  save_metadata(write_op, mail);
+}
+
 int RadosMetadataStorageIma::update_keyword_metadata(const std::string &oid, RadosMetadata *metadata) {
   int ret = -1;
   if (metadata != nullptr) {
@@ -15,6 +15,7 @@
 #include <jansson.h>
 #include <list>
 #include <set>
+#include <vector>
 #include <string>
 #include <map>
 
@@ -35,15 +36,23 @@ namespace librmb {
 class RadosMetadataStorageIma : public RadosStorageMetadataModule {
  private:
   int parse_attribute(RadosMail *mail, json_t *root);
+  void load_attributes(RadosMail *mail, std::map<std::string, ceph::bufferlist> &attr);
 
  public:
   RadosMetadataStorageIma(librados::IoCtx *io_ctx_, RadosDovecotCephCfg *cfg_);
   virtual ~RadosMetadataStorageIma();
   void set_io_ctx(librados::IoCtx *io_ctx_) override { this->io_ctx = io_ctx_; }
+  bool is_xattr_filterable(enum rbox_metadata_key key) override {
+    // all other attributes are part of the json attribute
+    return cfg->is_updateable_attribute(key) && cfg->is_update_attributes();
+  }
   int load_metadata(RadosMail *mail) override;
+  int load_metadata_batch(std::vector<RadosMail *> &mails) override;
   int set_metadata(RadosMail *mail, RadosMetadata &xattr) override;
   int set_metadata(RadosMail *mail, RadosMetadata &xattr, librados::ObjectWriteOperation *write_op) override;
   bool update_metadata(const std::string &oid, std::list<RadosMetadata> &to_update) override;
+  void update_metadata(librados::ObjectWriteOperation *write_op, RadosMail *mail,
+                       std::list<RadosMetadata> &to_update) override;
   void save_metadata(librados::ObjectWriteOperation *write_op, RadosMail *mail) override;
 
   int update_keyword_metadata(const std::string &oid, RadosMetadata *metadata) override;
@@ -12,6 +12,7 @@
 #ifndef SRC_LIBRMB_RADOS_METADATA_STORAGE_MODULE_H_
 #define SRC_LIBRMB_RADOS_METADATA_STORAGE_MODULE_H_
 
+#include <vector>
 #include <rados/librados.hpp>
 
 #include "rados-mail.h"
@@ -22,14 +23,24 @@ class RadosStorageMetadataModule {
   virtual ~RadosStorageMetadataModule(){};
   /* update io_ctx */
   virtual void set_io_ctx(librados::IoCtx *io_ctx){};
+  /* true if the attribute is stored as a separate xattr of the mail object, which
+   * can be used as listing filter (RadosStorage::find_mails) */
+  virtual bool is_xattr_filterable(enum rbox_metadata_key key) { return true; }
   /* load the metadta into RadosMail */
   virtual int load_metadata(RadosMail *mail) = 0;
+  /* load the metadata of all given mails with parallel aio reads and a single wait.
+   * mails which could not be loaded are marked as invalid (RadosMail::is_valid).
+   * returns 0 if all mails have been loaded, else the last error */
+  virtual int load_metadata_batch(std::vector<RadosMail *> &mails) = 0;
   /* set a new metadata attribute to a mail object */
   virtual int set_metadata(RadosMail *mail, RadosMetadata &xattr) = 0;
   /* set a new metadata attribute to a mail object */
   virtual int set_metadata(RadosMail *mail, RadosMetadata &xattr, librados::ObjectWriteOperation *write_op) = 0;
   /* update the given metadata attributes */
   virtual bool update_metadata(const std::string &oid, std::list<RadosMetadata> &to_update) = 0;
+  /* add the update of the given metadata attributes of an already loaded mail to write_op */
+  virtual void update_metadata(librados::ObjectWriteOperation *write_op, RadosMail *mail,
+                               std::list<RadosMetadata> &to_update) = 0;
   /* add all metadata of RadosMail to write_operation */
   virtual void save_metadata(librados::ObjectWriteOperation *write_op, RadosMail *mail) = 0;
   /* manage keywords */
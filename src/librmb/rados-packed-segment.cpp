@@ -0,0 +1,393 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#include "dovecot-ceph-plugin-config.h"
+#include "rados-packed-segment.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <list>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "encoding.h"
+#include "rados-types.h"
+
+namespace librmb {
+
+/* a pin waits up to 5s for a running compaction */
+static const int PIN_RETRIES = 50;
+static const useconds_t PIN_RETRY_DELAY_US = 100000;
+static const char *COMPACT_LOCK_COOKIE = "compact";
+
+/* splits the first three ':' separated fields, the rest is the namespace */
+static bool parse_fields(const std::string &value, std::string *first, uint64_t *offset, uint64_t *length,
+                         std::string *nspace) {
+  size_t pos1 = value.find(':');
+  if (pos1 == std::string::npos) {
+    return false;
+  }
+  size_t pos2 = value.find(':', pos1 + 1);
+  if (pos2 == std::string::npos) {
+    return false;
+  }
+  size_t pos3 = value.find(':', pos2 + 1);
+  if (pos3 == std::string::npos) {
+    return false;
+  }
+  try {
+    *offset = std::stoull(value.substr(pos1 + 1, pos2 - pos1 - 1));
+    *length = std::stoull(value.substr(pos2 + 1, pos3 - pos2 - 1));
+  } catch (std::exception &e) {
+    return false;
+  }
+  *first = value.substr(0, pos1);
+  *nspace = value.substr(pos3 + 1);
+  return true;
+}
+
+/* numops add, which does not create the segment, if it has been removed in between */
+static int add_dead_bytes(librados::IoCtx *io_ctx, const std::string &segment_oid, const std::set<std::string> &keys,
+                          uint64_t dead) {
+  librados::bufferlist in;
+  encode(std::string(RBOX_SEGMENT_DEAD_KEY), in);
+  std::stringstream stream;
+  stream << dead;
+  encode(stream.str(), in);
+
+  librados::ObjectWriteOperation write_op;
+  write_op.assert_exists();
+  if (!keys.empty()) {
+    write_op.omap_rm_keys(keys);
+  }
+  write_op.exec("numops", "add", in);
+  return io_ctx->operate(segment_oid, &write_op);
+}
+
+/* locking a removed segment creates it again, as empty object */
+static void remove_empty_segment(librados::IoCtx *io_ctx, const std::string &segment_oid) {
+  uint64_t size = 0;
+  if (io_ctx->stat(segment_oid, &size, nullptr) >= 0 && size == 0) {
+    io_ctx->remove(segment_oid);
+  }
+}
+
+std::string RadosPackedSegment::entry_key(const std::string &oid) { return RBOX_SEGMENT_ENTRY_PREFIX + oid; }
+
+std::string RadosPackedSegment::to_ref(const std::string &segment_oid, uint64_t offset, uint64_t length,
+                                       const std::string &nspace) {
+  std::stringstream ss;
+  ss << segment_oid << ":" << offset << ":" << length << ":" << nspace;
+  return ss.str();
+}
+
+bool RadosPackedSegment::parse_ref(const std::string &ref, std::string *segment_oid, uint64_t *offset,
+                                   uint64_t *length, std::string *nspace) {
+  return parse_fields(ref, segment_oid, offset, length, nspace) && !segment_oid->empty();
+}
+
+std::string RadosPackedSegment::to_entry(uint64_t offset, uint64_t length, const std::string &stub_nspace) {
+  // same format as the reference without segment oid
+  return to_ref("", offset, length, stub_nspace);
+}
+
+int RadosPackedSegment::create(librados::IoCtx *io_ctx, const std::string &segment_oid, librados::bufferlist &data,
+                               std::map<std::string, librados::bufferlist> &entries) {
+  librados::ObjectWriteOperation write_op;
+  write_op.create(true);
+  write_op.write_full(data);
+  write_op.omap_set(entries);
+  return io_ctx->operate(segment_oid, &write_op);
+}
+
+int RadosPackedSegment::read(librados::IoCtx *io_ctx, const std::string &ref, librados::bufferlist *bl) {
+  std::string segment_oid;
+  std::string nspace;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  if (!parse_ref(ref, &segment_oid, &offset, &length, &nspace)) {
+    return -EINVAL;
+  }
+  librados::IoCtx segment_io_ctx;
+  segment_io_ctx.dup(*io_ctx);
+  segment_io_ctx.set_namespace(nspace);
+
+  librados::bufferlist data;
+  int ret = segment_io_ctx.read(segment_oid, data, length, offset);
+  if (ret < 0) {
+    return ret;
+  }
+  if (data.length() != length) {
+    return -EIO;
+  }
+  bl->claim_append(data);
+  return 0;
+}
+
+int RadosPackedSegment::add_reference(librados::IoCtx *io_ctx, const std::string &ref, const std::string &oid) {
+  std::string segment_oid;
+  std::string nspace;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  if (!parse_ref(ref, &segment_oid, &offset, &length, &nspace)) {
+    return -EINVAL;
+  }
+  librados::IoCtx segment_io_ctx;
+  segment_io_ctx.dup(*io_ctx);
+  segment_io_ctx.set_namespace(nspace);
+
+  std::map<std::string, librados::bufferlist> entries;
+  entries[entry_key(oid)].append(to_entry(offset, length, io_ctx->get_namespace()));
+  librados::ObjectWriteOperation write_op;
+  write_op.assert_exists();
+  write_op.omap_set(entries);
+  return segment_io_ctx.operate(segment_oid, &write_op);
+}
+
+int RadosPackedSegment::pin(librados::IoCtx *io_ctx, const std::string &oid, const std::string &cookie,
+                            std::string *ref) {
+  for (int i = 0; i < PIN_RETRIES; i++) {
+    librados::bufferlist packed_ref;
+    int ret = io_ctx->getxattr(oid, RBOX_PACKED_XATTR, packed_ref);
+    if (ret == -ENODATA) {
+      ref->clear();
+      return 0;
+    } else if (ret < 0) {
+      return ret;
+    }
+    std::string segment_oid;
+    std::string nspace;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    if (!parse_ref(packed_ref.to_str(), &segment_oid, &offset, &length, &nspace)) {
+      return -EINVAL;
+    }
+    librados::IoCtx segment_io_ctx;
+    segment_io_ctx.dup(*io_ctx);
+    segment_io_ctx.set_namespace(nspace);
+
+    struct timeval duration = {RBOX_SEGMENT_LOCK_DURATION, 0};
+    ret = segment_io_ctx.lock_shared(segment_oid, RBOX_SEGMENT_LOCK, cookie, "", "", &duration, 0);
+    if (ret == -EBUSY) {
+      // the segment is compacted
+      usleep(PIN_RETRY_DELAY_US);
+      continue;
+    } else if (ret < 0) {
+      return ret;
+    }
+    // the segment may have been compacted before it has been locked
+    librados::bufferlist current_ref;
+    ret = io_ctx->getxattr(oid, RBOX_PACKED_XATTR, current_ref);
+    if (ret >= 0 && current_ref.contents_equal(packed_ref)) {
+      *ref = packed_ref.to_str();
+      return 0;
+    }
+    segment_io_ctx.unlock(segment_oid, RBOX_SEGMENT_LOCK, cookie);
+    remove_empty_segment(&segment_io_ctx, segment_oid);
+    if (ret < 0 && ret != -ENODATA) {
+      return ret;
+    }
+  }
+  return -EBUSY;
+}
+
+int RadosPackedSegment::unpin(librados::IoCtx *io_ctx, const std::string &ref, const std::string &cookie) {
+  std::string segment_oid;
+  std::string nspace;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  if (!parse_ref(ref, &segment_oid, &offset, &length, &nspace)) {
+    return -EINVAL;
+  }
+  librados::IoCtx segment_io_ctx;
+  segment_io_ctx.dup(*io_ctx);
+  segment_io_ctx.set_namespace(nspace);
+  return segment_io_ctx.unlock(segment_oid, RBOX_SEGMENT_LOCK, cookie);
+}
+
+int RadosPackedSegment::remove_reference(librados::IoCtx *io_ctx, const std::string &ref, const std::string &oid) {
+  std::string segment_oid;
+  std::string nspace;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  if (!parse_ref(ref, &segment_oid, &offset, &length, &nspace)) {
+    return -EINVAL;
+  }
+  librados::IoCtx segment_io_ctx;
+  segment_io_ctx.dup(*io_ctx);
+  segment_io_ctx.set_namespace(nspace);
+
+  std::set<std::string> keys;
+  keys.insert(entry_key(oid));
+  int ret = add_dead_bytes(&segment_io_ctx, segment_oid, keys, length);
+  if (ret < 0) {
+    return ret == -ENOENT ? 0 : ret;
+  }
+
+  std::set<std::string> dead_key;
+  dead_key.insert(RBOX_SEGMENT_DEAD_KEY);
+  std::map<std::string, librados::bufferlist> values;
+  uint64_t size = 0;
+  librados::ObjectReadOperation read_op;
+  read_op.omap_get_vals_by_keys(dead_key, &values, nullptr);
+  read_op.stat(&size, nullptr, nullptr);
+  ret = segment_io_ctx.operate(segment_oid, &read_op, nullptr);
+  if (ret < 0) {
+    return ret == -ENOENT ? 0 : ret;
+  }
+  double dead = 0;
+  try {
+    // numops may save the value in floating point notation
+    dead = std::stod(values[RBOX_SEGMENT_DEAD_KEY].to_str());
+  } catch (std::exception &e) {
+    return 0;
+  }
+  if (dead * 2 < size) {
+    return 0;
+  }
+  return compact(&segment_io_ctx, segment_oid);
+}
+
+int RadosPackedSegment::compact(librados::IoCtx *io_ctx, const std::string &segment_oid) {
+  struct stub_update {
+    std::string oid;
+    std::string nspace;
+    librados::bufferlist old_ref;
+    librados::bufferlist new_ref;
+    uint64_t length;
+    librados::AioCompletion *completion;
+  };
+
+  // a single compaction at a time, and none while stubs of the segment are copied or moved (pin).
+  struct timeval duration = {RBOX_SEGMENT_LOCK_DURATION, 0};
+  int ret = io_ctx->lock_exclusive(segment_oid, RBOX_SEGMENT_LOCK, COMPACT_LOCK_COOKIE, "", &duration, 0);
+  if (ret == -EBUSY || ret == -EEXIST) {
+    // compacted later on, with the next removed reference
+    return 0;
+  } else if (ret < 0) {
+    return ret;
+  }
+
+  librados::bufferlist data;
+  std::map<std::string, librados::bufferlist> entries;
+  librados::ObjectReadOperation read_op;
+  read_op.read(0, 0, &data, nullptr);
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_OMAP_GET_VALS2
+  read_op.omap_get_vals2("", RBOX_SEGMENT_ENTRY_PREFIX, LONG_MAX, &entries, nullptr, nullptr);
+#else
+  read_op.omap_get_vals("", RBOX_SEGMENT_ENTRY_PREFIX, LONG_MAX, &entries, nullptr);
+#endif
+  ret = io_ctx->operate(segment_oid, &read_op, nullptr);
+  if (ret < 0) {
+    io_ctx->unlock(segment_oid, RBOX_SEGMENT_LOCK, COMPACT_LOCK_COOKIE);
+    return ret == -ENOENT ? 0 : ret;
+  }
+  if (entries.empty()) {
+    // e.g. the segment has been removed and created again by the lock
+    ret = io_ctx->remove(segment_oid);
+    return ret == -ENOENT ? 0 : ret;
+  }
+
+  // copies of a stub reference the same range, which is copied only once.
+  std::map<std::pair<uint64_t, uint64_t>, uint64_t> moved;
+  librados::bufferlist new_data;
+  std::map<std::string, librados::bufferlist> new_entries;
+  std::vector<stub_update> updates;
+  for (std::map<std::string, librados::bufferlist>::iterator it = entries.begin(); it != entries.end(); ++it) {
+    std::string unused;
+    stub_update update;
+    uint64_t offset = 0;
+    if (!parse_fields(it->second.to_str(), &unused, &offset, &update.length, &update.nspace) ||
+        offset + update.length > data.length()) {
+      continue;
+    }
+    std::pair<uint64_t, uint64_t> range(offset, update.length);
+    if (moved.find(range) == moved.end()) {
+      moved[range] = new_data.length();
+      librados::bufferlist bl;
+      bl.substr_of(data, offset, update.length);
+      new_data.claim_append(bl);
+    }
+    update.oid = it->first.substr(strlen(RBOX_SEGMENT_ENTRY_PREFIX));
+    update.old_ref.append(to_ref(segment_oid, offset, update.length, io_ctx->get_namespace()));
+    update.completion = nullptr;
+    new_entries[it->first].append(to_entry(moved[range], update.length, update.nspace));
+    updates.push_back(update);
+  }
+
+  if (updates.empty()) {
+    ret = io_ctx->remove(segment_oid);
+    return ret == -ENOENT ? 0 : ret;
+  }
+  if (new_data.length() * 2 >= data.length()) {
+    // the dead bytes of shared ranges have been counted more than once.
+    std::map<std::string, librados::bufferlist> dead;
+    dead[RBOX_SEGMENT_DEAD_KEY].append(std::to_string(data.length() - new_data.length()));
+    ret = io_ctx->omap_set(segment_oid, dead);
+    io_ctx->unlock(segment_oid, RBOX_SEGMENT_LOCK, COMPACT_LOCK_COOKIE);
+    return ret;
+  }
+
+  std::string new_segment_oid = RBOX_SEGMENT_OID_PREFIX + updates.front().oid + "." + std::to_string(time(NULL));
+  ret = create(io_ctx, new_segment_oid, new_data, new_entries);
+  if (ret < 0) {
+    io_ctx->unlock(segment_oid, RBOX_SEGMENT_LOCK, COMPACT_LOCK_COOKIE);
+    return ret;
+  }
+
+  // update the stubs, unless they have been changed or removed in between.
+  for (std::vector<stub_update>::iterator it = updates.begin(); it != updates.end(); ++it) {
+    std::string new_segment_entry = new_entries[entry_key(it->oid)].to_str();
+    std::string unused;
+    std::string unused_ns;
+    uint64_t new_offset = 0;
+    uint64_t new_length = 0;
+    parse_fields(new_segment_entry, &unused, &new_offset, &new_length, &unused_ns);
+    it->new_ref.append(to_ref(new_segment_oid, new_offset, new_length, io_ctx->get_namespace()));
+
+    librados::IoCtx stub_io_ctx;
+    stub_io_ctx.dup(*io_ctx);
+    stub_io_ctx.set_namespace(it->nspace);
+    librados::ObjectWriteOperation write_op;
+    write_op.cmpxattr(RBOX_PACKED_XATTR, LIBRADOS_CMPXATTR_OP_EQ, it->old_ref);
+    write_op.setxattr(RBOX_PACKED_XATTR, it->new_ref);
+    it->completion = librados::Rados::aio_create_completion();
+    if (stub_io_ctx.aio_operate(it->oid, it->completion, &write_op) < 0) {
+      it->completion->release();
+      it->completion = nullptr;
+    }
+  }
+  std::set<std::string> stale_keys;
+  uint64_t stale_bytes = 0;
+  for (std::vector<stub_update>::iterator it = updates.begin(); it != updates.end(); ++it) {
+    int update_ret = -EIO;
+    if (it->completion != nullptr) {
+      it->completion->wait_for_complete();
+      update_ret = it->completion->get_return_value();
+      it->completion->release();
+    }
+    if (update_ret < 0) {
+      stale_keys.insert(entry_key(it->oid));
+      stale_bytes += it->length;
+    }
+  }
+  if (!stale_keys.empty()) {
+    add_dead_bytes(io_ctx, new_segment_oid, stale_keys, stale_bytes);
+  }
+  ret = io_ctx->remove(segment_oid);
+  return ret == -ENOENT ? 0 : ret;
+}
+
+}  // namespace librmb
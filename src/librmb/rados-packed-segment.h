@@ -0,0 +1,119 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#ifndef SRC_LIBRMB_RADOS_PACKED_SEGMENT_H_
+#define SRC_LIBRMB_RADOS_PACKED_SEGMENT_H_
+
+#include <map>
+#include <string>
+#include <rados/librados.hpp>
+
+namespace librmb {
+
+/**
+ * class RadosPackedSegment
+ *
+ * Packed alt storage (rbox_alt_segment_size): the data of mails moved to the
+ * alt storage is appended to a segment object. The mail object stays as data
+ * less stub holding the metadata and the reference <segment oid>:<offset>:<length>:<namespace>
+ * in the xattr RBOX_PACKED_XATTR.
+ *
+ * The segment lists the referencing stubs in its omap (RBOX_SEGMENT_ENTRY_PREFIX + oid
+ * => <offset>:<length>:<stub namespace>) and counts the bytes of removed references
+ * in RBOX_SEGMENT_DEAD_KEY. A segment is compacted, when half of its data is dead.
+ *
+ * Compaction holds the segment lock (RBOX_SEGMENT_LOCK) exclusive, copies and moves of
+ * stubs pin the segment with a shared lock, so that their entries are not lost.
+ *
+ */
+class RadosPackedSegment {
+ public:
+  /*!
+   * @return reference to the mail data in the segment
+   */
+  static std::string to_ref(const std::string &segment_oid, uint64_t offset, uint64_t length,
+                            const std::string &nspace);
+  /*!
+   * parse the reference saved in RBOX_PACKED_XATTR
+   * @return false if the reference is invalid
+   */
+  static bool parse_ref(const std::string &ref, std::string *segment_oid, uint64_t *offset, uint64_t *length,
+                        std::string *nspace);
+  /*!
+   * @return omap value of a segment entry
+   */
+  static std::string to_entry(uint64_t offset, uint64_t length, const std::string &stub_nspace);
+  /*!
+   * create a new segment
+   * @param[in] io_ctx io context of the segment namespace
+   * @param[in] segment_oid unique oid
+   * @param[in] data packed mail data
+   * @param[in] entries omap entries (see entry_key, to_entry)
+   * @return linux error code or 0 if successful
+   */
+  static int create(librados::IoCtx *io_ctx, const std::string &segment_oid, librados::bufferlist &data,
+                    std::map<std::string, librados::bufferlist> &entries);
+  /*!
+   * read the mail data
+   * @param[in] io_ctx io context of the stub (namespace is taken from the reference)
+   * @param[in] ref reference
+   * @param[out] bl valid ptr
+   * @return linux error code or 0 if successful
+   */
+  static int read(librados::IoCtx *io_ctx, const std::string &ref, librados::bufferlist *bl);
+  /*!
+   * add the stub oid (e.g. copy of a stub) to the segment referenced by ref. An existing
+   * entry of the oid is replaced (e.g. stub moved to another namespace).
+   * @param[in] io_ctx io context of the stub
+   * @return linux error code or 0 if successful
+   */
+  static int add_reference(librados::IoCtx *io_ctx, const std::string &ref, const std::string &oid);
+  /*!
+   * pin the segment referenced by the stub against compaction (shared segment lock), e.g. to
+   * copy or move the stub. A running compaction is waited for.
+   * @param[in] io_ctx io context of the stub
+   * @param[in] oid stub
+   * @param[in] cookie unique id of the pin, e.g. oid of the copy
+   * @param[out] ref reference of the stub, empty if the mail is not packed (nothing is pinned)
+   * @return linux error code or 0 if successful
+   */
+  static int pin(librados::IoCtx *io_ctx, const std::string &oid, const std::string &cookie, std::string *ref);
+  /*!
+   * release the pin of the segment
+   * @param[in] io_ctx io context of the stub
+   * @param[in] ref reference returned by pin
+   * @param[in] cookie id of the pin
+   * @return linux error code or 0 if successful
+   */
+  static int unpin(librados::IoCtx *io_ctx, const std::string &ref, const std::string &cookie);
+  /*!
+   * remove the reference of the removed stub oid. Compacts the segment, if half
+   * of its data is dead.
+   * @return linux error code or 0 if successful
+   */
+  static int remove_reference(librados::IoCtx *io_ctx, const std::string &ref, const std::string &oid);
+  /*!
+   * copy the referenced data to a new segment, update the stubs and remove the segment.
+   * Nothing is done while the segment is pinned or compacted by someone else.
+   * @param[in] io_ctx io context of the segment namespace
+   * @param[in] segment_oid segment
+   * @return linux error code or 0 if successful
+   */
+  static int compact(librados::IoCtx *io_ctx, const std::string &segment_oid);
+  /*!
+   * @return omap key of the segment entry of the stub oid
+   */
+  static std::string entry_key(const std::string &oid);
+};
+
+}  // namespace librmb
+
+#endif  // SRC_LIBRMB_RADOS_PACKED_SEGMENT_H_
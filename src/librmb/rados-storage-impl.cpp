@@ -10,12 +10,18 @@
  */
 
 #include "rados-storage-impl.h"
+#include "rados-compression.h"
+#include "rados-packed-segment.h"
+#include "rados-util.h"
 
+#include <errno.h>
 #include <algorithm>
 #include <list>
 #include <set>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include <rados/librados.hpp>
 #include "encoding.h"
@@ -29,6 +35,8 @@ using ceph::bufferlist;
 using librmb::RadosStorageImpl;
 
 #define DICT_USERNAME_SEPARATOR '/'
+/* max. number of objects returned by one object_list call */
+#define LIST_MAILS_CHUNK_SIZE 1024
 const char *RadosStorageImpl::CFG_OSD_MAX_WRITE_SIZE = "osd_max_write_size";
 
 RadosStorageImpl::RadosStorageImpl(RadosCluster *_cluster) {
@@ -36,6 +44,8 @@ RadosStorageImpl::RadosStorageImpl(RadosCluster *_cluster) {
   max_write_size = 10;
   io_ctx_created = false;
   wait_method = WAIT_FOR_COMPLETE_AND_CB;
+  compression_level = 0;
+  mail_inline_max_size = 0;
 }
 
 RadosStorageImpl::~RadosStorageImpl() {}
@@ -91,6 +101,14 @@ int RadosStorageImpl::split_buffer_and_exec_op(RadosMail *current_object,
   return ret_val;
 }
 
+// saves the mail data in the xattr RBOX_INLINE_XATTR, the object has no data.
+int RadosStorageImpl::inline_and_exec_op(RadosMail *mail, librados::ObjectWriteOperation *write_op_xattr) {
+  mail->set_completion(librados::Rados::aio_create_completion());
+  write_op_xattr->setxattr(RBOX_INLINE_XATTR, *mail->get_mail_buffer());
+  mail->set_active_op(1);
+  return get_io_ctx().aio_operate(*mail->get_oid(), mail->get_completion(), write_op_xattr);
+}
+
 int RadosStorageImpl::save_mail(const std::string &oid, librados::bufferlist &buffer) {
   return get_io_ctx().write_full(oid, buffer);
 }
@@ -100,7 +118,76 @@ int RadosStorageImpl::read_mail(const std::string &oid, librados::bufferlist *bu
     return -1;
   }
   size_t max = INT_MAX;
-  return get_io_ctx().read(oid, *buffer, max, 0);
+  int read_err = 0;
+  int inline_err = 0;
+  librados::bufferlist inline_data;
+  librados::ObjectReadOperation op;
+  op.read(0, max, buffer, &read_err);
+  // only inline mails have this xattr
+  op.getxattr(RBOX_INLINE_XATTR, &inline_data, &inline_err);
+  op.set_op_flags2(librados::OP_FAILOK);
+  // only packed mails have this xattr
+  int packed_err = 0;
+  librados::bufferlist packed_ref;
+  op.getxattr(RBOX_PACKED_XATTR, &packed_ref, &packed_err);
+  op.set_op_flags2(librados::OP_FAILOK);
+  // only compressed mails have this xattr
+  int compression_err = 0;
+  librados::bufferlist compression;
+  op.getxattr(rbox_metadata_key_to_char(RBOX_METADATA_COMPRESSION), &compression, &compression_err);
+  op.set_op_flags2(librados::OP_FAILOK);
+  // only deduplicated mails have this xattr
+  int sis_err = 0;
+  librados::bufferlist sis_ref;
+  op.getxattr(RBOX_SIS_XATTR, &sis_ref, &sis_err);
+  op.set_op_flags2(librados::OP_FAILOK);
+  int ret = get_io_ctx().operate(oid, &op, nullptr);
+  if (ret < 0) {
+    return ret;
+  }
+  if (inline_err >= 0 && inline_data.length() > 0) {
+    buffer->claim_append(inline_data);
+  } else if (packed_err >= 0 && packed_ref.length() > 0) {
+    ret = RadosPackedSegment::read(&get_io_ctx(), packed_ref.to_str(), buffer);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  if (compression_err >= 0 && compression.length() > 0) {
+    std::string codec;
+    size_t size = 0;
+    // metadata values are saved with trailing '\0'
+    if (!RadosCompression::from_metadata(compression.c_str(), &codec, &size)) {
+      return -EIO;
+    }
+    librados::bufferlist data;
+    ret = RadosCompression::decompress(codec, *buffer, size, &data);
+    if (ret < 0) {
+      return ret == -ENOENT ? -EIO : ret;
+    }
+    buffer->swap(data);
+  }
+  if (sis_err >= 0 && sis_ref.length() > 0) {
+    // the mail object holds the header, the body is stored in the single instance object
+    librados::IoCtx sis_io_ctx;
+    RadosUtils::get_sis_io_ctx(&get_io_ctx(), &sis_io_ctx);
+    librados::bufferlist body;
+    ret = sis_io_ctx.read(sis_ref.to_str(), body, max, 0);
+    if (ret < 0) {
+      // the mail object exists, so do not report the mail as missing
+      return ret == -ENOENT ? -EIO : ret;
+    }
+    buffer->claim_append(body);
+  }
+  return buffer->length();
+}
+
+int RadosStorageImpl::read_mail(const std::string &oid, librados::bufferlist *buffer, uint64_t offset,
+                                size_t length) {
+  if (!cluster->is_connected() || !io_ctx_created) {
+    return -1;
+  }
+  return get_io_ctx().read(oid, *buffer, length, offset);
 }
 
 int RadosStorageImpl::delete_mail(RadosMail *mail) {
@@ -138,11 +225,37 @@ int RadosStorageImpl::stat_mail(const std::string &oid, uint64_t *psize, time_t
   return get_io_ctx().stat(oid, psize, pmtime);
 }
 
+int RadosStorageImpl::get_sis_reference(const std::string &oid, const std::string &ns, std::string *sis_oid) {
+  if (!cluster->is_connected() || !io_ctx_created) {
+    return -1;
+  }
+  librados::IoCtx ns_io_ctx;
+  ns_io_ctx.dup(get_io_ctx());
+  ns_io_ctx.set_namespace(ns);
+  librados::bufferlist sis_ref;
+  int ret = ns_io_ctx.getxattr(oid, RBOX_SIS_XATTR, sis_ref);
+  if (ret == -ENODATA) {
+    sis_oid->clear();
+    return 0;
+  } else if (ret < 0) {
+    return ret;
+  }
+  *sis_oid = sis_ref.to_str();
+  return 0;
+}
+
 void RadosStorageImpl::set_namespace(const std::string &_nspace) {
   get_io_ctx().set_namespace(_nspace);
   this->nspace = _nspace;
 }
 
+static void create_plain_filter(const librmb::RadosMetadata *attr, ceph::bufferlist *filter_bl) {
+  std::string filter_name = PLAIN_FILTER_NAME;
+  encode(filter_name, *filter_bl);
+  encode("_" + attr->key, *filter_bl);
+  encode(attr->bl.to_str(), *filter_bl);
+}
+
 librados::NObjectIterator RadosStorageImpl::find_mails(const RadosMetadata *attr) {
   if (!cluster->is_connected() || !io_ctx_created) {
     return librados::NObjectIterator::__EndObjectIterator;
@@ -150,12 +263,8 @@ librados::NObjectIterator RadosStorageImpl::find_mails(const RadosMetadata *attr
 
   if (attr != nullptr) {
    // int hashpos = get_io_ctx().get_object_hash_position("t1_u");
-    std::string filter_name = PLAIN_FILTER_NAME;
     ceph::bufferlist filter_bl;
-
-    encode(filter_name, filter_bl);
-    encode("_" + attr->key, filter_bl);
-    encode(attr->bl.to_str(), filter_bl);
+    create_plain_filter(attr, &filter_bl);
 
     return get_io_ctx().nobjects_begin(filter_bl);
   } else {
@@ -163,6 +272,61 @@ librados::NObjectIterator RadosStorageImpl::find_mails(const RadosMetadata *attr
   }
 }
 
+librados::NObjectIterator RadosStorageImpl::find_mails(const std::list<RadosMetadata> &predicates) {
+  return predicates.empty() ? find_mails(nullptr) : find_mails(&predicates.front());
+}
+
+int RadosStorageImpl::list_mails(int slices, const std::list<RadosMetadata> &predicates,
+                                 std::list<std::string> *oids) {
+  if (!cluster->is_connected() || !io_ctx_created) {
+    return -1;
+  }
+  if (slices < 1) {
+    slices = 1;
+  }
+  ceph::bufferlist filter_bl;
+  if (!predicates.empty()) {
+    create_plain_filter(&predicates.front(), &filter_bl);
+  }
+
+  librados::ObjectCursor begin = io_ctx.object_list_begin();
+  librados::ObjectCursor end = io_ctx.object_list_end();
+  std::vector<std::list<std::string>> results(slices);
+  std::vector<int> rets(slices, 0);
+  std::vector<std::thread> threads;
+
+  for (int i = 0; i < slices; i++) {
+    threads.push_back(std::thread([this, &begin, &end, &filter_bl, &results, &rets, slices, i]() {
+      librados::ObjectCursor slice_start;
+      librados::ObjectCursor slice_end;
+      io_ctx.object_list_slice(begin, end, i, slices, &slice_start, &slice_end);
+
+      librados::ObjectCursor cursor = slice_start;
+      while (cursor < slice_end) {
+        std::vector<librados::ObjectItem> items;
+        int ret = io_ctx.object_list(cursor, slice_end, LIST_MAILS_CHUNK_SIZE, filter_bl, &items, &cursor);
+        if (ret < 0) {
+          rets[i] = ret;
+          return;
+        }
+        for (std::vector<librados::ObjectItem>::iterator it = items.begin(); it != items.end(); ++it) {
+          results[i].push_back(it->oid);
+        }
+      }
+    }));
+  }
+
+  int ret = 0;
+  for (int i = 0; i < slices; i++) {
+    threads[i].join();
+    if (rets[i] < 0) {
+      ret = rets[i];
+    }
+    oids->splice(oids->end(), results[i]);
+  }
+  return ret;
+}
+
 librados::IoCtx &RadosStorageImpl::get_io_ctx() { return io_ctx; }
 
 int RadosStorageImpl::open_connection(const std::string &poolname, const std::string &clustername,
@@ -256,6 +420,7 @@ bool RadosStorageImpl::wait_for_rados_operations(const std::list<librmb::RadosMa
     // free mail's buffer cause we don't need it anymore
     librados::bufferlist *mail_buffer = (*it_cur_obj)->get_mail_buffer();
     delete mail_buffer;
+    (*it_cur_obj)->set_mail_buffer(nullptr);
   }
   return ctx_failed;
 }
@@ -281,11 +446,7 @@ int RadosStorageImpl::move(std::string &src_oid, const char *src_ns, std::string
     src_io_ctx.set_namespace(src_ns);
     dest_io_ctx.set_namespace(dest_ns);
 
-#if LIBRADOS_VERSION_CODE >= 30000
-    write_op.copy_from(src_oid, src_io_ctx, 0, 0);
-#else
-    write_op.copy_from(src_oid, src_io_ctx, 0);
-#endif
+    RadosUtils::copy_from(&write_op, src_oid, src_io_ctx);
   } else {
     src_io_ctx = dest_io_ctx;
     time_t t;
@@ -342,11 +503,7 @@ int RadosStorageImpl::copy(std::string &src_oid, const char *src_ns, std::string
     src_io_ctx = dest_io_ctx;
   }
 
-#if LIBRADOS_VERSION_CODE >= 30000
-  write_op.copy_from(src_oid, src_io_ctx, 0, 0);
-#else
-  write_op.copy_from(src_oid, src_io_ctx, 0);
-#endif
+  RadosUtils::copy_from(&write_op, src_oid, src_io_ctx);
 
   // because we create a copy, save date needs to be updated
   // as an alternative we could use &ctx->data.save_date here if we save it to xattribute in write_metadata
@@ -373,6 +530,49 @@ int RadosStorageImpl::copy(std::string &src_oid, const char *src_ns, std::string
   return ret;
 }
 
+int RadosStorageImpl::copy_async(RadosCopyOperations *copy_ops, std::string &src_oid, const char *src_ns,
+                                 std::string &dest_oid, const char *dest_ns, std::list<RadosMetadata> &to_update,
+                                 bool delete_source, unsigned int max_inflight) {
+  if (!cluster->is_connected() || !io_ctx_created) {
+    return -1;
+  }
+  return copy_ops->add(io_ctx, src_oid, src_ns, dest_oid, dest_ns, to_update, delete_source, max_inflight);
+}
+
+int RadosStorageImpl::wait_for_copy_operations(RadosCopyOperations *copy_ops, bool commit,
+                                               std::map<std::string, int> *failed) {
+  return copy_ops->wait(commit, failed);
+}
+
+void RadosStorageImpl::set_mail_inline_max_size(uint64_t max_size) {
+  this->mail_inline_max_size = std::min<uint64_t>(max_size, RBOX_INLINE_MAX_SIZE_LIMIT);
+}
+
+// replaces the mail buffer with the compressed mail, if the mail gets smaller.
+void RadosStorageImpl::compress_mail(RadosMail *mail, librados::ObjectWriteOperation *write_op) {
+  if (compression_codec.empty() || !mail->is_compressible()) {
+    return;
+  }
+  // the buffer is compressed once, even if it doesn't get smaller
+  mail->set_compressible(false);
+  librados::bufferlist *buffer = mail->get_mail_buffer();
+  librados::bufferlist compressed;
+  if (buffer == nullptr ||
+      RadosCompression::compress(compression_codec, compression_level, *buffer, &compressed) < 0 ||
+      compressed.length() >= buffer->length()) {
+    return;
+  }
+  RadosMetadata compression;
+  compression.convert(RBOX_METADATA_COMPRESSION, RadosCompression::to_metadata(compression_codec, buffer->length()));
+  write_op->setxattr(compression.key.c_str(), compression.bl);
+  buffer->swap(compressed);
+  mail->set_mail_size(buffer->length());
+}
+
+bool RadosStorageImpl::is_inline_mail(RadosMail *mail) {
+  return mail->get_mail_size() > 0 && static_cast<uint64_t>(mail->get_mail_size()) <= mail_inline_max_size;
+}
+
 // if save_async = true, don't forget to call wait_for_rados_operations e.g. wait_for_write_operations_complete
 // to wait for completion and free resources.
 bool RadosStorageImpl::save_mail(librados::ObjectWriteOperation *write_op_xattr, RadosMail *mail, bool save_async) {
@@ -384,7 +584,13 @@ bool RadosStorageImpl::save_mail(librados::ObjectWriteOperation *write_op_xattr,
   }
   time_t save_date = mail->get_rados_save_date();
   write_op_xattr->mtime(&save_date);
-  int ret = split_buffer_and_exec_op(mail, write_op_xattr, get_max_write_size_bytes());
+  compress_mail(mail, write_op_xattr);
+  int ret;
+  if (is_inline_mail(mail)) {
+    ret = inline_and_exec_op(mail, write_op_xattr);
+  } else {
+    ret = split_buffer_and_exec_op(mail, write_op_xattr, get_max_write_size_bytes());
+  }
   if (ret != 0) {
     write_op_xattr->remove();
     delete write_op_xattr;
@@ -32,11 +32,19 @@ class RadosStorageImpl : public RadosStorage {
 
   librados::IoCtx &get_io_ctx() override;
   int stat_mail(const std::string &oid, uint64_t *psize, time_t *pmtime) override;
+  int get_sis_reference(const std::string &oid, const std::string &ns, std::string *sis_oid) override;
   void set_namespace(const std::string &_nspace) override;
   std::string get_namespace() override { return nspace; }
   std::string get_pool_name() override { return pool_name; }
 
   void set_ceph_wait_method(enum rbox_ceph_aio_wait_method wait_method_) { this->wait_method = wait_method_; }
+  void set_compression(const std::string &codec, int level) override {
+    this->compression_codec = codec;
+    this->compression_level = level;
+  }
+  void set_mail_inline_max_size(uint64_t max_size) override;
+  void compress_mail(RadosMail *mail, librados::ObjectWriteOperation *write_op) override;
+  bool is_inline_mail(RadosMail *mail) override;
   int get_max_write_size() override { return max_write_size; }
   int get_max_write_size_bytes() override { return max_write_size * 1024 * 1024; }
 
@@ -49,6 +57,8 @@ class RadosStorageImpl : public RadosStorage {
   int aio_operate(librados::IoCtx *io_ctx_, const std::string &oid, librados::AioCompletion *c,
                   librados::ObjectWriteOperation *op) override;
   librados::NObjectIterator find_mails(const RadosMetadata *attr) override;
+  librados::NObjectIterator find_mails(const std::list<RadosMetadata> &predicates) override;
+  int list_mails(int slices, const std::list<RadosMetadata> &predicates, std::list<std::string> *oids) override;
   int open_connection(const std::string &poolname) override;
   int open_connection(const std::string &poolname, const std::string &clustername,
                       const std::string &rados_username) override;
@@ -59,10 +69,16 @@ class RadosStorageImpl : public RadosStorage {
   bool wait_for_rados_operations(const std::list<librmb::RadosMail *> &object_list) override;
 
   int read_mail(const std::string &oid, librados::bufferlist *buffer) override;
+  int read_mail(const std::string &oid, librados::bufferlist *buffer, uint64_t offset, size_t length) override;
   int move(std::string &src_oid, const char *src_ns, std::string &dest_oid, const char *dest_ns,
            std::list<RadosMetadata> &to_update, bool delete_source) override;
   int copy(std::string &src_oid, const char *src_ns, std::string &dest_oid, const char *dest_ns,
            std::list<RadosMetadata> &to_update) override;
+  int copy_async(RadosCopyOperations *copy_ops, std::string &src_oid, const char *src_ns, std::string &dest_oid,
+                 const char *dest_ns, std::list<RadosMetadata> &to_update, bool delete_source,
+                 unsigned int max_inflight) override;
+  int wait_for_copy_operations(RadosCopyOperations *copy_ops, bool commit,
+                               std::map<std::string, int> *failed) override;
 
   int save_mail(const std::string &oid, librados::bufferlist &buffer) override;
   bool save_mail(RadosMail *mail, bool &save_async) override;
@@ -73,8 +89,10 @@ class RadosStorageImpl : public RadosStorage {
 
  private:
   int create_connection(const std::string &poolname);
+  int inline_and_exec_op(RadosMail *mail, librados::ObjectWriteOperation *write_op_xattr);
 
  private:
+
   RadosCluster *cluster;
   int max_write_size;
   std::string nspace;
@@ -82,6 +100,9 @@ class RadosStorageImpl : public RadosStorage {
   bool io_ctx_created;
   std::string pool_name;
   enum rbox_ceph_aio_wait_method wait_method;
+  std::string compression_codec;
+  int compression_level;
+  uint64_t mail_inline_max_size;
 
   static const char *CFG_OSD_MAX_WRITE_SIZE;
 };
@@ -18,6 +18,7 @@
 
 #include <rados/librados.hpp>
 #include "rados-cluster.h"
+#include "rados-copy-operations.h"
 #include "rados-mail.h"
 #include "rados-types.h"
 
@@ -40,6 +41,12 @@ class RadosStorage {
    * @param[out] psize size of the object
    * @param[out] pmtime last modified date**/
   virtual int stat_mail(const std::string &oid, uint64_t *psize, time_t *pmtime) = 0;
+  /*! get the reference of the mail object to its single instance body object (RBOX_SIS_XATTR)
+   * @param[in] oid unique ident for the object
+   * @param[in] ns namespace of the object
+   * @param[out] sis_oid oid of the body object, empty if the mail object holds its body
+   * @return linux error code or 0 if successful */
+  virtual int get_sis_reference(const std::string &oid, const std::string &ns, std::string *sis_oid) = 0;
   /*! set the object namespace
    * @param[in] _nspace namespace */
   virtual void set_namespace(const std::string &_nspace) = 0;
@@ -55,6 +62,22 @@ class RadosStorage {
 
   /* set the wait method for async operations */
   virtual void set_ceph_wait_method(enum rbox_ceph_aio_wait_method wait_method) = 0;
+  /*! compress the mails saved with save_mail (see RadosCompression)
+   * @param[in] codec supported codec, empty = no compression
+   * @param[in] level compression level */
+  virtual void set_compression(const std::string &codec, int level) = 0;
+  /*! store mails up to max_size bytes in the xattr RBOX_INLINE_XATTR of the mail object
+   * @param[in] max_size 0 = disabled, limited to RBOX_INLINE_MAX_SIZE_LIMIT */
+  virtual void set_mail_inline_max_size(uint64_t max_size) = 0;
+  /*! compress the mail buffer (see set_compression), the compression xattr is added to write_op.
+   * The buffer is compressed at most once, save_mail calls it if the caller hasn't.
+   * @param[in] mail mail with the buffer to compress
+   * @param[in] write_op write operation of the mail */
+  virtual void compress_mail(RadosMail *mail, librados::ObjectWriteOperation *write_op) = 0;
+  /*! check if save_mail stores the current (compressed) mail buffer in the xattr RBOX_INLINE_XATTR
+   * @param[in] mail mail to save
+   * @return true if the mail is saved inline */
+  virtual bool is_inline_mail(RadosMail *mail) = 0;
 
   /*! get the max object size in mb
    * @return the maximal number of mb to write in a single write operation*/
@@ -100,6 +123,21 @@ class RadosStorage {
    *
    * @return object iterator or librados::NObjectIterator::__EndObjectIterator */
   virtual librados::NObjectIterator find_mails(const RadosMetadata *attr) = 0;
+  /*! search for mails matching all given xattr values. The filter is evaluated by the OSDs,
+   * which support one xattr equality per listing, so only the first predicate is pushed down.
+   * The caller has to check the remaining predicates after loading the metadata.
+   * @param[in] predicates xattr values to search for, the most selective first (empty = all mails).
+   *
+   * @return object iterator or librados::NObjectIterator::__EndObjectIterator */
+  virtual librados::NObjectIterator find_mails(const std::list<RadosMetadata> &predicates) = 0;
+  /*! list the mails of the namespace. The object hash space is split into slices,
+   * which are listed in parallel, one thread per slice.
+   * @param[in] slices number of slices (threads)
+   * @param[in] predicates see find_mails
+   * @param[out] oids object identifiers of all slices
+   *
+   * @return linux error code or 0 if successful */
+  virtual int list_mails(int slices, const std::list<RadosMetadata> &predicates, std::list<std::string> *oids) = 0;
   /*! open the rados connections with default cluster and username
    * @param[in] poolname the poolname to connect to, in case this one does not exists, it will be created.
    * */
@@ -142,13 +180,23 @@ class RadosStorage {
    * @return linux errorcode or 0 if successful
    * */
   virtual int save_mail(const std::string &oid, librados::bufferlist &buffer) = 0;
-  /*! read the complete mail object into bufferlist
+  /*! read the complete mail object into bufferlist (inline, packed and compressed mails are resolved,
+   * the body of a deduplicated mail is appended from the single instance objects of this pool)
    *
    * @param[in] oid unique object identifier
    * @param[out] buffer valid ptr to bufferlist.
    * @return linux errorcode or 0 if successful
    * */
   virtual int read_mail(const std::string &oid, librados::bufferlist *buffer) = 0;
+  /*! read a range of the mail object into bufferlist
+   *
+   * @param[in] oid unique object identifier
+   * @param[out] buffer valid ptr to bufferlist.
+   * @param[in] offset start of the range
+   * @param[in] length max. number of bytes to read
+   * @return linux errorcode or number of bytes read
+   * */
+  virtual int read_mail(const std::string &oid, librados::bufferlist *buffer, uint64_t offset, size_t length) = 0;
   /*! move a object from the given namespace to the other, updates the metadata given in to_update list
    *
    * @param[in] src_oid unique identifier of source object
@@ -172,6 +220,24 @@ class RadosStorage {
    */
   virtual int copy(std::string &src_oid, const char *src_ns, std::string &dest_oid, const char *dest_ns,
                    std::list<RadosMetadata> &to_update) = 0;
+  /*! queue a copy (delete_source = false) or move of an object, see copy and move.
+   * The operation is submitted immediately and completed by wait_for_copy_operations.
+   * @param[in] copy_ops valid ptr, queue of the current transaction
+   * @param[in] max_inflight max. number of unfinished operations in the queue (0 = unlimited)
+   * @return linux errorcode or 0 if the operation has been submitted
+   */
+  virtual int copy_async(RadosCopyOperations *copy_ops, std::string &src_oid, const char *src_ns,
+                         std::string &dest_oid, const char *dest_ns, std::list<RadosMetadata> &to_update,
+                         bool delete_source, unsigned int max_inflight) = 0;
+  /*! wait for all queued copy and move operations. The sources of the moved objects are removed,
+   * if commit is true and all operations succeeded, otherwise the copied objects are removed.
+   * @param[in] copy_ops valid ptr, queue of the current transaction
+   * @param[in] commit false to discard the queued operations
+   * @param[out] failed source oid => linux errorcode of each failed operation (may be nullptr)
+   * @return linux errorcode of the first failed operation or 0 if successful
+   */
+  virtual int wait_for_copy_operations(RadosCopyOperations *copy_ops, bool commit,
+                                       std::map<std::string, int> *failed) = 0;
   /*! save the mail
    * @param[in] mail valid rados mail.
    * @param[in] save_async if false save will be synchronous.
@@ -14,6 +14,50 @@
 
 namespace librmb {
 #define GUID_128_SIZE 16
+/**
+ * omap keys of the mail object holding a copy of the parsed
+ * mail (rbox_mail_omap_cache). They are no mail metadata
+ * and are never loaded as extended metadata (keywords).
+ */
+#define RBOX_MAIL_CACHE_KEY_PREFIX "rbox.cache."
+#define RBOX_MAIL_CACHE_KEY_HEADER RBOX_MAIL_CACHE_KEY_PREFIX "header"
+#define RBOX_MAIL_CACHE_KEY_ENVELOPE RBOX_MAIL_CACHE_KEY_PREFIX "envelope"
+#define RBOX_MAIL_CACHE_KEY_BODYSTRUCTURE RBOX_MAIL_CACHE_KEY_PREFIX "bodystructure"
+/**
+ * single instance storage (rbox_mail_dedup_min_size): the body of a mail is
+ * stored in a content addressed object (prefix + sha256 of the body) in the
+ * namespace RBOX_SIS_NAMESPACE of the primary pool. The mail object holds the
+ * header and the oid of the body object in the xattr RBOX_SIS_XATTR, the body
+ * object counts its references in the omap key RBOX_SIS_REFS_KEY.
+ */
+#define RBOX_SIS_NAMESPACE "rbox_sis"
+#define RBOX_SIS_OID_PREFIX "sis."
+#define RBOX_SIS_XATTR "rbox.sis"
+#define RBOX_SIS_REFS_KEY "refs"
+/**
+ * mails up to rbox_mail_inline_max_size bytes are stored in this xattr of the
+ * mail object instead of the object data.
+ */
+#define RBOX_INLINE_XATTR "rbox.inline"
+/**
+ * upper bound of rbox_mail_inline_max_size, the inline xattr and the metadata
+ * xattrs have to stay below the xattr size limit of the osd (64k).
+ */
+#define RBOX_INLINE_MAX_SIZE_LIMIT 32768
+/**
+ * packed alt storage (rbox_alt_segment_size), see RadosPackedSegment
+ */
+#define RBOX_PACKED_XATTR "rbox.packed"
+#define RBOX_SEGMENT_OID_PREFIX "seg."
+#define RBOX_SEGMENT_ENTRY_PREFIX "m."
+#define RBOX_SEGMENT_DEAD_KEY "dead"
+/**
+ * lock of a segment: compaction holds it exclusive, copies and moves of
+ * stubs hold it shared (see RadosPackedSegment::pin). Expires after
+ * RBOX_SEGMENT_LOCK_DURATION seconds.
+ */
+#define RBOX_SEGMENT_LOCK "rbox.segment"
+#define RBOX_SEGMENT_LOCK_DURATION 60
 /**
  * The available metadata keys used as rados
  * omap / xattribute
@@ -62,6 +106,10 @@ enum rbox_metadata_key {
    * private flags.
    */
   RBOX_METADATA_PVT_FLAGS = 'C',
+  /**
+   * codec and uncompressed size of a compressed mail object (<codec>:<size>)
+   */
+  RBOX_METADATA_COMPRESSION = 'Y',
   /** metadata used by old Dovecot versions **/
   RBOX_METADATA_OLDV1_EXPUNGED = 'E',
   /** saved as uint**/
@@ -107,6 +155,8 @@ static const char *rbox_metadata_key_to_char(rbox_metadata_key type) {
       return "A";
     case RBOX_METADATA_PVT_FLAGS:
       return "C";
+    case RBOX_METADATA_COMPRESSION:
+      return "Y";
     case RBOX_METADATA_OLDV1_EXPUNGED:
       return "E";
     case RBOX_METADATA_OLDV1_FLAGS:
@@ -14,13 +14,20 @@
 #endif
 
 #include "rados-util.h"
+#include <errno.h>
 #include <limits.h>
+#include <algorithm>
+#include <deque>
 #include <string>
 #include <list>
 #include <iostream>
 #include <sstream>
 #include <set>
+#include <map>
+#include <utility>
+#include <vector>
 #include "encoding.h"
+#include "rados-packed-segment.h"
 
 namespace librmb {
 
@@ -118,9 +125,154 @@ int RadosUtils::get_all_keys_and_values(librados::IoCtx *io_ctx, const std::stri
   if (ret < 0) {
     return ret;
   }
+  for (std::set<std::string>::iterator it = extended_keys.begin(); it != extended_keys.end();) {
+    if (is_mail_cache_key(*it)) {
+      extended_keys.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  if (extended_keys.empty()) {
+    return 0;
+  }
   return io_ctx->omap_get_vals_by_keys(oid, extended_keys, kv_map);
 }
 
+bool RadosUtils::is_mail_cache_key(const std::string &key) {
+  return key.compare(0, sizeof(RBOX_MAIL_CACHE_KEY_PREFIX) - 1, RBOX_MAIL_CACHE_KEY_PREFIX) == 0;
+}
+
+bool RadosUtils::is_object_data_xattr(const std::string &key) {
+  return key == std::string(1, static_cast<char>(RBOX_METADATA_COMPRESSION)) || key == RBOX_SIS_XATTR ||
+         key == RBOX_INLINE_XATTR || key == RBOX_PACKED_XATTR;
+}
+
+void RadosUtils::remove_mail_cache_keys(std::map<std::string, librados::bufferlist> *kv_map) {
+  std::map<std::string, librados::bufferlist>::iterator it =
+      kv_map->lower_bound(RBOX_MAIL_CACHE_KEY_PREFIX);
+  while (it != kv_map->end() && is_mail_cache_key(it->first)) {
+    kv_map->erase(it++);
+  }
+}
+
+int RadosUtils::get_more_omap_values(librados::IoCtx *io_ctx, const std::string &oid,
+                                     std::map<std::string, librados::bufferlist> *kv_map) {
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_OMAP_GET_VALS2
+  bool more = true;
+  while (more) {
+    std::string start_after = kv_map->empty() ? "" : kv_map->rbegin()->first;
+    std::map<std::string, librados::bufferlist> values;
+    int err = 0;
+    librados::ObjectReadOperation read_op;
+    read_op.omap_get_vals2(start_after, "", LONG_MAX, &values, &more, &err);
+    int ret = io_ctx->operate(oid, &read_op, nullptr);
+    if (ret < 0) {
+      return ret;
+    }
+    if (err < 0) {
+      return err;
+    }
+    if (values.empty()) {
+      break;
+    }
+    kv_map->insert(values.begin(), values.end());
+  }
+#endif
+  return 0;
+}
+
+void RadosUtils::append_to_segment(const char *data, size_t length, size_t segment_size,
+                                   librados::bufferptr *segment, librados::bufferlist *bl) {
+  while (length > 0) {
+    if (!segment->have_raw() || segment->unused_tail_length() == 0) {
+      *segment = librados::bufferptr(ceph::buffer::create_page_aligned(segment_size));
+      segment->set_length(0);
+    }
+    unsigned offset = segment->length();
+    unsigned n = std::min<size_t>(length, segment->unused_tail_length());
+    segment->append(data, n);
+    // references the segment, contiguous appends are merged into the last ptr of bl
+    bl->append(*segment, offset, n);
+    data += n;
+    length -= n;
+  }
+}
+
+size_t RadosUtils::find_header_end(const char *data, size_t length, int *state) {
+  // 0 = within a line, 1 = at the start of a line, 2 = CR at the start of a line
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] == '\n') {
+      if (*state != 0) {
+        return i + 1;
+      }
+      *state = 1;
+    } else if (data[i] == '\r' && *state == 1) {
+      *state = 2;
+    } else {
+      *state = 0;
+    }
+  }
+  return 0;
+}
+
+void RadosUtils::get_sis_io_ctx(librados::IoCtx *io_ctx, librados::IoCtx *sis_io_ctx) {
+  sis_io_ctx->dup(*io_ctx);
+  sis_io_ctx->set_namespace(RBOX_SIS_NAMESPACE);
+}
+
+/* numops add, which does not create the object, if it has been removed in between */
+static int sis_add_refs(librados::IoCtx *sis_io_ctx, const std::string &oid, long long value) {
+  librados::bufferlist in;
+  encode(std::string(RBOX_SIS_REFS_KEY), in);
+  std::stringstream stream;
+  stream << value;
+  encode(stream.str(), in);
+
+  librados::ObjectWriteOperation write_op;
+  write_op.assert_exists();
+  write_op.exec("numops", "add", in);
+  return sis_io_ctx->operate(oid, &write_op);
+}
+
+int RadosUtils::sis_add_reference(librados::IoCtx *sis_io_ctx, const std::string &oid,
+                                  librados::bufferlist *content) {
+  int ret = -ENOENT;
+  // the object may be removed with its last reference in between, so try again to create it.
+  for (int i = 0; i < 3 && ret == -ENOENT; i++) {
+    if (content != nullptr) {
+      librados::ObjectWriteOperation write_op;
+      write_op.create(true);
+      write_op.write_full(*content);
+      std::map<std::string, librados::bufferlist> refs;
+      refs[RBOX_SIS_REFS_KEY].append("1");
+      write_op.omap_set(refs);
+      ret = sis_io_ctx->operate(oid, &write_op);
+      if (ret != -EEXIST) {
+        break;
+      }
+    }
+    ret = sis_add_refs(sis_io_ctx, oid, 1);
+  }
+  return ret;
+}
+
+int RadosUtils::sis_remove_reference(librados::IoCtx *sis_io_ctx, const std::string &oid) {
+  int ret = sis_add_refs(sis_io_ctx, oid, -1);
+  if (ret < 0) {
+    return ret;
+  }
+  // remove the object, if there is no new reference in between.
+  std::map<std::string, std::pair<librados::bufferlist, int>> assertions;
+  assertions[RBOX_SIS_REFS_KEY].first.append("0");
+  assertions[RBOX_SIS_REFS_KEY].second = LIBRADOS_CMPXATTR_OP_EQ;
+  int cmp_ret = 0;
+  librados::ObjectWriteOperation write_op;
+  write_op.omap_cmp(assertions, &cmp_ret);
+  write_op.remove();
+  ret = sis_io_ctx->operate(oid, &write_op);
+  return ret == -ECANCELED || ret == -ENOENT ? 0 : ret;
+}
+
 void RadosUtils::resolve_flags(const uint8_t &flags, std::string *flat) {
   std::stringbuf buf;
   std::ostream os(&buf);
@@ -146,19 +298,28 @@ void RadosUtils::resolve_flags(const uint8_t &flags, std::string *flat) {
   *flat = buf.str();
 }
 
-int RadosUtils::osd_add(librados::IoCtx *ioctx, const std::string &oid, const std::string &key,
-                        long long value_to_add) {
-  librados::bufferlist in, out;
-  encode(key, in);
+static void encode_osd_add(const std::string &key, long long value_to_add, librados::bufferlist *in) {
+  encode(key, *in);
 
   std::stringstream stream;
   stream << value_to_add;
 
-  encode(stream.str(), in);
+  encode(stream.str(), *in);
+}
 
+int RadosUtils::osd_add(librados::IoCtx *ioctx, const std::string &oid, const std::string &key,
+                        long long value_to_add) {
+  librados::bufferlist in, out;
+  encode_osd_add(key, value_to_add, &in);
   return ioctx->exec(oid, "numops", "add", in, out);
 }
 
+void RadosUtils::osd_add(librados::ObjectWriteOperation *write_op, const std::string &key, long long value_to_add) {
+  librados::bufferlist in;
+  encode_osd_add(key, value_to_add, &in);
+  write_op->exec("numops", "add", in);
+}
+
 int RadosUtils::osd_sub(librados::IoCtx *ioctx, const std::string &oid, const std::string &key,
                         long long value_to_subtract) {
   return osd_add(ioctx, oid, key, -value_to_subtract);
@@ -229,77 +390,310 @@ bool RadosUtils::validate_metadata(map<string, ceph::bufferlist> *metadata) {
 int RadosUtils::move_to_alt(std::string &oid, RadosStorage *primary, RadosStorage *alt_storage,
                             RadosMetadataStorage *metadata, bool inverse) {
   int ret = -1;
+  librados::bufferlist packed_ref;
+  if (inverse && alt_storage != nullptr) {
+    // the data of a packed mail stays in the segment until the reference is removed.
+    alt_storage->get_io_ctx().getxattr(oid, RBOX_PACKED_XATTR, packed_ref);
+  }
   ret = copy_to_alt(oid, oid, primary, alt_storage, metadata, inverse);
   if (ret > 0) {
     if (inverse) {
       ret = alt_storage->get_io_ctx().remove(oid);
+      if (ret >= 0 && packed_ref.length() > 0) {
+        RadosPackedSegment::remove_reference(&alt_storage->get_io_ctx(), packed_ref.to_str(), oid);
+      }
     } else {
       ret = primary->get_io_ctx().remove(oid);
     }
   }
   return ret;
 }
-int RadosUtils::copy_to_alt(std::string &src_oid, std::string &dest_oid, RadosStorage *primary,
-                            RadosStorage *alt_storage, RadosMetadataStorage *metadata, bool inverse) {
-  int ret = 0;
 
-  // TODO(jrse) check that storage is connected and open.
-  if (primary == nullptr || alt_storage == nullptr) {
-    return 0;
-  }
+namespace {
+/* state of a single object move of RadosUtils::move_to_alt */
+struct alt_move {
+  enum stage { CHECK, COPY, REMOVE };
+  size_t index;
+  stage step;
+  librados::AioCompletion *completion;
+  librados::ObjectReadOperation read_op;
+  librados::ObjectWriteOperation write_op;
+  librados::bufferlist packed_ref;
+  int packed_err;
+};
+
+bool is_packed_stub(librados::IoCtx *io_ctx, const std::string &oid) {
+  librados::bufferlist packed_ref;
+  return io_ctx->getxattr(oid, RBOX_PACKED_XATTR, packed_ref) > 0;
+}
 
-  RadosMail mail;
-  mail.set_oid(src_oid);
+/* mail object as stored: the object data (e.g. compressed or the header of a single
+ * instance mail) with all of its xattrs and omap values */
+struct raw_mail_object {
+  librados::bufferlist data;
+  std::map<std::string, librados::bufferlist> xattrs;
+  std::map<std::string, librados::bufferlist> omap;
+  time_t mtime;
+};
+
+/* reads the mail object as stored, inline data and the data of packed stubs are resolved.
+ * The other object data xattrs (e.g. compression, single instance reference) are kept as they are. */
+int read_raw_mail_object(librados::IoCtx *io_ctx, const std::string &oid, raw_mail_object *obj) {
+  librados::ObjectReadOperation read_op;
+  bool more = false;
+  obj->mtime = 0;
+  read_op.read(0, INT_MAX, &obj->data, nullptr);
+  read_op.getxattrs(&obj->xattrs, nullptr);
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_OMAP_GET_VALS2
+  read_op.omap_get_vals2("", "", LONG_MAX, &obj->omap, &more, nullptr);
+#else
+  read_op.omap_get_vals("", "", LONG_MAX, &obj->omap, nullptr);
+#endif
+  read_op.stat(nullptr, &obj->mtime, nullptr);
+  int ret = io_ctx->operate(oid, &read_op, nullptr);
+  if (ret >= 0 && more) {
+    // the osd limits the omap values per read
+    ret = RadosUtils::get_more_omap_values(io_ctx, oid, &obj->omap);
+  }
+  if (ret < 0) {
+    return ret;
+  }
+  std::map<std::string, librados::bufferlist>::iterator it = obj->xattrs.find(RBOX_INLINE_XATTR);
+  if (it != obj->xattrs.end()) {
+    obj->data.claim_append(it->second);
+    obj->xattrs.erase(it);
+  }
+  it = obj->xattrs.find(RBOX_PACKED_XATTR);
+  if (it != obj->xattrs.end()) {
+    ret = RadosPackedSegment::read(io_ctx, it->second.to_str(), &obj->data);
+    obj->xattrs.erase(it);
+  }
+  return ret;
+}
 
-  librados::bufferlist *bl = new librados::bufferlist();
-  mail.set_mail_buffer(bl);
+/* adds the xattrs, omap values and mtime of the raw mail object to the write operation */
+void set_raw_mail_metadata(librados::ObjectWriteOperation *write_op, raw_mail_object *obj) {
+  for (std::map<std::string, librados::bufferlist>::iterator it = obj->xattrs.begin(); it != obj->xattrs.end();
+       ++it) {
+    write_op->setxattr(it->first.c_str(), it->second);
+  }
+  if (!obj->omap.empty()) {
+    write_op->omap_set(obj->omap);
+  }
+  write_op->mtime(&obj->mtime);
+}
+}  // namespace
 
-  if (inverse) {
-    ret = alt_storage->read_mail(src_oid, mail.get_mail_buffer());
-    metadata->get_storage()->set_io_ctx(&alt_storage->get_io_ctx());
-  } else {
-    ret = primary->read_mail(src_oid, mail.get_mail_buffer());
+int RadosUtils::move_to_alt(const std::vector<std::string> &oids, RadosStorage *primary, RadosStorage *alt_storage,
+                            RadosMetadataStorage *metadata, bool inverse, unsigned int max_inflight,
+                            std::vector<int> *results) {
+  int ret = 0;
+  results->assign(oids.size(), -1);
+  if (primary == nullptr || alt_storage == nullptr) {
+    return -1;
   }
+  librados::IoCtx *src_io_ctx = inverse ? &alt_storage->get_io_ctx() : &primary->get_io_ctx();
+  librados::IoCtx *dest_io_ctx = inverse ? &primary->get_io_ctx() : &alt_storage->get_io_ctx();
+
+  std::deque<alt_move *> window;
+  size_t next = 0;
+  while (next < oids.size() || !window.empty()) {
+    while (next < oids.size() && window.size() < std::max(max_inflight, 1u)) {
+      alt_move *move = new alt_move();
+      move->index = next++;
+      move->completion = librados::Rados::aio_create_completion();
+      int start_ret;
+      if (inverse) {
+        // only stubs of the packed alt storage have this xattr
+        move->step = alt_move::CHECK;
+        move->packed_err = 0;
+        move->read_op.getxattr(RBOX_PACKED_XATTR, &move->packed_ref, &move->packed_err);
+        move->read_op.set_op_flags2(librados::OP_FAILOK);
+        start_ret = src_io_ctx->aio_operate(oids[move->index], move->completion, &move->read_op, nullptr);
+      } else {
+        move->step = alt_move::COPY;
+        copy_from(&move->write_op, oids[move->index], *src_io_ctx);
+        start_ret = dest_io_ctx->aio_operate(oids[move->index], move->completion, &move->write_op);
+      }
+      if (start_ret < 0) {
+        (*results)[move->index] = start_ret;
+        move->completion->release();
+        delete move;
+        continue;
+      }
+      window.push_back(move);
+    }
+    if (window.empty()) {
+      continue;
+    }
 
-  if (ret < 0) {
-    metadata->get_storage()->set_io_ctx(&primary->get_io_ctx());
-    return ret;
+    // ops complete in any order, waiting for the oldest keeps the window bounded.
+    alt_move *move = window.front();
+    window.pop_front();
+    move->completion->wait_for_complete();
+    int step_ret = move->completion->get_return_value();
+    move->completion->release();
+    move->completion = nullptr;
+    const std::string &oid = oids[move->index];
+
+    if (step_ret >= 0 && move->step == alt_move::CHECK && move->packed_err >= 0 && move->packed_ref.length() > 0) {
+      // the data is stored in a segment of the alt storage
+      std::string src_oid = oid;
+      step_ret = move_to_alt(src_oid, primary, alt_storage, metadata, inverse);
+      step_ret = step_ret < 0 ? step_ret : 0;
+    } else if (step_ret >= 0 && move->step == alt_move::CHECK) {
+      move->step = alt_move::COPY;
+      copy_from(&move->write_op, oid, *src_io_ctx);
+      move->completion = librados::Rados::aio_create_completion();
+      step_ret = dest_io_ctx->aio_operate(oid, move->completion, &move->write_op);
+    } else if (step_ret >= 0 && move->step == alt_move::COPY) {
+      move->step = alt_move::REMOVE;
+      move->completion = librados::Rados::aio_create_completion();
+      step_ret = src_io_ctx->aio_remove(oid, move->completion);
+    }
+
+    if (step_ret >= 0 && move->completion != nullptr) {
+      window.push_back(move);
+      continue;
+    }
+    if (move->completion != nullptr) {
+      move->completion->release();
+    }
+    (*results)[move->index] = step_ret;
+    delete move;
   }
-  mail.set_mail_size(mail.get_mail_buffer()->length());
 
-  // load the metadata;
-  ret = metadata->get_storage()->load_metadata(&mail);
-  if (ret < 0) {
-    return ret;
+  for (std::vector<int>::iterator it = results->begin(); it != results->end() && ret == 0; ++it) {
+    ret = *it < 0 ? *it : 0;
   }
+  return ret;
+}
 
-  mail.set_oid(dest_oid);
+int RadosUtils::move_to_alt_packed(const std::vector<std::string> &oids, RadosStorage *primary,
+                                   RadosStorage *alt_storage, RadosMetadataStorage *metadata, uint64_t segment_size,
+                                   std::vector<int> *results) {
+  int ret = 0;
+  results->assign(oids.size(), -1);
+  if (primary == nullptr || alt_storage == nullptr) {
+    return -1;
+  }
+  librados::IoCtx *alt_io_ctx = &alt_storage->get_io_ctx();
+
+  size_t begin = 0;
+  while (begin < oids.size()) {
+    // read the mails until the segment is full
+    std::vector<raw_mail_object *> mails;
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> lengths;
+    std::map<std::string, librados::bufferlist> entries;
+    librados::bufferlist data;
+    size_t end = begin;
+    for (; end < oids.size() && data.length() < segment_size; ++end) {
+      // the object data and xattrs are moved as they are, e.g. the data of a compressed mail stays compressed.
+      raw_mail_object *mail = new raw_mail_object();
+      int read_ret = read_raw_mail_object(&primary->get_io_ctx(), oids[end], mail);
+      if (read_ret < 0 || mail->data.length() == 0) {
+        (*results)[end] = read_ret < 0 ? read_ret : -EIO;
+        delete mail;
+        mails.push_back(nullptr);
+        offsets.push_back(0);
+        lengths.push_back(0);
+        continue;
+      }
+      entries[RadosPackedSegment::entry_key(oids[end])].append(
+          RadosPackedSegment::to_entry(data.length(), mail->data.length(), alt_io_ctx->get_namespace()));
+      offsets.push_back(data.length());
+      lengths.push_back(mail->data.length());
+      data.claim_append(mail->data);
+      mails.push_back(mail);
+    }
 
-  librados::ObjectWriteOperation write_op;  // = new librados::ObjectWriteOperation();
-  metadata->get_storage()->save_metadata(&write_op, &mail);
+    int segment_ret = -ENOENT;
+    std::string segment_oid;
+    for (size_t i = 0; i < mails.size(); i++) {
+      if (mails[i] != nullptr) {
+        // mail oids are unique, so is the segment oid
+        segment_oid = RBOX_SEGMENT_OID_PREFIX + oids[begin + i];
+        segment_ret = RadosPackedSegment::create(alt_io_ctx, segment_oid, data, entries);
+        break;
+      }
+    }
 
-  bool success;
-  if (inverse) {
-    success = primary->save_mail(&write_op, &mail, true);
-  } else {
-    success = alt_storage->save_mail(&write_op, &mail, true);
+    // write the stubs, the source objects are removed after their stub is written.
+    std::vector<librados::AioCompletion *> completions(mails.size(), nullptr);
+    for (size_t i = 0; i < mails.size() && segment_ret >= 0; i++) {
+      if (mails[i] == nullptr) {
+        continue;
+      }
+      librados::ObjectWriteOperation write_op;
+      set_raw_mail_metadata(&write_op, mails[i]);
+      librados::bufferlist ref;
+      ref.append(RadosPackedSegment::to_ref(segment_oid, offsets[i], lengths[i], alt_io_ctx->get_namespace()));
+      write_op.setxattr(RBOX_PACKED_XATTR, ref);
+      completions[i] = librados::Rados::aio_create_completion();
+      if (alt_io_ctx->aio_operate(oids[begin + i], completions[i], &write_op) < 0) {
+        completions[i]->release();
+        completions[i] = nullptr;
+      }
+    }
+    for (size_t i = 0; i < mails.size(); i++) {
+      if (mails[i] == nullptr) {
+        continue;
+      }
+      int stub_ret = segment_ret < 0 ? segment_ret : -EIO;
+      if (completions[i] != nullptr) {
+        completions[i]->wait_for_complete();
+        stub_ret = completions[i]->get_return_value();
+        completions[i]->release();
+      }
+      if (stub_ret >= 0) {
+        stub_ret = primary->get_io_ctx().remove(oids[begin + i]);
+      } else if (segment_ret >= 0) {
+        // the data is dead
+        RadosPackedSegment::remove_reference(
+            alt_io_ctx, RadosPackedSegment::to_ref(segment_oid, offsets[i], lengths[i], alt_io_ctx->get_namespace()),
+            oids[begin + i]);
+      }
+      (*results)[begin + i] = stub_ret;
+      delete mails[i];
+    }
+    begin = end;
+  }
+  for (std::vector<int>::iterator it = results->begin(); it != results->end() && ret == 0; ++it) {
+    ret = *it < 0 ? *it : 0;
   }
+  return ret;
+}
+int RadosUtils::copy_to_alt(std::string &src_oid, std::string &dest_oid, RadosStorage *primary,
+                            RadosStorage *alt_storage, RadosMetadataStorage *metadata, bool inverse) {
+  int ret = 0;
 
-  if (!success) {
+  // TODO(jrse) check that storage is connected and open.
+  if (primary == nullptr || alt_storage == nullptr) {
     return 0;
   }
 
-  std::list<librmb::RadosMail *> objects;
-  objects.push_back(&mail);
-  if (inverse) {
-    success = primary->wait_for_rados_operations(objects);
-    // ret = primary->aio_operate(&primary->get_io_ctx(), dest_oid, completion, &write_op);
-  } else {
-    success = alt_storage->wait_for_rados_operations(objects);
-    // ret = alt_storage->aio_operate(&alt_storage->get_io_ctx(), dest_oid, completion, &write_op);
+  librados::IoCtx *src_io_ctx = inverse ? &alt_storage->get_io_ctx() : &primary->get_io_ctx();
+  librados::IoCtx *dest_io_ctx = inverse ? &primary->get_io_ctx() : &alt_storage->get_io_ctx();
+  if (!inverse || !is_packed_stub(src_io_ctx, src_oid)) {
+    // the osd copies data and metadata, the mail does not pass this host.
+    librados::ObjectWriteOperation copy_op;
+    copy_from(&copy_op, src_oid, *src_io_ctx);
+    ret = dest_io_ctx->operate(dest_oid, &copy_op);
+    return ret < 0 ? ret : 1;
   }
 
-  return success ? 0 : 1;
+  // packed stubs have no data, the segment data is written to the object as it is stored (e.g. compressed).
+  raw_mail_object mail;
+  ret = read_raw_mail_object(src_io_ctx, src_oid, &mail);
+  if (ret < 0) {
+    return ret;
+  }
+  librados::ObjectWriteOperation write_op;
+  write_op.write_full(mail.data);
+  set_raw_mail_metadata(&write_op, &mail);
+  ret = dest_io_ctx->operate(dest_oid, &write_op);
+  return ret < 0 ? ret : 1;
 }
 
 }  // namespace librmb
@@ -18,6 +18,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <rados/librados.hpp>
 #include "rados-storage.h"
 #include "rados-metadata-storage.h"
@@ -97,13 +98,99 @@ class RadosUtils {
   static void find_and_replace(std::string *source, std::string const &find, std::string const &replace);
 
   /*!
-   * get a list of key value pairs
+   * get a list of key value pairs, without the mail cache keys (RBOX_MAIL_CACHE_KEY_PREFIX)
    * @param[in] io_ctx valid io_ctx
    * @param[in] oid: unique identifier
    * @param[out] kv_map valid ptr to key value map.
    */
   static int get_all_keys_and_values(librados::IoCtx *io_ctx, const std::string &oid,
                                      std::map<std::string, librados::bufferlist> *kv_map);
+  /*!
+   * check if the omap key belongs to the mail cache (RBOX_MAIL_CACHE_KEY_PREFIX)
+   * @param[in] key omap key
+   * @return true if key is a mail cache key
+   */
+  static bool is_mail_cache_key(const std::string &key);
+  /*!
+   * check if the xattr describes how the mail data is stored (compression, single instance body,
+   * inline data, packed segment) instead of the mail. These xattrs belong to the object data
+   * and are never rewritten together with the mail metadata.
+   * @param[in] key xattr name
+   * @return true if key is such an xattr
+   */
+  static bool is_object_data_xattr(const std::string &key);
+  /*!
+   * remove the mail cache keys from the map
+   * @param[in,out] kv_map valid ptr to key value map.
+   */
+  static void remove_mail_cache_keys(std::map<std::string, librados::bufferlist> *kv_map);
+  /*!
+   * load the omap values following the last key of kv_map, e.g. if a read with
+   * omap_get_vals2 has been truncated by the osd (more = true).
+   * @param[in] io_ctx valid io_ctx
+   * @param[in] oid: unique identifier
+   * @param[in,out] kv_map valid ptr to key value map.
+   * @return linux error code or 0 if successful
+   */
+  static int get_more_omap_values(librados::IoCtx *io_ctx, const std::string &oid,
+                                  std::map<std::string, librados::bufferlist> *kv_map);
+  /*!
+   * append data to the bufferlist. The data is copied into page aligned segments of segment_size
+   * bytes, the bufferlist references the segments instead of allocating its own append buffers.
+   * @param[in] data data to append
+   * @param[in] length length of data
+   * @param[in] segment_size size of a newly allocated segment
+   * @param[in,out] segment valid ptr to the current segment
+   * @param[out] bl valid ptr to the bufferlist
+   */
+  static void append_to_segment(const char *data, size_t length, size_t segment_size, librados::bufferptr *segment,
+                                librados::bufferlist *bl);
+  /*!
+   * scan data for the end of the header block (empty line) of a mail.
+   * @param[in] data part of the mail
+   * @param[in] length length of data
+   * @param[in,out] state scanner state, initialize with 1 at the start of the mail
+   * @return number of bytes of data which belong to the header incl. the empty line, 0 if the header
+   * does not end within data
+   */
+  static size_t find_header_end(const char *data, size_t length, int *state);
+  /*!
+   * io context of the single instance storage (RBOX_SIS_NAMESPACE)
+   * @param[in] io_ctx io context of the primary pool
+   * @param[out] sis_io_ctx valid ptr
+   */
+  static void get_sis_io_ctx(librados::IoCtx *io_ctx, librados::IoCtx *sis_io_ctx);
+  /*!
+   * add a reference to a single instance object. If the object does not exist, it is created with
+   * the given content.
+   * @param[in] sis_io_ctx io context of the single instance storage
+   * @param[in] oid content addressed oid
+   * @param[in] content content of the object, nullptr: the object has to exist
+   * @return linux error code or 0 if successful
+   */
+  static int sis_add_reference(librados::IoCtx *sis_io_ctx, const std::string &oid, librados::bufferlist *content);
+  /*!
+   * remove a reference from a single instance object, the object is removed with its last reference.
+   * @param[in] sis_io_ctx io context of the single instance storage
+   * @param[in] oid content addressed oid
+   * @return linux error code or 0 if successful
+   */
+  static int sis_remove_reference(librados::IoCtx *sis_io_ctx, const std::string &oid);
+  /*!
+   * add the server side copy of the object (data, xattrs, omap and mtime) to the write operation,
+   * the source can be in another pool of the same cluster.
+   * @param[in] write_op write operation of the destination object, e.g. librados::ObjectWriteOperation
+   * @param[in] src_oid source object
+   * @param[in] src_io_ctx io context of the source object
+   */
+  template <typename WriteOp>
+  static void copy_from(WriteOp *write_op, const std::string &src_oid, librados::IoCtx &src_io_ctx) {
+#if LIBRADOS_VERSION_CODE >= 30000
+    write_op->copy_from(src_oid, src_io_ctx, 0, 0);
+#else
+    write_op->copy_from(src_oid, src_io_ctx, 0);
+#endif
+  }
   /*!
    * get the text representation of uint flags.
    * @param[in] flags
@@ -111,7 +198,8 @@ class RadosUtils {
    */
   static void resolve_flags(const uint8_t &flags, std::string *flat);
   /*!
-   * copy object to alternative storage
+   * copy object to alternative storage. The object is copied by the osd (copy_from),
+   * primary and alternative storage have to be pools of the same cluster.
    * @param[in] src_oid
    * @param[in] dest_oid
    * @param[in] primary rados primary storage
@@ -134,6 +222,34 @@ class RadosUtils {
    */
   static int move_to_alt(std::string &oid, RadosStorage *primary, RadosStorage *alt_storage,
                          RadosMetadataStorage *metadata, bool inverse);
+  /*!
+   * move objects between primary and alternative storage. Up to max_inflight
+   * objects are moved concurrently (server side copy_from -> remove of the source).
+   * @param[in] oids objects to move
+   * @param[in] primary rados primary storage
+   * @param[in] alt_storage rados alternative storage
+   * @param[in] metadata storage
+   * @param[in] inverse if true, move from alt to primary.
+   * @param[in] max_inflight max. number of concurrent moves
+   * @param[out] results linux error code or 0 for each oid
+   * @return linux error code or 0 if all objects have been moved
+   */
+  static int move_to_alt(const std::vector<std::string> &oids, RadosStorage *primary, RadosStorage *alt_storage,
+                         RadosMetadataStorage *metadata, bool inverse, unsigned int max_inflight,
+                         std::vector<int> *results);
+  /*!
+   * move objects to the packed alternative storage (see RadosPackedSegment)
+   * @param[in] oids objects to move
+   * @param[in] primary rados primary storage
+   * @param[in] alt_storage rados alternative storage
+   * @param[in] metadata storage
+   * @param[in] segment_size min. size of a segment in bytes
+   * @param[out] results linux error code or 0 for each oid
+   * @return linux error code or 0 if all objects have been moved
+   */
+  static int move_to_alt_packed(const std::vector<std::string> &oids, RadosStorage *primary,
+                                RadosStorage *alt_storage, RadosMetadataStorage *metadata, uint64_t segment_size,
+                                std::vector<int> *results);
   /*!
    * increment (add) value directly on osd
    * @param[in] ioctx
@@ -144,6 +260,13 @@ class RadosUtils {
    * @return linux error code or 0 if sucessful
    */
   static int osd_add(librados::IoCtx *ioctx, const std::string &oid, const std::string &key, long long value_to_add);
+  /*!
+   * add the increment (add) of the value to the write operation
+   * @param[in] write_op
+   * @param[in] key
+   * @param[in] value_to_add
+   */
+  static void osd_add(librados::ObjectWriteOperation *write_op, const std::string &key, long long value_to_add);
   /*!
    * decrement (sub) value directly on osd
    * @param[in] ioctx
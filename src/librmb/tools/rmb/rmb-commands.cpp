@@ -31,8 +31,17 @@ RmbCommands::RmbCommands(librmb::RadosStorage *storage_, librmb::RadosCluster *c
   this->storage = storage_;
   this->cluster = cluster_;
   this->opts = opts_;
+  this->list_slices = RMB_LIST_SLICES;
   if (this->opts != nullptr) {
     is_debug = ((*opts).find("debug") != (*opts).end()) ? true : false;
+    if ((*opts).find("list_slices") != (*opts).end()) {
+      try {
+        list_slices = std::stoi((*opts)["list_slices"]);
+      } catch (std::exception &e) {
+        std::cerr << "invalid number of list slices: " << (*opts)["list_slices"] << std::endl;
+      }
+      list_slices = std::max(1, std::min(list_slices, RMB_LIST_MAX_SLICES));
+    }
   }
 }
 RmbCommands::~RmbCommands() {}
@@ -423,8 +432,34 @@ static void aio_cb(rados_completion_t cb, void *arg) {
   stat->mail_objects->push_back(stat->mail);
   delete stat;
 }
+void RmbCommands::get_filter_predicates(librmb::RadosStorageMetadataModule *ms, librmb::CmdLineParser *parser,
+                                        std::list<librmb::RadosMetadata> *predicates) {
+  if (parser == nullptr) {
+    return;
+  }
+  for (std::map<std::string, librmb::Predicate *>::iterator it = parser->get_predicates().begin();
+       it != parser->get_predicates().end(); ++it) {
+    librmb::Predicate *p = it->second;
+    if (p == nullptr || !p->valid || p->op.compare("=") != 0 || p->key.size() != 1) {
+      continue;
+    }
+    rbox_metadata_key key = static_cast<librmb::rbox_metadata_key>(*p->key.c_str());
+    // dates are given in a different format than stored, ranges can not be evaluated by the OSDs.
+    if (key == RBOX_METADATA_RECEIVED_TIME || key == RBOX_METADATA_OLDV1_SAVE_TIME || !ms->is_xattr_filterable(key)) {
+      continue;
+    }
+    librmb::RadosMetadata metadata(key, p->value);
+    if (key == RBOX_METADATA_MAILBOX_GUID) {
+      // most selective one first
+      predicates->push_front(metadata);
+    } else {
+      predicates->push_back(metadata);
+    }
+  }
+}
+
 int RmbCommands::load_objects(librmb::RadosStorageMetadataModule *ms, std::list<librmb::RadosMail *> &mail_objects,
-                              std::string &sort_string, bool load_metadata) {
+                              std::string &sort_string, bool load_metadata, librmb::CmdLineParser *parser) {
   time_t begin = time(NULL);
 
   print_debug("entry: load_objects");
@@ -434,21 +469,29 @@ int RmbCommands::load_objects(librmb::RadosStorageMetadataModule *ms, std::list<
   }
   // TODO(jrse): Fix completions.....
   std::list<librados::AioCompletion *> completions;
-  // load all objects metadata into memory
-  librados::NObjectIterator iter(storage->find_mails(nullptr));
-  while (iter != librados::NObjectIterator::__EndObjectIterator) {
+  std::list<librmb::RadosMetadata> predicates;
+  get_filter_predicates(ms, parser, &predicates);
+  // list all (matching) objects, the slices of the object hash space are listed in parallel
+  std::list<std::string> oids;
+  int list_ret = storage->list_mails(list_slices, predicates, &oids);
+  if (list_ret < 0) {
+    std::cout << " listing the mail objects failed, ret code: " << list_ret << std::endl;
+    print_debug("end: load_objects");
+    return list_ret;
+  }
+  // load all (matching) objects metadata into memory
+  for (std::list<std::string>::iterator it_oid = oids.begin(); it_oid != oids.end(); ++it_oid) {
+    const std::string &oid = *it_oid;
     librmb::RadosMail *mail = new librmb::RadosMail();
     AioStat *stat = new AioStat();
     stat->mail = mail;
     stat->mail_objects = &mail_objects;
     stat->load_metadata = load_metadata;
     stat->ms = ms;
-    std::string oid = iter->get_oid();
     stat->completion = librados::Rados::aio_create_completion(static_cast<void *>(stat), aio_cb, NULL);
     int ret = storage->get_io_ctx().aio_stat(oid, stat->completion, &stat->object_size, &stat->save_date_rados);
     if (ret != 0) {
       std::cout << " object '" << oid << "' is not a valid mail object, size = 0, ret code: " << ret << std::endl;
-      ++iter;
       delete mail;
       delete stat;
       continue;
@@ -456,7 +499,6 @@ int RmbCommands::load_objects(librmb::RadosStorageMetadataModule *ms, std::list<
     mail->set_oid(oid);
     completions.push_back(stat->completion);
 
-    ++iter;
     if (is_debug) {
       std::cout << "added: mail " << *mail->get_oid() << std::endl;
     }
@@ -30,6 +30,11 @@
 #include "rados-metadata-storage-module.h"
 #include "rados-save-log.h"
 
+/* default number of slices of the object hash space, which are listed in parallel (-L) */
+#define RMB_LIST_SLICES 8
+/* max. number of slices (listing threads) */
+#define RMB_LIST_MAX_SLICES 64
+
 namespace librmb {
 
 class RmbCommands {
@@ -51,8 +56,14 @@ class RmbCommands {
 
   int configuration(bool confirmed, librmb::RadosCephConfig &ceph_cfg);
 
+  /*!
+   * load the mail objects of the namespace. Equality predicates of the parser are
+   * evaluated by the OSDs if possible, the caller still has to filter (query_mail_storage)
+   */
   int load_objects(librmb::RadosStorageMetadataModule *ms, std::list<librmb::RadosMail *> &mail_objects,
-                   std::string &sort_string, bool load_metadata = true);
+                   std::string &sort_string, bool load_metadata = true, librmb::CmdLineParser *parser = nullptr);
+  static void get_filter_predicates(librmb::RadosStorageMetadataModule *ms, librmb::CmdLineParser *parser,
+                                    std::list<librmb::RadosMetadata> *predicates);
   int update_attributes(librmb::RadosStorageMetadataModule *ms, std::map<std::string, std::string> *metadata);
   int print_mail(std::map<std::string, librmb::RadosMailBox *> *mailbox, std::string &output_dir, bool download);
   int query_mail_storage(std::list<librmb::RadosMail *> *mail_objects, librmb::CmdLineParser *parser, bool download,
@@ -64,11 +75,14 @@ class RmbCommands {
   static bool sort_save_date(librmb::RadosMail *i, librmb::RadosMail *j);
 
   void set_output_path(librmb::CmdLineParser *parser);
+  /* number of slices listed in parallel by load_objects (option list_slices) */
+  int get_list_slices() { return list_slices; }
 
  private:
   std::map<std::string, std::string> *opts;
   librmb::RadosStorage *storage;
   librmb::RadosCluster *cluster;
+  int list_slices;
   bool is_debug;
 };
 
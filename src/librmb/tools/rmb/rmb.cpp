@@ -165,6 +165,7 @@ static void usage(std::ostream &out) {
          "   -c    rados cluster name, default: 'ceph'\n"
          "   -u    rados user name, default: 'client.admin' \n"
          "   -D    debug output \n"
+         "   -L    number of slices of the object listing, which are listed in parallel, default: 8, max: 64\n"
          "   -r    save log with objects to delete => deletes all entries (save,mv,cp) from object store, use with \n"
          "   -v    print plugin version\n"
          "care!!!! \n "
@@ -242,6 +243,8 @@ static void parse_cmd_line_args(std::map<std::string, std::string> *opts, bool &
       (*opts)["rados_user"] = val;
     } else if (ceph_argparse_flag(*args, i, "-D", "--debug", static_cast<char>(NULL))) {
       (*opts)["debug"] = "true";
+    } else if (ceph_argparse_witharg(args, &i, &val, "-L", "--list_slices", static_cast<char>(NULL))) {
+      (*opts)["list_slices"] = val;
     } else if (ceph_argparse_witharg(args, &i, &val, "-r", "--remove", static_cast<char>(NULL))) {
       (*opts)["remove_save_log"] = val;
     } else if (ceph_argparse_witharg(args, &i, &val, "ls", "--ls", static_cast<char>(NULL))) {
@@ -425,7 +428,7 @@ int main(int argc, const char **argv) {
   } else if (opts.find("ls") != opts.end()) {
     librmb::CmdLineParser parser(opts["ls"]);
     if (opts["ls"].compare("all") == 0 || opts["ls"].compare("-") == 0 || parser.parse_ls_string()) {
-      rmb_commands->load_objects(ms, mail_objects, sort_type);
+      rmb_commands->load_objects(ms, mail_objects, sort_type, true, &parser);
       rmb_commands->query_mail_storage(&mail_objects, &parser, false, false);
       std::cout << " NOTE: rmb tool does not have access to dovecot index. so all objects are set  <<<   MAIL OBJECT "
                    "HAS NO INDEX REFERENCE <<<< use doveadm rmb ls - instead "
@@ -438,7 +441,7 @@ int main(int argc, const char **argv) {
 
     if (opts["get"].compare("all") == 0 || opts["get"].compare("-") == 0 || parser.parse_ls_string()) {
       // get load all objects metadata into memory
-      rmb_commands->load_objects(ms, mail_objects, sort_type);
+      rmb_commands->load_objects(ms, mail_objects, sort_type, true, &parser);
       rmb_commands->query_mail_storage(&mail_objects, &parser, true, false);
     }
   } else if (opts.find("set") != opts.end()) {
@@ -178,7 +178,8 @@ static int cmd_rmb_search_run(std::map<std::string, std::string> &opts, struct m
     return -1;
   }
 
-  int ret = rmb_cmds.load_objects(ms, mail_objects, opts["sort"], load_metadata);
+  // without metadata the predicates are not evaluated, so do not filter the listing either.
+  int ret = rmb_cmds.load_objects(ms, mail_objects, opts["sort"], load_metadata, load_metadata ? &parser : nullptr);
   if (ret < 0) {
     i_error("Error loading ceph objects. Errorcode: %d", ret);
     delete ms;
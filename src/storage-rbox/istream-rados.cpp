@@ -0,0 +1,117 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ * Copyright (c) 2007-2017 Dovecot authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#include <string.h>
+
+extern "C" {
+#include "lib.h"
+#include "istream-private.h"
+}
+
+#include "istream-rados.h"
+#include <string>
+#include <rados/librados.hpp>
+
+struct rados_istream {
+  struct istream_private istream;
+  librmb::RadosStorage *storage;
+  std::string *oid;
+  /* data of offset 0, which was read together with the object stat */
+  librados::bufferlist *first_chunk;
+  size_t size;
+  size_t chunk_size;
+};
+
+static ssize_t i_stream_rados_read(struct istream_private *stream) {
+  struct rados_istream *rstream = (struct rados_istream *)stream;
+  uoff_t offset = stream->istream.v_offset + (stream->pos - stream->skip);
+  size_t size;
+
+  if (offset >= rstream->size) {
+    stream->istream.eof = TRUE;
+    return -1;
+  }
+  if (!i_stream_try_alloc(stream, rstream->chunk_size, &size)) {
+    return -2;
+  }
+  size = I_MIN(size, rstream->size - offset);
+
+  char *dest = reinterpret_cast<char *>(stream->w_buffer + stream->pos);
+  if (offset < rstream->first_chunk->length()) {
+    size = I_MIN(size, rstream->first_chunk->length() - offset);
+    rstream->first_chunk->copy(offset, size, dest);
+  } else {
+    librados::bufferlist bl;
+    size = I_MIN(size, rstream->chunk_size);
+    int ret = rstream->storage->read_mail(*rstream->oid, &bl, offset, size);
+    if (ret < 0) {
+      io_stream_set_error(&stream->iostream, "read(%s, offset=%llu) failed: %s", rstream->oid->c_str(),
+                          (unsigned long long)offset, strerror(-ret));
+      stream->istream.stream_errno = -ret;
+      return -1;
+    }
+    if (bl.length() == 0) {
+      // object is smaller than its stat size, it has been replaced in the meantime.
+      io_stream_set_error(&stream->iostream, "read(%s) failed: unexpected end of object at offset %llu",
+                          rstream->oid->c_str(), (unsigned long long)offset);
+      stream->istream.stream_errno = EPIPE;
+      return -1;
+    }
+    size = I_MIN(size, bl.length());
+    bl.copy(0, size, dest);
+  }
+  stream->pos += size;
+  return size;
+}
+
+static void i_stream_rados_destroy(struct iostream_private *stream) {
+  struct rados_istream *rstream = (struct rados_istream *)stream;
+  struct istream_private *_stream = &rstream->istream;
+
+#if DOVECOT_PREREQ(2, 3)
+  i_stream_free_buffer(_stream);
+#else
+  i_free(_stream->w_buffer);
+#endif
+  delete rstream->first_chunk;
+  delete rstream->oid;
+}
+
+struct istream *i_stream_create_rados(librmb::RadosStorage *storage, const std::string &oid,
+                                      librados::bufferlist *first_chunk, const size_t &size, const size_t &chunk_size) {
+  struct rados_istream *rstream;
+
+  rstream = i_new(struct rados_istream, 1);
+  rstream->storage = storage;
+  rstream->oid = new std::string(oid);
+  rstream->first_chunk = first_chunk;
+  rstream->size = size;
+  rstream->chunk_size = chunk_size;
+
+  rstream->istream.max_buffer_size = chunk_size;
+  rstream->istream.read = i_stream_rados_read;
+  rstream->istream.iostream.destroy = i_stream_rados_destroy;
+
+  rstream->istream.istream.readable_fd = FALSE;
+  rstream->istream.istream.blocking = TRUE;
+  rstream->istream.istream.seekable = TRUE;
+
+#if DOVECOT_PREREQ(2, 3)
+  i_stream_create(&rstream->istream, NULL, -1, static_cast<enum istream_create_flag>(0));
+#else
+  i_stream_create(&rstream->istream, NULL, -1);
+#endif
+  // same as i_stream_create_from_bufferlist: the object is \0 terminated.
+  rstream->istream.statbuf.st_size = size - 1;
+  i_stream_set_name(&rstream->istream.istream, oid.c_str());
+  return &rstream->istream.istream;
+}
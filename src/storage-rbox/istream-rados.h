@@ -0,0 +1,31 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (c) 2017-2018 Tallence AG and the authors
+ * Copyright (c) 2007-2017 Dovecot authors
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ */
+
+#include <string>
+#include <rados/librados.hpp>
+#include "../librmb/rados-storage.h"
+
+#ifndef SRC_STORAGE_RBOX_ISTREAM_RADOS_H_
+#define SRC_STORAGE_RBOX_ISTREAM_RADOS_H_
+/**
+ * @brief: creates a seekable istream, which reads the mail object with ranged reads of chunk_size bytes
+ * on demand.
+ * @param[in] storage valid rados storage, which is avail while istream is avail.
+ * @param[in] oid unique object identifier.
+ * @param[in] first_chunk already read data from offset 0, istream takes ownership.
+ * @param[in] size object size.
+ * @param[in] chunk_size size of the ranged reads.
+ */
+struct istream *i_stream_create_rados(librmb::RadosStorage *storage, const std::string &oid,
+                                      librados::bufferlist *first_chunk, const size_t &size, const size_t &chunk_size);
+
+#endif /* SRC_STORAGE_RBOX_ISTREAM_RADOS_H_ */
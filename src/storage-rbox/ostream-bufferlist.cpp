@@ -11,12 +11,15 @@
  */
 #include <string>
 #include <list>
+#include <deque>
 
 extern "C" {
 #include "lib.h"
 #include "ostream-private.h"
+#include "sha2.h"
 }
 #include "ostream-bufferlist.h"
+#include "rados-util.h"
 
 struct bufferlist_ostream {
   struct ostream_private ostream;
@@ -25,8 +28,57 @@ struct bufferlist_ostream {
   librmb::RadosStorage *rados_storage;
   librmb::RadosMail *rados_mail;
   bool execute_write_ops;
+  /* current page aligned segment, if segment_size > 0 */
+  librados::bufferptr *segment;
+  size_t segment_size;
+  /* chunked writes (execute_write_ops): object offset of the buffered chunk,
+     flush size of a chunk (0 = every sendv) and the in flight write completions */
+  uoff_t chunk_offset;
+  size_t chunk_size;
+  unsigned int max_inflight;
+  std::deque<librados::AioCompletion *> *inflight;
+  bool write_failed;
+  /* single instance storage: sha256 of the body, the header end is searched first */
+  struct sha256_ctx *body_hash;
+  int hdr_state;
+  bool hdr_found;
+  uoff_t hdr_size;
 };
 
+static void o_stream_bufferlist_wait_oldest(struct bufferlist_ostream *bstream) {
+  librados::AioCompletion *completion = bstream->inflight->front();
+  bstream->inflight->pop_front();
+  completion->wait_for_complete();
+  int ret = completion->get_return_value();
+  if (ret < 0) {
+    i_error("chunked write of mail %s failed: %d", bstream->rados_mail->get_oid()->c_str(), ret);
+    bstream->write_failed = true;
+  }
+  completion->release();
+}
+
+static void o_stream_bufferlist_write_chunk(struct bufferlist_ostream *bstream) {
+  if (bstream->buf->length() == 0) {
+    return;
+  }
+  while (bstream->inflight->size() >= bstream->max_inflight) {
+    o_stream_bufferlist_wait_oldest(bstream);
+  }
+  librados::ObjectWriteOperation write_op;
+  // the write op holds its own references to the buffers
+  write_op.write(bstream->chunk_offset, *bstream->buf);
+  librados::AioCompletion *completion = librados::Rados::aio_create_completion();
+  if (bstream->rados_storage->aio_operate(&bstream->rados_storage->get_io_ctx(), *bstream->rados_mail->get_oid(),
+                                          completion, &write_op) < 0) {
+    completion->release();
+    bstream->write_failed = true;
+  } else {
+    bstream->inflight->push_back(completion);
+  }
+  bstream->chunk_offset += bstream->buf->length();
+  bstream->buf->clear();
+}
+
 static int o_stream_buffer_seek(struct ostream_private *stream, uoff_t offset) {
   struct bufferlist_ostream *bstream = (struct bufferlist_ostream *)stream;
   bstream->seeked = TRUE;
@@ -47,39 +99,112 @@ static void rbox_ostream_destroy(struct iostream_private *stream) {
   // wait for write operation
   struct bufferlist_ostream *bstream = (struct bufferlist_ostream *)stream;
   i_assert(bstream->buf != nullptr);
+  // the bufferlist holds its own references to the segments
+  if (bstream->segment != nullptr) {
+    delete bstream->segment;
+    bstream->segment = nullptr;
+  }
+  if (bstream->inflight != nullptr) {
+    while (!bstream->inflight->empty()) {
+      o_stream_bufferlist_wait_oldest(bstream);
+    }
+    delete bstream->inflight;
+    bstream->inflight = nullptr;
+  }
+  if (bstream->body_hash != nullptr) {
+    i_free(bstream->body_hash);
+  }
 
   // do not free the outbut stream! cause, it is needed until all write operations are finished!
   // delete bstream->buf;
 }
 
+static void o_stream_bufferlist_hash_body(struct bufferlist_ostream *bstream, const void *data, size_t size) {
+  const char *body = reinterpret_cast<const char *>(data);
+  if (!bstream->hdr_found) {
+    size_t hdr_end = librmb::RadosUtils::find_header_end(body, size, &bstream->hdr_state);
+    if (hdr_end == 0) {
+      return;
+    }
+    bstream->hdr_found = true;
+    bstream->hdr_size = bstream->ostream.ostream.offset + hdr_end;
+    body += hdr_end;
+    size -= hdr_end;
+  }
+  sha256_loop(bstream->body_hash, body, size);
+}
+
 static ssize_t o_stream_buffer_sendv(struct ostream_private *stream, const struct const_iovec *iov,
                                      unsigned int iov_count) {
   struct bufferlist_ostream *bstream = (struct bufferlist_ostream *)stream;
   ssize_t ret = 0;
   unsigned int i;
-  uint64_t val = stream->ostream.offset;
-  if (bstream->execute_write_ops) {
-    bstream->buf->clear();
-  }
   for (i = 0; i < iov_count; i++) {
-    // use unsigned char* for binary data!
-    bstream->buf->append(reinterpret_cast<const unsigned char *>(iov[i].iov_base), iov[i].iov_len);
+    if (bstream->body_hash != nullptr) {
+      o_stream_bufferlist_hash_body(bstream, iov[i].iov_base, iov[i].iov_len);
+    }
+    if (bstream->segment != nullptr) {
+      librmb::RadosUtils::append_to_segment(reinterpret_cast<const char *>(iov[i].iov_base), iov[i].iov_len,
+                                            bstream->segment_size, bstream->segment, bstream->buf);
+    } else {
+      // use unsigned char* for binary data!
+      bstream->buf->append(reinterpret_cast<const unsigned char *>(iov[i].iov_base), iov[i].iov_len);
+    }
     stream->ostream.offset += iov[i].iov_len;
     ret += iov[i].iov_len;
   }
 
-  if (bstream->execute_write_ops) {
-    librados::ObjectWriteOperation write_op;
-    write_op.write(val, *bstream->buf);
-
-    bstream->rados_storage->aio_operate(&bstream->rados_storage->get_io_ctx(), *bstream->rados_mail->get_oid(),
-                                        bstream->rados_mail->get_completion(), &write_op);
+  if (bstream->execute_write_ops && bstream->buf->length() >= bstream->chunk_size) {
+    o_stream_bufferlist_write_chunk(bstream);
+  }
+  if (bstream->write_failed) {
+    io_stream_set_error(&stream->iostream, "chunked write of %s failed", bstream->rados_mail->get_oid()->c_str());
+    stream->ostream.stream_errno = EIO;
+    return -1;
   }
   return ret;
 }
 
+int o_stream_bufferlist_finish_writes(struct ostream *output) {
+  struct bufferlist_ostream *bstream = (struct bufferlist_ostream *)output->real_stream;
+  if (!bstream->execute_write_ops) {
+    return 0;
+  }
+  o_stream_bufferlist_write_chunk(bstream);
+  while (!bstream->inflight->empty()) {
+    o_stream_bufferlist_wait_oldest(bstream);
+  }
+  return bstream->write_failed ? -1 : 0;
+}
+
+void o_stream_bufferlist_set_body_hash(struct ostream *output) {
+  struct bufferlist_ostream *bstream = (struct bufferlist_ostream *)output->real_stream;
+  i_assert(output->offset == 0);
+  if (bstream->body_hash == nullptr) {
+    bstream->body_hash = i_new(struct sha256_ctx, 1);
+    sha256_init(bstream->body_hash);
+  }
+}
+
+bool o_stream_bufferlist_get_body_hash(struct ostream *output, uoff_t *hdr_size_r,
+                                       unsigned char digest_r[SHA256_RESULTLEN]) {
+  struct bufferlist_ostream *bstream = (struct bufferlist_ostream *)output->real_stream;
+  if (bstream->body_hash == nullptr || !bstream->hdr_found) {
+    return false;
+  }
+  sha256_result(bstream->body_hash, digest_r);
+  *hdr_size_r = bstream->hdr_size;
+  return true;
+}
+
+void o_stream_bufferlist_set_write_chunks(struct ostream *output, size_t chunk_size, unsigned int max_inflight) {
+  struct bufferlist_ostream *bstream = (struct bufferlist_ostream *)output->real_stream;
+  bstream->chunk_size = chunk_size;
+  bstream->max_inflight = max_inflight > 0 ? max_inflight : 1;
+}
+
 struct ostream *o_stream_create_bufferlist(librmb::RadosMail *rados_mail, librmb::RadosStorage *rados_storage,
-                                           bool execute_write_ops) {
+                                           bool execute_write_ops, size_t segment_size) {
   struct bufferlist_ostream *bstream;
   struct ostream *output;
 
@@ -98,10 +223,17 @@ struct ostream *o_stream_create_bufferlist(librmb::RadosMail *rados_mail, librmb
   bstream->rados_storage = rados_storage;
   bstream->rados_mail = rados_mail;
   bstream->execute_write_ops = execute_write_ops;
-  if (execute_write_ops) {
-    rados_mail->set_completion(librados::Rados::aio_create_completion());
-    rados_mail->set_active_op(1);
-  }
+  bstream->segment_size = segment_size;
+  bstream->segment = segment_size > 0 ? new librados::bufferptr() : nullptr;
+  bstream->chunk_offset = 0;
+  bstream->chunk_size = 0;
+  bstream->max_inflight = RBOX_WRITE_CHUNKS_MAX_INFLIGHT;
+  bstream->inflight = execute_write_ops ? new std::deque<librados::AioCompletion *>() : nullptr;
+  bstream->write_failed = false;
+  bstream->body_hash = nullptr;
+  bstream->hdr_state = 1;
+  bstream->hdr_found = false;
+  bstream->hdr_size = 0;
   output = o_stream_create(&bstream->ostream, NULL, -1);
   o_stream_set_name(output, "(buffer)");
   return output;
@@ -15,12 +15,28 @@
 extern "C" {
 #include "lib.h"
 #include "ostream-private.h"
+#include "sha2.h"
 }
 #include <rados/librados.hpp>
 #include "rados-storage.h"
 #include "rados-mail.h"
 
+/* default max. number of chunk writes in flight per mail */
+#define RBOX_WRITE_CHUNKS_MAX_INFLIGHT 8
+
+/* segment_size > 0: copy the data once into page aligned segments of segment_size bytes,
+   which are referenced by the mail buffer and the write operations */
 struct ostream *o_stream_create_bufferlist(librmb::RadosMail *rados_mail, librmb::RadosStorage *rados_storage,
-                                           bool execute_write_ops);
+                                           bool execute_write_ops, size_t segment_size);
+/* execute_write_ops: write the mail in chunks of chunk_size bytes (0 = every sendv)
+   with at most max_inflight writes in flight */
+void o_stream_bufferlist_set_write_chunks(struct ostream *output, size_t chunk_size, unsigned int max_inflight);
+/* writes the last chunk and waits for all chunk writes, returns -1 if a write failed */
+int o_stream_bufferlist_finish_writes(struct ostream *output);
+/* hash the body of the mail while it is written (single instance storage) */
+void o_stream_bufferlist_set_body_hash(struct ostream *output);
+/* returns false, if the body has not been hashed or the mail has no body */
+bool o_stream_bufferlist_get_body_hash(struct ostream *output, uoff_t *hdr_size_r,
+                                       unsigned char digest_r[SHA256_RESULTLEN]);
 int o_stream_buffer_write_at(struct ostream_private *stream, const void *data, size_t size, uoff_t offset);
 #endif /* SRC_STORAGE_RBOX_OSTREAM_BUFFERLIST_H_ */
@@ -30,6 +30,7 @@ extern "C" {
 #include "rbox-sync.h"
 #include "rbox-copy.h"
 #include "rados-util.h"
+#include "../librmb/rados-packed-segment.h"
 
 const char *SETTINGS_RBOX_UPDATE_IMMUTABLE = "rbox_update_immutable";
 const char *SETTINGS_DEF_UPDATE_IMMUTABLE = "false";
@@ -174,6 +175,57 @@ static void mail_copy_set_failed(struct mail_save_context *ctx, struct mail *mai
   errstr = mail_storage_get_last_error(mail->box->storage, &error);
   mail_storage_set_error(ctx->transaction->box->storage, error, t_strdup_printf("%s (%s)", errstr, func));
 }
+/* a copied mail references the same single instance body object as the source mail.
+ * The reference is added before the copy, so that the body can't be removed together with
+ * the source mail in between. */
+static int copy_mail_sis_reference(struct rbox_storage *r_storage, const std::string &sis_oid, bool add) {
+  librados::IoCtx sis_io_ctx;
+  librmb::RadosUtils::get_sis_io_ctx(&r_storage->s->get_io_ctx(), &sis_io_ctx);
+  return add ? librmb::RadosUtils::sis_add_reference(&sis_io_ctx, sis_oid, nullptr)
+             : librmb::RadosUtils::sis_remove_reference(&sis_io_ctx, sis_oid);
+}
+
+/* copies or moves a mail of the alt storage. A copied stub references the same segment data as the
+ * source stub (rbox_alt_segment_size), a moved stub is referenced with its new namespace. The segment
+ * is pinned, so that it can't be compacted before the reference is in place.
+ * packed_ref_r is set to the segment reference of the stub (empty if the mail is not packed). */
+static int copy_mail_packed(librmb::RadosStorage *rados_storage, std::string &src_oid, const std::string *ns_src,
+                            std::string &dest_oid, const std::string *ns_dest,
+                            std::list<librmb::RadosMetadata> &metadata_update, bool move, std::string *packed_ref_r) {
+  librados::IoCtx src_io_ctx;
+  src_io_ctx.dup(rados_storage->get_io_ctx());
+  src_io_ctx.set_namespace(*ns_src);
+  librados::IoCtx dest_io_ctx;
+  dest_io_ctx.dup(rados_storage->get_io_ctx());
+  dest_io_ctx.set_namespace(*ns_dest);
+
+  std::string packed_ref;
+  int ret = librmb::RadosPackedSegment::pin(&src_io_ctx, src_oid, dest_oid, &packed_ref);
+  if (ret < 0) {
+    return ret;
+  }
+  if (!packed_ref.empty()) {
+    // the entry of a moved stub is replaced
+    ret = librmb::RadosPackedSegment::add_reference(&dest_io_ctx, packed_ref, dest_oid);
+  }
+  if (ret >= 0) {
+    ret = move ? rados_storage->move(src_oid, ns_src->c_str(), dest_oid, ns_dest->c_str(), metadata_update, true)
+               : rados_storage->copy(src_oid, ns_src->c_str(), dest_oid, ns_dest->c_str(), metadata_update);
+    if (ret < 0 && !packed_ref.empty()) {
+      if (move) {
+        (void)librmb::RadosPackedSegment::add_reference(&src_io_ctx, packed_ref, src_oid);
+      } else {
+        (void)librmb::RadosPackedSegment::remove_reference(&dest_io_ctx, packed_ref, dest_oid);
+      }
+    }
+  }
+  if (!packed_ref.empty()) {
+    (void)librmb::RadosPackedSegment::unpin(&src_io_ctx, packed_ref, dest_oid);
+  }
+  *packed_ref_r = packed_ref;
+  return ret;
+}
+
 static int copy_mail(struct mail_save_context *ctx, librmb::RadosStorage *rados_storage, struct rbox_mail *rmail,
                      const std::string *ns_src, const std::string *ns_dest) {
   struct rbox_save_context *r_ctx = (struct rbox_save_context *)ctx;
@@ -188,7 +240,29 @@ static int copy_mail(struct mail_save_context *ctx, librmb::RadosStorage *rados_
 
   set_mailbox_metadata(ctx, &metadata_update);
 
-  int ret_val = rados_storage->copy(src_oid, ns_src->c_str(), dest_oid, ns_dest->c_str(), metadata_update);
+  // the source may reference a single instance body, even if rbox_mail_dedup_min_size is disabled by now.
+  std::string sis_oid;
+  int ret_val = rados_storage->get_sis_reference(src_oid, *ns_src, &sis_oid);
+  if (ret_val >= 0 && !sis_oid.empty()) {
+    ret_val = copy_mail_sis_reference(r_storage, sis_oid, true);
+  }
+  std::string packed_ref;
+  if (ret_val >= 0) {
+    // copies referencing single instance bodies or alt segments are done synchronously.
+    if (rados_storage == r_storage->alt) {
+      ret_val = copy_mail_packed(rados_storage, src_oid, ns_src, dest_oid, ns_dest, metadata_update, false,
+                                 &packed_ref);
+    } else if (sis_oid.empty()) {
+      // completed by rbox_transaction_save_commit_pre
+      ret_val = rados_storage->copy_async(&r_ctx->copy_ops, src_oid, ns_src->c_str(), dest_oid, ns_dest->c_str(),
+                                          metadata_update, false, r_storage->config->get_save_max_inflight());
+    } else {
+      ret_val = rados_storage->copy(src_oid, ns_src->c_str(), dest_oid, ns_dest->c_str(), metadata_update);
+    }
+    if (ret_val < 0 && !sis_oid.empty()) {
+      (void)copy_mail_sis_reference(r_storage, sis_oid, false);
+    }
+  }
   if (ret_val < 0) {
     if (ret_val == -ENOENT) {
       i_warning(
@@ -212,6 +286,13 @@ static int copy_mail(struct mail_save_context *ctx, librmb::RadosStorage *rados_
   }
 
   rbox_add_to_index(ctx);
+  // released again, if the transaction is rolled back
+  if (!sis_oid.empty()) {
+    r_ctx->sis_refs[r_ctx->rados_mail] = sis_oid;
+  }
+  if (rados_storage == r_storage->alt) {
+    r_ctx->alt_copies[r_ctx->rados_mail] = packed_ref;
+  }
   if (r_storage->save_log->is_open()) {
     r_storage->save_log->append(librmb::RadosSaveLogEntry(dest_oid, *ns_dest, rados_storage->get_pool_name(),
                                                           librmb::RadosSaveLogEntry::op_cpy()));
@@ -237,8 +318,17 @@ static int move_mail(struct mail_save_context *ctx, librmb::RadosStorage *rados_
   set_mailbox_metadata(ctx, &metadata_update);
 
   bool delete_source = true;
-  int ret_val =
-      rados_storage->move(src_oid, ns_src->c_str(), dest_oid, ns_dest->c_str(), metadata_update, delete_source);
+  int ret_val;
+  if (rados_storage == r_storage->alt && *ns_src != *ns_dest) {
+    // the segment entry of a packed stub names the namespace of the stub
+    std::string packed_ref;
+    ret_val = copy_mail_packed(rados_storage, src_oid, ns_src, dest_oid, ns_dest, metadata_update, delete_source,
+                               &packed_ref);
+  } else {
+    // completed by rbox_transaction_save_commit_pre
+    ret_val = rados_storage->copy_async(&r_ctx->copy_ops, src_oid, ns_src->c_str(), dest_oid, ns_dest->c_str(),
+                                        metadata_update, delete_source, r_storage->config->get_save_max_inflight());
+  }
   if (ret_val < 0) {
     if (ret_val == -ENOENT) {
       i_warning(
@@ -261,10 +351,9 @@ static int move_mail(struct mail_save_context *ctx, librmb::RadosStorage *rados_
   }
 
   // set src as expunged
-  struct expunged_item *item = p_new(default_pool, struct expunged_item, 1);
-  i_zero(item);
-  guid_128_from_string(src_oid.c_str(), item->oid);
-  array_append(&rbox->moved_items, &item, 1);
+  guid_128_t moved_oid;
+  guid_128_from_string(src_oid.c_str(), moved_oid);
+  rbox_moved_items_add(rbox, moved_oid);
 
   rbox_move_index(ctx, mail);
   if (r_storage->save_log->is_open()) {
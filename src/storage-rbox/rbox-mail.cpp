@@ -17,8 +17,11 @@
 #include <sys/resource.h>
 #include <sys/time.h>
 
+#include <algorithm>
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include <iostream>
 
 extern "C" {
@@ -27,6 +30,7 @@ extern "C" {
 
 #include "istream.h"
 #include "ostream.h"
+#include "istream-concat.h"
 #include "index-mail.h"
 #include "debug-helper.h"
 #include "limits.h"
@@ -40,12 +44,20 @@ extern "C" {
 #include "rbox-storage.hpp"
 #include "../librmb/rados-storage-impl.h"
 #include "istream-bufferlist.h"
+#include "istream-rados.h"
 #include "rbox-mail.h"
 #include "rados-util.h"
+#include "../librmb/rados-compression.h"
+#include "../librmb/rados-packed-segment.h"
 
 using librmb::RadosMail;
 using librmb::rbox_metadata_key;
 
+/* fetch fields, which are read from the mail object metadata in case they are not in index or cache */
+#define RBOX_METADATA_FETCH_FIELDS                                                                             \
+  (MAIL_FETCH_GUID | MAIL_FETCH_UIDL_BACKEND | MAIL_FETCH_POP3_ORDER | MAIL_FETCH_RECEIVED_DATE | \
+   MAIL_FETCH_VIRTUAL_SIZE | MAIL_FETCH_PHYSICAL_SIZE)
+
 void rbox_mail_set_expunged(struct rbox_mail *mail) {
   FUNC_START();
   // only set mail to expunge. see #222 rbox_set_expunge => index rebuild!
@@ -93,11 +105,164 @@ struct mail *rbox_mail_alloc(struct mailbox_transaction_context *t, enum mail_fe
 #else
   index_mail_init(&mail->imail, t, wanted_fields, wanted_headers, pool, NULL);
 #endif
+  mail->wanted_fields = wanted_fields;
 
   FUNC_END();
   return &mail->imail.mail.mail;
 }
 
+void rbox_metadata_prefetch_free(struct rbox_mailbox *rbox) {
+  if (rbox->metadata_prefetch == NULL) {
+    return;
+  }
+  struct rbox_storage *r_storage = (struct rbox_storage *)rbox->box.storage;
+  for (std::map<std::string, RadosMail *>::iterator it = rbox->metadata_prefetch->mails.begin();
+       it != rbox->metadata_prefetch->mails.end(); ++it) {
+    r_storage->s->free_rados_mail(it->second);
+  }
+  delete rbox->metadata_prefetch;
+  rbox->metadata_prefetch = NULL;
+}
+
+void rbox_metadata_prefetch_transaction_end(struct mailbox_transaction_context *t) {
+  struct rbox_mailbox *rbox = (struct rbox_mailbox *)t->box;
+  if (rbox->metadata_prefetch != NULL && rbox->metadata_prefetch->trans == t) {
+    rbox_metadata_prefetch_free(rbox);
+  }
+}
+
+void rbox_metadata_prefetch_forget(struct rbox_mailbox *rbox, const std::string &oid) {
+  if (rbox->metadata_prefetch == NULL) {
+    return;
+  }
+  std::map<std::string, RadosMail *>::iterator it = rbox->metadata_prefetch->mails.find(oid);
+  if (it == rbox->metadata_prefetch->mails.end()) {
+    return;
+  }
+  struct rbox_storage *r_storage = (struct rbox_storage *)rbox->box.storage;
+  r_storage->s->free_rados_mail(it->second);
+  rbox->metadata_prefetch->mails.erase(it);
+}
+
+/* returns the prefetch state of the mail's transaction. The state of another
+ * transaction is dropped, the metadata may have changed in between. */
+static struct rbox_metadata_prefetch *rbox_mail_metadata_prefetch_get(struct rbox_mail *rmail) {
+  struct mail *mail = (struct mail *)rmail;
+  struct rbox_mailbox *rbox = (struct rbox_mailbox *)mail->box;
+
+  if (rbox->metadata_prefetch != NULL && rbox->metadata_prefetch->trans != mail->transaction) {
+    rbox_metadata_prefetch_free(rbox);
+  }
+  if (rbox->metadata_prefetch == NULL) {
+    rbox->metadata_prefetch = new rbox_metadata_prefetch();
+    rbox->metadata_prefetch->trans = mail->transaction;
+    rbox->metadata_prefetch->last_seq = 0;
+    rbox->metadata_prefetch->lookahead = 1;
+  }
+  return rbox->metadata_prefetch;
+}
+
+/* moves the metadata of a previous batch to the mail, unless the metadata of
+ * the mail is already loaded (the prefetched copy may be older).
+ * @return true if the metadata has been taken from the batch */
+static bool rbox_mail_metadata_prefetch_take(struct rbox_mail *rmail, struct rbox_metadata_prefetch *prefetch) {
+  struct mail *mail = (struct mail *)rmail;
+  struct rbox_storage *r_storage = (struct rbox_storage *)mail->box->storage;
+
+  std::map<std::string, RadosMail *>::iterator it = prefetch->mails.find(*rmail->rados_mail->get_oid());
+  if (it == prefetch->mails.end()) {
+    return false;
+  }
+  RadosMail *prefetched = it->second;
+  prefetch->mails.erase(it);
+  if (!rmail->rados_mail->get_metadata()->empty()) {
+    r_storage->s->free_rados_mail(prefetched);
+    return false;
+  }
+
+  rmail->rados_mail->get_metadata()->swap(*prefetched->get_metadata());
+  rmail->rados_mail->get_extended_metadata()->swap(*prefetched->get_extended_metadata());
+  r_storage->s->free_rados_mail(prefetched);
+  return true;
+}
+
+static bool rbox_mail_is_metadata_cached(struct mail *mail, uint32_t seq, enum rbox_metadata_key key) {
+  struct index_mailbox_context *ibox =
+      reinterpret_cast<index_mailbox_context *>(RBOX_INDEX_STORAGE_CONTEXT(mail->box));
+  enum index_cache_field cache_field;
+
+  switch (key) {
+    case rbox_metadata_key::RBOX_METADATA_GUID:
+      cache_field = MAIL_CACHE_GUID;
+      break;
+    case rbox_metadata_key::RBOX_METADATA_POP3_UIDL:
+      cache_field = MAIL_CACHE_POP3_UIDL;
+      break;
+    case rbox_metadata_key::RBOX_METADATA_POP3_ORDER:
+      cache_field = MAIL_CACHE_POP3_ORDER;
+      break;
+    default:
+      return false;
+  }
+  return mail_cache_field_exists(mail->transaction->cache_view, seq, ibox->cache_fields[cache_field].idx) > 0;
+}
+
+/* loads the metadata of the mail together with the metadata of the following
+ * mails of the transaction view (up to lookahead mails), which are stored in
+ * the same pool and do not have the requested field cached. */
+static int rbox_mail_metadata_load_batch(struct rbox_mail *rmail, bool alt_storage, enum rbox_metadata_key key,
+                                         struct rbox_metadata_prefetch *prefetch) {
+  struct mail *mail = (struct mail *)rmail;
+  struct rbox_mailbox *rbox = (struct rbox_mailbox *)mail->box;
+  struct rbox_storage *r_storage = (struct rbox_storage *)mail->box->storage;
+  bool alt_pool_valid = is_alternate_pool_valid(mail->box);
+
+  // the mails of the previous batch, which have not been accessed, are not accessed anymore
+  for (std::map<std::string, RadosMail *>::iterator it = prefetch->mails.begin(); it != prefetch->mails.end(); ++it) {
+    r_storage->s->free_rados_mail(it->second);
+  }
+  prefetch->mails.clear();
+
+  std::vector<RadosMail *> mails;
+  mails.push_back(rmail->rados_mail);
+
+  uint32_t messages_count = mail_index_view_get_messages_count(mail->transaction->view);
+  for (uint32_t seq = mail->seq + 1; seq <= messages_count && mails.size() < prefetch->lookahead; seq++) {
+    const struct mail_index_record *rec = mail_index_lookup(mail->transaction->view, seq);
+    bool alt = is_alternate_storage_set(rec->flags) && alt_pool_valid;
+    if (alt != alt_storage || rbox_mail_is_metadata_cached(mail, seq, key)) {
+      continue;
+    }
+    const void *rec_data = NULL;
+    mail_index_lookup_ext(mail->transaction->view, seq, rbox->ext_id, &rec_data, NULL);
+    if (rec_data == NULL) {
+      continue;
+    }
+    const struct obox_mail_index_record *obox_rec = static_cast<const struct obox_mail_index_record *>(rec_data);
+    RadosMail *next = r_storage->s->alloc_rados_mail();
+    next->set_oid(guid_128_to_string(obox_rec->oid));
+    mails.push_back(next);
+  }
+
+  (void)r_storage->ms->get_storage()->load_metadata_batch(mails);
+
+  for (size_t i = 1; i < mails.size(); i++) {
+    if (mails[i]->is_valid()) {
+      prefetch->mails[*mails[i]->get_oid()] = mails[i];
+    } else {
+      // will be loaded (and reported) again, when it is accessed
+      r_storage->s->free_rados_mail(mails[i]);
+    }
+  }
+
+  if (!rmail->rados_mail->is_valid()) {
+    // load it again to get the error code of this mail.
+    rmail->rados_mail->set_valid(true);
+    return r_storage->ms->get_storage()->load_metadata(rmail->rados_mail);
+  }
+  return 0;
+}
+
 static int rbox_mail_metadata_get(struct rbox_mail *rmail, enum rbox_metadata_key key, char **value_r) {
   FUNC_START();
   struct mail *mail = (struct mail *)rmail;
@@ -132,7 +297,28 @@ static int rbox_mail_metadata_get(struct rbox_mail *rmail, enum rbox_metadata_ke
     }
   }
   
-  int ret_load_metadata = r_storage->ms->get_storage()->load_metadata(rmail->rados_mail);
+  int ret_load_metadata = 0;
+  size_t batch_size = r_storage->config->get_metadata_batch_size();
+  if ((rmail->wanted_fields & RBOX_METADATA_FETCH_FIELDS) != 0 && batch_size > 1) {
+    struct rbox_metadata_prefetch *prefetch = rbox_mail_metadata_prefetch_get(rmail);
+    // the lookahead grows while the search or fetch accesses the mails in sequence,
+    // sparse results load the metadata of the accessed mails only.
+    bool in_sequence = prefetch->last_seq > 0 && mail->seq == prefetch->last_seq + 1;
+    if (!in_sequence && mail->seq != prefetch->last_seq) {
+      prefetch->lookahead = 1;
+    }
+    prefetch->last_seq = mail->seq;
+    if (!rbox_mail_metadata_prefetch_take(rmail, prefetch)) {
+      if (rmail->rados_mail->get_metadata()->empty() && in_sequence) {
+        prefetch->lookahead = std::min(prefetch->lookahead * 2, batch_size);
+        ret_load_metadata = rbox_mail_metadata_load_batch(rmail, alt_storage, key, prefetch);
+      } else {
+        ret_load_metadata = r_storage->ms->get_storage()->load_metadata(rmail->rados_mail);
+      }
+    }
+  } else {
+    ret_load_metadata = r_storage->ms->get_storage()->load_metadata(rmail->rados_mail);
+  }
   if (ret_load_metadata < 0) {
     std::string metadata_key = librmb::rbox_metadata_key_to_char(key);
     if (ret_load_metadata == -ENOENT) {
@@ -399,12 +585,32 @@ static int rbox_mail_get_physical_size(struct mail *_mail, uoff_t *size_r) {
   return ret;
 }
 
-static int get_mail_stream(struct rbox_mail *mail, librados::bufferlist *buffer, const size_t physical_size,
-                           struct istream **stream_r) {
+/* creates the stream of the mail. The stream takes the ownership of the buffer and of body_input,
+ * which is the stream of a single instance body (or NULL). */
+static int get_mail_stream(struct rbox_mail *mail, librmb::RadosStorage *rados_storage, librados::bufferlist *buffer,
+                           const size_t physical_size, struct istream *body_input, struct istream **stream_r) {
   struct mail_private *pmail = &mail->imail.mail;
+  struct rbox_storage *r_storage = (struct rbox_storage *)pmail->mail.box->storage;
   int ret = 0;
+  struct istream *input = NULL;
 
-  struct istream *input = i_stream_create_from_bufferlist(buffer, physical_size);
+  if (body_input != NULL) {
+    // the header is stored in the mail object, the body is read on demand from the single instance object.
+    struct istream *inputs[3];
+    inputs[0] = i_stream_create_from_bufferlist(buffer, buffer->length());
+    inputs[1] = body_input;
+    inputs[2] = NULL;
+    input = i_stream_create_concat(inputs);
+    i_stream_unref(&inputs[0]);
+    i_stream_unref(&inputs[1]);
+  } else if (buffer->length() < physical_size) {
+    // only the first chunk (or the header) has been read, the rest is read on demand.
+    int read_chunk_size = r_storage->config->get_read_chunk_size();
+    size_t chunk_size = read_chunk_size > 0 ? read_chunk_size : physical_size - buffer->length();
+    input = i_stream_create_rados(rados_storage, *mail->rados_mail->get_oid(), buffer, physical_size, chunk_size);
+  } else {
+    input = i_stream_create_from_bufferlist(buffer, physical_size);
+  }
   i_stream_seek(input, 0);
 
   *stream_r = input;
@@ -418,7 +624,353 @@ static int get_mail_stream(struct rbox_mail *mail, librados::bufferlist *buffer,
   return ret;
 }
 
-static int rbox_mail_get_stream(struct mail *_mail, bool get_body ATTR_UNUSED, struct message_size *hdr_size,
+static int rbox_mail_prepare_read(struct mail *_mail, bool alt_storage, librmb::RadosStorage **rados_storage_r) {
+  struct rbox_mail *rmail = (struct rbox_mail *)_mail;
+
+  if (rbox_open_rados_connection(_mail->box, alt_storage) < 0) {
+    return -1;
+  }
+
+  librmb::RadosStorage *rados_storage = alt_storage ? ((struct rbox_storage *)_mail->box->storage)->alt
+                                                    : ((struct rbox_storage *)_mail->box->storage)->s;
+  if (alt_storage) {
+    rados_storage->set_namespace(rados_storage->get_namespace());
+  }
+
+  /* Pop3 and virtual box needs this. it looks like rbox_index_mail_set_seq is not called. */
+  if (rmail->rados_mail == nullptr) {
+    // make sure that mail_object is initialized,
+    // else create and load guid from index.
+    rmail->rados_mail = rados_storage->alloc_rados_mail();
+    if (rbox_get_index_record(_mail) < 0) {
+      i_error("Error rbox_get_index uid(%d)", _mail->uid);
+      return -1;
+    }
+  }
+  *rados_storage_r = rados_storage;
+  return 0;
+}
+
+/* issues the asynchronous read (data + stat) of the mail object. The mail buffer
+ * is allocated here and has to stay valid until the read op is finished. */
+static int rbox_mail_read_op_start(struct rbox_mail *rmail, librmb::RadosStorage *rados_storage, bool alt_storage) {
+  struct rbox_storage *r_storage = (struct rbox_storage *)rmail->imail.mail.mail.box->storage;
+  struct rbox_mail_read_op *read_op = i_new(struct rbox_mail_read_op, 1);
+  read_op->alt_storage = alt_storage;
+  // with ranged reads enabled only the first chunk (usually containing the header) is read here.
+  int read_chunk_size = r_storage->config->get_read_chunk_size();
+  size_t read_length = read_chunk_size > 0 ? read_chunk_size : INT_MAX;
+
+  // create mail buffer!
+  rmail->rados_mail->set_mail_buffer(new librados::bufferlist());
+
+  read_op->op = new librados::ObjectReadOperation();
+  read_op->op->read(0, read_length, rmail->rados_mail->get_mail_buffer(), &read_op->read_err);
+  read_op->op->stat(&read_op->psize, &read_op->save_date, &read_op->stat_err);
+  // mails without single instance body have no such xattr
+  read_op->sis_ref = new librados::bufferlist();
+  read_op->op->getxattr(RBOX_SIS_XATTR, read_op->sis_ref, &read_op->sis_err);
+  read_op->op->set_op_flags2(librados::OP_FAILOK);
+  // only compressed mails have this xattr
+  read_op->compression = new librados::bufferlist();
+  read_op->op->getxattr(librmb::rbox_metadata_key_to_char(librmb::RBOX_METADATA_COMPRESSION),
+                        read_op->compression, &read_op->compression_err);
+  read_op->op->set_op_flags2(librados::OP_FAILOK);
+  // small mails are stored in the xattr instead of the object data (rbox_mail_inline_max_size)
+  read_op->inline_data = new librados::bufferlist();
+  read_op->op->getxattr(RBOX_INLINE_XATTR, read_op->inline_data, &read_op->inline_err);
+  read_op->op->set_op_flags2(librados::OP_FAILOK);
+  // the data of mails in the packed alt storage is stored in a segment (rbox_alt_segment_size)
+  read_op->packed_ref = new librados::bufferlist();
+  read_op->op->getxattr(RBOX_PACKED_XATTR, read_op->packed_ref, &read_op->packed_err);
+  read_op->op->set_op_flags2(librados::OP_FAILOK);
+
+  read_op->completion = librados::Rados::aio_create_completion();
+  int ret = rados_storage->get_io_ctx().aio_operate(*rmail->rados_mail->get_oid(), read_op->completion, read_op->op,
+                                                    rmail->rados_mail->get_mail_buffer());
+  if (ret < 0) {
+    read_op->completion->release();
+    delete read_op->op;
+    delete read_op->sis_ref;
+    delete read_op->compression;
+    delete read_op->inline_data;
+    delete read_op->packed_ref;
+    i_free(read_op);
+    delete rmail->rados_mail->get_mail_buffer();
+    rmail->rados_mail->set_mail_buffer(nullptr);
+    return ret;
+  }
+  rmail->read_op = read_op;
+  return 0;
+}
+
+/* waits for the pending read op and frees it.
+ * @param[out] sis_oid_r oid of the single instance body object, empty if the mail object holds the body
+ * @param[out] compression_r codec and size of a compressed mail object, empty if the object is not compressed
+ * @param[out] packed_ref_r reference to the segment holding the mail data, empty if the object holds the data
+ * @return the return value of the read op */
+static int rbox_mail_read_op_finish(struct rbox_mail *rmail, uint64_t *psize_r, time_t *save_date_r,
+                                    std::string *sis_oid_r, std::string *compression_r, std::string *packed_ref_r) {
+  struct rbox_mail_read_op *read_op = rmail->read_op;
+
+  read_op->completion->wait_for_complete_and_cb();
+  int ret = read_op->completion->get_return_value();
+  read_op->completion->release();
+  delete read_op->op;
+
+  *psize_r = read_op->psize;
+  *save_date_r = read_op->save_date;
+  if (read_op->sis_err >= 0 && read_op->sis_ref->length() > 0) {
+    *sis_oid_r = read_op->sis_ref->to_str();
+  }
+  delete read_op->sis_ref;
+  if (read_op->compression_err >= 0 && read_op->compression->length() > 0) {
+    // metadata values are saved with trailing '\0'
+    *compression_r = read_op->compression->c_str();
+  }
+  delete read_op->compression;
+  if (ret >= 0 && read_op->inline_err >= 0 && read_op->inline_data->length() > 0) {
+    // the object has no data
+    rmail->rados_mail->get_mail_buffer()->claim_append(*read_op->inline_data);
+    *psize_r = rmail->rados_mail->get_mail_buffer()->length();
+  }
+  delete read_op->inline_data;
+  if (read_op->packed_err >= 0 && read_op->packed_ref->length() > 0) {
+    *packed_ref_r = read_op->packed_ref->to_str();
+  }
+  delete read_op->packed_ref;
+  i_free(rmail->read_op);
+  return ret;
+}
+
+/* reads the rest of the mail object, if only the first chunk has been read (rbox_read_chunk_size) */
+static int rbox_mail_read_object_rest(struct rbox_mail *rmail, librmb::RadosStorage *rados_storage,
+                                      uint64_t psize) {
+  librados::bufferlist *buffer = rmail->rados_mail->get_mail_buffer();
+  if (buffer->length() >= psize) {
+    return 0;
+  }
+  librados::bufferlist rest;
+  int ret = rados_storage->read_mail(*rmail->rados_mail->get_oid(), &rest, buffer->length(), psize - buffer->length());
+  if (ret < 0) {
+    return ret;
+  }
+  buffer->claim_append(rest);
+  return 0;
+}
+
+/* reads the mail data from the segment of the packed alt storage (rbox_alt_segment_size).
+ * @return 0 if the mail buffer holds the mail data, < 0 read error */
+static int rbox_mail_read_packed(struct rbox_mail *rmail, librmb::RadosStorage *rados_storage,
+                                 const std::string &packed_ref, uint64_t *psize_r) {
+  librados::bufferlist *buffer = rmail->rados_mail->get_mail_buffer();
+  int ret = librmb::RadosPackedSegment::read(&rados_storage->get_io_ctx(), packed_ref, buffer);
+  if (ret == -ENOENT) {
+    // the segment has been compacted in between, read the new reference
+    librados::bufferlist new_ref;
+    ret = rados_storage->get_io_ctx().getxattr(*rmail->rados_mail->get_oid(), RBOX_PACKED_XATTR, new_ref);
+    if (ret < 0) {
+      // mail has been expunged in between
+      return ret;
+    }
+    ret = librmb::RadosPackedSegment::read(&rados_storage->get_io_ctx(), new_ref.to_str(), buffer);
+  }
+  if (ret < 0) {
+    i_error("reading packed data %s of mail %s failed: %d", packed_ref.c_str(), rmail->rados_mail->get_oid()->c_str(),
+            ret);
+    // the mail object exists, so do not report the mail as expunged
+    return ret == -ENOENT ? -EIO : ret;
+  }
+  *psize_r = buffer->length();
+  return 0;
+}
+
+/* replaces the compressed mail object data (rbox_compression) with the uncompressed mail.
+ * @return 0 if the mail buffer holds the uncompressed data, < 0 read error */
+static int rbox_mail_read_decompress(struct rbox_mail *rmail, librmb::RadosStorage *rados_storage,
+                                     const std::string &compression, uint64_t *psize_r) {
+  std::string codec;
+  size_t size = 0;
+  if (!librmb::RadosCompression::from_metadata(compression, &codec, &size)) {
+    i_error("invalid compression metadata (%s) of mail %s", compression.c_str(), rmail->rados_mail->get_oid()->c_str());
+    return -EIO;
+  }
+  int ret = rbox_mail_read_object_rest(rmail, rados_storage, *psize_r);
+  if (ret < 0) {
+    return ret;
+  }
+  librados::bufferlist *buffer = rmail->rados_mail->get_mail_buffer();
+  librados::bufferlist data;
+  ret = librmb::RadosCompression::decompress(codec, *buffer, size, &data);
+  if (ret < 0) {
+    i_error("decompressing mail %s (%s) failed: %d", rmail->rados_mail->get_oid()->c_str(), compression.c_str(), ret);
+    // the mail object exists, so do not report the mail as expunged
+    return ret == -ENOENT ? -EIO : ret;
+  }
+  buffer->swap(data);
+  *psize_r = buffer->length();
+  return 0;
+}
+
+/* completes the header, which is stored in the mail object, and creates the stream of the body
+ * in the single instance object (rbox_mail_dedup_min_size). The body is read like a mail object:
+ * the first chunk is read (together with the stat) while the header is completed, the rest
+ * is read on demand with ranged reads (rbox_read_chunk_size).
+ * @param[in,out] psize_r size of the header, size of the mail on return
+ * @param[out] body_r stream of the body
+ * @return 0 on success, < 0 read error */
+static int rbox_mail_read_sis_body(struct rbox_mail *rmail, librmb::RadosStorage *rados_storage,
+                                   const std::string &sis_oid, uint64_t *psize_r, struct istream **body_r) {
+  struct mailbox *box = rmail->imail.mail.mail.box;
+  struct rbox_storage *r_storage = (struct rbox_storage *)box->storage;
+
+  // single instance objects are stored in the primary pool, also for mails in the alt storage.
+  int ret = rbox_open_sis_connection(box);
+  if (ret < 0) {
+    return ret;
+  }
+  int read_chunk_size = r_storage->config->get_read_chunk_size();
+  size_t read_length = read_chunk_size > 0 ? read_chunk_size : INT_MAX;
+
+  librados::bufferlist *first_chunk = new librados::bufferlist();
+  uint64_t body_size = 0;
+  int read_err = 0;
+  int stat_err = 0;
+  librados::ObjectReadOperation op;
+  op.read(0, read_length, first_chunk, &read_err);
+  op.stat(&body_size, NULL, &stat_err);
+  librados::AioCompletion *completion = librados::Rados::aio_create_completion();
+  ret = r_storage->sis->get_io_ctx().aio_operate(sis_oid, completion, &op, first_chunk);
+  if (ret < 0) {
+    completion->release();
+    delete first_chunk;
+    return ret;
+  }
+  int header_ret = rbox_mail_read_object_rest(rmail, rados_storage, *psize_r);
+  // librados writes to the first chunk until the op is complete.
+  completion->wait_for_complete_and_cb();
+  ret = completion->get_return_value();
+  completion->release();
+  if (header_ret < 0) {
+    delete first_chunk;
+    return header_ret;
+  }
+  if (ret < 0) {
+    i_error("reading single instance body %s of mail %s failed: %d", sis_oid.c_str(),
+            rmail->rados_mail->get_oid()->c_str(), ret);
+    delete first_chunk;
+    // the mail object exists, so do not report the mail as expunged
+    return ret == -ENOENT ? -EIO : ret;
+  }
+
+  if (first_chunk->length() >= body_size) {
+    *body_r = i_stream_create_from_bufferlist(first_chunk, body_size);
+  } else {
+    *body_r = i_stream_create_rados(r_storage->sis, sis_oid, first_chunk, body_size,
+                                    read_chunk_size > 0 ? read_chunk_size : body_size - first_chunk->length());
+  }
+  *psize_r = rmail->rados_mail->get_mail_buffer()->length() + body_size;
+  return 0;
+}
+
+/* drops a pending read op, which result is not needed anymore (e.g. mail is closed) */
+static void rbox_mail_read_op_discard(struct rbox_mail *rmail) {
+  uint64_t psize;
+  time_t save_date;
+  std::string sis_oid;
+  std::string compression;
+  std::string packed_ref;
+
+  if (rmail->read_op == NULL) {
+    return;
+  }
+  // librados still writes to the buffer, so we have to wait before we can free it.
+  (void)rbox_mail_read_op_finish(rmail, &psize, &save_date, &sis_oid, &compression, &packed_ref);
+  if (rmail->rados_mail != nullptr) {
+    delete rmail->rados_mail->get_mail_buffer();
+    rmail->rados_mail->set_mail_buffer(nullptr);
+  }
+}
+
+/* called by dovecot's search for the next mail_prefetch_count mails, before they are
+ * returned to the caller. Starts reading the mail, so that the following
+ * rbox_mail_get_stream calls find the data already loaded.
+ * @return FALSE if a read has been started, TRUE if there was nothing to prefetch */
+static bool rbox_mail_prefetch(struct mail *_mail) {
+  FUNC_START();
+  struct rbox_mail *rmail = (struct rbox_mail *)_mail;
+  struct index_mail_data *data = &rmail->imail.data;
+  librmb::RadosStorage *rados_storage = nullptr;
+
+  if (rmail->read_op != NULL) {
+    FUNC_END_RET("ret == false; prefetch already running");
+    return FALSE;
+  }
+  if (data->stream != NULL || (data->access_part & (READ_HDR | READ_BODY)) == 0) {
+    FUNC_END_RET("ret == true; nothing to prefetch");
+    return TRUE;
+  }
+
+  enum mail_flags flags = index_mail_get_flags(_mail);
+  bool alt_storage = is_alternate_storage_set(flags) && is_alternate_pool_valid(_mail->box);
+  if (rbox_mail_prepare_read(_mail, alt_storage, &rados_storage) < 0) {
+    // rbox_mail_get_stream will report the error.
+    FUNC_END_RET("ret == true; prepare read failed");
+    return TRUE;
+  }
+
+  int ret = rbox_mail_read_op_start(rmail, rados_storage, alt_storage);
+  if (ret < 0) {
+    i_warning("prefetch of mail failed return code(%d), oid(%s), alt_storage(%d)", ret,
+              rmail->rados_mail->get_oid()->c_str(), alt_storage);
+    FUNC_END_RET("ret == true; prefetch failed");
+    return TRUE;
+  }
+  FUNC_END();
+  return FALSE;
+}
+
+/* reads the header block saved in the omap of the mail object (rbox_mail_omap_cache) together
+ * with the object stat. The body is read on demand by the rados istream.
+ * @return 1 if the mail buffer holds the header, 0 if there is no saved header or the
+ * mail object is compressed, < 0 read error */
+static int rbox_mail_read_omap_cache_header(struct rbox_mail *rmail, librmb::RadosStorage *rados_storage,
+                                            uint64_t *psize_r, time_t *save_date_r) {
+  std::set<std::string> keys;
+  std::map<std::string, librados::bufferlist> values;
+  int omap_err = 0;
+  int stat_err = 0;
+  int compression_err = 0;
+  librados::bufferlist compression;
+
+  // the buffer of a previous stream is owned (and freed) by that stream.
+  rmail->rados_mail->set_mail_buffer(nullptr);
+  keys.insert(RBOX_MAIL_CACHE_KEY_HEADER);
+  librados::ObjectReadOperation op;
+  op.omap_get_vals_by_keys(keys, &values, &omap_err);
+  op.stat(psize_r, save_date_r, &stat_err);
+  // the body of a compressed mail can't be read by offset
+  op.getxattr(librmb::rbox_metadata_key_to_char(librmb::RBOX_METADATA_COMPRESSION), &compression,
+              &compression_err);
+  op.set_op_flags2(librados::OP_FAILOK);
+  int ret = rados_storage->get_io_ctx().operate(*rmail->rados_mail->get_oid(), &op, NULL);
+  if (ret < 0) {
+    return ret;
+  }
+  if (compression_err >= 0 && compression.length() > 0) {
+    return 0;
+  }
+  std::map<std::string, librados::bufferlist>::iterator it = values.find(RBOX_MAIL_CACHE_KEY_HEADER);
+  if (omap_err < 0 || it == values.end() || it->second.length() == 0 || it->second.length() >= *psize_r) {
+    return 0;
+  }
+  librados::bufferlist *buffer = new librados::bufferlist();
+  buffer->claim_append(it->second);
+  rmail->rados_mail->set_mail_buffer(buffer);
+  return 1;
+}
+
+static int rbox_mail_get_stream(struct mail *_mail, bool get_body, struct message_size *hdr_size,
                                 struct message_size *body_size, struct istream **stream_r) {
   FUNC_START();
   struct rbox_mail *rmail = (struct rbox_mail *)_mail;
@@ -427,50 +979,53 @@ static int rbox_mail_get_stream(struct mail *_mail, bool get_body ATTR_UNUSED, s
   int ret = -1;
   enum mail_flags flags = index_mail_get_flags(_mail);
   bool alt_storage = is_alternate_storage_set(flags) && is_alternate_pool_valid(_mail->box);
-  
+
   if (data->stream == NULL) {
-    if (rbox_open_rados_connection(_mail->box, alt_storage) < 0) {
+    librmb::RadosStorage *rados_storage = nullptr;
+    if (rbox_mail_prepare_read(_mail, alt_storage, &rados_storage) < 0) {
       FUNC_END_RET("ret == -1;  connection to rados failed");
       return -1;
     }
-    
-    librmb::RadosStorage *rados_storage = alt_storage ? ((struct rbox_storage *)_mail->box->storage)->alt
-                                                      : ((struct rbox_storage *)_mail->box->storage)->s;
-    if (alt_storage) {
-      rados_storage->set_namespace(rados_storage->get_namespace());
-    }
 
-    /* Pop3 and virtual box needs this. it looks like rbox_index_mail_set_seq is not called. */
-    if (rmail->rados_mail == nullptr) {
-      // make sure that mail_object is initialized,
-      // else create and load guid from index.
-      rmail->rados_mail = rados_storage->alloc_rados_mail();
-      if (rbox_get_index_record(_mail) < 0) {
-        i_error("Error rbox_get_index uid(%d)", _mail->uid);
-        FUNC_END();
-        return -1;
-      }
+    if (rmail->read_op != NULL && rmail->read_op->alt_storage != alt_storage) {
+      // mail has been moved since prefetch, read it again from the right pool
+      rbox_mail_read_op_discard(rmail);
     }
-    // create mail buffer!
-    rmail->rados_mail->set_mail_buffer(new librados::bufferlist());
-
-    uint64_t psize;
-    time_t save_date;
 
-    int stat_err = 0;
-    int read_err = 0;
-
-    librados::ObjectReadOperation *read_mail = new librados::ObjectReadOperation();
-    read_mail->read(0, INT_MAX, rmail->rados_mail->get_mail_buffer(), &read_err);
-    read_mail->stat(&psize, &save_date, &stat_err);
+    uint64_t psize = 0;
+    time_t save_date = 0;
+    int header_cached = 0;
+    std::string sis_oid;
+    struct istream *body_input = NULL;
+    if (!get_body && rmail->read_op == NULL &&
+        ((struct rbox_storage *)_mail->box->storage)->config->is_mail_omap_cache()) {
+      header_cached = rbox_mail_read_omap_cache_header(rmail, rados_storage, &psize, &save_date);
+      ret = header_cached < 0 ? header_cached : 0;
+    }
 
-    librados::AioCompletion *completion = librados::Rados::aio_create_completion();
-    ret = rados_storage->get_io_ctx().aio_operate(*rmail->rados_mail->get_oid(), completion, read_mail,
-                                                  rmail->rados_mail->get_mail_buffer());
-    completion->wait_for_complete_and_cb();
-    ret = completion->get_return_value();
-    completion->release();
-    delete read_mail;
+    if (header_cached == 0) {
+      if (rmail->read_op == NULL) {
+        ret = rbox_mail_read_op_start(rmail, rados_storage, alt_storage);
+        if (ret < 0) {
+          i_error("reading mail return code(%d), oid(%s),namespace(%s), alt_storage(%d)", ret,
+                  rmail->rados_mail->get_oid()->c_str(), rados_storage->get_namespace().c_str(), alt_storage);
+          FUNC_END_RET("ret == -1");
+          return -1;
+        }
+      }
+      std::string compression;
+      std::string packed_ref;
+      ret = rbox_mail_read_op_finish(rmail, &psize, &save_date, &sis_oid, &compression, &packed_ref);
+      if (ret >= 0 && !packed_ref.empty()) {
+        ret = rbox_mail_read_packed(rmail, rados_storage, packed_ref, &psize);
+      }
+      if (ret >= 0 && !compression.empty()) {
+        ret = rbox_mail_read_decompress(rmail, rados_storage, compression, &psize);
+      }
+      if (ret >= 0 && !sis_oid.empty()) {
+        ret = rbox_mail_read_sis_body(rmail, rados_storage, sis_oid, &psize, &body_input);
+      }
+    }
 
     if (ret < 0) {
       if (ret == -ENOENT) {
@@ -508,12 +1063,17 @@ static int rbox_mail_get_stream(struct mail *_mail, bool get_body ATTR_UNUSED, s
               rmail->rados_mail->get_oid()->c_str(), rados_storage->get_namespace().c_str(), alt_storage);
       FUNC_END_RET("ret == -1");
       delete rmail->rados_mail->get_mail_buffer();
+      if (body_input != NULL) {
+        i_stream_unref(&body_input);
+      }
       return -1;
     }
 
-    if (get_mail_stream(rmail, rmail->rados_mail->get_mail_buffer(), physical_size, &input) < 0) {
+    if (get_mail_stream(rmail, rados_storage, rmail->rados_mail->get_mail_buffer(), physical_size, body_input,
+                        &input) < 0) {
+      // buffer has been freed together with the stream.
+      rmail->rados_mail->set_mail_buffer(nullptr);
       FUNC_END_RET("ret == -1");
-      delete rmail->rados_mail->get_mail_buffer();
       return -1;
     }
 
@@ -616,6 +1176,59 @@ static int rbox_get_cached_metadata(struct rbox_mail *mail, enum rbox_metadata_k
   return 0;
 }
 
+/* ENVELOPE and BODYSTRUCTURE are kept in the omap of the mail object (rbox_mail_omap_cache), so that
+ * a missing dovecot cache (new index, rebuild, cache decisions) does not require to parse the mail again.
+ * Values computed by dovecot are written back to the mail object. */
+static int rbox_mail_get_omap_cached(struct mail *_mail, enum mail_fetch_field field,
+                                     enum index_cache_field cache_field, const char *key, const char **value_r) {
+  struct rbox_mail *rmail = (struct rbox_mail *)_mail;
+  struct index_mail *imail = &rmail->imail;
+  struct index_mailbox_context *ibox =
+      reinterpret_cast<index_mailbox_context *>(RBOX_INDEX_STORAGE_CONTEXT(_mail->box));
+  unsigned int cache_idx = ibox->cache_fields[cache_field].idx;
+
+  if (mail_cache_field_exists(_mail->transaction->cache_view, _mail->seq, cache_idx) > 0) {
+    return index_mail_get_special(_mail, field, value_r);
+  }
+
+  enum mail_flags flags = index_mail_get_flags(_mail);
+  bool alt_storage = is_alternate_storage_set(flags) && is_alternate_pool_valid(_mail->box);
+  librmb::RadosStorage *rados_storage = nullptr;
+  if (rbox_mail_prepare_read(_mail, alt_storage, &rados_storage) < 0) {
+    return -1;
+  }
+
+  std::set<std::string> keys;
+  std::map<std::string, librados::bufferlist> values;
+  keys.insert(key);
+  int ret = rados_storage->get_io_ctx().omap_get_vals_by_keys(*rmail->rados_mail->get_oid(), keys, &values);
+  std::map<std::string, librados::bufferlist>::iterator it = values.find(key);
+  if (ret >= 0 && it != values.end() && it->second.length() > 0) {
+    *value_r = p_strndup(imail->mail.data_pool, it->second.c_str(), it->second.length());
+    index_mail_cache_add_idx(imail, cache_idx, *value_r, strlen(*value_r) + 1);
+    return 0;
+  }
+
+  if (index_mail_get_special(_mail, field, value_r) < 0) {
+    return -1;
+  }
+  if (ret >= 0 && *value_r != NULL && **value_r != '\0') {
+    // fire and forget, the value is just a cache.
+    std::map<std::string, librados::bufferlist> cache;
+    cache[key].append(*value_r);
+    librados::ObjectWriteOperation write_op;
+    // never recreate an expunged mail.
+    write_op.assert_exists();
+    write_op.omap_set(cache);
+    librados::AioCompletion *completion = librados::Rados::aio_create_completion();
+    if (rados_storage->get_io_ctx().aio_operate(*rmail->rados_mail->get_oid(), completion, &write_op) < 0) {
+      i_warning("unable to cache %s for oid(%s)", key, rmail->rados_mail->get_oid()->c_str());
+    }
+    completion->release();
+  }
+  return 0;
+}
+
 static int rbox_mail_get_special(struct mail *_mail, enum mail_fetch_field field, const char **value_r) {
   struct rbox_mail *mail = (struct rbox_mail *)_mail;
   struct rbox_mailbox *mbox = (struct rbox_mailbox *)_mail->box;
@@ -667,6 +1280,18 @@ static int rbox_mail_get_special(struct mail *_mail, enum mail_fetch_field field
 #endif
       return rbox_get_cached_metadata(mail, rbox_metadata_key::RBOX_METADATA_POP3_ORDER, MAIL_CACHE_POP3_ORDER,
                                       value_r);
+    case MAIL_FETCH_IMAP_BODYSTRUCTURE:
+      if (((struct rbox_storage *)_mail->box->storage)->config->is_mail_omap_cache()) {
+        return rbox_mail_get_omap_cached(_mail, field, MAIL_CACHE_IMAP_BODYSTRUCTURE, RBOX_MAIL_CACHE_KEY_BODYSTRUCTURE,
+                                         value_r);
+      }
+      break;
+    case MAIL_FETCH_IMAP_ENVELOPE:
+      if (((struct rbox_storage *)_mail->box->storage)->config->is_mail_omap_cache()) {
+        return rbox_mail_get_omap_cached(_mail, field, MAIL_CACHE_IMAP_ENVELOPE, RBOX_MAIL_CACHE_KEY_ENVELOPE,
+                                         value_r);
+      }
+      break;
 
     case MAIL_FETCH_FLAGS:
     // although it is possible to save the flags as xattr. we currently load them directly
@@ -682,8 +1307,6 @@ static int rbox_mail_get_special(struct mail *_mail, enum mail_fetch_field field
     case MAIL_FETCH_NUL_STATE:
     case MAIL_FETCH_STREAM_BINARY:
     case MAIL_FETCH_IMAP_BODY:
-    case MAIL_FETCH_IMAP_BODYSTRUCTURE:
-    case MAIL_FETCH_IMAP_ENVELOPE:
     case MAIL_FETCH_FROM_ENVELOPE:
     case MAIL_FETCH_HEADER_MD5:
     case MAIL_FETCH_STORAGE_ID:
@@ -702,6 +1325,8 @@ static void rbox_mail_close(struct mail *_mail) {
   struct rbox_mail *rmail_ = (struct rbox_mail *)_mail;
   struct rbox_storage *r_storage = (struct rbox_storage *)_mail->box->storage;
 
+  rbox_mail_read_op_discard(rmail_);
+
   if (rmail_->rados_mail != nullptr) {
     r_storage->s->free_rados_mail(rmail_->rados_mail);
     rmail_->rados_mail = nullptr;
@@ -731,7 +1356,7 @@ struct mail_vfuncs rbox_mail_vfuncs = {rbox_mail_close,
                                        rbox_index_mail_set_seq,
                                        index_mail_set_uid,
                                        index_mail_set_uid_cache_updates,
-                                       index_mail_prefetch,
+                                       rbox_mail_prefetch,
                                        index_mail_precache,
                                        index_mail_add_temp_wanted_fields,
 
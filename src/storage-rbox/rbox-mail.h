@@ -13,9 +13,39 @@
 #define SRC_STORAGE_RBOX_RBOX_MAIL_H_
 
 #include "index-mail.h"
+#include <map>
+#include <string>
 #include <rados/librados.hpp>
 #include "../librmb/rados-mail.h"
 
+struct rbox_mailbox;
+
+/**
+ * @brief: state of an asynchronous mail read (read + stat), started
+ * by rbox_mail_prefetch and consumed by rbox_mail_get_stream.
+ */
+struct rbox_mail_read_op {
+  librados::AioCompletion *completion;
+  librados::ObjectReadOperation *op;
+  uint64_t psize;
+  time_t save_date;
+  int read_err;
+  int stat_err;
+  /** oid of the single instance body object (RBOX_SIS_XATTR) **/
+  librados::bufferlist *sis_ref;
+  int sis_err;
+  /** codec and size of a compressed mail object (RBOX_METADATA_COMPRESSION) **/
+  librados::bufferlist *compression;
+  int compression_err;
+  /** data of an inline mail (RBOX_INLINE_XATTR) **/
+  librados::bufferlist *inline_data;
+  int inline_err;
+  /** reference to the data of a packed mail (RBOX_PACKED_XATTR) **/
+  librados::bufferlist *packed_ref;
+  int packed_err;
+  bool alt_storage;
+};
+
 /**
  * @brief: holds the rados mail object.
  */
@@ -27,7 +57,32 @@ struct rbox_mail {
   /** refrence to rados mail object **/
   librmb::RadosMail *rados_mail;
   uint32_t last_seq;  // TODO(jrse): init with -1
+  /** pending read issued by prefetch, NULL if none **/
+  struct rbox_mail_read_op *read_op;
+  /** fields the mail has been allocated for (search / fetch) **/
+  enum mail_fetch_field wanted_fields;
+};
+
+/**
+ * @brief: metadata of the following mails of a transaction, which has been
+ * loaded together with the metadata of the current mail. Entries are
+ * moved to the rbox_mail by rbox_mail_metadata_get.
+ */
+struct rbox_metadata_prefetch {
+  /** transaction the metadata has been loaded for **/
+  struct mailbox_transaction_context *trans;
+  /** oid => mail with loaded metadata **/
+  std::map<std::string, librmb::RadosMail *> mails;
+  /** sequence of the last mail, whose metadata has been accessed **/
+  uint32_t last_seq;
+  /** number of mails loaded by the next batch, grows while the mails are accessed in sequence **/
+  size_t lookahead;
 };
+extern void rbox_metadata_prefetch_free(struct rbox_mailbox *rbox);
+/* drops the prefetched metadata of the transaction, called at the end of the transaction */
+extern void rbox_metadata_prefetch_transaction_end(struct mailbox_transaction_context *t);
+/* drops the prefetched metadata of the mail, e.g. after its flags or keywords have been updated */
+extern void rbox_metadata_prefetch_forget(struct rbox_mailbox *rbox, const std::string &oid);
 extern void rbox_mail_set_expunged(struct rbox_mail *mail);
 extern int rbox_get_index_record(struct mail *_mail);
 extern struct mail *rbox_mail_alloc(struct mailbox_transaction_context *t, enum mail_fetch_field wanted_fields,
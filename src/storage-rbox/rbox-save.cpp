@@ -26,6 +26,8 @@ extern "C" {
 #include "istream-crlf.h"
 #include "ostream.h"
 #include "str.h"
+#include "hex-binary.h"
+#include "sha2.h"
 
 #include "rbox-sync.h"
 #include "rados-types.h"
@@ -41,6 +43,7 @@ extern "C" {
 #include "rados-util.h"
 #include "rbox-mail.h"
 #include "ostream-bufferlist.h"
+#include "../librmb/rados-packed-segment.h"
 
 using ceph::bufferlist;
 
@@ -199,8 +202,19 @@ void init_output_stream(mail_save_context *_ctx) {
 
   // create buffer ( delete is in wait_for_write_operations)
   r_ctx->rados_mail->set_mail_buffer(new librados::bufferlist());
-  r_ctx->output_stream =
-      o_stream_create_bufferlist(r_ctx->rados_mail, &r_ctx->rados_storage, rbox->storage->config->is_write_chunks());
+  int segment_size = rbox->storage->config->get_save_segment_size();
+  r_ctx->output_stream = o_stream_create_bufferlist(r_ctx->rados_mail, &r_ctx->rados_storage,
+                                                    rbox->storage->config->is_write_chunks(),
+                                                    segment_size > 0 ? segment_size : 0);
+  if (rbox->storage->config->get_mail_dedup_min_size() > 0 && !rbox->storage->config->is_write_chunks()) {
+    o_stream_bufferlist_set_body_hash(r_ctx->output_stream);
+  }
+  if (rbox->storage->config->is_write_chunks()) {
+    int chunk_size = rbox->storage->config->get_write_chunk_size();
+    int max_inflight = rbox->storage->config->get_write_chunks_max_inflight();
+    o_stream_bufferlist_set_write_chunks(r_ctx->output_stream, chunk_size > 0 ? chunk_size : 0,
+                                         max_inflight > 0 ? max_inflight : RBOX_WRITE_CHUNKS_MAX_INFLIGHT);
+  }
   o_stream_cork(r_ctx->output_stream);
   _ctx->data.output = r_ctx->output_stream;
 
@@ -416,9 +430,33 @@ static void clean_up_failed(struct rbox_save_context *r_ctx, bool wait_for_opera
   int delete_ret = 0;
   for (std::list<RadosMail *>::iterator it_cur_obj = r_ctx->rados_mails.begin(); it_cur_obj != r_ctx->rados_mails.end();
        ++it_cur_obj) {
-    delete_ret = r_storage->s->delete_mail(*it_cur_obj);
+    std::map<RadosMail *, std::string>::iterator alt_copy = r_ctx->alt_copies.find(*it_cur_obj);
+    if (alt_copy == r_ctx->alt_copies.end()) {
+      delete_ret = r_storage->s->delete_mail(*it_cur_obj);
+    } else {
+      delete_ret = r_storage->alt->delete_mail(*it_cur_obj);
+    }
     if (delete_ret < 0 && delete_ret != -ENOENT) {
       i_error("Librados obj: %s, could not be removed", (*it_cur_obj)->get_oid()->c_str());
+      continue;
+    }
+    if (alt_copy != r_ctx->alt_copies.end() && !alt_copy->second.empty()) {
+      int ret = librmb::RadosPackedSegment::remove_reference(&r_storage->alt->get_io_ctx(), alt_copy->second,
+                                                             *(*it_cur_obj)->get_oid());
+      if (ret < 0) {
+        i_error("removing reference to %s failed: %d, oid(%s)", alt_copy->second.c_str(), ret,
+                (*it_cur_obj)->get_oid()->c_str());
+      }
+    }
+    std::map<RadosMail *, std::string>::iterator sis_ref = r_ctx->sis_refs.find(*it_cur_obj);
+    if (sis_ref != r_ctx->sis_refs.end()) {
+      librados::IoCtx sis_io_ctx;
+      librmb::RadosUtils::get_sis_io_ctx(&r_storage->s->get_io_ctx(), &sis_io_ctx);
+      int ret = librmb::RadosUtils::sis_remove_reference(&sis_io_ctx, sis_ref->second);
+      if (ret < 0 && ret != -ENOENT) {
+        i_error("removing reference to single instance object %s failed: %d, oid(%s)", sis_ref->second.c_str(), ret,
+                (*it_cur_obj)->get_oid()->c_str());
+      }
     }
   }
   // clean up index
@@ -457,6 +495,122 @@ static void clean_up_write_finish(struct mail_save_context *_ctx) {
   FUNC_END();
 }
 
+/* returns the size of the header block incl. the empty line, or 0 if the mail has no body */
+static size_t rbox_save_get_header_size(librados::bufferlist *buffer) {
+  int state = 1;
+  size_t pos = 0;
+  for (const auto &ptr : buffer->buffers()) {
+    size_t hdr_end = librmb::RadosUtils::find_header_end(ptr.c_str(), ptr.length(), &state);
+    if (hdr_end > 0) {
+      return pos + hdr_end;
+    }
+    pos += ptr.length();
+  }
+  return 0;
+}
+
+/* stores the header block in the omap of the mail object, so that header only fetches
+ * (ENVELOPE, BODY.PEEK[HEADER], ...) do not need to read the mail body */
+static void rbox_save_mail_omap_cache(struct rbox_save_context *r_ctx,
+                                      std::map<std::string, librados::bufferlist> *cache) {
+  librados::bufferlist *buffer = r_ctx->rados_mail->get_mail_buffer();
+  size_t hdr_size = rbox_save_get_header_size(buffer);
+  if (hdr_size == 0 || hdr_size >= buffer->length()) {
+    return;
+  }
+  (*cache)[RBOX_MAIL_CACHE_KEY_HEADER].substr_of(*buffer, 0, hdr_size);
+}
+
+/* waits for the oldest outstanding object write of the transaction */
+static void rbox_save_wait_oldest_write(struct rbox_save_context *r_ctx, librmb::RadosStorage *storage) {
+  std::list<RadosMail *> oldest;
+  oldest.push_back(r_ctx->inflight_mails.front());
+  r_ctx->inflight_mails.pop_front();
+  if (storage->wait_for_rados_operations(oldest)) {
+    i_error("write of mail %s failed, namespace=%s", oldest.front()->get_oid()->c_str(),
+            storage->get_namespace().c_str());
+    r_ctx->write_failed = TRUE;
+  }
+}
+
+/* adds the write of the current mail to the transaction's window of outstanding writes.
+ * If the window is full, the oldest write is waited for. */
+static void rbox_save_schedule_write(struct rbox_save_context *r_ctx, struct rbox_storage *r_storage) {
+  if (!r_ctx->rados_mail->has_active_op()) {
+    return;
+  }
+  r_ctx->inflight_mails.push_back(r_ctx->rados_mail);
+  int max_inflight = r_storage->config->get_save_max_inflight();
+  while (max_inflight > 0 && r_ctx->inflight_mails.size() > (size_t)max_inflight) {
+    rbox_save_wait_oldest_write(r_ctx, r_storage->s);
+  }
+}
+
+/* waits for all outstanding object writes of the transaction.
+ * returns -1 if one of the writes failed */
+static int rbox_save_wait_writes(struct rbox_save_context *r_ctx, librmb::RadosStorage *storage) {
+  while (!r_ctx->inflight_mails.empty()) {
+    rbox_save_wait_oldest_write(r_ctx, storage);
+  }
+  return r_ctx->write_failed ? -1 : 0;
+}
+
+/* completes the copy and move operations of the transaction (see rbox_mail_copy).
+ * returns -1 if one of the operations failed */
+static int rbox_save_wait_copies(struct rbox_save_context *r_ctx, bool commit) {
+  struct rbox_storage *r_storage = (struct rbox_storage *)&r_ctx->mbox->storage->storage;
+  std::map<std::string, int> failed;
+  // the queue holds the operations of both storages
+  int ret = r_storage->s->wait_for_copy_operations(&r_ctx->copy_ops, commit, &failed);
+  for (std::map<std::string, int>::iterator it = failed.begin(); it != failed.end(); ++it) {
+    if (it->second == -ENOENT) {
+      i_warning("copy mail failed: src_oid: %s, error_code: %d, most likely concurrency issue => mail is expunged",
+                it->first.c_str(), it->second);
+    } else {
+      i_error("copy mail failed: src_oid: %s, error_code: %d, namespace=%s", it->first.c_str(), it->second,
+              r_storage->s->get_namespace().c_str());
+    }
+  }
+  return ret < 0 ? -1 : 0;
+}
+
+/* single instance storage: the body of the mail is stored in a content addressed object, which is shared
+ * by all mails with the same body. The mail object keeps the header and the oid of the body object. */
+static void rbox_save_mail_dedup(struct rbox_save_context *r_ctx, struct rbox_storage *r_storage,
+                                 librados::ObjectWriteOperation *write_op) {
+  uoff_t hdr_size = 0;
+  unsigned char digest[SHA256_RESULTLEN];
+  librados::bufferlist *buffer = r_ctx->rados_mail->get_mail_buffer();
+
+  if (!o_stream_bufferlist_get_body_hash(r_ctx->output_stream, &hdr_size, digest) || hdr_size >= buffer->length() ||
+      buffer->length() - hdr_size < (uoff_t)r_storage->config->get_mail_dedup_min_size()) {
+    return;
+  }
+  std::string sis_oid = RBOX_SIS_OID_PREFIX;
+  sis_oid += binary_to_hex(digest, sizeof(digest));
+
+  librados::bufferlist body;
+  body.substr_of(*buffer, hdr_size, buffer->length() - hdr_size);
+  librados::IoCtx sis_io_ctx;
+  librmb::RadosUtils::get_sis_io_ctx(&r_storage->s->get_io_ctx(), &sis_io_ctx);
+  int ret = librmb::RadosUtils::sis_add_reference(&sis_io_ctx, sis_oid, &body);
+  if (ret < 0) {
+    // store the complete mail
+    i_warning("adding reference to single instance object %s failed: %d, oid(%s)", sis_oid.c_str(), ret,
+              r_ctx->rados_mail->get_oid()->c_str());
+    return;
+  }
+  r_ctx->sis_refs[r_ctx->rados_mail] = sis_oid;
+  librados::bufferlist header;
+  header.substr_of(*buffer, 0, hdr_size);
+  buffer->swap(header);
+  r_ctx->rados_mail->set_mail_size(hdr_size + 1);
+
+  librados::bufferlist sis_ref;
+  sis_ref.append(sis_oid);
+  write_op->setxattr(RBOX_SIS_XATTR, sis_ref);
+}
+
 int rbox_save_finish(struct mail_save_context *_ctx) {
   FUNC_START();
 
@@ -530,17 +684,45 @@ int rbox_save_finish(struct mail_save_context *_ctx) {
       }
 
       rbox_save_mail_set_metadata(r_ctx, r_ctx->rados_mail);
+      // the zlib plugin has already compressed the stream
+      r_ctx->rados_mail->set_compressible(!zlib_plugin_active);
 
       librados::ObjectWriteOperation write_op;
       struct rbox_storage *r_storage = (struct rbox_storage *)&r_ctx->mbox->storage->storage;
 
       r_storage->ms->get_storage()->save_metadata(&write_op, r_ctx->rados_mail);
 
+      if (r_storage->config->get_mail_dedup_min_size() > 0 && !zlib_plugin_active &&
+          !r_storage->config->is_write_chunks()) {
+        rbox_save_mail_dedup(r_ctx, r_storage, &write_op);
+      }
+
       if (!r_storage->config->is_write_chunks()) {
+        // in chunk mode, the mail buffer has already been written and released.
+        std::map<std::string, librados::bufferlist> cache;
+        if (r_storage->config->is_mail_omap_cache() && !zlib_plugin_active) {
+          // the header is cached uncompressed
+          rbox_save_mail_omap_cache(r_ctx, &cache);
+        }
+        r_storage->s->compress_mail(r_ctx->rados_mail, &write_op);
+        // inline mails are read with a single op anyway, the decision is made on the final buffer
+        if (!cache.empty() && !r_storage->s->is_inline_mail(r_ctx->rados_mail)) {
+          write_op.omap_set(cache);
+        }
         r_ctx->failed = !r_storage->s->save_mail(&write_op, r_ctx->rados_mail, async_write);
+      } else if (o_stream_bufferlist_finish_writes(r_ctx->output_stream) < 0) {
+        r_ctx->failed = true;
       } else {
+        // all chunks have landed, attach the metadata
+        time_t save_date = r_ctx->rados_mail->get_rados_save_date();
+        write_op.mtime(&save_date);
+        r_ctx->rados_mail->set_completion(librados::Rados::aio_create_completion());
+        r_ctx->rados_mail->set_active_op(1);
         r_ctx->failed = r_storage->s->aio_operate(&r_storage->s->get_io_ctx(), *r_ctx->rados_mail->get_oid(),
-                                            r_ctx->rados_mail->get_completion(), &write_op) < 0;
+                                                  r_ctx->rados_mail->get_completion(), &write_op) < 0;
+      }
+      if (!r_ctx->failed) {
+        rbox_save_schedule_write(r_ctx, r_storage);
       }
       if (r_ctx->failed) {
         i_error("saved mail: %s failed metadata_count %ld, mail_size (%d)", r_ctx->rados_mail->get_oid()->c_str(),
@@ -647,6 +829,24 @@ int rbox_transaction_save_commit_pre(struct mail_save_context *_ctx) {
 
   i_assert(r_ctx->finished);
 
+  struct rbox_storage *r_storage = (struct rbox_storage *)&r_ctx->mbox->storage->storage;
+  // all mail objects need to be written, before the index is committed.
+  if (rbox_save_wait_writes(r_ctx, r_storage->s) < 0) {
+    i_error("saving mails failed, %lu mails in transaction, namespace=%s", r_ctx->rados_mails.size(),
+            r_storage->s->get_namespace().c_str());
+    r_ctx->failed = TRUE;
+    rbox_transaction_save_rollback(_ctx);
+    FUNC_END_RET("ret == -1");
+    return -1;
+  }
+  // copied and moved mails have to exist, before they are added to the index.
+  if (rbox_save_wait_copies(r_ctx, true) < 0) {
+    r_ctx->failed = TRUE;
+    rbox_transaction_save_rollback(_ctx);
+    FUNC_END_RET("ret == -1");
+    return -1;
+  }
+
   if (rbox_sync_begin(r_ctx->mbox, &r_ctx->sync_ctx,
                       static_cast<enum rbox_sync_flags>(RBOX_SYNC_FLAG_FORCE | RBOX_SYNC_FLAG_FSYNC)) < 0) {
     r_ctx->failed = TRUE;
@@ -715,6 +915,9 @@ void clean_up_mail_object_list(struct rbox_save_context *r_ctx, struct rbox_stor
     *it = nullptr;
   }
   r_ctx->rados_mails.clear();
+  r_ctx->inflight_mails.clear();
+  r_ctx->sis_refs.clear();
+  r_ctx->alt_copies.clear();
 
   FUNC_END();
 }
@@ -729,6 +932,10 @@ void rbox_transaction_save_rollback(struct mail_save_context *_ctx) {
     rbox_save_cancel(&r_ctx->ctx);
     clean_up_write_finish(_ctx);
   }
+  if (_ctx->transaction != NULL) {
+    // not called by rbox_transaction_save_commit_post, the saved mails are discarded.
+    r_ctx->failed = TRUE;
+  }
 
   if (r_ctx->sync_ctx != NULL)
     (void)rbox_sync_finish(&r_ctx->sync_ctx, FALSE);
@@ -739,6 +946,9 @@ void rbox_transaction_save_rollback(struct mail_save_context *_ctx) {
   if (_ctx->dest_mail != NULL && r_ctx->dest_mail_allocated == TRUE) {
     mail_free(&_ctx->dest_mail);
   }
+  // discard copy and move operations of a transaction, which is not committed.
+  rbox_save_wait_copies(r_ctx, false);
+
   bool wait_for_operations = true;
   if (!r_ctx->failed) {
     // the last moment to wait for our rados storage.
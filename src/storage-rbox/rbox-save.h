@@ -14,11 +14,14 @@
 
 #include <string>
 #include <list>
+#include <deque>
+#include <map>
 
 #include "../librmb/rados-storage-impl.h"
 #include "mail-storage-private.h"
 
 #include "../librmb/rados-mail.h"
+#include "../librmb/rados-copy-operations.h"
 /**
  * @brief: rbox_save_context
  *  class is holding all references to
@@ -47,7 +50,8 @@ class rbox_save_context {
         failed(1),
         finished(1),
         copying(0),
-        dest_mail_allocated(0) {
+        dest_mail_allocated(0),
+        write_failed(0) {
   }
 
   /** dovecot mail save context **/
@@ -75,6 +79,14 @@ class rbox_save_context {
   std::list<librmb::RadosMail *> rados_mails;
   /** current mail in the context **/
   librmb::RadosMail *rados_mail;
+  /** mails with outstanding object writes, oldest first **/
+  std::deque<librmb::RadosMail *> inflight_mails;
+  /** copy and move operations of the transaction (see rbox_mail_copy) **/
+  librmb::RadosCopyOperations copy_ops;
+  /** single instance body objects referenced by the mails of the context, released by clean_up_failed **/
+  std::map<librmb::RadosMail *, std::string> sis_refs;
+  /** copies in the alt storage => segment reference of the copied stub (empty if not packed) **/
+  std::map<librmb::RadosMail *, std::string> alt_copies;
 #if DOVECOT_PREREQ(2, 3)
   unsigned int highest_pop3_uidl_seq : 1;
 #endif
@@ -84,6 +96,8 @@ class rbox_save_context {
   unsigned int finished : 1;
   unsigned int copying : 1;
   unsigned int dest_mail_allocated : 1;
+  /** one of the object writes of the transaction failed **/
+  unsigned int write_failed : 1;
 };
 
 void setup_mail_object(struct mail_save_context *_ctx);
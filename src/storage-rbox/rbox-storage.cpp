@@ -41,6 +41,7 @@ extern "C" {
 #include "../librmb/rados-dovecot-ceph-cfg-impl.h"
 #include "../librmb/rados-guid-generator.h"
 #include "../librmb/rados-metadata-storage-impl.h"
+#include "../librmb/rados-compression.h"
 
 #include "rbox-copy.h"
 #include "rbox-mail.h"
@@ -76,6 +77,7 @@ struct mail_storage *rbox_storage_alloc(void) {
   r_storage->ns_mgr = new librmb::RadosNamespaceManager(r_storage->config);
   r_storage->ms = new librmb::RadosMetadataStorageImpl();
   r_storage->alt = new librmb::RadosStorageImpl(r_storage->cluster);
+  r_storage->sis = new librmb::RadosStorageImpl(r_storage->cluster);
 
   // logfile is set when 90-plugin.conf param rados_save_cfg is evaluated.
   r_storage->save_log = new librmb::RadosSaveLog();
@@ -198,6 +200,11 @@ void rbox_storage_destroy(struct mail_storage *storage) {
     delete r_storage->alt;
     r_storage->alt = nullptr;
   }
+  if (r_storage->sis != nullptr) {
+    r_storage->sis->close_connection();
+    delete r_storage->sis;
+    r_storage->sis = nullptr;
+  }
   if (r_storage->cluster != nullptr) {
     r_storage->cluster->deinit();
     delete r_storage->cluster;
@@ -378,11 +385,6 @@ static int rbox_open_mailbox(struct mailbox *box) {
       box->index, box->storage->set->parsed_fsync_mode,
       static_cast<mail_index_fsync_mask>(MAIL_INDEX_FSYNC_MASK_APPENDS | MAIL_INDEX_FSYNC_MASK_EXPUNGES));
 
-  struct rbox_mailbox *rbox = (struct rbox_mailbox *)box;
-  if (!array_is_created(&rbox->moved_items)) {
-    i_array_init(&rbox->moved_items, 32);
-  }
-
   FUNC_END();
   return 0;
 }
@@ -454,7 +456,22 @@ int rbox_open_rados_connection(struct mailbox *box, bool alt_storage) {
     read_plugin_ceph_client_settings(box, "rbox_ceph_client");
   }
   int ret = 0;
+  std::string compression_codec;
+  int compression_level = 0;
+  if (!rbox->storage->config->get_compression().empty() &&
+      !librmb::RadosCompression::parse_config(rbox->storage->config->get_compression(), &compression_codec,
+                                              &compression_level)) {
+    i_warning("rbox_compression=%s is not supported, mails are saved uncompressed",
+              rbox->storage->config->get_compression().c_str());
+    compression_codec.clear();
+  }
+  if (rbox->storage->config->get_mail_inline_max_size() > RBOX_INLINE_MAX_SIZE_LIMIT) {
+    i_warning("rbox_mail_inline_max_size=%d exceeds the xattr limit, mails up to %d bytes are saved inline",
+              rbox->storage->config->get_mail_inline_max_size(), RBOX_INLINE_MAX_SIZE_LIMIT);
+  }
   try {
+    rados_storage->set_compression(compression_codec, compression_level);
+    rados_storage->set_mail_inline_max_size(rbox->storage->config->get_mail_inline_max_size());
     rados_storage->set_ceph_wait_method(rbox->storage->config->is_ceph_aio_wait_for_safe_and_cb()
                                             ? librmb::WAIT_FOR_SAFE_AND_CB
                                             : librmb::WAIT_FOR_COMPLETE_AND_CB);
@@ -470,6 +487,8 @@ int rbox_open_rados_connection(struct mailbox *box, bool alt_storage) {
       rbox->storage->alt->set_ceph_wait_method(rbox->storage->config->is_ceph_aio_wait_for_safe_and_cb()
                                                    ? librmb::WAIT_FOR_SAFE_AND_CB
                                                    : librmb::WAIT_FOR_COMPLETE_AND_CB);
+      rbox->storage->alt->set_compression(compression_codec, compression_level);
+      rbox->storage->alt->set_mail_inline_max_size(rbox->storage->config->get_mail_inline_max_size());
     }
   } catch (std::exception &e) {
     ret = -1;
@@ -530,6 +549,31 @@ int rbox_open_rados_connection(struct mailbox *box, bool alt_storage) {
   return ret;
 }
 
+int rbox_open_sis_connection(struct mailbox *box) {
+  struct rbox_storage *r_storage = (struct rbox_storage *)box->storage;
+
+  // the primary storage loads the configuration
+  int ret = rbox_open_rados_connection(box, false);
+  if (ret < 0) {
+    return ret;
+  }
+  ret = r_storage->sis->open_connection(r_storage->config->get_pool_name(),
+                                        r_storage->config->get_rados_cluster_name(),
+                                        r_storage->config->get_rados_username());
+  if (ret < 0) {
+    i_error("Open rados connection to the single instance storage failed: %d (pool_name(%s))", ret,
+            r_storage->config->get_pool_name().c_str());
+    return ret;
+  }
+  if (ret == 0) {
+    r_storage->sis->set_namespace(RBOX_SIS_NAMESPACE);
+    r_storage->sis->set_ceph_wait_method(r_storage->config->is_ceph_aio_wait_for_safe_and_cb()
+                                             ? librmb::WAIT_FOR_SAFE_AND_CB
+                                             : librmb::WAIT_FOR_COMPLETE_AND_CB);
+  }
+  return 0;
+}
+
 static void rbox_update_header(struct rbox_mailbox *rbox, struct mail_index_transaction *trans,
                                const struct mailbox_update *update) {
   FUNC_START();
@@ -699,23 +743,45 @@ void rbox_set_mailbox_corrupted(struct mailbox *box) {
   FUNC_END();
 }
 
+void rbox_moved_items_add(struct rbox_mailbox *rbox, const guid_128_t oid) {
+  if (rbox->moved_items == NULL) {
+    rbox->moved_items = new rbox_moved_items();
+  }
+  rbox->moved_items->oids.insert(std::string(reinterpret_cast<const char *>(oid), GUID_128_SIZE));
+}
+
+bool rbox_moved_items_contains(struct rbox_mailbox *rbox, const guid_128_t oid) {
+  if (rbox->moved_items == NULL) {
+    return false;
+  }
+  return rbox->moved_items->oids.find(std::string(reinterpret_cast<const char *>(oid), GUID_128_SIZE)) !=
+         rbox->moved_items->oids.end();
+}
+
+void rbox_moved_items_free(struct rbox_mailbox *rbox) {
+  if (rbox->moved_items != NULL) {
+    delete rbox->moved_items;
+    rbox->moved_items = NULL;
+  }
+}
+
+static int rbox_transaction_commit(struct mailbox_transaction_context *t,
+                                   struct mail_transaction_commit_changes *changes_r) {
+  rbox_metadata_prefetch_transaction_end(t);
+  return index_transaction_commit(t, changes_r);
+}
+
+static void rbox_transaction_rollback(struct mailbox_transaction_context *t) {
+  rbox_metadata_prefetch_transaction_end(t);
+  index_transaction_rollback(t);
+}
+
 static void rbox_mailbox_close(struct mailbox *box) {
   FUNC_START();
   struct rbox_mailbox *rbox = (struct rbox_mailbox *)box;
-  struct expunged_item *const *moved_items, *moved_item;
-
-  if (array_is_created(&rbox->moved_items)) {
-    if (array_count(&rbox->moved_items) > 0) {
-      unsigned int moved_count;
-      moved_items = array_get(&rbox->moved_items, &moved_count);
-      for (unsigned int i = 0; i < moved_count; i++) {
-        moved_item = moved_items[i];
-        i_free(moved_item);
-      }
-      array_delete(&rbox->moved_items, array_count(&rbox->moved_items) - 1, 1);
-    }
-    array_free(&rbox->moved_items);
-  }
+
+  rbox_moved_items_free(rbox);
+  rbox_metadata_prefetch_free(rbox);
 
   if (rbox->storage->corrupted_rebuild_count != 0) {
 #ifdef DEBUG
@@ -1024,8 +1090,8 @@ struct mailbox_vfuncs rbox_mailbox_vfuncs = {index_storage_is_readonly,
                                              NULL,
                                              rbox_notify_changes,
                                              index_transaction_begin,
-                                             index_transaction_commit,
-                                             index_transaction_rollback,
+                                             rbox_transaction_commit,
+                                             rbox_transaction_rollback,
                                              NULL,
                                              rbox_mail_alloc,
                                              index_storage_search_init,
@@ -53,6 +53,11 @@ extern struct mail_storage rbox_storage;
  * @param[in] alt_storage indicates if alt_storage should be used.
  */
 extern int rbox_open_rados_connection(struct mailbox *box, bool alt_storage);
+/**
+ * @brief opens the connection to the single instance storage (rbox_mail_dedup_min_size)
+ * @param[in] box valid mailbox (state open)
+ */
+extern int rbox_open_sis_connection(struct mailbox *box);
 /**
  * @brief reads the 90-plugin.conf section
  * @param[in] box mailbox (state open).
@@ -83,6 +88,9 @@ extern bool rbox_header_have_flag(struct mailbox *box, uint32_t ext_id, unsigned
 
 #define SDBOX_INDEX_HEADER_MIN_SIZE (sizeof(uint32_t))
 
+struct rbox_metadata_prefetch;
+struct rbox_moved_items;
+
 struct obox_mail_index_record {
   unsigned char guid[GUID_128_SIZE];
   unsigned char oid[GUID_128_SIZE];
@@ -101,9 +109,11 @@ struct rbox_mailbox {
   uint32_t ext_id;
   /** unique identifier **/
   guid_128_t mailbox_guid;
-  /** list of moved_items, after move mail will not be deleted immediately,
+  /** set of moved mail objects, after move mail will not be deleted immediately,
    * but during next sync.   */
-  ARRAY(struct expunged_item *) moved_items;
+  struct rbox_moved_items *moved_items;
+  /** metadata loaded in advance by a metadata batch, see rbox_mail_metadata_get **/
+  struct rbox_metadata_prefetch *metadata_prefetch;
 };
 
 enum rbox_index_header_flags {
@@ -24,6 +24,8 @@
 #define RBOX_MAILDIR_NAME "rbox-Mails"
 
 #ifdef __cplusplus
+#include <string>
+#include <unordered_set>
 #include "../librmb/rados-cluster-impl.h"
 #include "../librmb/rados-storage-impl.h"
 #include "../librmb/rados-namespace-manager.h"
@@ -42,12 +44,21 @@ struct rbox_storage {
   librmb::RadosNamespaceManager *ns_mgr;
   librmb::RadosMetadataStorage *ms;
   librmb::RadosStorage *alt;
+  /* single instance body objects (rbox_mail_dedup_min_size), primary pool */
+  librmb::RadosStorage *sis;
   librmb::RadosSaveLog *save_log;
 
   uint32_t corrupted_rebuild_count;
   bool corrupted;
 };
 
+/**
+ * @brief: oids (binary guid_128) of the moved mails of a mailbox
+ */
+struct rbox_moved_items {
+  std::unordered_set<std::string> oids;
+};
+
 #endif
 
 struct index_rebuild_context;
@@ -63,6 +74,10 @@ extern void rbox_transaction_save_commit_post(struct mail_save_context *ctx,
                                               struct mail_index_transaction_commit_result *result);
 extern void rbox_transaction_save_rollback(struct mail_save_context *ctx);
 
+extern void rbox_moved_items_add(struct rbox_mailbox *rbox, const guid_128_t oid);
+extern bool rbox_moved_items_contains(struct rbox_mailbox *rbox, const guid_128_t oid);
+extern void rbox_moved_items_free(struct rbox_mailbox *rbox);
+
 extern int rbox_mailbox_open(struct mailbox *box);
 extern int rbox_mailbox_create(struct mailbox *box, const struct mailbox_update *update, bool directory);
 extern int rbox_mailbox_get_metadata(struct mailbox *box, enum mailbox_metadata_items items,
@@ -10,6 +10,8 @@
  * Foundation.  See file COPYING.
  */
 #include <list>
+#include <string>
+#include <vector>
 extern "C" {
 #include "dovecot-all.h"
 
@@ -30,8 +32,10 @@ extern "C" {
 using librmb::RadosMail;
 using librmb::rbox_metadata_key;
 
+#define RBOX_REBUILD_PROGRESS_COUNT 1000
+
 int rbox_sync_add_object(struct index_rebuild_context *ctx, const std::string &oi, librmb::RadosMail *mail_obj,
-                         bool alt_storage, uint32_t next_uid) {
+                         bool alt_storage, uint32_t next_uid, std::list<struct rbox_sync_rebuild_update> *updates) {
   FUNC_START();
   struct rbox_mailbox *rbox = (struct rbox_mailbox *)ctx->box;
   char *xattr_mail_uid = NULL;
@@ -73,13 +77,23 @@ int rbox_sync_add_object(struct index_rebuild_context *ctx, const std::string &o
   T_BEGIN { index_rebuild_index_metadata(ctx, seq, next_uid); }
   T_END;
 
-  // update uid.
+  // update uid, the write is collected by the caller (rbox_sync_rebuild_wait_updates)
   librmb::RadosMetadata mail_uid(librmb::RBOX_METADATA_MAIL_UID, next_uid);
-  std::string s_oid = *mail_obj->get_oid();
   std::list<librmb::RadosMetadata> to_update;
   to_update.push_back(mail_uid);
-  if (!r_storage->ms->get_storage()->update_metadata(s_oid, to_update)) {
-    i_warning("update of MAIL_UID failed: for object: %s , uid: %d", mail_obj->get_oid()->c_str(), next_uid);
+  librados::ObjectWriteOperation write_op;
+  r_storage->ms->get_storage()->update_metadata(&write_op, mail_obj, to_update);
+
+  struct rbox_sync_rebuild_update update;
+  update.completion = librados::Rados::aio_create_completion();
+  update.oid = *mail_obj->get_oid();
+  update.uid = next_uid;
+  librados::IoCtx &io_ctx = alt_storage ? r_storage->alt->get_io_ctx() : r_storage->s->get_io_ctx();
+  if (io_ctx.aio_operate(update.oid, update.completion, &write_op) < 0) {
+    i_warning("update of MAIL_UID failed: for object: %s , uid: %d", update.oid.c_str(), next_uid);
+    update.completion->release();
+  } else {
+    updates->push_back(update);
   }
 #ifdef DEBUG
   i_debug("rebuilding %s , with oid=%d", oi.c_str(), next_uid);
@@ -87,8 +101,93 @@ int rbox_sync_add_object(struct index_rebuild_context *ctx, const std::string &o
   FUNC_END();
   return 0;
 }
-// find objects with mailbox_guid 'U' attribute
-int rbox_sync_rebuild_entry(struct index_rebuild_context *ctx, librados::NObjectIterator &iter,
+
+/* waits for the pending MAIL_UID rewrites */
+static void rbox_sync_rebuild_wait_updates(std::list<struct rbox_sync_rebuild_update> *updates) {
+  for (std::list<struct rbox_sync_rebuild_update>::iterator it = updates->begin(); it != updates->end(); ++it) {
+    it->completion->wait_for_complete();
+    if (it->completion->get_return_value() < 0) {
+      i_warning("update of MAIL_UID failed: for object: %s , uid: %d", it->oid.c_str(), it->uid);
+    }
+    it->completion->release();
+  }
+  updates->clear();
+}
+
+void rbox_sync_rebuild_free_mails(std::vector<librmb::RadosMail *> *mails) {
+  for (std::vector<librmb::RadosMail *>::iterator it = mails->begin(); it != mails->end(); ++it) {
+    delete *it;
+  }
+  mails->clear();
+}
+
+/* loads the metadata of the mails, invalid mails are freed and removed */
+static void rbox_sync_rebuild_load_mails(struct rbox_storage *r_storage, std::vector<librmb::RadosMail *> *mails) {
+  // errors are marked per mail (RadosMail::is_valid)
+  (void)r_storage->ms->get_storage()->load_metadata_batch(*mails);
+
+  std::vector<librmb::RadosMail *>::iterator it = mails->begin();
+  while (it != mails->end()) {
+    librmb::RadosMail *mail_object = *it;
+    if (!mail_object->is_valid() || !librmb::RadosUtils::validate_metadata(mail_object->get_metadata())) {
+      i_error("metadata for object : %s is not valid, skipping object ", mail_object->get_oid()->c_str());
+      delete mail_object;
+      it = mails->erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// lists the namespace once and groups the oids of the mail objects with valid metadata by their
+// mailbox_guid 'M' attribute. Only the oids are kept, the metadata of up to rbox_metadata_batch_size
+// objects is loaded in parallel and freed after the batch. The listing order is kept within each mailbox.
+int rbox_sync_rebuild_scan(struct rbox_storage *r_storage, librados::NObjectIterator &iter, bool alt_storage,
+                           rbox_sync_rebuild_mailboxes *mailboxes) {
+  FUNC_START();
+  int scanned = 0;
+  int next_progress = RBOX_REBUILD_PROGRESS_COUNT;
+  int batch_size = r_storage->config->get_metadata_batch_size();
+  if (batch_size < 1) {
+    batch_size = 1;
+  }
+  std::vector<librmb::RadosMail *> mails;
+  mails.reserve(batch_size);
+
+  if (alt_storage) {
+    r_storage->ms->get_storage()->set_io_ctx(&r_storage->alt->get_io_ctx());
+  }
+
+  while (iter != librados::NObjectIterator::__EndObjectIterator) {
+    for (; iter != librados::NObjectIterator::__EndObjectIterator && mails.size() < (size_t)batch_size; ++iter) {
+      librmb::RadosMail *mail_object = new librmb::RadosMail();
+      mail_object->set_oid((*iter).get_oid());
+      mails.push_back(mail_object);
+    }
+    scanned += mails.size();
+    rbox_sync_rebuild_load_mails(r_storage, &mails);
+
+    for (std::vector<librmb::RadosMail *>::iterator it = mails.begin(); it != mails.end(); ++it) {
+      char *mailbox_guid = NULL;
+      librmb::RadosUtils::get_metadata(librmb::RBOX_METADATA_MAILBOX_GUID, (*it)->get_metadata(), &mailbox_guid);
+      (*mailboxes)[mailbox_guid].push_back(*(*it)->get_oid());
+    }
+    rbox_sync_rebuild_free_mails(&mails);
+
+    if (scanned >= next_progress) {
+      i_info("rebuild scan in progress: %d objects scanned, %lu mailboxes found", scanned, mailboxes->size());
+      next_progress = scanned + RBOX_REBUILD_PROGRESS_COUNT;
+    }
+  }
+  i_info("rebuild scan: %d objects scanned, %lu mailboxes found", scanned, mailboxes->size());
+  FUNC_END();
+  return 0;
+}
+
+// re-adds the mails found for this mailbox by rbox_sync_rebuild_scan. The mails are processed in
+// chunks of rbox_metadata_batch_size: the metadata of a chunk is loaded in parallel, the MAIL_UID
+// rewrites of the chunk are issued asynchronously and the chunk is freed. UIDs are assigned in listing order.
+int rbox_sync_rebuild_entry(struct index_rebuild_context *ctx, std::vector<std::string> &oids,
                             struct rbox_sync_rebuild_ctx *rebuild_ctx) {
   FUNC_START();
   struct mail_storage *storage = ctx->box->storage;
@@ -102,62 +201,49 @@ int rbox_sync_rebuild_entry(struct index_rebuild_context *ctx, librados::NObject
   }
 
   int found = 0;
+  int next_progress = RBOX_REBUILD_PROGRESS_COUNT;
   int sync_add_objects_ret = 0;
-  
-  while (iter != librados::NObjectIterator::__EndObjectIterator) {
-    
-    librmb::RadosMail mail_object;
-    mail_object.set_oid((*iter).get_oid());
-
-    int load_metadata_ret;
-    if (rebuild_ctx->alt_storage) {
-      r_storage->ms->get_storage()->set_io_ctx(&r_storage->alt->get_io_ctx());
-      load_metadata_ret = r_storage->ms->get_storage()->load_metadata(&mail_object);
-    } else {
-      load_metadata_ret = r_storage->ms->get_storage()->load_metadata(&mail_object);
-    }
-   
-    if (load_metadata_ret < 0 || !librmb::RadosUtils::validate_metadata(mail_object.get_metadata())) {    
-      i_error("metadata for object : %s is not valid, skipping object ", mail_object.get_oid()->c_str());
-      ++iter;
-      continue;
+  int batch_size = r_storage->config->get_metadata_batch_size();
+  if (batch_size < 1) {
+    batch_size = 1;
+  }
+  std::string guid(guid_128_to_string(rbox->mailbox_guid));
+  std::list<struct rbox_sync_rebuild_update> updates;
+  std::vector<librmb::RadosMail *> mails;
+  mails.reserve(batch_size);
+
+  for (std::vector<std::string>::iterator oid = oids.begin(); oid != oids.end() && sync_add_objects_ret >= 0;) {
+    for (; oid != oids.end() && mails.size() < (size_t)batch_size; ++oid) {
+      librmb::RadosMail *mail_object = new librmb::RadosMail();
+      mail_object->set_oid(*oid);
+      mails.push_back(mail_object);
     }
-    
-    if (load_metadata_ret >= 0) {
-      char *mailbox_guid = NULL;
-      librmb::RadosUtils::get_metadata(librmb::RBOX_METADATA_MAILBOX_GUID, 
-                                       mail_object.get_metadata(), 
-                                       &mailbox_guid
-                                      );
-      
-      std::string mails_guid(mailbox_guid);
-      std::string guid(guid_128_to_string(rbox->mailbox_guid));  
-      if(guid != mailbox_guid) {
-        // mail object does not belong to this mailbox, 
-        // skip it and hope that other mailboxes exist and we can assign it.
-        i_debug("mail_guid : %s is not part of mailbox_guid %s mails mailbox_guid is: %s ", 
-                mail_object.get_oid()->c_str(), 
-                guid.c_str(), 
-                mails_guid.c_str() 
-              );
-        ++iter;
-        continue;
-      }
-
-      sync_add_objects_ret =
-          rbox_sync_add_object(ctx, (*iter).get_oid(), &mail_object, rebuild_ctx->alt_storage, rebuild_ctx->next_uid);
-      i_debug("re-adding mail : %s to mailbox %s ", mail_object.get_oid()->c_str(), guid.c_str() );
+    rbox_sync_rebuild_load_mails(r_storage, &mails);
+    // the rewrites of the previous chunk overlap with the metadata reads of this chunk
+    rbox_sync_rebuild_wait_updates(&updates);
+
+    for (std::vector<librmb::RadosMail *>::iterator it = mails.begin(); it != mails.end(); ++it) {
+      librmb::RadosMail *mail_object = *it;
+      sync_add_objects_ret = rbox_sync_add_object(ctx, *mail_object->get_oid(), mail_object, rebuild_ctx->alt_storage,
+                                                  rebuild_ctx->next_uid, &updates);
+      i_debug("re-adding mail : %s to mailbox %s ", mail_object->get_oid()->c_str(), guid.c_str());
       if (sync_add_objects_ret < 0) {
-        i_error("sync_add_object: oid(%s), alt_storage(%d),uid(%d)", (*iter).get_oid().c_str(),
+        i_error("sync_add_object: oid(%s), alt_storage(%d),uid(%d)", mail_object->get_oid()->c_str(),
                 rebuild_ctx->alt_storage, rebuild_ctx->next_uid);
         break;
       }
+      ++found;
+      ++rebuild_ctx->next_uid;
+
+      if (found >= next_progress) {
+        i_info("rebuild of mailbox %s in progress: %d of %lu mails restored", ctx->box->name, found, oids.size());
+        next_progress = found + RBOX_REBUILD_PROGRESS_COUNT;
+      }
     }
-    ++iter;
-    ++found;
-    ++rebuild_ctx->next_uid;
+    rbox_sync_rebuild_free_mails(&mails);
   }
-  i_info("----- warnings may be okay, as we do not track if a mail was already assigned to a another mailbox, if unsure check all indexes for guids. run: doveadm rmb ls mb -u <userid> uid -to validate all objects are assigned--- ");
+  rbox_sync_rebuild_wait_updates(&updates);
+  i_info("rebuild of mailbox %s: %d mails restored", ctx->box->name, found);
 
   if (sync_add_objects_ret < 0) {
     i_error("error rbox_sync_add_objects for mbox %s", ctx->box->name);
@@ -211,7 +297,7 @@ void rbox_sync_update_header(struct index_rebuild_context *ctx) {
   FUNC_END();
 }
 
-int rbox_sync_index_rebuild_objects(struct index_rebuild_context *ctx, librados::NObjectIterator &iter_guid) {
+int rbox_sync_index_rebuild_objects(struct index_rebuild_context *ctx, std::vector<std::string> &oids) {
   FUNC_START();
   
   int ret = 0;
@@ -227,7 +313,7 @@ int rbox_sync_index_rebuild_objects(struct index_rebuild_context *ctx, librados:
   rebuild_ctx->alt_storage = false;
   rebuild_ctx->next_uid = INT_MAX;
 
-  ret = rbox_sync_rebuild_entry(ctx, iter_guid, rebuild_ctx);
+  ret = rbox_sync_rebuild_entry(ctx, oids, rebuild_ctx);
 
   rbox_sync_update_header(ctx);
   pool_unref(&pool);
@@ -240,27 +326,32 @@ int rbox_storage_rebuild_in_context(struct rbox_storage *r_storage, bool force)
   FUNC_START();
 
   struct mail_user *user = r_storage->storage.user;
-  librados::NObjectIterator *iter_guid = nullptr;
+  rbox_sync_rebuild_mailboxes *mailboxes = nullptr;
 
   struct mail_namespace *ns = mail_namespace_find_inbox(user->namespaces);
   
   for (; ns != NULL; ns = ns->next) {
-    // iter_guid will be initialized in repair_namespace,
+    // mailboxes will be initialized in repair_namespace,
     // as we first need to call open_mailbox to initialize
     // the rados_connection successfully and list objects in
-    // the user namespace
-    repair_namespace(ns, force, r_storage, iter_guid);
+    // the user namespace. The listing is shared by all mailboxes.
+    repair_namespace(ns, force, r_storage, &mailboxes);
   }
 
-  if( iter_guid != nullptr ){
-    delete iter_guid;
+  if (mailboxes != nullptr) {
+    for (rbox_sync_rebuild_mailboxes::iterator it = mailboxes->begin(); it != mailboxes->end(); ++it) {
+      i_warning("%lu mail objects with mailbox_guid %s do not belong to any mailbox", it->second.size(),
+                it->first.c_str());
+    }
+    delete mailboxes;
   }
 
   FUNC_END();
   return 0;
 }
 
-int repair_namespace(struct mail_namespace *ns, bool force, struct rbox_storage *r_storage, librados::NObjectIterator *iter_guid) {
+int repair_namespace(struct mail_namespace *ns, bool force, struct rbox_storage *r_storage,
+                     rbox_sync_rebuild_mailboxes **mailboxes) {
   FUNC_START();
   struct mailbox_list_iterate_context *iter;
   const struct mailbox_info *info;
@@ -287,17 +378,27 @@ int repair_namespace(struct mail_namespace *ns, bool force, struct rbox_storage
 
       mail_index_lock_sync(box->index, "LOCKED_FOR_REPAIR");
       
-      if(iter_guid == nullptr) {
+      if (*mailboxes == nullptr) {
         if (rbox_open_rados_connection(box, false) < 0) {
           i_error("rbox_sync_index_rebuild_objects: cannot open rados connection");
           FUNC_END();
           return -1;
         }
         i_info("ceph connection established using namespace: %s",r_storage->s->get_namespace().c_str());
-        iter_guid = new librados::NObjectIterator(r_storage->s->find_mails(nullptr));
+        *mailboxes = new rbox_sync_rebuild_mailboxes();
+        librados::NObjectIterator iter_guid(r_storage->s->find_mails(nullptr));
+        rbox_sync_rebuild_scan(r_storage, iter_guid, false, *mailboxes);
+      }
+
+      std::string mailbox_guid(guid_128_to_string(((struct rbox_mailbox *)box)->mailbox_guid));
+      std::vector<std::string> oids;
+      rbox_sync_rebuild_mailboxes::iterator bucket = (*mailboxes)->find(mailbox_guid);
+      if (bucket != (*mailboxes)->end()) {
+        oids.swap(bucket->second);
+        (*mailboxes)->erase(bucket);
       }
 
-      ret = rbox_sync_index_rebuild((struct rbox_mailbox *)box, force, iter_guid);
+      ret = rbox_sync_index_rebuild((struct rbox_mailbox *)box, force, &oids);
 
       if (ret < 0) {
         i_error("error resync (%s), error(%d), force(%d)", info->vname, ret, force);
@@ -317,7 +418,7 @@ int repair_namespace(struct mail_namespace *ns, bool force, struct rbox_storage
   return ret;
 }
 
-int rbox_sync_index_rebuild(struct rbox_mailbox *rbox, bool force, librados::NObjectIterator *iter) {
+int rbox_sync_index_rebuild(struct rbox_mailbox *rbox, bool force, std::vector<std::string> *oids) {
   struct index_rebuild_context *ctx;
   struct mail_index_view *view;
   struct mail_index_transaction *trans;
@@ -349,7 +450,7 @@ int rbox_sync_index_rebuild(struct rbox_mailbox *rbox, bool force, librados::NOb
 
   ctx = index_index_rebuild_init(&rbox->box, view, trans);
 
-  ret = rbox_sync_index_rebuild_objects(ctx, *iter);
+  ret = rbox_sync_index_rebuild_objects(ctx, *oids);
 
 #ifdef DEBUG
   i_debug("rebuild finished");
@@ -12,8 +12,10 @@
 #ifndef SRC_STORAGE_RBOX_RBOX_SYNC_REBUILD_H_
 #define SRC_STORAGE_RBOX_RBOX_SYNC_REBUILD_H_
 
+#include <list>
 #include <map>
 #include <string>
+#include <vector>
 #include <rados/librados.hpp>
 
 #include "../librmb/rados-mail.h"
@@ -26,20 +28,35 @@ struct rbox_sync_rebuild_ctx {
   bool alt_storage;
   uint32_t next_uid;
 };
+/**
+ * @brief: pending asynchronous rewrite of the mail uid (U) of a rebuilt mail
+ */
+struct rbox_sync_rebuild_update {
+  librados::AioCompletion *completion;
+  std::string oid;
+  uint32_t uid;
+};
 extern void rbox_sync_update_header(struct index_rebuild_context *ctx);
 
 extern int rbox_sync_add_object(struct index_rebuild_context *ctx, const std::string &oi, librmb::RadosMail *mail_obj,
-                                bool alt_storage, uint32_t next_uid);
+                                bool alt_storage, uint32_t next_uid,
+                                std::list<struct rbox_sync_rebuild_update> *updates);
 
-extern int rbox_sync_index_rebuild(struct index_rebuild_context *ctx, librados::NObjectIterator &iter,
-                                   struct rbox_sync_rebuild_ctx *rebuild_ctx);
 extern void rbox_sync_set_uidvalidity(struct index_rebuild_context *ctx);
 
-extern int rbox_sync_index_rebuild_objects(struct index_rebuild_context *ctx, librados::NObjectIterator &iter_guid);
-extern int rbox_sync_rebuild_entry(struct index_rebuild_context *ctx, librados::NObjectIterator &iter,
+/* oids of the mail objects (with valid metadata) of the namespace grouped by mailbox guid */
+typedef std::map<std::string, std::vector<std::string> > rbox_sync_rebuild_mailboxes;
+
+extern void rbox_sync_rebuild_free_mails(std::vector<librmb::RadosMail *> *mails);
+extern int rbox_sync_rebuild_scan(struct rbox_storage *r_storage, librados::NObjectIterator &iter, bool alt_storage,
+                                  rbox_sync_rebuild_mailboxes *mailboxes);
+
+extern int rbox_sync_index_rebuild_objects(struct index_rebuild_context *ctx, std::vector<std::string> &oids);
+extern int rbox_sync_rebuild_entry(struct index_rebuild_context *ctx, std::vector<std::string> &oids,
                                    struct rbox_sync_rebuild_ctx *rebuild_ctx);
-extern int rbox_sync_index_rebuild(struct rbox_mailbox *rbox, bool force, librados::NObjectIterator *iter);
+extern int rbox_sync_index_rebuild(struct rbox_mailbox *rbox, bool force, std::vector<std::string> *oids);
 extern int rbox_storage_rebuild_in_context(struct rbox_storage *r_storage, bool force);
-extern int repair_namespace(struct mail_namespace *ns, bool force, struct rbox_storage *r_storage, librados::NObjectIterator *iter_guid);
+extern int repair_namespace(struct mail_namespace *ns, bool force, struct rbox_storage *r_storage,
+                            rbox_sync_rebuild_mailboxes **mailboxes);
 
 #endif  // SRC_STORAGE_RBOX_RBOX_SYNC_REBUILD_H_
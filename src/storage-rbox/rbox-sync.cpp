@@ -12,6 +12,8 @@
 #include <string>
 #include <rados/librados.hpp>
 #include <list>
+#include <deque>
+#include <vector>
 
 extern "C" {
 #include "dovecot-all.h"
@@ -21,11 +23,39 @@ extern "C" {
 #include "debug-helper.h"
 }
 #include "rados-util.h"
+#include "../librmb/rados-packed-segment.h"
 #include "rbox-storage.hpp"
 #include "rbox-mail.h"
 #include "rbox-sync-rebuild.h"
 
 #define RBOX_REBUILD_COUNT 3
+/* max. number of object removes in flight during expunge */
+#define RBOX_SYNC_EXPUNGE_MAX_INFLIGHT 128
+/* max. number of mails moved concurrently to (or from) the alt storage */
+#define RBOX_SYNC_ALT_MOVE_MAX_INFLIGHT 32
+
+/**
+ * @brief: references of an expunged mail object to data stored outside of the object
+ */
+struct rbox_sync_expunge_refs {
+  /* single instance storage: oid of the body object */
+  librados::bufferlist sis_ref;
+  int sis_err;
+  /* packed alt storage: segment of the mail data */
+  librados::bufferlist packed_ref;
+  int packed_err;
+};
+
+/**
+ * @brief: pending remove of an expunged mail object
+ */
+struct rbox_sync_expunge_op {
+  struct expunged_item *item;
+  librados::AioCompletion *completion;
+  /* reads the references before the remove */
+  librados::AioCompletion *refs_completion;
+  struct rbox_sync_expunge_refs *refs;
+};
 
 static int rbox_get_oid_from_index(struct mail_index_view *_sync_view, uint32_t seq, uint32_t ext_id,
                                    guid_128_t *index_oid) {
@@ -112,6 +142,7 @@ static int update_extended_metadata(struct rbox_sync_context *ctx, uint32_t seq1
 
       std::string key_oid(oid);
       std::string ext_key = std::to_string(keyword_idx);
+      rbox_metadata_prefetch_forget(ctx->rbox, key_oid);
       if (remove) {
         ret = r_storage->ms->get_storage()->remove_keyword_metadata(key_oid, ext_key);
       } else {
@@ -136,6 +167,27 @@ static int update_extended_metadata(struct rbox_sync_context *ctx, uint32_t seq1
   return ret;
 }
 
+/* sets (or removes) the alt flag of the moved mails, consecutive sequences are updated as one range */
+static void move_to_alt_update_flags(struct rbox_sync_context *ctx, const std::vector<std::string> &oids,
+                                     const std::vector<uint32_t> &seqs, const std::vector<int> &results,
+                                     bool inverse) {
+  enum modify_type modify_type = inverse ? MODIFY_REMOVE : MODIFY_ADD;
+  size_t i = 0;
+  while (i < seqs.size()) {
+    if (results[i] < 0) {
+      i_error("move_to_alt: moving %s failed with %d (inverse=%d)", oids[i].c_str(), results[i], inverse);
+      i++;
+      continue;
+    }
+    size_t last = i;
+    while (last + 1 < seqs.size() && results[last + 1] >= 0 && seqs[last + 1] == seqs[last] + 1) {
+      last++;
+    }
+    mail_index_update_flags_range(ctx->trans, seqs[i], seqs[last], modify_type, (enum mail_flags)RBOX_INDEX_FLAG_ALT);
+    i = last + 1;
+  }
+}
+
 static int move_to_alt(struct rbox_sync_context *ctx, uint32_t seq1, uint32_t seq2, bool inverse) {
   struct mailbox *box = &ctx->rbox->box;
   struct rbox_storage *r_storage = (struct rbox_storage *)box->storage;
@@ -145,24 +197,30 @@ static int move_to_alt(struct rbox_sync_context *ctx, uint32_t seq1, uint32_t se
     i_error("move_to_alt: connection to rados failed");
     return -1;
   }
+  std::vector<std::string> oids;
+  std::vector<uint32_t> seqs;
   for (; seq1 <= seq2; seq1++) {
     guid_128_t index_oid;
     if (rbox_get_oid_from_index(ctx->sync_view, seq1, ((struct rbox_mailbox *)&ctx->rbox->box)->ext_id, &index_oid) >=
         0) {
-      std::string oid = guid_128_to_string(index_oid);
-#ifdef DEBUG
-      i_debug("found oid: %s", oid.c_str());
-#endif
-      ret = librmb::RadosUtils::move_to_alt(oid, r_storage->s, r_storage->alt, r_storage->ms, inverse);
-      if (ret >= 0) {
-        if (inverse) {
-          mail_index_update_flags(ctx->trans, seq1, MODIFY_REMOVE, (enum mail_flags)RBOX_INDEX_FLAG_ALT);
-        } else {
-          mail_index_update_flags(ctx->trans, seq1, MODIFY_ADD, (enum mail_flags)RBOX_INDEX_FLAG_ALT);
-        }
-      }
+      oids.push_back(guid_128_to_string(index_oid));
+      seqs.push_back(seq1);
     }
   }
+  if (oids.empty()) {
+    return ret;
+  }
+
+  std::vector<int> results;
+  if (!inverse && r_storage->config->get_alt_segment_size() > 0) {
+    // pack the data of the mails into segment objects of the alt storage (rbox_alt_segment_size)
+    ret = librmb::RadosUtils::move_to_alt_packed(oids, r_storage->s, r_storage->alt, r_storage->ms,
+                                                 r_storage->config->get_alt_segment_size(), &results);
+  } else {
+    ret = librmb::RadosUtils::move_to_alt(oids, r_storage->s, r_storage->alt, r_storage->ms, inverse,
+                                          RBOX_SYNC_ALT_MOVE_MAX_INFLIGHT, &results);
+  }
+  move_to_alt_update_flags(ctx, oids, seqs, results, inverse);
   return ret;
 }
 
@@ -198,6 +256,7 @@ static int update_flags(struct rbox_sync_context *ctx, uint32_t seq1, uint32_t s
     guid_128_t index_oid;
     if (rbox_get_oid_from_index(ctx->sync_view, seq1, ((struct rbox_mailbox *)box)->ext_id, &index_oid) >= 0) {
       const char *oid = guid_128_to_string(index_oid);
+      rbox_metadata_prefetch_forget(ctx->rbox, oid);
 
       librmb::RadosMail mail_object;
       mail_object.set_oid(oid);
@@ -444,66 +503,146 @@ int rbox_sync_begin(struct rbox_mailbox *rbox, struct rbox_sync_context **ctx_r,
   return 0;
 }
 
-static int rbox_sync_object_expunge(struct rbox_sync_context *ctx, struct expunged_item *item) {
+/* issues the asynchronous remove of the mail object.
+ * @return < 0 if the remove could not be started */
+static int rbox_sync_object_expunge_start(struct rbox_sync_context *ctx, struct rbox_sync_expunge_op *op) {
   FUNC_START();
   int ret_remove = -1;
   struct mailbox *box = &ctx->rbox->box;
   struct rbox_storage *r_storage = (struct rbox_storage *)box->storage;
 
-  const char *oid = guid_128_to_string(item->oid);
+  const char *oid = guid_128_to_string(op->item->oid);
 
-  ret_remove = rbox_open_rados_connection(box, item->alt_storage);
+  ret_remove = rbox_open_rados_connection(box, op->item->alt_storage);
   if (ret_remove < 0) {
     i_error("rbox_sync_object_expunge: connection to rados failed %d, alt_storage(%d), oid(%s)", ret_remove,
-            item->alt_storage, oid);
+            op->item->alt_storage, oid);
     FUNC_END();
     return ret_remove;
   }
-  librmb::RadosStorage *rados_storage = item->alt_storage ? r_storage->alt : r_storage->s;
-  ret_remove = rados_storage->get_io_ctx().remove(oid);
+  librmb::RadosStorage *rados_storage = op->item->alt_storage ? r_storage->alt : r_storage->s;
+  // ops on the same object are executed in order, so the xattrs are read before the object is removed.
+  // Mails may reference a single instance body, even if rbox_mail_dedup_min_size is disabled by now.
+  librados::ObjectReadOperation read_op;
+  op->refs = new rbox_sync_expunge_refs();
+  read_op.getxattr(RBOX_SIS_XATTR, &op->refs->sis_ref, &op->refs->sis_err);
+  read_op.set_op_flags2(librados::OP_FAILOK);
+  read_op.getxattr(RBOX_PACKED_XATTR, &op->refs->packed_ref, &op->refs->packed_err);
+  read_op.set_op_flags2(librados::OP_FAILOK);
+  op->refs_completion = librados::Rados::aio_create_completion();
+  if (rados_storage->get_io_ctx().aio_operate(oid, op->refs_completion, &read_op, NULL) < 0) {
+    op->refs_completion->release();
+    op->refs_completion = nullptr;
+  }
+  op->completion = librados::Rados::aio_create_completion();
+  ret_remove = rados_storage->get_io_ctx().aio_remove(oid, op->completion);
   if (ret_remove < 0) {
-    if(ret_remove != -ENOENT){
-    	i_error("rbox_sync_object_expunge: aio_remove failed with %d oid(%s), alt_storage(%d)", ret_remove, oid,
-            item->alt_storage);
-    }
+    i_error("rbox_sync_object_expunge: aio_remove failed with %d oid(%s), alt_storage(%d)", ret_remove, oid,
+            op->item->alt_storage);
+    op->completion->release();
+    op->completion = nullptr;
   }
-
   FUNC_END();
   return ret_remove;
 }
 
+/* removes the reference of the expunged mail from its single instance body object */
+static void rbox_sync_object_expunge_sis(struct rbox_sync_context *ctx, const std::string &sis_oid) {
+  struct rbox_storage *r_storage = (struct rbox_storage *)ctx->rbox->box.storage;
+  if (rbox_open_rados_connection(&ctx->rbox->box, false) < 0) {
+    i_error("rbox_sync_object_expunge: connection to rados failed, reference to %s not removed", sis_oid.c_str());
+    return;
+  }
+  librados::IoCtx sis_io_ctx;
+  librmb::RadosUtils::get_sis_io_ctx(&r_storage->s->get_io_ctx(), &sis_io_ctx);
+  int ret = librmb::RadosUtils::sis_remove_reference(&sis_io_ctx, sis_oid);
+  if (ret < 0) {
+    i_error("rbox_sync_object_expunge: removing reference to %s failed with %d", sis_oid.c_str(), ret);
+  }
+}
+
+/* removes the reference of the expunged stub from its segment, which may be compacted */
+static void rbox_sync_object_expunge_packed(struct rbox_sync_context *ctx, const std::string &packed_ref,
+                                            const std::string &oid) {
+  struct rbox_storage *r_storage = (struct rbox_storage *)ctx->rbox->box.storage;
+  int ret = librmb::RadosPackedSegment::remove_reference(&r_storage->alt->get_io_ctx(), packed_ref, oid);
+  if (ret < 0) {
+    i_error("rbox_sync_object_expunge: removing reference to %s failed with %d", packed_ref.c_str(), ret);
+  }
+}
+
+/* waits for the remove of the mail object and notifies the expunge */
+static void rbox_sync_object_expunge_finish(struct rbox_sync_context *ctx, struct rbox_sync_expunge_op *op) {
+  FUNC_START();
+  int ret_remove = -1;
+  if (op->completion != nullptr) {
+    op->completion->wait_for_complete();
+    ret_remove = op->completion->get_return_value();
+    op->completion->release();
+    op->completion = nullptr;
+    if (ret_remove < 0 && ret_remove != -ENOENT) {
+      i_error("rbox_sync_object_expunge: aio_remove failed with %d oid(%s), alt_storage(%d)", ret_remove,
+              guid_128_to_string(op->item->oid), op->item->alt_storage);
+    }
+  }
+  if (op->refs_completion != nullptr) {
+    op->refs_completion->wait_for_complete();
+    if (ret_remove >= 0 && op->refs_completion->get_return_value() >= 0) {
+      if (op->refs->sis_err >= 0 && op->refs->sis_ref.length() > 0) {
+        rbox_sync_object_expunge_sis(ctx, op->refs->sis_ref.to_str());
+      }
+      if (op->refs->packed_err >= 0 && op->refs->packed_ref.length() > 0) {
+        rbox_sync_object_expunge_packed(ctx, op->refs->packed_ref.to_str(), guid_128_to_string(op->item->oid));
+      }
+    }
+    op->refs_completion->release();
+    op->refs_completion = nullptr;
+  }
+  delete op->refs;
+  op->refs = nullptr;
+  // notify in the order of the expunged items.
+  if (ctx->rbox->box.v.sync_notify != NULL) {
+    ctx->rbox->box.v.sync_notify(&ctx->rbox->box, op->item->uid, MAILBOX_SYNC_TYPE_EXPUNGE);
+  }
+  FUNC_END();
+}
+
 static void rbox_sync_expunge_rbox_objects(struct rbox_sync_context *ctx) {
   FUNC_START();
   struct expunged_item *const *items, *item;
-  struct expunged_item *const *moved_items, *moved_item;
-  unsigned int count, moved_count = 0;
+  unsigned int count;
+  std::deque<struct rbox_sync_expunge_op> ops;
 
   // rbox_sync_object_expunge;
   items = array_get(&ctx->expunged_items, &count);
 
   if (count > 0) {
-    moved_items = array_get(&ctx->rbox->moved_items, &moved_count);
     for (unsigned int i = 0; i < count; i++) {
       T_BEGIN {
         item = items[i];
-        bool moved = FALSE;
-        for (unsigned j = 0; j < moved_count; j++) {
-          moved_item = moved_items[j];
-          if (guid_128_equals(moved_item->oid, item->oid)) {
-            moved = TRUE;
-            break;
-          }
-        }
-        if (moved != TRUE) {
-          rbox_sync_object_expunge(ctx, item);
-          // directly notify
-          if (ctx->rbox->box.v.sync_notify != NULL) {
-            ctx->rbox->box.v.sync_notify(&ctx->rbox->box, item->uid, MAILBOX_SYNC_TYPE_EXPUNGE);
+        if (!rbox_moved_items_contains(ctx->rbox, item->oid)) {
+          if (ops.size() >= RBOX_SYNC_EXPUNGE_MAX_INFLIGHT) {
+            rbox_sync_object_expunge_finish(ctx, &ops.front());
+            ops.pop_front();
           }
+          struct rbox_sync_expunge_op op;
+          op.item = item;
+          op.completion = nullptr;
+          op.refs_completion = nullptr;
+          op.refs = nullptr;
+          (void)rbox_sync_object_expunge_start(ctx, &op);
+          ops.push_back(op);
         }
       }
       T_END;
     }
+    while (!ops.empty()) {
+      T_BEGIN {
+        rbox_sync_object_expunge_finish(ctx, &ops.front());
+      }
+      T_END;
+      ops.pop_front();
+    }
     if (ctx->rbox->box.v.sync_notify != NULL) {
       ctx->rbox->box.v.sync_notify(&ctx->rbox->box, 0, static_cast<mailbox_sync_type>(0));
     }
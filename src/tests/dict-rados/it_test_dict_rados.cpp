@@ -9,6 +9,11 @@
  * Foundation.  See file COPYING.
  */
 
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <string>
+#include <thread>  // NOLINT
+
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 #include "TestCase.h"
@@ -106,6 +111,147 @@ TEST_F(DictTest, iterate) {
   ASSERT_EQ(dict_iterate_deinit(&iter, &error_r), 0);
 }
 
+TEST_F(DictTest, transaction_set_unset_atomic_inc) {
+  ASSERT_NE(target, nullptr);
+
+  struct dict_transaction_context *ctx = dict_transaction_begin(target);
+  dict_set(ctx, "priv/quota/storage", "10");
+  dict_set(ctx, "priv/quota/messages", "1");
+  dict_set(ctx, "priv/quota/unset", "1");
+  dict_set(ctx, "shared/quota/S1", "V-S1");
+  ASSERT_EQ(dict_transaction_commit(&ctx, &error_r), 1);
+
+  ctx = dict_transaction_begin(target);
+  dict_atomic_inc(ctx, "priv/quota/storage", 5);
+  dict_atomic_inc(ctx, "priv/quota/messages", 1);
+  dict_unset(ctx, "priv/quota/unset");
+  dict_set(ctx, "shared/quota/S2", "V-S2");
+  ASSERT_EQ(dict_transaction_commit(&ctx, &error_r), 1);
+
+  EXPECT_KVEQ("priv/quota/storage", "15");
+  EXPECT_KVEQ("priv/quota/messages", "2");
+  EXPECT_KVEQ("shared/quota/S1", "V-S1");
+  EXPECT_KVEQ("shared/quota/S2", "V-S2");
+  const char *v_r;
+  ASSERT_EQ(dict_lookup(target, s_test_pool, "priv/quota/unset", &v_r, &error_r), 0);
+}
+
+TEST_F(DictTest, transaction_atomic_inc_not_found) {
+  ASSERT_NE(target, nullptr);
+
+  struct dict_transaction_context *ctx = dict_transaction_begin(target);
+  dict_set(ctx, "priv/quota/inc", "1");
+  dict_set(ctx, "shared/quota/inc", "1");
+  ASSERT_EQ(dict_transaction_commit(&ctx, &error_r), 1);
+
+  // a missing key cancels the increments of the dict object, but not its other changes
+  ctx = dict_transaction_begin(target);
+  dict_atomic_inc(ctx, "priv/quota/inc", 1);
+  dict_atomic_inc(ctx, "priv/quota/inc_missing", 1);
+  dict_set(ctx, "priv/quota/inc_set", "V-SET");
+  dict_unset(ctx, "shared/quota/inc");
+  dict_atomic_inc(ctx, "shared/quota/inc_missing", 1);
+  ASSERT_EQ(dict_transaction_commit(&ctx, &error_r), 0);
+
+  EXPECT_KVEQ("priv/quota/inc", "1");
+  EXPECT_KVEQ("priv/quota/inc_set", "V-SET");
+  const char *v_r;
+  ASSERT_EQ(dict_lookup(target, s_test_pool, "priv/quota/inc_missing", &v_r, &error_r), 0);
+  ASSERT_EQ(dict_lookup(target, s_test_pool, "shared/quota/inc", &v_r, &error_r), 0);
+  ASSERT_EQ(dict_lookup(target, s_test_pool, "shared/quota/inc_missing", &v_r, &error_r), 0);
+}
+
+#if DOVECOT_PREREQ(2, 3)
+static void test_dict_commit_callback(const struct dict_commit_result *result, void *context) {
+  *static_cast<int *>(context) = result->ret;
+}
+#else
+static void test_dict_commit_callback(int ret, void *context) { *static_cast<int *>(context) = ret; }
+#endif
+
+TEST_F(DictTest, transaction_commit_async) {
+  ASSERT_NE(target, nullptr);
+
+  int commit_ret = -2;
+  struct dict_transaction_context *ctx = dict_transaction_begin(target);
+  dict_set(ctx, "priv/quota/async", "1");
+  dict_transaction_commit_async(&ctx, test_dict_commit_callback, &commit_ret);
+  dict_wait(target);
+  EXPECT_EQ(commit_ret, RADOS_COMMIT_RET_OK);
+  EXPECT_KVEQ("priv/quota/async", "1");
+
+  // missing key is not created
+  commit_ret = -2;
+  ctx = dict_transaction_begin(target);
+  dict_atomic_inc(ctx, "priv/quota/async", 1);
+  dict_atomic_inc(ctx, "priv/quota/async_missing", 1);
+  dict_transaction_commit_async(&ctx, test_dict_commit_callback, &commit_ret);
+  dict_wait(target);
+  EXPECT_EQ(commit_ret, RADOS_COMMIT_RET_NOTFOUND);
+  EXPECT_KVEQ("priv/quota/async", "1");
+  const char *v_r;
+  ASSERT_EQ(dict_lookup(target, s_test_pool, "priv/quota/async_missing", &v_r, &error_r), 0);
+}
+
+struct test_lookup_result {
+  int ret;
+  std::string value;
+  std::atomic<int> *done;
+};
+
+static void test_dict_lookup_callback(const struct dict_lookup_result *result, void *context) {
+  struct test_lookup_result *lookup = static_cast<struct test_lookup_result *>(context);
+  lookup->ret = result->ret;
+  if (result->value != nullptr) {
+    lookup->value = result->value;
+  }
+  (*lookup->done)++;
+}
+
+TEST_F(DictTest, lookup_async_coalesced) {
+  ASSERT_NE(target, nullptr);
+
+  struct dict_transaction_context *ctx = dict_transaction_begin(target);
+  dict_set(ctx, "priv/lookup/L1", "V-L1");
+  dict_set(ctx, "priv/lookup/L2", "V-L2");
+  dict_set(ctx, "shared/lookup/L1", "V-S-L1");
+  ASSERT_EQ(dict_transaction_commit(&ctx, &error_r), 1);
+
+  // the lookups are queued and read with one operation per dict object
+  std::atomic<int> done(0);
+  struct test_lookup_result results[5];
+  for (int i = 0; i < 5; i++) {
+    results[i].ret = -2;
+    results[i].done = &done;
+  }
+  dict_lookup_async(target, "priv/lookup/L1", test_dict_lookup_callback, &results[0]);
+  dict_lookup_async(target, "priv/lookup/L1", test_dict_lookup_callback, &results[1]);
+  dict_lookup_async(target, "priv/lookup/L2", test_dict_lookup_callback, &results[2]);
+  dict_lookup_async(target, "priv/lookup/missing", test_dict_lookup_callback, &results[3]);
+  dict_lookup_async(target, "shared/lookup/L1", test_dict_lookup_callback, &results[4]);
+  EXPECT_EQ(0, done);
+
+  // the next dict call submits the queued lookups, dict_wait is not required
+  const char *v_r;
+  ASSERT_EQ(dict_lookup(target, s_test_pool, "priv/lookup/L2", &v_r, &error_r), 1);
+  for (int i = 0; i < 100 && done < 5; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  ASSERT_EQ(5, done);
+
+  EXPECT_EQ(results[0].ret, RADOS_COMMIT_RET_OK);
+  EXPECT_EQ(results[0].value, "V-L1");
+  EXPECT_EQ(results[1].ret, RADOS_COMMIT_RET_OK);
+  EXPECT_EQ(results[1].value, "V-L1");
+  EXPECT_EQ(results[2].ret, RADOS_COMMIT_RET_OK);
+  EXPECT_EQ(results[2].value, "V-L2");
+  EXPECT_EQ(results[3].ret, RADOS_COMMIT_RET_NOTFOUND);
+  EXPECT_EQ(results[4].ret, RADOS_COMMIT_RET_OK);
+  EXPECT_EQ(results[4].value, "V-S-L1");
+  // releases the completions
+  dict_wait(target);
+}
+
 TEST_F(DictTest, deinit) {
   ASSERT_NE(target, nullptr);
   target->v.deinit(target);
@@ -12,6 +12,10 @@
 #include <ctime>
 #include <rados/librados.hpp>
 #include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 #include "../../librmb/rados-cluster-impl.h"
 #include "../../librmb/rados-storage-impl.h"
 #include "mock_test.h"
@@ -19,10 +23,13 @@
 #include "gmock/gmock.h"
 #include "../../librmb/rados-metadata-storage-default.h"
 #include "../../librmb/rados-metadata-storage-ima.h"
+#include "../../librmb/rados-metadata-storage-impl.h"
 #include "../../librmb/rados-dovecot-ceph-cfg-impl.h"
 #include "../../librmb/rados-util.h"
 #include "../../librmb/tools/rmb/rmb-commands.h"
 #include "../../librmb/rados-save-log.h"
+#include "../../librmb/rados-compression.h"
+#include "../../librmb/rados-packed-segment.h"
 
 using ::testing::AtLeast;
 using ::testing::Return;
@@ -702,6 +709,61 @@ TEST(librmb, test_default_metadata_load_attributes_obj_no_longer_exist_ima) {
   // tear down
   cluster.deinit();
 }
+/**
+ * Test batch metadata load with default reader, one of the objects does not exist.
+ */
+TEST(librmb, test_default_metadata_load_batch) {
+  uint64_t max_size = 3;
+
+  librados::ObjectWriteOperation op;
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+
+  std::string pool_name("test");
+  std::string ns("t1");
+
+  int open_connection = storage.open_connection(pool_name);
+  storage.set_namespace(ns);
+  EXPECT_EQ(0, open_connection);
+
+  librmb::RadosMetadataStorageDefault ms(&storage.get_io_ctx());
+
+  librmb::RadosMail obj;
+  librados::bufferlist buffer;
+  obj.set_mail_buffer(&buffer);
+  obj.get_mail_buffer()->append("abcdefghijklmn");
+  obj.set_mail_size(obj.get_mail_buffer()->length());
+  obj.set_oid("test_batch");
+  librmb::RadosMetadata attr(librmb::RBOX_METADATA_GUID, "guid");
+  obj.add_metadata(attr);
+  librmb::RadosMetadata ext_metadata("k_1", "1");
+  obj.add_extended_metadata(ext_metadata);
+
+  ms.save_metadata(&op, &obj);
+  EXPECT_EQ(0, storage.split_buffer_and_exec_op(&obj, &op, max_size));
+  storage.wait_for_write_operations_complete(obj.get_completion(), obj.get_write_operation());
+
+  librmb::RadosMail obj2;
+  obj2.set_oid("test_batch");
+  librmb::RadosMail obj3;
+  obj3.set_oid("test_batch_not_existing");
+  std::vector<librmb::RadosMail *> mails;
+  mails.push_back(&obj2);
+  mails.push_back(&obj3);
+
+  EXPECT_EQ(-2, ms.load_metadata_batch(mails));
+  EXPECT_TRUE(obj2.is_valid());
+  EXPECT_FALSE(obj3.is_valid());
+  char *guid = NULL;
+  librmb::RadosUtils::get_metadata(librmb::RBOX_METADATA_GUID, obj2.get_metadata(), &guid);
+  ASSERT_NE(nullptr, guid);
+  EXPECT_STREQ("guid", guid);
+  EXPECT_EQ(1u, obj2.get_extended_metadata()->size());
+
+  storage.delete_mail(&obj);
+  // tear down
+  cluster.deinit();
+}
 /**
  * Test osd increment
  */
@@ -1381,6 +1443,571 @@ TEST(librmb, move_object_delete_with_save_log) {
   EXPECT_EQ(storage.delete_mail("abc3"), 0);  // move does not delete the object
   cluster.deinit();
 }
+/**
+ * Test queued copy and move operations
+ */
+TEST(librmb, copy_async_move_commit_and_discard) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+
+  std::string pool_name("test");
+  std::string ns_src("t1");
+  std::string ns_dest("t2");
+
+  EXPECT_EQ(0, storage.open_connection(pool_name));
+  storage.set_namespace(ns_src);
+  librados::bufferlist bl;
+  bl.append("mail");
+  EXPECT_EQ(0, storage.save_mail("copy_async_1", bl));
+  EXPECT_EQ(0, storage.save_mail("copy_async_2", bl));
+  storage.set_namespace(ns_dest);
+
+  std::string oid1 = "copy_async_1";
+  std::string oid2 = "copy_async_2";
+  std::string missing = "copy_async_missing";
+  std::list<librmb::RadosMetadata> to_update;
+  std::map<std::string, int> failed;
+
+  // discarded move keeps the source, discarded copy removes the copy
+  {
+    librmb::RadosCopyOperations copy_ops;
+    EXPECT_EQ(0, storage.copy_async(&copy_ops, oid1, ns_src.c_str(), oid1, ns_dest.c_str(), to_update, true, 1));
+    EXPECT_EQ(0, storage.copy_async(&copy_ops, oid2, ns_src.c_str(), oid2, ns_dest.c_str(), to_update, false, 1));
+    EXPECT_EQ(0, storage.wait_for_copy_operations(&copy_ops, false, &failed));
+    EXPECT_TRUE(copy_ops.empty());
+  }
+  EXPECT_EQ(-ENOENT, storage.stat_mail(oid1, nullptr, nullptr));
+  EXPECT_EQ(-ENOENT, storage.stat_mail(oid2, nullptr, nullptr));
+
+  // a queue, which is not completed, is discarded
+  {
+    librmb::RadosCopyOperations copy_ops;
+    EXPECT_EQ(0, storage.copy_async(&copy_ops, oid2, ns_src.c_str(), oid2, ns_dest.c_str(), to_update, false, 0));
+  }
+  EXPECT_EQ(-ENOENT, storage.stat_mail(oid2, nullptr, nullptr));
+
+  // a failed operation keeps the sources of all moves
+  {
+    librmb::RadosCopyOperations copy_ops;
+    EXPECT_EQ(0, storage.copy_async(&copy_ops, oid1, ns_src.c_str(), oid1, ns_dest.c_str(), to_update, true, 1));
+    EXPECT_EQ(0, storage.copy_async(&copy_ops, missing, ns_src.c_str(), missing, ns_dest.c_str(), to_update, true, 1));
+    EXPECT_EQ(-ENOENT, storage.wait_for_copy_operations(&copy_ops, true, &failed));
+    EXPECT_EQ(1u, failed.size());
+    EXPECT_EQ(-ENOENT, failed[missing]);
+  }
+  EXPECT_EQ(-ENOENT, storage.stat_mail(oid1, nullptr, nullptr));
+
+  // the queues of concurrent transactions are independent
+  librmb::RadosCopyOperations move_ops;
+  librmb::RadosCopyOperations copy_ops;
+  EXPECT_EQ(0, storage.copy_async(&move_ops, oid1, ns_src.c_str(), oid1, ns_dest.c_str(), to_update, true, 0));
+  EXPECT_EQ(0, storage.copy_async(&copy_ops, oid2, ns_src.c_str(), oid2, ns_dest.c_str(), to_update, false, 0));
+  failed.clear();
+  EXPECT_EQ(0, storage.wait_for_copy_operations(&copy_ops, true, &failed));
+  EXPECT_EQ(0u, failed.size());
+  EXPECT_FALSE(move_ops.empty());
+  EXPECT_EQ(0, storage.wait_for_copy_operations(&move_ops, true, &failed));
+  EXPECT_EQ(0u, failed.size());
+  EXPECT_EQ(0, storage.delete_mail(oid1));
+  EXPECT_EQ(0, storage.delete_mail(oid2));
+
+  storage.set_namespace(ns_src);
+  EXPECT_EQ(-ENOENT, storage.delete_mail(oid1));
+  EXPECT_EQ(0, storage.delete_mail(oid2));
+  cluster.deinit();
+}
+/**
+ * Test that a move within the namespace updates the metadata on commit only
+ */
+TEST(librmb, copy_async_move_in_place) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+
+  std::string pool_name("test");
+  std::string ns("move_in_place");
+
+  EXPECT_EQ(0, storage.open_connection(pool_name));
+  storage.set_namespace(ns);
+  std::string oid = "move_in_place_1";
+  std::string missing = "move_in_place_missing";
+  librados::bufferlist bl;
+  bl.append("mail");
+  EXPECT_EQ(0, storage.save_mail(oid, bl));
+
+  std::list<librmb::RadosMetadata> to_update;
+  to_update.push_back(librmb::RadosMetadata(librmb::RBOX_METADATA_MAILBOX_GUID, "dest_mailbox"));
+  std::string key = librmb::rbox_metadata_key_to_char(librmb::RBOX_METADATA_MAILBOX_GUID);
+  std::map<std::string, int> failed;
+
+  // a discarded move keeps the metadata of the object
+  {
+    librmb::RadosCopyOperations copy_ops;
+    EXPECT_EQ(0, storage.copy_async(&copy_ops, oid, ns.c_str(), oid, ns.c_str(), to_update, true, 0));
+    EXPECT_EQ(0, storage.wait_for_copy_operations(&copy_ops, false, &failed));
+  }
+  librados::bufferlist value;
+  EXPECT_EQ(-ENODATA, storage.get_io_ctx().getxattr(oid, key.c_str(), value));
+
+  // a failed operation keeps the metadata of all moves
+  {
+    librmb::RadosCopyOperations copy_ops;
+    EXPECT_EQ(0, storage.copy_async(&copy_ops, oid, ns.c_str(), oid, ns.c_str(), to_update, true, 0));
+    EXPECT_EQ(0, storage.copy_async(&copy_ops, missing, ns.c_str(), missing, ns.c_str(), to_update, true, 0));
+    EXPECT_EQ(-ENOENT, storage.wait_for_copy_operations(&copy_ops, true, &failed));
+    EXPECT_EQ(-ENOENT, failed[missing]);
+  }
+  EXPECT_EQ(-ENODATA, storage.get_io_ctx().getxattr(oid, key.c_str(), value));
+  EXPECT_EQ(-ENOENT, storage.stat_mail(missing, nullptr, nullptr));
+
+  // the committed move updates the metadata and keeps the object
+  {
+    librmb::RadosCopyOperations copy_ops;
+    EXPECT_EQ(0, storage.copy_async(&copy_ops, oid, ns.c_str(), oid, ns.c_str(), to_update, true, 0));
+    EXPECT_EQ(-ENODATA, storage.get_io_ctx().getxattr(oid, key.c_str(), value));
+    failed.clear();
+    EXPECT_EQ(0, storage.wait_for_copy_operations(&copy_ops, true, &failed));
+    EXPECT_EQ(0u, failed.size());
+  }
+  EXPECT_LT(0, storage.get_io_ctx().getxattr(oid, key.c_str(), value));
+  EXPECT_STREQ("dest_mailbox", value.c_str());
+
+  EXPECT_EQ(0, storage.delete_mail(oid));
+  cluster.deinit();
+}
+/**
+ * Test that the sliced listing returns the same objects as the plain listing
+ */
+TEST(librmb, list_mails_slices) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+
+  std::string pool_name("test");
+  std::string ns("list_slices");
+
+  EXPECT_EQ(0, storage.open_connection(pool_name));
+  storage.set_namespace(ns);
+  librados::bufferlist bl;
+  bl.append("mail");
+  for (int i = 0; i < 20; i++) {
+    EXPECT_EQ(0, storage.save_mail("list_slices_" + std::to_string(i), bl));
+  }
+
+  std::set<std::string> plain;
+  for (librados::NObjectIterator iter = storage.find_mails(nullptr); iter != librados::NObjectIterator::__EndObjectIterator;
+       ++iter) {
+    plain.insert(iter->get_oid());
+  }
+  EXPECT_EQ(20u, plain.size());
+
+  std::list<librmb::RadosMetadata> predicates;
+  std::list<std::string> oids;
+  EXPECT_EQ(0, storage.list_mails(4, predicates, &oids));
+  EXPECT_EQ(plain.size(), oids.size());
+  std::set<std::string> sliced(oids.begin(), oids.end());
+  EXPECT_EQ(plain, sliced);
+
+  oids.clear();
+  EXPECT_EQ(0, storage.list_mails(1, predicates, &oids));
+  EXPECT_EQ(plain, std::set<std::string>(oids.begin(), oids.end()));
+
+  for (auto &oid : plain) {
+    EXPECT_EQ(0, storage.delete_mail(oid));
+  }
+  cluster.deinit();
+}
+/**
+ * single instance storage: the body object is created with the first reference
+ * and removed with the last one.
+ */
+TEST(librmb, sis_add_and_remove_reference) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+  EXPECT_EQ(0, storage.open_connection("test"));
+  storage.set_namespace("sis_test");
+
+  librados::IoCtx sis_io_ctx;
+  librmb::RadosUtils::get_sis_io_ctx(&storage.get_io_ctx(), &sis_io_ctx);
+  std::string sis_oid = RBOX_SIS_OID_PREFIX "sis_add_and_remove_reference";
+  std::set<std::string> keys;
+  keys.insert(RBOX_SIS_REFS_KEY);
+  std::map<std::string, librados::bufferlist> refs;
+
+  // a reference without content needs an existing object
+  EXPECT_EQ(-ENOENT, librmb::RadosUtils::sis_add_reference(&sis_io_ctx, sis_oid, nullptr));
+
+  librados::bufferlist body;
+  body.append("body");
+  EXPECT_EQ(0, librmb::RadosUtils::sis_add_reference(&sis_io_ctx, sis_oid, &body));
+  // the content of the second save is not written again
+  librados::bufferlist body2;
+  body2.append("other");
+  EXPECT_EQ(0, librmb::RadosUtils::sis_add_reference(&sis_io_ctx, sis_oid, &body2));
+  EXPECT_EQ(0, librmb::RadosUtils::sis_add_reference(&sis_io_ctx, sis_oid, nullptr));
+  EXPECT_EQ(0, sis_io_ctx.omap_get_vals_by_keys(sis_oid, keys, &refs));
+  EXPECT_EQ("3", refs[RBOX_SIS_REFS_KEY].to_str());
+  librados::bufferlist content;
+  EXPECT_EQ(4, sis_io_ctx.read(sis_oid, content, 0, 0));
+  EXPECT_EQ("body", content.to_str());
+
+  EXPECT_EQ(0, librmb::RadosUtils::sis_remove_reference(&sis_io_ctx, sis_oid));
+  EXPECT_EQ(0, librmb::RadosUtils::sis_remove_reference(&sis_io_ctx, sis_oid));
+  refs.clear();
+  EXPECT_EQ(0, sis_io_ctx.omap_get_vals_by_keys(sis_oid, keys, &refs));
+  EXPECT_EQ("1", refs[RBOX_SIS_REFS_KEY].to_str());
+
+  // the last reference removes the object
+  EXPECT_EQ(0, librmb::RadosUtils::sis_remove_reference(&sis_io_ctx, sis_oid));
+  EXPECT_EQ(-ENOENT, sis_io_ctx.stat(sis_oid, nullptr, nullptr));
+  EXPECT_EQ(-ENOENT, librmb::RadosUtils::sis_remove_reference(&sis_io_ctx, sis_oid));
+  cluster.deinit();
+}
+/**
+ * Test read_mail of a deduplicated mail
+ *
+ */
+TEST(librmb, read_mail_sis) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+  EXPECT_EQ(0, storage.open_connection("test"));
+  storage.set_namespace("sis_read_test");
+
+  std::string header = "Subject: deduplicated\r\n\r\n";
+  std::string body = "the body of the mail\r\n";
+  librados::IoCtx sis_io_ctx;
+  librmb::RadosUtils::get_sis_io_ctx(&storage.get_io_ctx(), &sis_io_ctx);
+  std::string sis_oid = RBOX_SIS_OID_PREFIX "read_mail_sis";
+  librados::bufferlist body_bl;
+  body_bl.append(body);
+  EXPECT_EQ(0, librmb::RadosUtils::sis_add_reference(&sis_io_ctx, sis_oid, &body_bl));
+
+  // the mail object holds the header and the reference to the body
+  librados::bufferlist header_bl;
+  header_bl.append(header);
+  librados::bufferlist sis_ref;
+  sis_ref.append(sis_oid);
+  librados::ObjectWriteOperation write_op;
+  write_op.write_full(header_bl);
+  write_op.setxattr(RBOX_SIS_XATTR, sis_ref);
+  EXPECT_EQ(0, storage.get_io_ctx().operate("read_mail_sis", &write_op));
+
+  librados::bufferlist bl;
+  EXPECT_EQ(static_cast<int>(header.size() + body.size()), storage.read_mail("read_mail_sis", &bl));
+  EXPECT_EQ(header + body, bl.to_str());
+
+  // the body is missing, but the mail object exists
+  EXPECT_EQ(0, librmb::RadosUtils::sis_remove_reference(&sis_io_ctx, sis_oid));
+  librados::bufferlist bl2;
+  EXPECT_EQ(-EIO, storage.read_mail("read_mail_sis", &bl2));
+
+  EXPECT_EQ(0, storage.delete_mail("read_mail_sis"));
+  cluster.deinit();
+}
+/**
+ * Test read_mail of a compressed mail
+ *
+ */
+TEST(librmb, read_mail_compressed) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+  EXPECT_EQ(0, storage.open_connection("test"));
+  storage.set_namespace("compression_test");
+
+  std::string content = "Subject: compressed\r\n\r\n";
+  for (int i = 0; i < 1000; i++) {
+    content += "some body text, which compresses well\r\n";
+  }
+  std::string codecs[] = {RBOX_COMPRESSION_ZSTD, RBOX_COMPRESSION_LZ4};
+  for (const std::string &codec : codecs) {
+    if (!librmb::RadosCompression::is_supported(codec)) {
+      continue;
+    }
+    storage.set_compression(codec, 0);
+    librmb::RadosMail mail;
+    librados::bufferlist buffer;
+    buffer.append(content);
+    mail.set_mail_buffer(&buffer);
+    mail.set_mail_size(buffer.length());
+    mail.set_oid("read_mail_compressed_" + codec);
+    bool save_async = false;
+    EXPECT_TRUE(storage.save_mail(&mail, save_async));
+
+    // the object holds the compressed mail
+    uint64_t size = 0;
+    time_t save_date;
+    EXPECT_EQ(0, storage.stat_mail(*mail.get_oid(), &size, &save_date));
+    EXPECT_LT(size, content.size());
+
+    librados::bufferlist bl;
+    EXPECT_EQ(static_cast<int>(content.size()), storage.read_mail(*mail.get_oid(), &bl));
+    EXPECT_EQ(content, bl.to_str());
+    EXPECT_EQ(0, storage.delete_mail(*mail.get_oid()));
+  }
+  cluster.deinit();
+}
+/**
+ * Test save and read of inline mails (with and without compression)
+ *
+ */
+TEST(librmb, inline_mail_save_and_read) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+  EXPECT_EQ(0, storage.open_connection("test"));
+  storage.set_namespace("inline_test");
+  librmb::RadosMetadataStorageDefault ms(&storage.get_io_ctx());
+
+  std::string content = "Subject: inline\r\n\r\n";
+  for (int i = 0; i < 100; i++) {
+    content += "some body text, which compresses well\r\n";
+  }
+  std::string codecs[] = {"", RBOX_COMPRESSION_ZSTD, RBOX_COMPRESSION_LZ4};
+  for (const std::string &codec : codecs) {
+    if (!codec.empty() && !librmb::RadosCompression::is_supported(codec)) {
+      continue;
+    }
+    storage.set_compression(codec, 0);
+    // the compressed mail fits, the uncompressed mail doesn't
+    storage.set_mail_inline_max_size(codec.empty() ? content.size() : content.size() - 1);
+
+    librmb::RadosMail mail;
+    librados::bufferlist buffer;
+    buffer.append(content);
+    mail.set_mail_buffer(&buffer);
+    mail.set_mail_size(buffer.length());
+    mail.set_oid("inline_mail_save_and_read_" + codec);
+    librmb::RadosMetadata guid(librmb::RBOX_METADATA_GUID, "guid");
+    mail.add_metadata(guid);
+    bool save_async = false;
+    EXPECT_TRUE(storage.save_mail(&mail, save_async));
+
+    // the object has no data
+    uint64_t size = 1;
+    time_t save_date;
+    EXPECT_EQ(0, storage.stat_mail(*mail.get_oid(), &size, &save_date));
+    EXPECT_EQ(0u, size);
+
+    librados::bufferlist bl;
+    EXPECT_EQ(static_cast<int>(content.size()), storage.read_mail(*mail.get_oid(), &bl));
+    EXPECT_EQ(content, bl.to_str());
+
+    // the inline data is no metadata
+    librmb::RadosMail loaded;
+    loaded.set_oid(*mail.get_oid());
+    EXPECT_EQ(0, ms.load_metadata(&loaded));
+    EXPECT_EQ(loaded.get_metadata()->end(), loaded.get_metadata()->find(RBOX_INLINE_XATTR));
+    EXPECT_NE(loaded.get_metadata()->end(), loaded.get_metadata()->find("G"));
+    EXPECT_EQ(0, storage.delete_mail(*mail.get_oid()));
+  }
+  cluster.deinit();
+}
+/**
+ * Test the upper bound of the inline size
+ *
+ */
+TEST(librmb, inline_mail_max_size_limit) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+  EXPECT_EQ(0, storage.open_connection("test"));
+  storage.set_namespace("inline_test");
+  storage.set_mail_inline_max_size(1024 * 1024);
+
+  librmb::RadosMail mail;
+  librados::bufferlist buffer;
+  buffer.append(std::string(RBOX_INLINE_MAX_SIZE_LIMIT + 1, 'a'));
+  mail.set_mail_buffer(&buffer);
+  mail.set_mail_size(buffer.length());
+  mail.set_oid("inline_mail_max_size_limit");
+  EXPECT_FALSE(storage.is_inline_mail(&mail));
+  bool save_async = false;
+  EXPECT_TRUE(storage.save_mail(&mail, save_async));
+
+  uint64_t size = 0;
+  time_t save_date;
+  EXPECT_EQ(0, storage.stat_mail(*mail.get_oid(), &size, &save_date));
+  EXPECT_EQ(static_cast<uint64_t>(RBOX_INLINE_MAX_SIZE_LIMIT + 1), size);
+
+  librados::bufferlist bl;
+  EXPECT_EQ(RBOX_INLINE_MAX_SIZE_LIMIT + 1, storage.read_mail(*mail.get_oid(), &bl));
+  EXPECT_EQ(0, storage.delete_mail(*mail.get_oid()));
+
+  mail.set_mail_size(RBOX_INLINE_MAX_SIZE_LIMIT);
+  EXPECT_TRUE(storage.is_inline_mail(&mail));
+  cluster.deinit();
+}
+/* creates a segment with count mails of 4 bytes and their stubs stub.<i> */
+static std::string create_test_segment(librados::IoCtx *io_ctx, const std::string &name, int count) {
+  std::string segment_oid = RBOX_SEGMENT_OID_PREFIX + name;
+  librados::bufferlist data;
+  std::map<std::string, librados::bufferlist> entries;
+  for (int i = 0; i < count; i++) {
+    std::string oid = name + ".stub." + std::to_string(i);
+    entries[librmb::RadosPackedSegment::entry_key(oid)].append(
+        librmb::RadosPackedSegment::to_entry(data.length(), 4, io_ctx->get_namespace()));
+    librados::bufferlist ref;
+    ref.append(librmb::RadosPackedSegment::to_ref(segment_oid, data.length(), 4, io_ctx->get_namespace()));
+    EXPECT_EQ(0, io_ctx->setxattr(oid, RBOX_PACKED_XATTR, ref));
+    data.append(std::string(4, 'a' + i));
+  }
+  EXPECT_EQ(0, librmb::RadosPackedSegment::create(io_ctx, segment_oid, data, entries));
+  return segment_oid;
+}
+
+/* removes the stub and its reference */
+static void remove_test_stub(librados::IoCtx *io_ctx, const std::string &oid) {
+  librados::bufferlist ref;
+  EXPECT_LT(0, io_ctx->getxattr(oid, RBOX_PACKED_XATTR, ref));
+  EXPECT_EQ(0, io_ctx->remove(oid));
+  EXPECT_EQ(0, librmb::RadosPackedSegment::remove_reference(io_ctx, ref.to_str(), oid));
+}
+
+/**
+ * Test reference counting and compaction of a packed segment
+ *
+ */
+TEST(librmb, packed_segment_compaction) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+  EXPECT_EQ(0, storage.open_connection("test"));
+  storage.set_namespace("segment_test");
+  librados::IoCtx *io_ctx = &storage.get_io_ctx();
+
+  std::string segment_oid = create_test_segment(io_ctx, "compaction", 4);
+  std::string stub0 = "compaction.stub.0";
+  // a copy of stub 0 references the same data
+  std::string copy0 = "compaction.copy.0";
+  librados::bufferlist ref0;
+  EXPECT_LT(0, io_ctx->getxattr(stub0, RBOX_PACKED_XATTR, ref0));
+  EXPECT_EQ(0, io_ctx->setxattr(copy0, RBOX_PACKED_XATTR, ref0));
+  EXPECT_EQ(0, librmb::RadosPackedSegment::add_reference(io_ctx, ref0.to_str(), copy0));
+
+  // half of the data is dead, shared data isn't
+  remove_test_stub(io_ctx, "compaction.stub.1");
+  remove_test_stub(io_ctx, "compaction.stub.2");
+  uint64_t size = 0;
+  EXPECT_EQ(0, io_ctx->stat(segment_oid, &size, nullptr));
+  EXPECT_EQ(16u, size);
+
+  // stub 0 and its copy are moved to a new segment
+  remove_test_stub(io_ctx, "compaction.stub.3");
+  EXPECT_EQ(-ENOENT, io_ctx->stat(segment_oid, nullptr, nullptr));
+  librados::bufferlist new_ref;
+  librados::bufferlist new_copy_ref;
+  EXPECT_LT(0, io_ctx->getxattr(stub0, RBOX_PACKED_XATTR, new_ref));
+  EXPECT_LT(0, io_ctx->getxattr(copy0, RBOX_PACKED_XATTR, new_copy_ref));
+  EXPECT_FALSE(new_ref.contents_equal(ref0));
+  EXPECT_TRUE(new_ref.contents_equal(new_copy_ref));
+  librados::bufferlist data;
+  EXPECT_EQ(0, librmb::RadosPackedSegment::read(io_ctx, new_ref.to_str(), &data));
+  EXPECT_EQ("aaaa", data.to_str());
+
+  // the last reference removes the segment
+  std::string new_segment_oid;
+  std::string nspace;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  EXPECT_TRUE(librmb::RadosPackedSegment::parse_ref(new_ref.to_str(), &new_segment_oid, &offset, &length, &nspace));
+  remove_test_stub(io_ctx, copy0);
+  EXPECT_EQ(0, io_ctx->stat(new_segment_oid, nullptr, nullptr));
+  remove_test_stub(io_ctx, stub0);
+  EXPECT_EQ(-ENOENT, io_ctx->stat(new_segment_oid, nullptr, nullptr));
+  cluster.deinit();
+}
+
+/**
+ * Test that a pinned segment or a segment compacted by someone else is not compacted
+ *
+ */
+TEST(librmb, packed_segment_compaction_locked) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl storage(&cluster);
+  EXPECT_EQ(0, storage.open_connection("test"));
+  storage.set_namespace("segment_test");
+  librados::IoCtx *io_ctx = &storage.get_io_ctx();
+
+  std::string segment_oid = create_test_segment(io_ctx, "locked", 3);
+  std::string stub0 = "locked.stub.0";
+  librados::bufferlist ref0;
+  EXPECT_LT(0, io_ctx->getxattr(stub0, RBOX_PACKED_XATTR, ref0));
+
+  // a copy of stub 0 is in progress
+  std::string ref;
+  EXPECT_EQ(0, librmb::RadosPackedSegment::pin(io_ctx, stub0, "locked.copy.0", &ref));
+  EXPECT_EQ(ref0.to_str(), ref);
+  remove_test_stub(io_ctx, "locked.stub.1");
+  remove_test_stub(io_ctx, "locked.stub.2");
+  EXPECT_EQ(0, io_ctx->stat(segment_oid, nullptr, nullptr));
+  EXPECT_EQ(0, librmb::RadosPackedSegment::unpin(io_ctx, ref, "locked.copy.0"));
+
+  // another compaction is running
+  struct timeval duration = {RBOX_SEGMENT_LOCK_DURATION, 0};
+  EXPECT_EQ(0, io_ctx->lock_exclusive(segment_oid, RBOX_SEGMENT_LOCK, "other", "", &duration, 0));
+  EXPECT_EQ(0, librmb::RadosPackedSegment::compact(io_ctx, segment_oid));
+  EXPECT_EQ(0, io_ctx->stat(segment_oid, nullptr, nullptr));
+  librados::bufferlist current_ref;
+  EXPECT_LT(0, io_ctx->getxattr(stub0, RBOX_PACKED_XATTR, current_ref));
+  EXPECT_TRUE(current_ref.contents_equal(ref0));
+  EXPECT_EQ(0, io_ctx->unlock(segment_oid, RBOX_SEGMENT_LOCK, "other"));
+
+  EXPECT_EQ(0, librmb::RadosPackedSegment::compact(io_ctx, segment_oid));
+  EXPECT_EQ(-ENOENT, io_ctx->stat(segment_oid, nullptr, nullptr));
+  remove_test_stub(io_ctx, stub0);
+  cluster.deinit();
+}
+/**
+ * Test the windowed move between primary and alt storage, packed stubs are moved back
+ * one by one.
+ *
+ */
+TEST(librmb, move_to_alt_window) {
+  librmb::RadosClusterImpl cluster;
+  librmb::RadosStorageImpl primary(&cluster);
+  librmb::RadosStorageImpl alt(&cluster);
+  EXPECT_EQ(0, primary.open_connection("test"));
+  EXPECT_EQ(0, alt.open_connection("test_alt"));
+  primary.set_namespace("move_to_alt_test");
+  alt.set_namespace("move_to_alt_test");
+  librmb::RadosDovecotCephCfgImpl cfg(&primary.get_io_ctx());
+  librmb::RadosMetadataStorageImpl ms;
+  ms.create_metadata_storage(&primary.get_io_ctx(), &cfg);
+
+  std::vector<std::string> oids;
+  for (int i = 0; i < 5; i++) {
+    oids.push_back("move_to_alt_window_" + std::to_string(i));
+    librados::bufferlist bl;
+    bl.append("mail " + std::to_string(i));
+    EXPECT_EQ(0, primary.save_mail(oids.back(), bl));
+  }
+  // the first two mails are packed, the others are moved with a window of two
+  std::vector<std::string> packed(oids.begin(), oids.begin() + 2);
+  std::vector<std::string> unpacked(oids.begin() + 2, oids.end());
+  std::vector<int> results;
+  EXPECT_EQ(0, librmb::RadosUtils::move_to_alt_packed(packed, &primary, &alt, &ms, 1024, &results));
+  EXPECT_EQ(0, librmb::RadosUtils::move_to_alt(unpacked, &primary, &alt, &ms, false, 2, &results));
+  EXPECT_EQ(std::vector<int>(unpacked.size(), 0), results);
+  for (size_t i = 0; i < oids.size(); i++) {
+    EXPECT_EQ(-ENOENT, primary.stat_mail(oids[i], nullptr, nullptr));
+  }
+  librados::bufferlist packed_ref;
+  EXPECT_LT(0, alt.get_io_ctx().getxattr(packed[0], RBOX_PACKED_XATTR, packed_ref));
+  std::string segment_oid;
+  std::string nspace;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  EXPECT_TRUE(
+      librmb::RadosPackedSegment::parse_ref(packed_ref.to_str(), &segment_oid, &offset, &length, &nspace));
+
+  EXPECT_EQ(0, librmb::RadosUtils::move_to_alt(oids, &primary, &alt, &ms, true, 2, &results));
+  EXPECT_EQ(std::vector<int>(oids.size(), 0), results);
+  for (size_t i = 0; i < oids.size(); i++) {
+    librados::bufferlist bl;
+    EXPECT_EQ(static_cast<int>(("mail " + std::to_string(i)).size()), primary.read_mail(oids[i], &bl));
+    EXPECT_EQ("mail " + std::to_string(i), bl.to_str());
+    EXPECT_EQ(-ENOENT, alt.stat_mail(oids[i], nullptr, nullptr));
+    EXPECT_EQ(0, primary.delete_mail(oids[i]));
+  }
+  // the references of the moved stubs are removed
+  EXPECT_EQ(-ENOENT, alt.get_io_ctx().stat(segment_oid, nullptr, nullptr));
+  cluster.deinit();
+}
 TEST(librmb, mock_obj) {}
 int main(int argc, char **argv) {
   ::testing::InitGoogleMock(&argc, argv);
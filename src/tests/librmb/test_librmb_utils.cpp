@@ -10,11 +10,13 @@
  */
 
 #include <ctime>
+#include <unistd.h>
 #include <rados/librados.hpp>
 
 #include "../../librmb/rados-cluster-impl.h"
 #include "../../librmb/rados-ceph-json-config.h"
 #include "../../librmb/rados-storage-impl.h"
+#include "../../librmb/rados-dictionary-impl.h"
 #include "mock_test.h"
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
@@ -22,10 +24,16 @@
 #include "rados-types.h"
 #include "rados-save-log.h"
 #include "rados-mail.h"
+#include "rados-dovecot-config.h"
+#include "rados-compression.h"
+#include "rados-packed-segment.h"
+#include "rados-dictionary-cache.h"
 #include <cstdio>
+#include <cerrno>
 #include <pthread.h>
 
 using ::testing::AtLeast;
+using ::testing::Ref;
 using ::testing::Return;
 
 TEST(librmb, get_metadata_1) {
@@ -178,6 +186,36 @@ TEST(librmb, config_mutable_metadata) {
   EXPECT_TRUE(config2.is_mail_attribute(librmb::RBOX_METADATA_POP3_UIDL));
 }
 
+TEST(librmb, config_metadata_batch_size) {
+  librmb::RadosConfig config;
+  EXPECT_EQ(100, config.get_metadata_batch_size());
+
+  config.update_metadata("rbox_metadata_batch_size", "0");
+  EXPECT_EQ(0, config.get_metadata_batch_size());
+
+  // invalid values fall back to disabled
+  config.update_metadata("rbox_metadata_batch_size", "abc");
+  EXPECT_EQ(0, config.get_metadata_batch_size());
+  config.update_metadata("rbox_metadata_batch_size", "-5");
+  EXPECT_EQ(0, config.get_metadata_batch_size());
+}
+
+TEST(librmb, remove_mail_cache_keys) {
+  std::map<std::string, librados::bufferlist> kv_map;
+  kv_map["1"].append("keyword_1");
+  kv_map[RBOX_MAIL_CACHE_KEY_HEADER].append("Subject: test\n\n");
+  kv_map[RBOX_MAIL_CACHE_KEY_ENVELOPE].append("NIL");
+  kv_map["z"].append("keyword_z");
+
+  EXPECT_TRUE(librmb::RadosUtils::is_mail_cache_key(RBOX_MAIL_CACHE_KEY_BODYSTRUCTURE));
+  EXPECT_FALSE(librmb::RadosUtils::is_mail_cache_key("1"));
+
+  librmb::RadosUtils::remove_mail_cache_keys(&kv_map);
+  EXPECT_EQ(2, kv_map.size());
+  EXPECT_TRUE(kv_map.find("1") != kv_map.end());
+  EXPECT_TRUE(kv_map.find("z") != kv_map.end());
+}
+
 TEST(librmb, convert_flags) {
   uint8_t flags = 0x3f;
   std::string s;
@@ -377,6 +415,246 @@ TEST(librmb, test_mvn_option) {
   std::remove(test_file_name.c_str());
 }
 
+TEST(librmb, append_to_segment) {
+  librados::bufferlist bl;
+  librados::bufferptr segment;
+  std::string data = "0123456789";
+  for (int i = 0; i < 5; i++) {
+    librmb::RadosUtils::append_to_segment(data.c_str(), data.length(), 16, &segment, &bl);
+  }
+  EXPECT_EQ(50, bl.length());
+  EXPECT_EQ(data + data + data + data + data, bl.to_str());
+  // 4 segments of 16 bytes, adjacent appends are merged
+  EXPECT_EQ(4, bl.buffers().size());
+  for (std::list<librados::bufferptr>::const_iterator it = bl.buffers().begin(); it != bl.buffers().end(); ++it) {
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(it->c_str()) % sysconf(_SC_PAGESIZE));
+  }
+}
+/**
+ * appends larger than a segment and unaligned appends are split over
+ * the segments, the content is unchanged
+ */
+TEST(librmb, append_to_segment_split) {
+  const size_t segment_size = 4096;
+  std::string data;
+  for (int i = 0; i < 3 * 4096 + 100; i++) {
+    data.push_back(static_cast<char>('a' + i % 26));
+  }
+  librados::bufferlist bl;
+  librados::bufferptr segment;
+  // one append larger than two segments, followed by small unaligned appends
+  librmb::RadosUtils::append_to_segment(data.c_str(), 2 * segment_size + 10, segment_size, &segment, &bl);
+  for (size_t offset = 2 * segment_size + 10; offset < data.length(); offset += 333) {
+    size_t n = std::min<size_t>(333, data.length() - offset);
+    librmb::RadosUtils::append_to_segment(data.c_str() + offset, n, segment_size, &segment, &bl);
+  }
+  EXPECT_EQ(data.length(), bl.length());
+  EXPECT_EQ(data, bl.to_str());
+  EXPECT_EQ(4u, bl.buffers().size());
+  // a range across the segment boundary
+  librados::bufferlist tmp;
+  tmp.substr_of(bl, segment_size - 1, 2);
+  EXPECT_EQ(data.substr(segment_size - 1, 2), tmp.to_str());
+}
+
+TEST(librmb, find_header_end) {
+  int state = 1;
+  std::string part1 = "Subject: test\r\nFrom: a@b.de\r";
+  std::string part2 = "\n\r";
+  std::string part3 = "\nbody\r\n\r\n";
+  EXPECT_EQ(0, librmb::RadosUtils::find_header_end(part1.c_str(), part1.length(), &state));
+  EXPECT_EQ(0, librmb::RadosUtils::find_header_end(part2.c_str(), part2.length(), &state));
+  // the empty line is split between the parts
+  EXPECT_EQ(1, librmb::RadosUtils::find_header_end(part3.c_str(), part3.length(), &state));
+
+  state = 1;
+  std::string lf_only = "Subject: test\n\nbody\n";
+  EXPECT_EQ(15, librmb::RadosUtils::find_header_end(lf_only.c_str(), lf_only.length(), &state));
+
+  state = 1;
+  std::string no_body = "Subject: test\r\n";
+  EXPECT_EQ(0, librmb::RadosUtils::find_header_end(no_body.c_str(), no_body.length(), &state));
+}
+
+TEST(librmb, compression_metadata) {
+  std::string codec;
+  size_t size = 0;
+  EXPECT_TRUE(librmb::RadosCompression::from_metadata(librmb::RadosCompression::to_metadata("zstd", 4711), &codec,
+                                                      &size));
+  EXPECT_EQ("zstd", codec);
+  EXPECT_EQ(4711u, size);
+  EXPECT_FALSE(librmb::RadosCompression::from_metadata("zstd", &codec, &size));
+  EXPECT_FALSE(librmb::RadosCompression::from_metadata(":10", &codec, &size));
+  EXPECT_FALSE(librmb::RadosCompression::from_metadata("zstd:abc", &codec, &size));
+
+  int level = 0;
+  EXPECT_FALSE(librmb::RadosCompression::parse_config("unknown:3", &codec, &level));
+  EXPECT_FALSE(librmb::RadosCompression::parse_config("zstd:abc", &codec, &level));
+}
+
+TEST(librmb, compression_roundtrip) {
+  std::string mail = "Subject: test\r\nFrom: a@b.de\r\n\r\n";
+  for (int i = 0; i < 1000; i++) {
+    mail += "some body text, which compresses well\r\n";
+  }
+  std::string codecs[] = {RBOX_COMPRESSION_ZSTD, RBOX_COMPRESSION_LZ4};
+  for (const std::string &codec : codecs) {
+    librados::bufferlist in;
+    in.append(mail);
+    librados::bufferlist compressed;
+    if (!librmb::RadosCompression::is_supported(codec)) {
+      EXPECT_EQ(-ENOTSUP, librmb::RadosCompression::compress(codec, 0, in, &compressed));
+      continue;
+    }
+    EXPECT_EQ(0, librmb::RadosCompression::compress(codec, 0, in, &compressed));
+    EXPECT_LT(compressed.length(), in.length());
+
+    librados::bufferlist out;
+    EXPECT_EQ(0, librmb::RadosCompression::decompress(codec, compressed, in.length(), &out));
+    EXPECT_TRUE(out.contents_equal(in));
+
+    // wrong size of the uncompressed data
+    librados::bufferlist invalid;
+    EXPECT_GT(0, librmb::RadosCompression::decompress(codec, compressed, in.length() + 1, &invalid));
+  }
+}
+
+/* write operation, which records the copy_from of RadosUtils::copy_from */
+class CopyFromWriteOpMock {
+ public:
+#if LIBRADOS_VERSION_CODE >= 30000
+  MOCK_METHOD4(copy_from, void(const std::string &src, const librados::IoCtx &src_ioctx, uint64_t src_version,
+                               uint32_t src_fadvise_flags));
+#else
+  MOCK_METHOD3(copy_from, void(const std::string &src, const librados::IoCtx &src_ioctx, uint64_t src_version));
+#endif
+};
+
+TEST(librmb, copy_from) {
+  CopyFromWriteOpMock write_op;
+  librados::IoCtx src_io_ctx;
+  // copy of the current version of the source without fadvise flags
+#if LIBRADOS_VERSION_CODE >= 30000
+  EXPECT_CALL(write_op, copy_from("src_oid", Ref(src_io_ctx), 0u, 0u)).Times(1);
+#else
+  EXPECT_CALL(write_op, copy_from("src_oid", Ref(src_io_ctx), 0u)).Times(1);
+#endif
+  librmb::RadosUtils::copy_from(&write_op, "src_oid", src_io_ctx);
+}
+
+TEST(librmb, object_data_xattr) {
+  EXPECT_TRUE(librmb::RadosUtils::is_object_data_xattr(
+      librmb::rbox_metadata_key_to_char(librmb::RBOX_METADATA_COMPRESSION)));
+  EXPECT_TRUE(librmb::RadosUtils::is_object_data_xattr(RBOX_SIS_XATTR));
+  EXPECT_TRUE(librmb::RadosUtils::is_object_data_xattr(RBOX_INLINE_XATTR));
+  EXPECT_TRUE(librmb::RadosUtils::is_object_data_xattr(RBOX_PACKED_XATTR));
+  EXPECT_FALSE(librmb::RadosUtils::is_object_data_xattr(
+      librmb::rbox_metadata_key_to_char(librmb::RBOX_METADATA_GUID)));
+  EXPECT_FALSE(librmb::RadosUtils::is_object_data_xattr("rbox.other"));
+}
+
+TEST(librmb, packed_segment_ref) {
+  std::string ref = librmb::RadosPackedSegment::to_ref("seg.abc", 4096, 512, "user_ns");
+  std::string segment_oid;
+  std::string nspace;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  EXPECT_TRUE(librmb::RadosPackedSegment::parse_ref(ref, &segment_oid, &offset, &length, &nspace));
+  EXPECT_EQ("seg.abc", segment_oid);
+  EXPECT_EQ(4096u, offset);
+  EXPECT_EQ(512u, length);
+  EXPECT_EQ("user_ns", nspace);
+
+  // the namespace may be empty or contain ':'
+  EXPECT_TRUE(librmb::RadosPackedSegment::parse_ref("seg.abc:0:1:", &segment_oid, &offset, &length, &nspace));
+  EXPECT_EQ("", nspace);
+  EXPECT_TRUE(librmb::RadosPackedSegment::parse_ref("seg.abc:0:1:a:b", &segment_oid, &offset, &length, &nspace));
+  EXPECT_EQ("a:b", nspace);
+
+  EXPECT_FALSE(librmb::RadosPackedSegment::parse_ref("seg.abc:0:1", &segment_oid, &offset, &length, &nspace));
+  EXPECT_FALSE(librmb::RadosPackedSegment::parse_ref("seg.abc:x:1:", &segment_oid, &offset, &length, &nspace));
+  // segment entries have no segment oid
+  EXPECT_FALSE(librmb::RadosPackedSegment::parse_ref(librmb::RadosPackedSegment::to_entry(0, 1, "user_ns"),
+                                                     &segment_oid, &offset, &length, &nspace));
+  EXPECT_EQ(std::string(RBOX_SEGMENT_ENTRY_PREFIX) + "abc", librmb::RadosPackedSegment::entry_key("abc"));
+}
+
+TEST(librmb, dictionary_cache) {
+  librmb::RadosDictionaryCache cache;
+  std::string value;
+  bool found = false;
+  // disabled by default
+  cache.update("priv/quota/storage", &value, cache.get_generation());
+  EXPECT_FALSE(cache.lookup("priv/quota/storage", &value, &found));
+  // writes start a new generation, even if the cache is disabled
+  uint64_t disabled_generation = cache.get_generation();
+  cache.invalidate("priv/quota/storage");
+  EXPECT_NE(disabled_generation, cache.get_generation());
+
+  std::list<std::string> bypass;
+  bypass.push_back("shared/");
+  cache.configure(2, 0, bypass);
+  // entries always expire
+  EXPECT_EQ(static_cast<unsigned int>(RBOX_DICT_CACHE_DEFAULT_TTL), cache.get_ttl());
+
+  std::string storage = "10";
+  cache.update("priv/quota/storage", &storage, cache.get_generation());
+  cache.update("priv/quota/messages", nullptr, cache.get_generation());
+  cache.update("shared/acl", &storage, cache.get_generation());
+  EXPECT_TRUE(cache.lookup("priv/quota/storage", &value, &found));
+  EXPECT_TRUE(found);
+  EXPECT_EQ("10", value);
+  EXPECT_TRUE(cache.lookup("priv/quota/messages", &value, &found));
+  EXPECT_FALSE(found);
+  EXPECT_FALSE(cache.lookup("shared/acl", &value, &found));
+  EXPECT_EQ(2u, cache.get_hits());
+  // bypassed keys are not counted
+  EXPECT_EQ(0u, cache.get_misses());
+
+  // least recently used entry is removed
+  cache.lookup("priv/quota/storage", &value, &found);
+  cache.update("priv/last_login", &storage, cache.get_generation());
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_FALSE(cache.lookup("priv/quota/messages", &value, &found));
+  EXPECT_EQ(1u, cache.get_misses());
+
+  // lookup started before the invalidation does not update the cache
+  uint64_t generation = cache.get_generation();
+  cache.invalidate("priv/quota/storage");
+  EXPECT_FALSE(cache.lookup("priv/quota/storage", &value, &found));
+  cache.update("priv/quota/storage", &storage, generation);
+  EXPECT_FALSE(cache.lookup("priv/quota/storage", &value, &found));
+
+  // and so do writes of bypassed keys
+  generation = cache.get_generation();
+  cache.invalidate("shared/acl");
+  EXPECT_NE(generation, cache.get_generation());
+}
+
+TEST(librmb, dictionary_shared_shards) {
+  librmb::RadosDictionaryImpl dict(nullptr, "mail_dictionaries", "username", "dict_oid", nullptr, "rbox_cfg");
+  // not sharded by default
+  EXPECT_EQ(1u, dict.get_shared_shards());
+  EXPECT_EQ("dict_oid", dict.get_full_oid("shared/mailbox/acl"));
+  EXPECT_EQ("dict_oid", dict.get_full_oid("priv/quota/storage"));
+
+  dict.set_shared_shards(4);
+  EXPECT_EQ(4u, dict.get_shared_shards());
+  EXPECT_EQ("dict_oid.3", dict.get_shared_shard_oid(3));
+  EXPECT_EQ("dict_oid", dict.get_full_oid("priv/quota/storage"));
+
+  std::set<std::string> shards;
+  for (int i = 0; i < 64; i++) {
+    std::string key = "shared/mailbox/acl/" + std::to_string(i);
+    std::string shard_oid = dict.get_full_oid(key);
+    // same shard for the same key
+    EXPECT_EQ(shard_oid, dict.get_full_oid(key));
+    shards.insert(shard_oid);
+  }
+  EXPECT_EQ(4u, shards.size());
+  EXPECT_EQ(1u, shards.count("dict_oid.0"));
+}
+
 /*TEST(librmb, test_if) {
   int arr[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
 
@@ -33,6 +33,7 @@ class RadosStorageMock : public RadosStorage {
  public:
   MOCK_METHOD0(get_io_ctx, librados::IoCtx &());
   MOCK_METHOD3(stat_mail, int(const std::string &oid, uint64_t *psize, time_t *pmtime));
+  MOCK_METHOD3(get_sis_reference, int(const std::string &oid, const std::string &ns, std::string *sis_oid));
   MOCK_METHOD1(set_namespace, void(const std::string &nspace));
   MOCK_METHOD0(get_namespace, std::string());
 
@@ -49,6 +50,8 @@ class RadosStorageMock : public RadosStorage {
   MOCK_METHOD4(aio_operate, int(librados::IoCtx *io_ctx_, const std::string &oid, librados::AioCompletion *c,
                                 librados::ObjectWriteOperation *op));
   MOCK_METHOD1(find_mails, librados::NObjectIterator(const RadosMetadata *attr));
+  MOCK_METHOD1(find_mails, librados::NObjectIterator(const std::list<RadosMetadata> &predicates));
+  MOCK_METHOD3(list_mails, int(int slices, const std::list<RadosMetadata> &predicates, std::list<std::string> *oids));
   MOCK_METHOD1(open_connection, int(const std::string &poolname));
   MOCK_METHOD3(open_connection,
                int(const std::string &poolname, const std::string &clustername, const std::string &rados_username));
@@ -57,12 +60,22 @@ class RadosStorageMock : public RadosStorage {
                bool(librados::AioCompletion *completion, librados::ObjectWriteOperation *write_operation));
   MOCK_METHOD1(wait_for_rados_operations, bool(const std::list<librmb::RadosMail *> &object_list));
   MOCK_METHOD1(set_ceph_wait_method, void(enum librmb::rbox_ceph_aio_wait_method wait_method));
+  MOCK_METHOD2(set_compression, void(const std::string &codec, int level));
+  MOCK_METHOD1(set_mail_inline_max_size, void(uint64_t max_size));
+  MOCK_METHOD2(compress_mail, void(RadosMail *mail, librados::ObjectWriteOperation *write_op));
+  MOCK_METHOD1(is_inline_mail, bool(RadosMail *mail));
   MOCK_METHOD2(read_mail, int(const std::string &oid, librados::bufferlist *buffer));
+  MOCK_METHOD4(read_mail, int(const std::string &oid, librados::bufferlist *buffer, uint64_t offset, size_t length));
   MOCK_METHOD6(move, int(std::string &src_oid, const char *src_ns, std::string &dest_oid, const char *dest_ns,
                          std::list<RadosMetadata> &to_update, bool delete_source));
 
   MOCK_METHOD5(copy, int(std::string &src_oid, const char *src_ns, std::string &dest_oid, const char *dest_ns,
                          std::list<RadosMetadata> &to_update));
+  MOCK_METHOD8(copy_async, int(librmb::RadosCopyOperations *copy_ops, std::string &src_oid, const char *src_ns,
+                               std::string &dest_oid, const char *dest_ns, std::list<RadosMetadata> &to_update,
+                               bool delete_source, unsigned int max_inflight));
+  MOCK_METHOD3(wait_for_copy_operations,
+               int(librmb::RadosCopyOperations *copy_ops, bool commit, std::map<std::string, int> *failed));
   MOCK_METHOD2(save_mail, int(const std::string &oid, librados::bufferlist &bufferlist));
   MOCK_METHOD2(save_mail, bool(RadosMail *mail, bool &save_async));
   MOCK_METHOD3(save_mail, bool(librados::ObjectWriteOperation *write_op, RadosMail *mail, bool save_async));
@@ -78,10 +91,13 @@ class RadosStorageMetadataMock : public RadosStorageMetadataModule {
  public:
   MOCK_METHOD1(set_io_ctx, void(librados::IoCtx *io_ctx));
   MOCK_METHOD1(load_metadata, int(RadosMail *mail));
+  MOCK_METHOD1(load_metadata_batch, int(std::vector<RadosMail *> &mails));
   MOCK_METHOD2(set_metadata, int(RadosMail *mail, RadosMetadata &xattr));
   MOCK_METHOD3(set_metadata, int(RadosMail *mail, RadosMetadata &xattr, librados::ObjectWriteOperation *write_op));
 
   MOCK_METHOD2(update_metadata, bool(const std::string &oid, std::list<RadosMetadata> &to_update));
+  MOCK_METHOD3(update_metadata,
+               void(librados::ObjectWriteOperation *write_op, RadosMail *mail, std::list<RadosMetadata> &to_update));
   // MOCK_METHOD2(save_metadata, void(librados::ObjectWriteOperation *write_op, RadosMailObject *mail));
   void save_metadata(librados::ObjectWriteOperation *write_op, RadosMail *mail) {
     // delete write_op to avoid memory leak in case mocks are used
@@ -111,6 +127,9 @@ class RadosDictionaryMock : public RadosDictionary {
   MOCK_METHOD1(get_full_oid, const std::string(const std::string &key));
   MOCK_METHOD0(get_shared_oid, const std::string());
   MOCK_METHOD0(get_private_oid, const std::string());
+  MOCK_METHOD1(set_shared_shards, void(unsigned int shards));
+  MOCK_METHOD0(get_shared_shards, unsigned int());
+  MOCK_METHOD1(get_shared_shard_oid, const std::string(unsigned int shard));
   MOCK_METHOD0(get_oid, const std::string &());
   MOCK_METHOD0(get_username, const std::string &());
   MOCK_METHOD0(get_io_ctx, librados::IoCtx &());
@@ -118,6 +137,10 @@ class RadosDictionaryMock : public RadosDictionary {
   MOCK_METHOD1(push_back_completion, void(librados::AioCompletion *c));
   MOCK_METHOD0(wait_for_completions, void());
   MOCK_METHOD2(get, int(const std::string &key, std::string *value_r));
+  MOCK_METHOD0(get_cache, librmb::RadosDictionaryCache *());
+  MOCK_METHOD3(lookup_async,
+               void(const std::string &key, librmb::RadosDictionaryLookupCallback callback, void *context));
+  MOCK_METHOD0(flush_lookups, void());
 };
 
 using librmb::RadosCluster;
@@ -150,6 +173,17 @@ class RadosDovecotCephCfgMock : public RadosDovecotCephCfg {
   MOCK_METHOD0(is_ceph_posix_bugfix_enabled, bool());
   MOCK_METHOD0(is_ceph_aio_wait_for_safe_and_cb, bool());
   MOCK_METHOD0(is_write_chunks, bool());
+  MOCK_METHOD0(get_metadata_batch_size, int());
+  MOCK_METHOD0(get_read_chunk_size, int());
+  MOCK_METHOD0(get_save_segment_size, int());
+  MOCK_METHOD0(get_write_chunk_size, int());
+  MOCK_METHOD0(get_write_chunks_max_inflight, int());
+  MOCK_METHOD0(get_save_max_inflight, int());
+  MOCK_METHOD0(get_mail_dedup_min_size, int());
+  MOCK_METHOD0(get_compression, const std::string &());
+  MOCK_METHOD0(get_mail_inline_max_size, int());
+  MOCK_METHOD0(get_alt_segment_size, int());
+  MOCK_METHOD0(is_mail_omap_cache, bool());
 
   MOCK_METHOD1(update_mail_attributes, void(const char *value));
   MOCK_METHOD1(update_updatable_attributes, void(const char *value));
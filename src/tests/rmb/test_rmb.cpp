@@ -60,6 +60,24 @@ TEST(rmb, test_cmd_parser) {
   EXPECT_FALSE(p3->eval(value));
 }
 
+/**
+ * Test filter pushdown
+ * - equality predicates are pushed down, mailbox guid first
+ * - date ranges are evaluated by the client
+ */
+TEST(rmb1, rmb_commands_filter_predicates) {
+  librmbtest::RadosStorageMetadataMock ms_module_mock;
+  librmb::CmdLineParser parser("U=1;M=abc;R<2013-12-04 15:03");
+  EXPECT_TRUE(parser.parse_ls_string());
+
+  std::list<librmb::RadosMetadata> predicates;
+  librmb::RmbCommands::get_filter_predicates(&ms_module_mock, &parser, &predicates);
+  ASSERT_EQ(2, (int)predicates.size());
+  EXPECT_EQ("M", predicates.front().key);
+  EXPECT_EQ("abc", std::string(predicates.front().bl.c_str()));
+  EXPECT_EQ("U", predicates.back().key);
+}
+
 /**
  * Test date predicate
  */
@@ -152,11 +170,58 @@ TEST(rmb1, rmb_commands_no_objects_found) {
   librados::IoCtx test_ioctx;
 
   EXPECT_CALL(storage_mock, find_mails(nullptr)).WillRepeatedly(Return(iter));
+  EXPECT_CALL(storage_mock, list_mails(RMB_LIST_SLICES, _, _)).WillOnce(Return(0));
   EXPECT_CALL(storage_mock, get_io_ctx()).WillRepeatedly(ReturnRef(test_ioctx));
   EXPECT_CALL(storage_mock, stat_mail(_, _, _)).WillRepeatedly(Return(0));
   int ret = rmb_cmd.load_objects(&ms_module_mock, mails, search_string);
   EXPECT_EQ(ret, 0);
 }
+/**
+ * Test rmb commands
+ * - listing error is returned
+ */
+TEST(rmb1, rmb_commands_list_mails_error) {
+  librmbtest::RadosStorageMock storage_mock;
+  librmbtest::RadosClusterMock cluster_mock;
+  librmbtest::RadosStorageMetadataMock ms_module_mock;
+
+  std::map<std::string, std::string> opts;
+  librmb::RmbCommands rmb_cmd(&storage_mock, &cluster_mock, &opts);
+  std::list<librmb::RadosMail *> mails;
+  std::string search_string = "uid";
+
+  EXPECT_CALL(storage_mock, list_mails(RMB_LIST_SLICES, _, _)).WillOnce(Return(-ENOENT));
+  int ret = rmb_cmd.load_objects(&ms_module_mock, mails, search_string);
+  EXPECT_EQ(ret, -ENOENT);
+  EXPECT_EQ(mails.size(), 0);
+}
+/**
+ * Test rmb commands
+ * - number of list slices is configurable and bounded
+ */
+TEST(rmb1, rmb_commands_list_slices) {
+  librmbtest::RadosStorageMock storage_mock;
+  librmbtest::RadosClusterMock cluster_mock;
+  librmbtest::RadosStorageMetadataMock ms_module_mock;
+
+  std::map<std::string, std::string> opts;
+  opts["list_slices"] = "3";
+  librmb::RmbCommands rmb_cmd(&storage_mock, &cluster_mock, &opts);
+  EXPECT_EQ(3, rmb_cmd.get_list_slices());
+  std::list<librmb::RadosMail *> mails;
+  std::string search_string = "uid";
+
+  EXPECT_CALL(storage_mock, list_mails(3, _, _)).WillOnce(Return(0));
+  int ret = rmb_cmd.load_objects(&ms_module_mock, mails, search_string);
+  EXPECT_EQ(ret, 0);
+
+  opts["list_slices"] = "1000";
+  librmb::RmbCommands rmb_cmd_max(&storage_mock, &cluster_mock, &opts);
+  EXPECT_EQ(RMB_LIST_MAX_SLICES, rmb_cmd_max.get_list_slices());
+  opts["list_slices"] = "abc";
+  librmb::RmbCommands rmb_cmd_invalid(&storage_mock, &cluster_mock, &opts);
+  EXPECT_EQ(RMB_LIST_SLICES, rmb_cmd_invalid.get_list_slices());
+}
 /**
  * Test rmb commands
  * - search filter
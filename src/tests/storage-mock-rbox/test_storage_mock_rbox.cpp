@@ -13,6 +13,10 @@
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 
+#include <set>
+#include <string>
+#include <vector>
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wshadow"           // turn off warnings for Dovecot :-(
 #pragma GCC diagnostic ignored "-Wundef"            // turn off warnings for Dovecot :-(
@@ -42,9 +46,11 @@ extern "C" {
 #include "../mocks/mock_test.h"
 #include "rados-dovecot-ceph-cfg-impl.h"
 #include "../../storage-rbox/istream-bufferlist.h"
+#include "../../storage-rbox/istream-rados.h"
 #include "../../storage-rbox/ostream-bufferlist.h"
 using ::testing::_;
 using ::testing::AtLeast;
+using ::testing::Invoke;
 using ::testing::Matcher;
 using ::testing::Return;
 using ::testing::ReturnRef;
@@ -225,6 +231,8 @@ TEST_F(StorageTest, save_mail_fail_test) {
   EXPECT_CALL(*cfg_mock, get_rados_cluster_name()).WillRepeatedly(ReturnRef(cluster));
   EXPECT_CALL(*cfg_mock, get_pool_name()).WillRepeatedly(ReturnRef(pool));
   EXPECT_CALL(*cfg_mock, get_user_suffix()).WillRepeatedly(ReturnRef(suffix));
+  std::string compression = "";
+  EXPECT_CALL(*cfg_mock, get_compression()).WillRepeatedly(ReturnRef(compression));
   storage->ns_mgr->set_config(cfg_mock);
 
   storage->config = cfg_mock;
@@ -356,6 +364,8 @@ TEST_F(StorageTest, write_op_fails) {
   EXPECT_CALL(*cfg_mock, get_rados_cluster_name()).WillRepeatedly(ReturnRef(cluster));
   EXPECT_CALL(*cfg_mock, get_pool_name()).WillRepeatedly(ReturnRef(pool));
   EXPECT_CALL(*cfg_mock, get_user_suffix()).WillRepeatedly(ReturnRef(suffix));
+  std::string compression = "";
+  EXPECT_CALL(*cfg_mock, get_compression()).WillRepeatedly(ReturnRef(compression));
   storage->ns_mgr->set_config(cfg_mock);
 
   storage->config = cfg_mock;
@@ -506,7 +516,8 @@ TEST_F(StorageTest, mock_copy_failed_due_to_rados_err) {
       .WillOnce(Return(test_object2));
   EXPECT_CALL(*storage_mock_copy, wait_for_rados_operations(_)).Times(AtLeast(1)).WillRepeatedly(Return(false));
 
-  EXPECT_CALL(*storage_mock_copy, copy(_, _, _, _, _)).WillRepeatedly(Return(-1));
+  EXPECT_CALL(*storage_mock_copy, copy_async(_, _, _, _, _, _, false, _)).WillRepeatedly(Return(-1));
+  EXPECT_CALL(*storage_mock_copy, wait_for_copy_operations(_, _, _)).WillRepeatedly(Return(0));
   EXPECT_CALL(*storage_mock_copy, get_io_ctx()).WillRepeatedly(ReturnRef(test_ioctx));
 
   storage->s = storage_mock_copy;
@@ -530,6 +541,8 @@ TEST_F(StorageTest, mock_copy_failed_due_to_rados_err) {
   EXPECT_CALL(*cfg_mock, get_rados_cluster_name()).WillRepeatedly(ReturnRef(cluster));
   EXPECT_CALL(*cfg_mock, get_pool_name()).WillRepeatedly(ReturnRef(pool));
   EXPECT_CALL(*cfg_mock, get_user_suffix()).WillRepeatedly(ReturnRef(suffix));
+  std::string compression = "";
+  EXPECT_CALL(*cfg_mock, get_compression()).WillRepeatedly(ReturnRef(compression));
   storage->ns_mgr->set_config(cfg_mock);
 
   storage->config = cfg_mock;
@@ -597,7 +610,36 @@ TEST_F(StorageTest, copy_input_to_output_stream) {
 
   librados::bufferlist buffer2;
   mail.set_mail_buffer(&buffer2);
-  output = o_stream_create_bufferlist(&mail, nullptr, false);
+  output = o_stream_create_bufferlist(&mail, nullptr, false, 0);
+  input = i_stream_create_from_bufferlist(buffer, physical_size);
+
+  do {
+    if (o_stream_send_istream(output, input) < 0) {
+      EXPECT_EQ(1, -1);
+    }
+
+  } while (i_stream_read(input) > 0);
+
+  EXPECT_EQ(buffer->to_str(), mail.get_mail_buffer()->to_str());
+  o_stream_unref(&output);
+  i_stream_unref(&input);
+}
+/**
+ * eval copy from input to output stream, using page aligned segments
+ */
+TEST_F(StorageTest, copy_input_to_output_stream_segments) {
+  librados::bufferlist *buffer = new librados::bufferlist();
+  librmb::RadosMail mail;
+  for (int i = 0; i < 1000; i++) {
+    buffer->append("Subject: segment test\r\n");
+  }
+  unsigned long physical_size = buffer->length();
+  struct istream *input;
+  struct ostream *output;
+
+  librados::bufferlist buffer2;
+  mail.set_mail_buffer(&buffer2);
+  output = o_stream_create_bufferlist(&mail, nullptr, false, 4096);
   input = i_stream_create_from_bufferlist(buffer, physical_size);
 
   do {
@@ -608,9 +650,312 @@ TEST_F(StorageTest, copy_input_to_output_stream) {
   } while (i_stream_read(input) > 0);
 
   EXPECT_EQ(buffer->to_str(), mail.get_mail_buffer()->to_str());
+  EXPECT_EQ(physical_size / 4096 + 1, mail.get_mail_buffer()->buffers().size());
+  o_stream_unref(&output);
+  i_stream_unref(&input);
+}
+/**
+ * Error test:
+ *
+ * - chunked writes: a failed chunk write fails the output stream
+ */
+TEST_F(StorageTest, write_chunks_failed) {
+  librmbtest::RadosStorageMock storage;
+  librmb::RadosMail mail;
+  librados::IoCtx test_ioctx;
+  std::string oid = "oid";
+  mail.set_oid(oid);
+
+  EXPECT_CALL(storage, get_io_ctx()).WillRepeatedly(ReturnRef(test_ioctx));
+  EXPECT_CALL(storage, aio_operate(_, "oid", _, _)).Times(1).WillOnce(Return(-EIO));
+
+  librados::bufferlist buffer;
+  mail.set_mail_buffer(&buffer);
+  struct ostream *output = o_stream_create_bufferlist(&mail, &storage, true, 0);
+  o_stream_bufferlist_set_write_chunks(output, 4, 2);
+
+  std::string data = "abc";
+  // below chunk size, nothing is written
+  EXPECT_EQ(3, o_stream_send(output, data.c_str(), data.length()));
+  EXPECT_EQ(-1, o_stream_send(output, data.c_str(), data.length()));
+  EXPECT_EQ(0, buffer.length());
+  EXPECT_EQ(-1, o_stream_bufferlist_finish_writes(output));
   o_stream_unref(&output);
+}
+/**
+ * read a mail object with ranged reads, the first chunk is already loaded.
+ */
+TEST_F(StorageTest, read_rados_istream_ranged) {
+  librmbtest::RadosStorageMock storage;
+  std::string content = "Subject: test\n\nbody of the mail";
+  librados::bufferlist *first_chunk = new librados::bufferlist();
+  first_chunk->append(content.substr(0, 4));
+
+  EXPECT_CALL(storage, read_mail("oid", _, _, _))
+      .WillRepeatedly(
+          Invoke([&content](const std::string &oid, librados::bufferlist *buffer, uint64_t offset, size_t length) {
+            std::string part = content.substr(offset, length);
+            buffer->append(part);
+            return static_cast<int>(part.length());
+          }));
+
+  struct istream *input = i_stream_create_rados(&storage, "oid", first_chunk, content.length(), 4);
+  const unsigned char *data = NULL;
+  size_t size = 0;
+  std::string result;
+  while (i_stream_read_data(input, &data, &size, 0) > 0) {
+    result.append(reinterpret_cast<const char *>(data), size);
+    i_stream_skip(input, size);
+  }
+  EXPECT_EQ(0, input->stream_errno);
+  EXPECT_EQ(content, result);
+
+  // seek back, data is read again
+  i_stream_seek(input, 2);
+  ASSERT_GT(i_stream_read_data(input, &data, &size, 0), 0);
+  EXPECT_EQ(content.substr(2, size), std::string(reinterpret_cast<const char *>(data), size));
   i_stream_unref(&input);
 }
+
+/**
+ * read error is reported as stream error.
+ */
+TEST_F(StorageTest, read_rados_istream_read_fails) {
+  librmbtest::RadosStorageMock storage;
+  librados::bufferlist *first_chunk = new librados::bufferlist();
+  first_chunk->append("abcd");
+
+  EXPECT_CALL(storage, read_mail("oid", _, _, _)).WillOnce(Return(-ENOENT));
+
+  struct istream *input = i_stream_create_rados(&storage, "oid", first_chunk, 10, 4);
+  const unsigned char *data = NULL;
+  size_t size = 0;
+  ASSERT_GT(i_stream_read_data(input, &data, &size, 0), 0);
+  i_stream_skip(input, size);
+  EXPECT_EQ(-1, i_stream_read_data(input, &data, &size, 0));
+  EXPECT_EQ(ENOENT, input->stream_errno);
+  i_stream_unref(&input);
+}
+
+/* mocks and recorded calls of the save window tests */
+struct save_window_mocks {
+  librmbtest::RadosStorageMock *storage_mock;
+  librmbtest::RadosStorageMetadataMock ms_mock;
+  std::vector<librmb::RadosMail *> allocated;
+  /* oids passed to save_mail */
+  std::vector<std::string> saved;
+  /* oids of each wait_for_rados_operations call */
+  std::vector<std::vector<std::string>> waits;
+  std::set<librmb::RadosMail *> freed;
+};
+
+/* replaces storage, config and metadata module of the box with mocks, which record the object writes
+ * and waits. The wait call with index failing_wait fails. */
+static void set_save_window_mocks(struct mailbox *box, struct save_window_mocks *m, int max_inflight,
+                                  int failing_wait) {
+  static std::string user = "client.admin";
+  static std::string cluster = "ceph";
+  static std::string pool = "mail_storage";
+  static std::string suffix = "_u";
+  static std::string compression = "";
+
+  struct rbox_storage *storage = (struct rbox_storage *)box->storage;
+  delete storage->s;
+  m->storage_mock = new librmbtest::RadosStorageMock();
+  static librados::IoCtx test_ioctx;
+  EXPECT_CALL(*m->storage_mock, get_io_ctx()).WillRepeatedly(ReturnRef(test_ioctx));
+  EXPECT_CALL(*m->storage_mock, open_connection("mail_storage", "ceph", "client.admin")).WillRepeatedly(Return(0));
+  EXPECT_CALL(*m->storage_mock, read_mail(_, _)).WillRepeatedly(Return(-2));
+  EXPECT_CALL(*m->storage_mock, wait_for_copy_operations(_, _, _)).WillRepeatedly(Return(0));
+  EXPECT_CALL(*m->storage_mock, alloc_rados_mail()).WillRepeatedly(Invoke([m]() {
+    librmb::RadosMail *mail = new librmb::RadosMail();
+    mail->set_mail_buffer(nullptr);
+    m->allocated.push_back(mail);
+    return mail;
+  }));
+  EXPECT_CALL(*m->storage_mock, free_rados_mail(_)).WillRepeatedly(Invoke([m](librmb::RadosMail *mail) {
+    m->freed.insert(mail);
+  }));
+  // the write is started, but not completed
+  EXPECT_CALL(*m->storage_mock, save_mail(Matcher<librados::ObjectWriteOperation *>(_), _, _))
+      .WillRepeatedly(Invoke([m](librados::ObjectWriteOperation *, librmb::RadosMail *mail, bool) {
+        mail->set_active_op(1);
+        m->saved.push_back(*mail->get_oid());
+        return true;
+      }));
+  EXPECT_CALL(*m->storage_mock, wait_for_rados_operations(_))
+      .WillRepeatedly(Invoke([m, failing_wait](const std::list<librmb::RadosMail *> &object_list) {
+        std::vector<std::string> oids;
+        for (std::list<librmb::RadosMail *>::const_iterator it = object_list.begin(); it != object_list.end(); ++it) {
+          oids.push_back(*(*it)->get_oid());
+        }
+        m->waits.push_back(oids);
+        return static_cast<int>(m->waits.size()) - 1 == failing_wait;
+      }));
+
+  delete storage->config;
+  librmbtest::RadosDovecotCephCfgMock *cfg_mock = new librmbtest::RadosDovecotCephCfgMock();
+  EXPECT_CALL(*cfg_mock, is_config_valid()).WillRepeatedly(Return(true));
+  EXPECT_CALL(*cfg_mock, get_rados_username()).WillRepeatedly(ReturnRef(user));
+  EXPECT_CALL(*cfg_mock, get_rados_cluster_name()).WillRepeatedly(ReturnRef(cluster));
+  EXPECT_CALL(*cfg_mock, get_pool_name()).WillRepeatedly(ReturnRef(pool));
+  EXPECT_CALL(*cfg_mock, get_user_suffix()).WillRepeatedly(ReturnRef(suffix));
+  EXPECT_CALL(*cfg_mock, get_compression()).WillRepeatedly(ReturnRef(compression));
+  EXPECT_CALL(*cfg_mock, get_save_max_inflight()).WillRepeatedly(Return(max_inflight));
+  storage->ns_mgr->set_config(cfg_mock);
+  storage->config = cfg_mock;
+  storage->s = m->storage_mock;
+
+  delete storage->ms;
+  librmbtest::RadosMetadataStorageProducerMock *ms_p_mock = new librmbtest::RadosMetadataStorageProducerMock();
+  storage->ms = ms_p_mock;
+  EXPECT_CALL(*ms_p_mock, get_storage()).WillRepeatedly(Return(&m->ms_mock));
+  EXPECT_CALL(m->ms_mock, set_metadata(_, _)).WillRepeatedly(Return(0));
+}
+
+static void free_save_window_mocks(struct save_window_mocks *m) {
+  for (std::vector<librmb::RadosMail *>::iterator it = m->allocated.begin(); it != m->allocated.end(); ++it) {
+    if ((*it)->get_mail_buffer() != nullptr) {
+      delete (*it)->get_mail_buffer();
+    }
+    delete *it;
+  }
+}
+
+/* saves one mail in the transaction, returns -1 on failure */
+static int save_window_save_mail(struct mailbox_transaction_context *trans) {
+  const char *message =
+      "From: user@domain.org\n"
+      "Date: Sat, 24 Mar 2017 23:00:00 +0200\n"
+      "Mime-Version: 1.0\n"
+      "Content-Type: text/plain; charset=us-ascii\n"
+      "\n"
+      "body\n";
+  struct istream *input = i_stream_create_from_data(message, strlen(message));
+  struct mail_save_context *save_ctx = mailbox_save_alloc(trans);
+  int ret = mailbox_save_begin(&save_ctx, input);
+  if (ret == 0) {
+    do {
+      if (mailbox_save_continue(save_ctx) < 0) {
+        ret = -1;
+        break;
+      }
+    } while (i_stream_read(input) > 0);
+    if (ret < 0) {
+      mailbox_save_cancel(&save_ctx);
+    } else {
+      ret = mailbox_save_finish(&save_ctx);
+    }
+  }
+  i_stream_unref(&input);
+  return ret;
+}
+
+static struct mailbox_transaction_context *save_window_transaction_begin(struct mailbox *box) {
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_MAIL_STORAGE_TRANSACTION_OLD_SIGNATURE
+  return mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+#else
+  return mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, "save window test");
+#endif
+}
+
+/**
+ * save window: if the window of outstanding object writes is full,
+ * the oldest write is waited for, before the next mail is saved.
+ */
+TEST_F(StorageTest, save_window_full_waits_for_oldest) {
+  struct mail_namespace *ns = mail_namespace_find_inbox(s_test_mail_user->namespaces);
+  ASSERT_NE(ns, nullptr);
+  struct mailbox *box = mailbox_alloc(ns->list, "INBOX", (mailbox_flags)0);
+  ASSERT_GE(mailbox_open(box), 0);
+  struct mailbox_transaction_context *trans = save_window_transaction_begin(box);
+
+  struct save_window_mocks mocks;
+  set_save_window_mocks(box, &mocks, 2, -1);
+
+  EXPECT_EQ(0, save_window_save_mail(trans));
+  EXPECT_EQ(0, save_window_save_mail(trans));
+  // window is not full yet
+  EXPECT_EQ(0u, mocks.waits.size());
+
+  EXPECT_EQ(0, save_window_save_mail(trans));
+  ASSERT_EQ(1u, mocks.waits.size());
+  ASSERT_EQ(1u, mocks.waits[0].size());
+  EXPECT_EQ(mocks.saved[0], mocks.waits[0][0]);
+
+  EXPECT_EQ(0, save_window_save_mail(trans));
+  ASSERT_EQ(2u, mocks.waits.size());
+  ASSERT_EQ(1u, mocks.waits[1].size());
+  EXPECT_EQ(mocks.saved[1], mocks.waits[1][0]);
+  EXPECT_EQ(4u, mocks.saved.size());
+
+  mailbox_transaction_rollback(&trans);
+  mailbox_free(&box);
+  free_save_window_mocks(&mocks);
+}
+
+/**
+ * save window: a failed write of the oldest mail fails the commit,
+ * all mails of the transaction are removed.
+ */
+TEST_F(StorageTest, save_window_oldest_write_fails) {
+  struct mail_namespace *ns = mail_namespace_find_inbox(s_test_mail_user->namespaces);
+  ASSERT_NE(ns, nullptr);
+  struct mailbox *box = mailbox_alloc(ns->list, "INBOX", (mailbox_flags)0);
+  ASSERT_GE(mailbox_open(box), 0);
+  struct mailbox_transaction_context *trans = save_window_transaction_begin(box);
+
+  struct save_window_mocks mocks;
+  // the wait for the first mail (window size 1) fails
+  set_save_window_mocks(box, &mocks, 1, 0);
+  EXPECT_CALL(*mocks.storage_mock, delete_mail(Matcher<librmb::RadosMail *>(_))).Times(2).WillRepeatedly(Return(0));
+
+  EXPECT_EQ(0, save_window_save_mail(trans));
+  EXPECT_EQ(0, save_window_save_mail(trans));
+  ASSERT_EQ(1u, mocks.waits.size());
+  EXPECT_EQ(mocks.saved[0], mocks.waits[0][0]);
+
+  EXPECT_LT(mailbox_transaction_commit(&trans), 0);
+  EXPECT_EQ(trans, nullptr);
+  // the second mail is waited for, before the mails are removed
+  ASSERT_GE(mocks.waits.size(), 2u);
+  EXPECT_EQ(mocks.saved[1], mocks.waits[1][0]);
+
+  mailbox_free(&box);
+  free_save_window_mocks(&mocks);
+}
+
+/**
+ * save window: the rollback of a transaction waits for the writes in flight,
+ * before the mails are freed.
+ */
+TEST_F(StorageTest, save_window_rollback_with_writes_in_flight) {
+  struct mail_namespace *ns = mail_namespace_find_inbox(s_test_mail_user->namespaces);
+  ASSERT_NE(ns, nullptr);
+  struct mailbox *box = mailbox_alloc(ns->list, "INBOX", (mailbox_flags)0);
+  ASSERT_GE(mailbox_open(box), 0);
+  struct mailbox_transaction_context *trans = save_window_transaction_begin(box);
+
+  struct save_window_mocks mocks;
+  set_save_window_mocks(box, &mocks, 8, -1);
+
+  EXPECT_EQ(0, save_window_save_mail(trans));
+  EXPECT_EQ(0, save_window_save_mail(trans));
+  EXPECT_EQ(0, save_window_save_mail(trans));
+  EXPECT_EQ(0u, mocks.waits.size());
+
+  mailbox_transaction_rollback(&trans);
+  ASSERT_EQ(1u, mocks.waits.size());
+  EXPECT_EQ(mocks.saved, mocks.waits[0]);
+  for (std::vector<librmb::RadosMail *>::iterator it = mocks.allocated.begin(); it != mocks.allocated.end(); ++it) {
+    if ((*it)->has_active_op()) {
+      EXPECT_EQ(1u, mocks.freed.count(*it));
+    }
+  }
+
+  mailbox_free(&box);
+  free_save_window_mocks(&mocks);
+}
 /*
 TEST_F(StorageTest, eval_output_append) {
   librados::bufferlist buffer;
@@ -41,6 +41,11 @@ extern "C" {
 #include "dovecot-ceph-plugin-config.h"
 #include "../test-utils/it_utils.h"
 #include "rados-util.h"
+#include "rados-types.h"
+
+#include <map>
+#include <set>
+#include <string>
 
 using ::testing::AtLeast;
 using ::testing::Return;
@@ -215,6 +220,104 @@ TEST_F(StorageTest, mail_copy_mail_in_inbox) {
   mailbox_free(&box);
 }
 
+/**
+ * single instance storage: the copy of a mail with a single instance body adds a reference,
+ * and the expunge of the mails removes them, also if rbox_mail_dedup_min_size is disabled.
+ */
+TEST_F(StorageTest, mail_copy_sis_reference) {
+  struct mailbox_transaction_context *trans;
+  struct mail_save_context *save_ctx;
+  struct mail *mail;
+  struct mail_search_context *search_ctx;
+  struct mail_search_args *search_args;
+
+  const char *message =
+      "From: user@domain.org\n"
+      "Date: Sat, 24 Mar 2017 23:00:00 +0200\n"
+      "Mime-Version: 1.0\n"
+      "Content-Type: text/plain; charset=us-ascii\n"
+      "\n"
+      "body\n";
+  const char *mailbox = "INBOX";
+  testutils::ItUtils::add_mail(message, mailbox, StorageTest::s_test_mail_user->namespaces);
+
+  struct mail_namespace *ns = mail_namespace_find_inbox(s_test_mail_user->namespaces);
+  ASSERT_NE(ns, nullptr);
+  struct mailbox *box = mailbox_alloc(ns->list, mailbox, MAILBOX_FLAG_SAVEONLY);
+  ASSERT_GE(mailbox_open(box), 0);
+  ASSERT_GE(mailbox_sync(box, static_cast<mailbox_sync_flags>(0)), 0);
+  struct rbox_storage *r_storage = (struct rbox_storage *)box->storage;
+
+  // let all mails reference the same body object
+  std::string sis_oid = RBOX_SIS_OID_PREFIX "it_test_copy";
+  librados::IoCtx sis_io_ctx;
+  librmb::RadosUtils::get_sis_io_ctx(&r_storage->s->get_io_ctx(), &sis_io_ctx);
+  librados::bufferlist body;
+  body.append("body\n");
+  ASSERT_EQ(0, librmb::RadosUtils::sis_add_reference(&sis_io_ctx, sis_oid, &body));
+  int mail_count = 0;
+  for (librados::NObjectIterator iter(r_storage->s->get_io_ctx().nobjects_begin());
+       iter != librados::NObjectIterator::__EndObjectIterator; ++iter) {
+    librados::bufferlist sis_ref;
+    sis_ref.append(sis_oid);
+    ASSERT_EQ(0, r_storage->s->get_io_ctx().setxattr(iter->get_oid(), RBOX_SIS_XATTR, sis_ref));
+    if (mail_count > 0) {
+      ASSERT_EQ(0, librmb::RadosUtils::sis_add_reference(&sis_io_ctx, sis_oid, nullptr));
+    }
+    mail_count++;
+  }
+  ASSERT_GT(mail_count, 0);
+
+  // copy the mails
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_MAIL_STORAGE_TRANSACTION_OLD_SIGNATURE
+  trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+#else
+  char reason[256];
+  memset(reason, '\0', sizeof(reason));
+  trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, reason);
+#endif
+  search_args = mail_search_build_init();
+  mail_search_build_add(search_args, SEARCH_ALL);
+  search_ctx = mailbox_search_init(trans, search_args, NULL, static_cast<mail_fetch_field>(0), NULL);
+  mail_search_args_unref(&search_args);
+  int copied = 0;
+  while (copied < mail_count && mailbox_search_next(search_ctx, &mail)) {
+    save_ctx = mailbox_save_alloc(trans);
+    mailbox_save_copy_flags(save_ctx, mail);
+    EXPECT_EQ(0, mailbox_copy(&save_ctx, mail));
+    copied++;
+  }
+  ASSERT_GE(mailbox_search_deinit(&search_ctx), 0);
+  ASSERT_GE(mailbox_transaction_commit(&trans), 0);
+  ASSERT_GE(mailbox_sync(box, static_cast<mailbox_sync_flags>(0)), 0);
+
+  std::set<std::string> keys;
+  keys.insert(RBOX_SIS_REFS_KEY);
+  std::map<std::string, librados::bufferlist> refs;
+  ASSERT_EQ(0, sis_io_ctx.omap_get_vals_by_keys(sis_oid, keys, &refs));
+  EXPECT_EQ(std::to_string(2 * mail_count), refs[RBOX_SIS_REFS_KEY].to_str());
+
+  // expunge all mails, the last one removes the body object
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_MAIL_STORAGE_TRANSACTION_OLD_SIGNATURE
+  trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+#else
+  trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, reason);
+#endif
+  search_args = mail_search_build_init();
+  mail_search_build_add(search_args, SEARCH_ALL);
+  search_ctx = mailbox_search_init(trans, search_args, NULL, static_cast<mail_fetch_field>(0), NULL);
+  mail_search_args_unref(&search_args);
+  while (mailbox_search_next(search_ctx, &mail)) {
+    mail_expunge(mail);
+  }
+  ASSERT_GE(mailbox_search_deinit(&search_ctx), 0);
+  ASSERT_GE(mailbox_transaction_commit(&trans), 0);
+  ASSERT_GE(mailbox_sync(box, static_cast<mailbox_sync_flags>(0)), 0);
+
+  EXPECT_EQ(-ENOENT, sis_io_ctx.stat(sis_oid, nullptr, nullptr));
+  mailbox_free(&box);
+}
+
 TEST_F(StorageTest, deinit) {}
 
 int main(int argc, char **argv) {
@@ -322,6 +322,72 @@ TEST_F(StorageTest, mail_copy_mail_in_inbox) {
   mailbox_free(&box);
 }
 
+static int count_objects(librados::IoCtx *io_ctx) {
+  int count = 0;
+  for (librados::NObjectIterator iter(io_ctx->nobjects_begin()); iter != librados::NObjectIterator::__EndObjectIterator;
+       ++iter) {
+    count++;
+  }
+  return count;
+}
+
+/**
+ * - change location of the last mail to alt_storage
+ * - copy mail via dovecot calls and rollback the transaction
+ * - validate that the copy is removed from the alt_storage
+ */
+TEST_F(StorageTest, mail_copy_rollback_in_alt) {
+  const char *message =
+      "From: user@domain.org\n"
+      "Date: Sat, 24 Mar 2017 23:00:00 +0200\n"
+      "Mime-Version: 1.0\n"
+      "Content-Type: text/plain; charset=us-ascii\n"
+      "\n"
+      "body\n";
+  const char *mailbox = "INBOX";
+  testutils::ItUtils::add_mail(message, mailbox, StorageTest::s_test_mail_user->namespaces);
+
+  struct mail_namespace *ns = mail_namespace_find_inbox(s_test_mail_user->namespaces);
+  ASSERT_NE(ns, nullptr);
+  struct mailbox *box = mailbox_alloc(ns->list, mailbox, MAILBOX_FLAG_SAVEONLY);
+  ASSERT_GE(mailbox_open(box), 0);
+  ASSERT_GE(mailbox_sync(box, static_cast<mailbox_sync_flags>(0)), 0);
+  std::string alt_dir = "mail_storage_alt_test_copy";
+  box->list->set.alt_dir = alt_dir.c_str();
+
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_MAIL_STORAGE_TRANSACTION_OLD_SIGNATURE
+  struct mailbox_transaction_context *trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+#else
+  char reason[256];
+  memset(reason, '\0', sizeof(reason));
+  struct mailbox_transaction_context *trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, reason);
+#endif
+  struct mail *mail = mail_alloc(trans, static_cast<mail_fetch_field>(0), NULL);
+  mail_set_seq(mail, mail_index_view_get_messages_count(box->view));
+  mail_update_flags(mail, MODIFY_ADD, (enum mail_flags)MAIL_INDEX_MAIL_FLAG_BACKEND);
+  ASSERT_GE(rbox_get_index_record(mail), 0);
+  ASSERT_GE(rbox_open_rados_connection(box, true), 0);
+
+  struct rbox_storage *r_storage = (struct rbox_storage *)box->storage;
+  std::string oid = *((struct rbox_mail *)mail)->rados_mail->get_oid();
+  librmb::RadosUtils::move_to_alt(oid, r_storage->s, r_storage->alt, r_storage->ms, false);
+  int alt_objects = count_objects(&r_storage->alt->get_io_ctx());
+
+  struct mail_save_context *save_ctx = mailbox_save_alloc(trans);
+  mailbox_save_copy_flags(save_ctx, mail);
+  EXPECT_EQ(0, mailbox_copy(&save_ctx, mail));
+  EXPECT_EQ(alt_objects + 1, count_objects(&r_storage->alt->get_io_ctx()));
+
+  // the copy is removed from the alt storage, the source is kept
+  mail_free(&mail);
+  mailbox_transaction_rollback(&trans);
+  EXPECT_EQ(alt_objects, count_objects(&r_storage->alt->get_io_ctx()));
+  EXPECT_EQ(0, r_storage->alt->stat_mail(oid, nullptr, nullptr));
+
+  EXPECT_EQ(0, r_storage->alt->delete_mail(oid));
+  mailbox_free(&box);
+}
+
 TEST_F(StorageTest, deinit) {}
 
 int main(int argc, char **argv) {
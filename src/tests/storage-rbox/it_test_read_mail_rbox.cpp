@@ -171,6 +171,84 @@ TEST_F(StorageTest, read_mail_test) {
   mailbox_free(&box);
 }
 
+/**
+ * Adds mails and reads them after a prefetch has been issued, which
+ * is what dovecot's search does for the next mail_prefetch_count mails.
+ */
+TEST_F(StorageTest, read_mail_prefetch_test) {
+  struct mailbox_transaction_context *desttrans;
+  struct mail *mail;
+  struct mail_search_context *search_ctx;
+  struct mail_search_args *search_args;
+  struct mail_search_arg *sarg;
+
+  const char *message =
+      "From: user@domain.org\n"
+      "Date: Sat, 24 Mar 2017 23:00:00 +0200\n"
+      "Mime-Version: 1.0\n"
+      "Content-Type: text/plain; charset=us-ascii\n"
+      "\n"
+      "prefetch\n";
+
+  const char *mailbox = "INBOX";
+
+  // testdata
+  testutils::ItUtils::add_mail(message, mailbox, StorageTest::s_test_mail_user->namespaces);
+  testutils::ItUtils::add_mail(message, mailbox, StorageTest::s_test_mail_user->namespaces);
+
+  search_args = mail_search_build_init();
+  sarg = mail_search_build_add(search_args, SEARCH_ALL);
+  ASSERT_NE(sarg, nullptr);
+
+  struct mail_namespace *ns = mail_namespace_find_inbox(s_test_mail_user->namespaces);
+  ASSERT_NE(ns, nullptr);
+
+  struct mailbox *box = mailbox_alloc(ns->list, mailbox, MAILBOX_FLAG_SAVEONLY);
+
+  if (mailbox_open(box) < 0) {
+    i_error("Opening mailbox %s failed: %s", mailbox, mailbox_get_last_internal_error(box, NULL));
+    FAIL() << " Forcing a resync on mailbox INBOX Failed";
+  }
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_MAIL_STORAGE_TRANSACTION_OLD_SIGNATURE
+  desttrans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+#else
+  char reason[256];
+  memset(reason, '\0', sizeof(reason));
+  desttrans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, reason);
+#endif
+
+  search_ctx = mailbox_search_init(desttrans, search_args, NULL,
+                                   static_cast<mail_fetch_field>(MAIL_FETCH_STREAM_HEADER | MAIL_FETCH_STREAM_BODY),
+                                   NULL);
+  mail_search_args_unref(&search_args);
+
+  struct message_size hdr_size, body_size;
+  struct istream *input = NULL;
+  int count = 0;
+  while (mailbox_search_next(search_ctx, &mail)) {
+    // start the read, a second prefetch must not issue another read
+    mail_prefetch(mail);
+    mail_prefetch(mail);
+
+    int ret2 = mail_get_stream(mail, &hdr_size, &body_size, &input);
+    EXPECT_EQ(ret2, 0);
+    EXPECT_NE(input, nullptr);
+    EXPECT_NE(body_size.physical_size, (uoff_t)0);
+    EXPECT_NE(hdr_size.physical_size, (uoff_t)0);
+    count++;
+  }
+  EXPECT_GE(count, 2);
+
+  if (mailbox_search_deinit(&search_ctx) < 0) {
+    FAIL() << "search deinit failed";
+  }
+
+  if (mailbox_transaction_commit(&desttrans) < 0) {
+    FAIL() << "tnx commit failed";
+  }
+  mailbox_free(&box);
+}
+
 TEST_F(StorageTest, deinit) {}
 
 int main(int argc, char **argv) {
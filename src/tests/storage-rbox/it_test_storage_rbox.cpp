@@ -36,6 +36,11 @@ extern "C" {
 #include "../mocks/mock_test.h"
 #include "rbox-save.h"
 #include "rados-util.h"
+#include "rados-types.h"
+
+#include <map>
+#include <set>
+#include <string>
 
 using ::testing::AtLeast;
 using ::testing::Return;
@@ -321,6 +326,101 @@ TEST_F(StorageTest, mail_save_to_inbox_reuse_save_context) {
 
   mailbox_free(&box);
 }
+
+/* saves the message in a transaction, which is committed or rolled back */
+static void save_message(struct mailbox *box, const char *message, bool commit) {
+  struct istream *input = i_stream_create_from_data(message, strlen(message));
+#ifdef DOVECOT_CEPH_PLUGIN_HAVE_MAIL_STORAGE_TRANSACTION_OLD_SIGNATURE
+  struct mailbox_transaction_context *trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+#else
+  char reason[256];
+  memset(reason, '\0', sizeof(reason));
+  struct mailbox_transaction_context *trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, reason);
+#endif
+  struct mail_save_context *save_ctx = mailbox_save_alloc(trans);
+  EXPECT_GE(mailbox_save_begin(&save_ctx, input), 0);
+  do {
+    EXPECT_GE(mailbox_save_continue(save_ctx), 0);
+  } while (i_stream_read(input) > 0);
+  EXPECT_GE(mailbox_save_finish(&save_ctx), 0);
+  if (commit) {
+    EXPECT_GE(mailbox_transaction_commit(&trans), 0);
+  } else {
+    mailbox_transaction_rollback(&trans);
+  }
+  i_stream_unref(&input);
+}
+
+static std::set<std::string> list_sis_objects(librados::IoCtx *sis_io_ctx) {
+  std::set<std::string> oids;
+  for (librados::NObjectIterator iter(sis_io_ctx->nobjects_begin());
+       iter != librados::NObjectIterator::__EndObjectIterator; ++iter) {
+    oids.insert(iter->get_oid());
+  }
+  return oids;
+}
+
+/**
+ * single instance storage: the rollback of a deduplicated save releases the reference to the body object.
+ */
+TEST_F(StorageTest, mail_save_dedup_rollback) {
+  struct mail_namespace *ns = mail_namespace_find_inbox(s_test_mail_user->namespaces);
+  ASSERT_NE(ns, nullptr);
+  struct mailbox *box = mailbox_alloc(ns->list, "INBOX", (mailbox_flags)0);
+  ASSERT_NE(box, nullptr);
+  ASSERT_GE(mailbox_open(box), 0);
+  struct rbox_storage *r_storage = (struct rbox_storage *)box->storage;
+  r_storage->config->update_metadata("rbox_mail_dedup_min_size", "1");
+
+  const char *message =
+      "From: user@domain.org\n"
+      "Date: Sat, 24 Mar 2017 23:00:00 +0200\n"
+      "Mime-Version: 1.0\n"
+      "Content-Type: text/plain; charset=us-ascii\n"
+      "\n"
+      "body of mail_save_dedup_rollback\n";
+  const char *message2 =
+      "From: user@domain.org\n"
+      "Date: Sat, 24 Mar 2017 23:00:00 +0200\n"
+      "Mime-Version: 1.0\n"
+      "Content-Type: text/plain; charset=us-ascii\n"
+      "\n"
+      "other body of mail_save_dedup_rollback\n";
+
+  librados::IoCtx sis_io_ctx;
+  librmb::RadosUtils::get_sis_io_ctx(&r_storage->s->get_io_ctx(), &sis_io_ctx);
+  std::set<std::string> sis_objects = list_sis_objects(&sis_io_ctx);
+
+  // the committed mail references a new body object
+  save_message(box, message, true);
+  std::set<std::string> committed = list_sis_objects(&sis_io_ctx);
+  ASSERT_EQ(sis_objects.size() + 1, committed.size());
+  std::string sis_oid;
+  for (std::set<std::string>::iterator it = committed.begin(); it != committed.end(); ++it) {
+    if (sis_objects.find(*it) == sis_objects.end()) {
+      sis_oid = *it;
+    }
+  }
+  std::set<std::string> keys;
+  keys.insert(RBOX_SIS_REFS_KEY);
+  std::map<std::string, librados::bufferlist> refs;
+  ASSERT_EQ(0, sis_io_ctx.omap_get_vals_by_keys(sis_oid, keys, &refs));
+  EXPECT_EQ("1", refs[RBOX_SIS_REFS_KEY].to_str());
+
+  // the rollback of the same body releases its reference again
+  save_message(box, message, false);
+  refs.clear();
+  ASSERT_EQ(0, sis_io_ctx.omap_get_vals_by_keys(sis_oid, keys, &refs));
+  EXPECT_EQ("1", refs[RBOX_SIS_REFS_KEY].to_str());
+
+  // the rollback of a new body removes the body object
+  save_message(box, message2, false);
+  EXPECT_EQ(committed, list_sis_objects(&sis_io_ctx));
+
+  r_storage->config->update_metadata("rbox_mail_dedup_min_size", "0");
+  mailbox_free(&box);
+}
+
 TEST_F(StorageTest, deinit) {}
 
 int main(int argc, char **argv) {